@@ -68,6 +68,7 @@ extern void error(const char *fmt, ...), warning(const char *fmt, ...);
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include "pars.h"
 #include "cgats.h"
 
@@ -77,6 +78,7 @@ extern void error(const char *fmt, ...), warning(const char *fmt, ...);
 static int cgats_read(cgats *p, cgatsFile *fp);
 static int find_kword(cgats *p, int table, const char *ksym);
 static int find_field(cgats *p, int table, const char *fsym);
+static int find_set(cgats *p, int table, const char *id);
 static int add_table(cgats *p, table_type tt, int oi);
 static int set_table_type(cgats *p, int table, table_type tt, int oi);
 static int set_table_flags(cgats *p, int table, int sup_id, int sup_kwords, int sup_fields);
@@ -89,11 +91,30 @@ static int add_field(cgats *p, int table, const char *fsym, data_type ftype);
 static int add_set(cgats *p, int table, ...);
 static int add_setarr(cgats *p, int table, cgats_set_elem *args);
 static int get_setarr(cgats *p, int table, int set_index, cgats_set_elem *args);
+static double *get_dcol(cgats *p, int table, int field);
+static int *get_icol(cgats *p, int table, int field);
+static char **get_scol(cgats *p, int table, int field);
 static int cgats_write(cgats *p, cgatsFile *fp);
+static int write_bin(cgats *p, cgatsFile *fp);
+static int is_bin(cgats *p, cgatsFile *fp, size_t *size);
+static int read_bin(cgats *p, cgatsFile *fp, size_t size);
+static int sread_open(cgats *p, cgatsFile *fp);
+static int sread_sets(cgats *p);
+static int sread_table(cgats *p);
+static void sread_close(cgats *p);
+static int swrite_table(cgats *p, int table, cgatsFile *fp, int nsets);
+static int swrite_end(cgats *p);
+static int flush_sets(cgats *p);
+static void discard_sets(cgats *p, cgats_table *t);
+static void free_sidx(cgats_table *t);
 static int cgats_error(cgats *p, char **mes);
 static void cgats_del(cgats *p);
 
 static void cgats_table_free(cgats_table *t);
+static char *strblk_dup(cgatsAlloc *al, cgats_strblk **list, const char *str);
+static void strblk_free(cgatsAlloc *al, cgats_strblk **list);
+static int layout_fdata(cgats_table *t);
+static int alloc_sets(cgats_table *t, int nsets);
 static void *alloc_copy_data_type(cgatsAlloc *al, data_type ktype, void *dpoint);
 static int reserved_kword(const char *ksym);
 static int standard_kword(const char *ksym);
@@ -102,19 +123,45 @@ static int cs_has_ws(const char *cs);
 static char *quote_cs(cgatsAlloc *al, const char *cs);
 static int clear_fields(cgats *p, int table);
 static int add_kword_at(cgats *p, int table, int  pos, const char *ksym, const char *kdatak, const char *kcom);
-static int add_data_item(cgats *p, int table, void *data);
+static int add_data_item(cgats *p, int table, void *data, int copy, int nhint);
 static void unquote_cs(char *cs);
 static data_type guess_type(const char *cs);
+static double read_real(const char *cs);
+static int read_int(const char *cs);
 static void real_format(double value, int nsd, char *fmt);
 
 #ifdef COMBINED_STD
 static int cgats_read_name(cgats *p, const char *filename);
 static int cgats_write_name(cgats *p, const char *filename);
+static int cgats_write_bin_name(cgats *p, const char *filename);
 #endif
 
 static const char *data_type_desc[] =
 	{ "real", "integer", "char string", "non-quoted char string", "no type" };
 
+/* State of a read in progress */
+struct _cgats_rstate {
+	parse *pp;			/* Parser for the file */
+	cgatsFile *fp;		/* File being read */
+	int stream;			/* NZ if reading a batch of sets at a time */
+	int rstate;			/* Read state */
+	int tablef;			/* Current table we should be filling */
+	int expsets;		/* Expected number of sets */
+	char *kw;			/* keyword symbol */
+	int nread;			/* Number of sets of the current table in previous batches */
+	int tend;			/* NZ if the current table's data has all been read */
+};
+
+/* State of a streaming write */
+struct _cgats_wstate {
+	cgatsFile *fp;		/* File being written */
+	int table;			/* Table being streamed, -1 if none */
+	int ntw;			/* Number of tables written so far */
+	int *sfield;		/* Standard field flags of the table being streamed */
+	int nsets;			/* Number of sets expected, -1 if not known */
+	int nw;				/* Number of sets written so far */
+};
+
 /* Create an empty cgats object */
 /* Return NULL on error */
 cgats *new_cgats_al(
@@ -130,6 +177,7 @@ cgatsAlloc *al			/* memory allocator */
 	/* Initialize the methods */
 	p->find_kword = find_kword;
 	p->find_field = find_field;
+	p->find_set   = find_set;
 	p->read       = cgats_read;
 	p->add_table  = add_table;
 	p->set_table_type = set_table_type;
@@ -144,21 +192,34 @@ cgatsAlloc *al			/* memory allocator */
 	p->add_set    = add_set;
 	p->add_setarr = add_setarr;
 	p->get_setarr = get_setarr;
+	p->get_dcol   = get_dcol;
+	p->get_icol   = get_icol;
+	p->get_scol   = get_scol;
 	p->write      = cgats_write;
+	p->write_bin  = write_bin;
+	p->sread_open  = sread_open;
+	p->sread_sets  = sread_sets;
+	p->sread_table = sread_table;
+	p->sread_close = sread_close;
+	p->swrite_table = swrite_table;
+	p->swrite_end   = swrite_end;
 	p->error      = cgats_error;
 	p->del        = cgats_del;
 	
 #ifndef SEPARATE_STD
 	p->read_name  = cgats_read_name;
 	p->write_name = cgats_write_name;
+	p->write_bin_name = cgats_write_bin_name;
 #else
 	p->read_name  = NULL;
 	p->write_name = NULL;
+	p->write_bin_name = NULL;
 #endif
 
 #ifdef EMIT_KEYWORDS
 	p->emit_keywords = 1;
 #endif
+	p->stream_sets = 1000;
 
 	return p;
 }
@@ -223,6 +284,14 @@ cgats_del(cgats *p) {
 	cgatsAlloc *al = p->al;
 	int del_al     = p->del_al;
 
+	/* Free any streaming state */
+	sread_close(p);
+	if (p->ws != NULL) {
+		if (p->ws->sfield != NULL)
+			al->free(al, p->ws->sfield);
+		al->free(al, p->ws);
+	}
+
 	/* Free all the user defined file identifiers */
 	if (p->cgats_type != NULL) {
 		al->free(al, p->cgats_type);
@@ -253,7 +322,7 @@ cgats_del(cgats *p) {
 static void
 cgats_table_free(cgats_table *t) {
 	cgatsAlloc *al = t->al;
-	int i,j;
+	int i;
 
 	/* Free all the keyword symbols */
 	if (t->ksym != NULL) {
@@ -288,27 +357,166 @@ cgats_table_free(cgats_table *t) {
 	if (t->ftype != NULL)
 		al->free(al, t->ftype);
 	/* Free all the original fields text values */
-	if (t->rfdata != NULL) {
-		for (j = 0; j < t->nsets; j++)
-			if (t->rfdata[j] != NULL) {
-				for (i = 0; i < t->nfields; i++)
-					if(t->rfdata[j][i] != NULL)
-						al->free(al, t->rfdata[j][i]);
-				al->free(al, t->rfdata[j]);
-			}
+	if (t->rfdata != NULL)
 		al->free(al, t->rfdata);
+	if (t->rtext != NULL)
+		al->free(al, t->rtext);
+	strblk_free(al, &t->rblk);
+
+	/* Free all the field value columns */
+	if (t->cdata != NULL) {
+		for (i = 0; i < t->nfields; i++)
+			if (t->cdata[i] != NULL)
+				al->free(al, t->cdata[i]);
+		al->free(al, t->cdata);
 	}
-	/* Free all the fields values */
-	if (t->fdata != NULL) {
-		for (j = 0; j < t->nsets; j++)
-			if (t->fdata[j] != NULL) {
-				for (i = 0; i < t->nfields; i++)
-					if(t->fdata[j][i] != NULL)
-						al->free(al, t->fdata[j][i]);
-				al->free(al, t->fdata[j]);
-			}
+	if (t->fdata != NULL)
 		al->free(al, t->fdata);
+	if (t->fdblk != NULL)
+		al->free(al, t->fdblk);
+	strblk_free(al, &t->sblk);
+	free_sidx(t);
+}
+
+/* ------------------------------------------- */
+/* Field value storage. */
+
+/* Each field's values are held in a contiguous column of its type */
+/* in cdata[], with string values packed into blocks of storage. */
+/* fdata[set][field] is kept as a view of pointers into the columns */
+/* for code that accesses the values a set at a time. */
+
+#define STRBLK_SIZE 8192	/* Default size of a string storage block */
+
+struct _cgats_strblk {
+	struct _cgats_strblk *next;		/* Next older block */
+	size_t size;					/* Size of data[] */
+	size_t used;					/* Amount of data[] used */
+	char data[1];					/* String storage (actually size) */
+};
+
+/* Return a copy of the string allocated from the block list */
+/* Return NULL if malloc failed */
+static char *
+strblk_dup(cgatsAlloc *al, cgats_strblk **list, const char *str) {
+	size_t len = strlen(str) + 1;
+	cgats_strblk *b = *list;
+	char *rv;
+
+	if (b == NULL || (b->size - b->used) < len) {
+		size_t size = STRBLK_SIZE;
+		if (len > STRBLK_SIZE/4)		/* Large strings get a block of their own */
+			size = len;
+		if ((b = (cgats_strblk *)al->malloc(al, sizeof(cgats_strblk) + size)) == NULL)
+			return NULL;
+		b->size = size;
+		b->used = 0;
+		/* Keep using the current block if this one will be full */
+		if (size == len && *list != NULL) {
+			b->next = (*list)->next;
+			(*list)->next = b;
+		} else {
+			b->next = *list;
+			*list = b;
+		}
+	}
+	rv = b->data + b->used;
+	memcpy(rv, str, len);
+	b->used += len;
+
+	return rv;
+}
+
+/* Free a list of string blocks */
+static void
+strblk_free(cgatsAlloc *al, cgats_strblk **list) {
+	cgats_strblk *b, *nb;
+
+	for (b = *list; b != NULL; b = nb) {
+		nb = b->next;
+		al->free(al, b);
+	}
+	*list = NULL;
+}
+
+/* Return the size of a column element of the given type */
+static size_t
+col_elem_size(data_type dtype) {
+	switch(dtype) {
+		case r_t:
+			return sizeof(double);
+		case i_t:
+			return sizeof(int);
+		default:
+			return sizeof(char *);
+	}
+}
+
+/* (Re)build the fdata[][] view for all the allocated sets, */
+/* after the columns have moved or a field has been added. */
+/* Return nz on malloc failure */
+static int
+layout_fdata(cgats_table *t) {
+	cgatsAlloc *al = t->al;
+	int i, j;
+
+	if (t->nsetsa == 0 || t->nfields == 0)
+		return 0;
+
+	if ((t->fdata = (void ***)al->realloc(al, t->fdata, t->nsetsa * sizeof(void **))) == NULL)
+		return 1;
+	if ((t->fdblk = (void **)al->realloc(al, t->fdblk,
+	                         (size_t)t->nsetsa * t->nfields * sizeof(void *))) == NULL)
+		return 1;
+	for (j = 0; j < t->nsetsa; j++) {
+		void **fd = t->fdata[j] = t->fdblk + (size_t)j * t->nfields;
+
+		for (i = 0; i < t->nfields; i++) {
+			switch(t->ftype[i]) {
+				case r_t:
+					fd[i] = (void *)&((double *)t->cdata[i])[j];
+					break;
+				case i_t:
+					fd[i] = (void *)&((int *)t->cdata[i])[j];
+					break;
+				default:
+					fd[i] = (void *)((char **)t->cdata[i])[j];
+					break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Make sure there is space in the columns and fdata[] for at least nsets sets. */
+/* Space grows geometrically, so that adding one set at a time is cheap. */
+/* The fields must have their final types. */
+/* Return nz on malloc failure */
+static int
+alloc_sets(cgats_table *t, int nsets) {
+	cgatsAlloc *al = t->al;
+	int i, nsetsa;
+
+	if (nsets <= t->nsetsa)
+		return 0;
+
+	nsetsa = 2 * t->nsetsa;
+	if (nsetsa < 100)
+		nsetsa = 100;
+	if (nsetsa < nsets)
+		nsetsa = nsets;
+
+	for (i = 0; i < t->nfields; i++) {
+		size_t esz = col_elem_size(t->ftype[i]);
+		if ((t->cdata[i] = al->realloc(al, t->cdata[i], nsetsa * esz)) == NULL)
+			return 1;
+		if (t->ftype[i] != r_t && t->ftype[i] != i_t)	/* Unset strings are NULL */
+			memset((char *)t->cdata[i] + t->nsetsa * esz, 0, (nsetsa - t->nsetsa) * esz);
 	}
+	t->nsetsa = nsetsa;
+
+	return layout_fdata(t);
 }
 
 /* Return index of the keyword, -1 on fail */
@@ -361,34 +569,296 @@ find_field(cgats *p, int table, const char *fsym) {
 	return -1;
 }
 
-/* Read a cgats file into structure */
-/* returns 0 normally, -ve if there was an error, */
-/* and p->e.c and p->e.m will be valid */
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* SAMPLE_ID index. Sets are looked up by the text of their */
+/* SAMPLE_ID value, using an open addressed hash table that is */
+/* built when first needed, or loaded from a binary file. */
+
+/* Return the FNV-1a hash of a string */
+static unsigned int
+hash_id(const char *id) {
+	unsigned int h = 2166136261u;
+
+	for (; *id != '\000'; id++)
+		h = ((h ^ (unsigned char)*id) * 16777619u) & 0xffffffff;
+	return h;
+}
+
+/* Return the text of the SAMPLE_ID value of a set. */
+/* A numeric value is formatted into buf[], as it would be written. */
+static char *
+sample_id_text(cgats_table *t, int field, int set, char *buf) {
+	switch(t->ftype[field]) {
+		case r_t: {
+			char fmt[30];
+			double val = ((double *)t->cdata[field])[set];
+			real_format(val, REAL_SIGDIG, fmt);
+			sprintf(buf, fmt, val);
+			return buf + strspn(buf, " ");	/* Skip any padding */
+		}
+		case i_t:
+			sprintf(buf, "%d", ((int *)t->cdata[field])[set]);
+			return buf;
+		default:
+			return ((char **)t->cdata[field])[set];
+	}
+}
+
+/* Build the SAMPLE_ID index of a table, given the SAMPLE_ID field. */
+/* Where a SAMPLE_ID is repeated, the first set will be found. */
+/* Return nz on malloc failure */
 static int
-cgats_read(cgats *p, cgatsFile *fp) {
-	parse *pp;
+build_sidx(cgats_table *t, int field) {
+	cgatsAlloc *al = t->al;
+	char buf[100];
+	int nsidx, j;
+
+	for (nsidx = 16; nsidx < 2 * t->nsets; nsidx *= 2)
+		;
+	if ((t->sidx = (int *)al->calloc(al, nsidx, sizeof(int))) == NULL)
+		return 1;
+	t->nsidx = nsidx;
+
+	for (j = 0; j < t->nsets; j++) {
+		unsigned int h = hash_id(sample_id_text(t, field, j, buf)) & (nsidx-1);
+		while (t->sidx[h] != 0)
+			h = (h + 1) & (nsidx-1);
+		t->sidx[h] = j + 1;
+	}
+	return 0;
+}
+
+/* Free the SAMPLE_ID index of a table */
+static void
+free_sidx(cgats_table *t) {
+	if (t->sidx != NULL)
+		t->al->free(t->al, t->sidx);
+	t->sidx = NULL;
+	t->nsidx = 0;
+}
+
+/* Return index of the set with the given SAMPLE_ID, -1 on fail */
+/* -2 on illegal table index or malloc failure, message in err & errc */
+static int
+find_set(cgats *p, int table, const char *id) {
+	cgats_table *t;
+	char buf[100];
+	unsigned int h;
+	int field, j;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	if (table < 0 || table >= p->ntables)
+		return err(p, -2, "cgats.find_set(), table number '%d' is out of range",table);
+	t = &p->t[table];
+
+	if (id == NULL || (field = find_field(p, table, "SAMPLE_ID")) < 0)
+		return -1;
+
+	if (t->sidx == NULL && build_sidx(t, field))
+		return err(p, -2, "cgats.find_set(), malloc failed!");
+
+	for (h = hash_id(id) & (t->nsidx-1); (j = t->sidx[h]) != 0; h = (h + 1) & (t->nsidx-1)) {
+		char *sid = sample_id_text(t, field, --j, buf);
+		if (sid != NULL && strcmp(sid, id) == 0)
+			return j;
+	}
+
+	return -1;
+}
+
 /* Read states */
 #define R_IDENT 0		/* Reading file identifier */
 #define R_KWORDS 1		/* Reading keywords */
 #define R_KWORD_VALUE 2	/* Reading keywords values */
 #define R_FIELDS 3		/* Reading field declarations */
 #define R_DATA 4		/* Reading data in set */
-	int rstate = R_IDENT;
-	int tablef = 0;		/* Current table we should be filling */
-	int expsets = 0;	/* Expected number of sets */
-	char *kw = NULL;	/* keyword symbol */
 
-	p->e.c = 0;
-	p->e.m[0] = '\000';
+/* Setup to read a file. */
+/* Return -ve, errc & err if there was an error */
+static int
+begin_read(cgats *p, cgats_rstate *rs, cgatsFile *fp, int stream) {
+
+	memset((void *)rs, 0, sizeof(cgats_rstate));
+	rs->fp = fp;
+	rs->stream = stream;
+	rs->rstate = R_IDENT;
 
-	if ((pp = new_parse_al(p->al, fp)) == NULL) {
+	if ((rs->pp = new_parse_al(p->al, fp)) == NULL) {
 		DBGF((DBGA,"Failed to open parser for file\n"));
 		return err(p, -1, "Unable to create file parser for file '%s'",fp->fname(fp));
 	}
+	rs->pp->block = stream;		/* Bound the memory used if streaming */
 
 	/* Setup our token parsing charaters */
 	/* Terminators, Not Read, Comment start, Quote characters */
-	pp->add_del(pp, " \t"," \t", "#", "\"");
+	rs->pp->add_del(rs->pp, " \t"," \t", "#", "\"");
+
+	return 0;
+}
+
+/* Clean up after reading a file */
+static void
+end_read(cgats *p, cgats_rstate *rs) {
+	if (rs->kw != NULL)
+		p->al->free(p->al, rs->kw);
+	rs->kw = NULL;
+	if (rs->pp != NULL)
+		rs->pp->del(rs->pp);		/* Clean up the parse file */
+	rs->pp = NULL;
+}
+
+/* Determine the types of the fields of the sets read in ct->rtext[], */
+/* and convert them into the field columns. */
+/* Return -ve, errc & err if there was an error */
+static int
+convert_sets(cgats *p, cgats_rstate *rs, cgats_table *ct) {
+	data_type *otype = NULL;	/* Types of the previous batch */
+	int i, j;
+
+	/* We now need to determine the data types. */
+	/* (Work through the sets in order, as the text is stored that way) */
+	/* When streaming, the types of the previous batches are the starting point */
+	if (ct->nsetsa > 0) {
+		if ((otype = (data_type *)p->al->malloc(p->al, ct->nfields * sizeof(data_type))) == NULL)
+			return err(p, -2, "cgats.read(), malloc failed!");
+		memcpy(otype, ct->ftype, ct->nfields * sizeof(data_type));
+	} else {
+		for (i = 0; i < ct->nfields; i++)
+			ct->ftype[i] = i_t;
+	}
+	for (j = 0; j < ct->nsets; j++) {
+		char **rt = ct->rtext + (size_t)j * ct->nfields;
+		for (i = 0; i < ct->nfields; i++) {
+			data_type ty, bt = ct->ftype[i];
+
+			if (bt == cs_t)
+				continue;		/* Early out */
+			ty = guess_type(rt[i]);
+
+			if (ty == cs_t) {
+				bt = cs_t;
+			} else if (ty == nqcs_t) {
+				if (bt == i_t || bt == r_t)
+					bt = ty;
+			} else if (ty == r_t) {
+				if (bt == i_t)
+					bt = ty;
+			} else { /* ty == i_t */
+				/* This is the default */
+			}
+			ct->ftype[i] = bt;
+		}
+	}
+	for (i = 0; i < ct->nfields; i++) {
+		data_type bt = ct->ftype[i], st;
+
+		/* Got guessed type bt. Sanity check against known field types */
+		/* and promote if that seems reasonable */
+		st = standard_field(ct->fsym[i]);
+		if ((st == r_t && bt == i_t)		/* If ambiguous, use standard field */
+		 || ((st == cs_t || st == nqcs_t) && bt == i_t)	/* Promote any to string */
+		 || ((st == cs_t || st == nqcs_t) && bt == r_t)	/* Promote any to string */
+		 || (st == nqcs_t && bt == cs_t)
+		 || (st == cs_t && bt == nqcs_t))
+			bt = st;
+
+		/* If standard type doesn't match what it should, throw an error */
+		if (st != none_t && st != bt) {
+			err(p, -1,"Error in file '%s': Field '%s' has unexpected type, should be '%s', is '%s'",rs->fp->fname(rs->fp),ct->fsym[i],data_type_desc[st],data_type_desc[bt]);
+			DBGF((DBGA,"Standard field has unexpected data type\n"));
+			if (otype != NULL)
+				p->al->free(p->al, otype);
+			return p->e.c;
+		}
+		ct->ftype[i] = bt;
+	}
+
+	/* Re-allocate any columns of a previous batch that have been promoted */
+	if (otype != NULL) {
+		int retyped = 0;
+		for (i = 0; i < ct->nfields; i++) {
+			size_t esz = col_elem_size(ct->ftype[i]);
+			if (otype[i] == ct->ftype[i])
+				continue;
+			if ((ct->cdata[i] = p->al->realloc(p->al, ct->cdata[i], ct->nsetsa * esz)) == NULL)
+				break;
+			if (ct->ftype[i] != r_t && ct->ftype[i] != i_t)
+				memset(ct->cdata[i], 0, ct->nsetsa * esz);
+			retyped = 1;
+		}
+		p->al->free(p->al, otype);
+		if (i < ct->nfields || (retyped && layout_fdata(ct)))
+			return err(p, -2, "cgats.read(), malloc failed!");
+	}
+
+	/* Allocate the field columns, and then convert the fields to correct type. */
+	if (alloc_sets(ct, ct->nsets)) {
+		err(p, -2, "cgats.read(), malloc failed!");
+		DBGF((DBGA,"Alloc field columns failed\n"));
+		return p->e.c;
+	}
+	for (j = 0; j < ct->nsets; j++) {
+		char **rt = ct->rtext + (size_t)j * ct->nfields;
+		for (i = 0; i < ct->nfields; i++) {
+			switch(ct->ftype[i]) {
+				case r_t:
+					((double *)ct->cdata[i])[j] = read_real(rt[i]);
+					break;
+				case i_t:
+					((int *)ct->cdata[i])[j] = read_int(rt[i]);
+					break;
+				case cs_t:
+				case nqcs_t: {
+					char *sv;
+					if ((sv = strblk_dup(p->al, &ct->sblk, rt[i])) == NULL) {
+						err(p, -2, "cgats.read(), malloc failed!");
+						DBGF((DBGA,"Alloc string value failed\n"));
+						return p->e.c;
+					}
+					unquote_cs(sv);
+					((char **)ct->cdata[i])[j] = sv;
+					ct->fdata[j][i] = (void *)sv;
+					break;
+				}
+				case none_t:
+					break;
+			}
+		}
+	}
+
+	/* Keep or free the text values */
+	if (p->keep_text && ct->nsets > 0) {
+		if ((ct->rfdata = (char ***)p->al->malloc(p->al, ct->nsets * sizeof(char **)))
+		                                                                    == NULL) {
+			err(p, -2, "cgats.read(), malloc failed!");
+			DBGF((DBGA,"Alloc rfdata failed\n"));
+			return p->e.c;
+		}
+		for (j = 0; j < ct->nsets; j++)
+			ct->rfdata[j] = ct->rtext + j * ct->nfields;
+	} else {
+		if (!rs->stream) {		/* (Streaming re-uses the text array for the next batch) */
+			if (ct->rtext != NULL)
+				p->al->free(p->al, ct->rtext);
+			ct->rtext = NULL;
+			ct->nrsetsa = 0;
+		}
+		strblk_free(p->al, &ct->rblk);
+	}
+
+	return 0;
+}
+
+/* Read the file, until the end of the file, or when streaming, */
+/* until the start of a table's data, a batch of sets, or the end of the data. */
+/* Return 0 at the end of the file, 1 if streaming stopped, */
+/* -ve, errc & err if there was an error */
+static int
+read_tokens(cgats *p, cgats_rstate *rs) {
+	parse *pp = rs->pp;
+	cgatsFile *fp = rs->fp;
 
 	/* Read in the file */
 	for (;;) {
@@ -399,7 +869,6 @@ cgats_read(cgats *p, cgatsFile *fp) {
 			int rc;
 			if (pp->e.c != 0) {		/* get_token got an error */
 				err(p, -1, "%s", pp->e.m);
-				pp->del(pp);
 				DBGF((DBGA,"Get token got error '%s'\n",pp->e.m));
 				return p->e.c;
 			}
@@ -407,7 +876,6 @@ cgats_read(cgats *p, cgatsFile *fp) {
 				break;		/* End of file */
 			else if (rc == -1) {		/* read_line got an error */
 				err(p, -1, "%s", pp->e.m);
-				pp->del(pp);
 				DBGF((DBGA,"Read line got error '%s'\n",pp->e.m));
 				return p->e.c;
 			}
@@ -419,18 +887,17 @@ cgats_read(cgats *p, cgatsFile *fp) {
 		if (strlen(tp) > CGATS_ERRM_LENGTH/2) {
 			tp[CGATS_ERRM_LENGTH/2] = '\000';
 			err(p,-1,"Read line got symbol '%s' that's too long\n",tp);
-			pp->del(pp);
 			return p->e.c;
 		}
 
-		switch(rstate) {
+		switch(rs->rstate) {
 			case R_IDENT: 		/* Expecting file identifier */
 			case R_KWORDS: {	/* Expecting keyword, field def or data */
 				table_type tt = tt_none;
 				int oi = 0;		/* Index if tt_other */
 
 				DBGF((DBGA,"Got kword '%s'\n",tp));
-				if (rstate == R_IDENT) {
+				if (rs->rstate == R_IDENT) {
 					DBGF((DBGA,"Expecting file identifier\n"));
 				}
 
@@ -456,12 +923,11 @@ cgats_read(cgats *p, cgatsFile *fp) {
 					if ((p->cgats_type = (char *)p->al->calloc(p->al,
 					                     (strlen(tp)+1), sizeof(char))) == NULL) {
 						err(p,-1,"Failed to malloc space for CGATS.X keyword");
-						pp->del(pp);
 						return p->e.c;
 					}
 					strcpy(p->cgats_type,tp);
 					DBGF((DBGA,"Found CGATS file identifier\n"));
-					rstate = R_KWORDS;
+					rs->rstate = R_KWORDS;
 				} else {	/* See if it is an 'other' file identifier */
 					int iswild = 0;	
 					DBGF((DBGA,"Checking for 'other' identifier\n"));
@@ -477,43 +943,40 @@ cgats_read(cgats *p, cgatsFile *fp) {
 						if(strcmp(tp,p->others[oi]) == 0) {
 							DBGF((DBGA,"Matches 'other' %s\n",p->others[oi]));
 							tt = tt_other;
-							rstate = R_KWORDS;
+							rs->rstate = R_KWORDS;
 							break;
 						}
 					}
 
 					if (tt == tt_none
 					 && iswild
-					 && rstate == R_IDENT				/* First token after a table */
+					 && rs->rstate == R_IDENT				/* First token after a table */
 					 && standard_kword(tp) == 0			/* And not an obvious kword */
 					 && reserved_kword(tp) == 0) {
 						DBGF((DBGA,"Matches 'other' wildcard\n"));
 						if ((oi = add_other(p, tp)) == -2) {
-							pp->del(pp);
 							DBGF((DBGA,"add_other for wilidcard failed\n"));
 							return p->e.c;
 						}
 						tt = tt_other;
-						rstate = R_KWORDS;
+						rs->rstate = R_KWORDS;
 					}
 				}
 
 				/* First ever token must be file identifier */
 				if (tt == tt_none && p->ntables == 0) {
 					err(p,-1,"Error at line %d of file '%s': No CGATS file identifier found",pp->line,fp->fname(fp));
-					pp->del(pp);
 					DBGF((DBGA,"Failed to match file identifier\n"));
 					return p->e.c;
 				}
 
 				/* Any token after previous table has data finished */
 				/* causes a new table to be created. */
-				if (p->ntables == tablef) {
+				if (p->ntables == rs->tablef) {
 
 					if (tt != tt_none) {			/* Current token is a file identifier */
 						DBGF((DBGA,"Got file identifier, adding plain table\n"));
 	        			if (add_table(p, tt, oi) < 0) {
-							pp->del(pp);
 							DBGF((DBGA,"Add table failed\n"));
 							return p->e.c;
 						}
@@ -525,7 +988,6 @@ cgats_read(cgats *p, cgatsFile *fp) {
 						DBGF((DBGA,"No file identifier, adding table copy of previous\n"));
 
 	        			if (add_table(p, p->t[p->ntables-1].tt, p->t[p->ntables-1].oi) < 0) {
-							pp->del(pp);
 							DBGF((DBGA,"Add table failed\n"));
 							return p->e.c;
 						}
@@ -535,14 +997,12 @@ cgats_read(cgats *p, cgatsFile *fp) {
 
 						for (i = 0; i < pt->nkwords; i++) {
 							if (p->add_kword(p, ct, pt->ksym[i], pt->kdata[i], pt->kcom[i]) < 0) {
-								pp->del(pp);
 								DBGF((DBGA,"Add keyword failed\n"));
 								return p->e.c;
 							}
 						}
 						for (i = 0; i < pt->nfields; i++)
 							if (p->add_field(p, ct, pt->fsym[i], none_t) < 0) {
-								pp->del(pp);
 								DBGF((DBGA,"Add field failed\n"));
 								return p->e.c;
 							}
@@ -553,18 +1013,16 @@ cgats_read(cgats *p, cgatsFile *fp) {
 				if (tt == tt_none) {
 					/* See if we're starting the field declarations */
 					if(strcmp(tp,"BEGIN_DATA_FORMAT") == 0) {
-						rstate = R_FIELDS;
+						rs->rstate = R_FIELDS;
 						if (clear_fields(p, p->ntables-1) < 0) {
-							pp->del(pp);
 							DBGF((DBGA,"Clear field failed\n"));
 							return p->e.c;
 						}
 						break;
 					}
 					if(strcmp(tp,"SAMPLE_ID") == 0) {	/* Faulty table - cope gracefully */
-						rstate = R_FIELDS;
+						rs->rstate = R_FIELDS;
 						if (clear_fields(p, p->ntables-1) < 0) {
-							pp->del(pp);
 							DBGF((DBGA,"Clear field failed\n"));
 							return p->e.c;
 						}
@@ -572,47 +1030,47 @@ cgats_read(cgats *p, cgatsFile *fp) {
 					}
 
 					if(strcmp(tp,"BEGIN_DATA") == 0) {
-						rstate = R_DATA;
+						rs->rstate = R_DATA;
+						if (rs->stream)
+							return 1;		/* Stop at the start of the data */
 						break;
 					}
 					/* Else must be a keyword */
-					if ((kw = (char *)alloc_copy_data_type(p->al, cs_t, (void *)tp)) == NULL) {
+					if ((rs->kw = (char *)alloc_copy_data_type(p->al, cs_t, (void *)tp)) == NULL) {
 						err(p, -2, "cgats.alloc_copy_data_type() malloc fail");
-						pp->del(pp);
 						DBGF((DBGA,"Alloc data type failed\n"));
 						return p->e.c;
 					}
-					rstate = R_KWORD_VALUE;
+					rs->rstate = R_KWORD_VALUE;
 				}
 				break;
 			}
 			case R_KWORD_VALUE: {
 				/* Add a keyword and its value */
 				
-				DBGF((DBGA,"Got keyword value '%s'\n",kw));
+				DBGF((DBGA,"Got keyword value '%s'\n",rs->kw));
 
 				/* Special case for read() use */
-				if(strcmp(kw,"NUMBER_OF_SETS") == 0)
-					expsets = atoi(tp);
+				if(strcmp(rs->kw,"NUMBER_OF_SETS") == 0)
+					rs->expsets = atoi(tp);
 
-				if (!reserved_kword(kw)) {	/* Don't add reserved keywords */
+				if (!reserved_kword(rs->kw)) {	/* Don't add reserved keywords */
 					int ix;
 
 					/* Replace keyword if it already exists */
 					unquote_cs(tp);
-					if ((ix = find_kword(p, p->ntables-1, kw)) < -1) {
-						pp->del(pp);
+					if ((ix = find_kword(p, p->ntables-1, rs->kw)) < -1) {
 						DBGF((DBGA,"Failed to find keyword\n"));
 						return p->e.c;
 					}
-					if (add_kword_at(p, p->ntables-1, ix, kw, tp, NULL) < 0) {
-						pp->del(pp);
-						DBGF((DBGA,"Failed to add keyword '%s'\n",kw));
+					if (add_kword_at(p, p->ntables-1, ix, rs->kw, tp, NULL) < 0) {
+						DBGF((DBGA,"Failed to add keyword '%s'\n",rs->kw));
 						return p->e.c;
 					}
 				}
-				p->al->free(p->al, kw);
-				rstate = R_KWORDS;
+				p->al->free(p->al, rs->kw);
+				rs->kw = NULL;
+				rs->rstate = R_KWORDS;
 				break;
 			}
 			case R_FIELDS: {
@@ -620,28 +1078,28 @@ cgats_read(cgats *p, cgatsFile *fp) {
 
 				/* Add a list of field name declarations */
 				if(strcmp(tp,"END_DATA_FORMAT") == 0) {
-					rstate = R_KWORDS;
+					rs->rstate = R_KWORDS;
 					break;
 				}
 				if(strcmp(tp,"BEGIN_DATA") == 0) {	/* Faulty table - cope gracefully */
-					rstate = R_DATA;
+					rs->rstate = R_DATA;
+					if (rs->stream)
+						return 1;		/* Stop at the start of the data */
 					break;
 				}
 				if(strcmp(tp,"DEVICE_NAME") == 0) {	/* Faulty CB table - cope gracefully */
 					/* It's unlikely anyone will use DEVICE_NAME as a field name */
 					/* Assume this is a keyword */
-					if ((kw = (char *)alloc_copy_data_type(p->al, cs_t, (void *)tp)) == NULL) {
+					if ((rs->kw = (char *)alloc_copy_data_type(p->al, cs_t, (void *)tp)) == NULL) {
 						err(p, -2, "cgats.alloc_copy_data_type() malloc fail");
-						pp->del(pp);
 						DBGF((DBGA,"Alloc data type failed\n"));
 						return p->e.c;
 					}
-					rstate = R_KWORD_VALUE;
+					rs->rstate = R_KWORD_VALUE;
 					break;
 				}
 			  first_field:;	/* Direct leap - cope with faulty table */
 				if (p->add_field(p, p->ntables-1, tp, none_t) < 0)	/* none == cs untill figure type */ {
-					pp->del(pp);
 					DBGF((DBGA,"Add field failed\n"));
 					return p->e.c;
 				}
@@ -652,137 +1110,100 @@ cgats_read(cgats *p, cgatsFile *fp) {
 
 				DBGF((DBGA,"Got data value '%s'\n",tp));
 				if(strcmp(tp,"END_DATA") == 0) {
-					int i,j;
 #ifdef NEVER
 					if (ct->nsets == 0) {
 						err(p,-1,"Error at line %d of file '%s': End of data without any data being read",pp->line,fp->fname(fp));
-						pp->del(pp);
 						DBGF((DBGA,"End of data without any data being read\n"));
 						return p->e.c;
 					}
 #endif // NEVER
-					if (expsets != 0 && ct->nsets != expsets) {
-						err(p,-1,"Error at line %d of file '%s': Read %d sets, expected %d sets",pp->line,fp->fname(fp),ct->nsets,expsets);
-						pp->del(pp);
+					if (rs->expsets != 0 && (rs->nread + ct->nsets) != rs->expsets) {
+						err(p,-1,"Error at line %d of file '%s': Read %d sets, expected %d sets",pp->line,fp->fname(fp),rs->nread + ct->nsets,rs->expsets);
 						DBGF((DBGA,"End of mimatch in number of sets\n"));
 						return p->e.c;
 					}
 					if (ct->ndf != 0) {
 						err(p,-1,"Error at line %d of file '%s': Data was not an integer multiple of fields (remainder %d out of %d)",pp->line,fp->fname(fp),ct->ndf,ct->nfields);
-						pp->del(pp);
 						DBGF((DBGA,"Not an interger multiple of fields\n"));
 						return p->e.c;
 					}
 
-					/* We now need to determine the data types */
-					/* and convert them appropriately */
-					for (i = 0; i < ct->nfields; i++) {
-						data_type bt = i_t, st;
-						for (j = 0; j < ct->nsets; j++) {
-							data_type ty;
-							ty = guess_type(((char *)ct->rfdata[j][i]));
-
-							if (ty == cs_t) {
-								bt = cs_t;
-								break;		/* Early out */
-							} else if (ty == nqcs_t) {
-								if (bt == i_t || bt == r_t)
-									bt = ty;
-							} else if (ty == r_t) {
-								if (bt == i_t)
-									bt = ty;
-							} else { /* ty == i_t */
-								/* This is the default */
-							}
-						}
-						/* Got guessed type bt. Sanity check against known field types */
-						/* and promote if that seems reasonable */
-						st = standard_field(ct->fsym[i]);
-						if ((st == r_t && bt == i_t)		/* If ambiguous, use standard field */
-						 || ((st == cs_t || st == nqcs_t) && bt == i_t)	/* Promote any to string */
-						 || ((st == cs_t || st == nqcs_t) && bt == r_t)	/* Promote any to string */
-						 || (st == nqcs_t && bt == cs_t)
-						 || (st == cs_t && bt == nqcs_t))
-							bt = st;
-
-						/* If standard type doesn't match what it should, throw an error */
-						if (st != none_t && st != bt) {
-							err(p, -1,"Error in file '%s': Field '%s' has unexpected type, should be '%s', is '%s'",fp->fname(fp),ct->fsym[i],data_type_desc[st],data_type_desc[bt]);
-							pp->del(pp);
-							DBGF((DBGA,"Standard field has unexpected data type\n"));
-							return p->e.c;
-						}
+					/* Determine the data types and convert the values */
+					if (convert_sets(p, rs, ct) < 0)
+						return p->e.c;
 
-						/* Set field type, and then convert the fields to correct type. */
-						ct->ftype[i] = bt;
-						for (j = 0; j < ct->nsets; j++) {
-							switch(bt) {
-								case r_t: {
-									double dv;
-									dv = atof((char *)ct->rfdata[j][i]);
-									if ((ct->fdata[j][i] = alloc_copy_data_type(p->al, bt, (void *)&dv)) == NULL) {
-										err(p, -2, "cgats.alloc_copy_data_type() malloc fail");
-										pp->del(pp);
-										DBGF((DBGA,"Alloc copy data type failed\n"));
-										return p->e.c;
-									}
-									break;
-								}
-								case i_t: {
-									int iv;
-									iv = atoi((char *)ct->rfdata[j][i]);
-									if ((ct->fdata[j][i] = alloc_copy_data_type(p->al, bt, (void *)&iv)) == NULL) {
-										err(p, -2, "cgats.alloc_copy_data_type() malloc fail");
-										pp->del(pp);
-										DBGF((DBGA,"Alloc copy data type failed\n"));
-										return p->e.c = -2;
-									}
-									break;
-								}
-								case cs_t:
-								case nqcs_t: {
-									char *cv;
-									cv = ct->rfdata[j][i];
-									if ((ct->fdata[j][i]
-= alloc_copy_data_type(p->al, bt, (void *)cv)) == NULL) {
-										err(p, -2, "cgats.alloc_copy_data_type() malloc fail");
-										pp->del(pp);
-										DBGF((DBGA,"Alloc copy data type failed\n"));
-										return p->e.c = -2;
-									}
-									unquote_cs((char *)ct->fdata[j][i]);
-									break;
-								}
-								case none_t:
-									break;
-							}
-						}
+					rs->tablef = p->ntables;	/* Finished data for current table */
+					rs->rstate = R_IDENT;
+					if (rs->stream) {
+						rs->tend = 1;
+						return 1;		/* Stop at the end of the data */
 					}
-					
-					tablef = p->ntables;	/* Finished data for current table */
-					rstate = R_IDENT;
 					break;
 				}
 
 				/* Make sure fields have been decalared */
 				if (ct->nfields == 0) {
 					err(p, -1,"Error at line %d of file '%s': Found data without field definitions",pp->line,fp->fname(fp));
-					pp->del(pp);
 					DBGF((DBGA,"Found data without field definition\n"));
 					return p->e.c;
 				}
 				/* Add the data item */
-				if (add_data_item(p, p->ntables-1, tp) < 0) {
-					pp->del(pp);
+				/* (Token text can be used in place if the file is all in memory) */
+				if (add_data_item(p, p->ntables-1, tp, !pp->image || p->keep_text,
+				                  rs->stream ? p->stream_sets : rs->expsets) < 0) {
 					DBGF((DBGA,"Adding data item failed\n"));
 					return p->e.c;
 				}
+				/* Stop when a batch of sets has been read */
+				if (rs->stream && ct->ndf == 0 && ct->nsets >= p->stream_sets) {
+					if (convert_sets(p, rs, ct) < 0)
+						return p->e.c;
+					return 1;
+				}
 				break;
 			}
 		}
 	}
 
-	pp->del(pp);		/* Clean up the parse file */
+	return 0;
+}
+
+/* Read a cgats text or binary file into structure */
+/* returns 0 normally, -ve if there was an error, */
+/* and p->e.c and p->e.m will be valid */
+static int
+cgats_read(cgats *p, cgatsFile *fp) {
+	cgats_rstate rs;
+	size_t size;
+	int rv;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	/* A binary file is loaded directly */
+	if ((rv = is_bin(p, fp, &size)) < 0)
+		return rv;
+	if (rv) {
+		if ((rv = read_bin(p, fp, size)) < 0)
+			return rv;
+	} else {
+		if (begin_read(p, &rs, fp, 0) < 0)
+			return p->e.c;
+		rv = read_tokens(p, &rs);
+
+		/* End of file without END_DATA. Convert the sets read so far, */
+		/* while any text they point to is still in the parse buffer. */
+		if (rv == 0 && rs.rstate == R_DATA) {
+			cgats_table *ct = &p->t[p->ntables-1];
+			if (ct->ndf != 0)
+				rv = err(p,-1,"Unexpected end of file '%s' in the middle of a set",fp->fname(fp));
+			else if (convert_sets(p, &rs, ct) < 0)
+				rv = p->e.c;
+		}
+		end_read(p, &rs);
+		if (rv < 0)
+			return rv;
+	}
 
 	if (p->ntables == 0)
 		return -1;		/* Failed to load any table */
@@ -790,6 +1211,141 @@ cgats_read(cgats *p, cgatsFile *fp) {
 	return 0;
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Streaming read. The file is parsed a block at a time, and */
+/* only the current batch of sets of the last table is held. */
+
+/* Discard the sets of a table that is being streamed, */
+/* keeping the storage for the next batch. */
+static void
+discard_sets(cgats *p, cgats_table *t) {
+	if (t->rfdata != NULL)
+		p->al->free(p->al, t->rfdata);
+	t->rfdata = NULL;
+	strblk_free(p->al, &t->rblk);
+	strblk_free(p->al, &t->sblk);
+	free_sidx(t);
+	t->nsets = 0;
+}
+
+/* Start a streaming read of a cgats file, */
+/* and read it up to the data of the first table. */
+/* Return -ve, errc & err if there was an error */
+static int
+sread_open(cgats *p, cgatsFile *fp) {
+	size_t size;
+	int rv;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	if (p->rs != NULL)
+		return err(p,-1,"cgats.sread_open(), a streaming read is already open");
+	if (p->stream_sets < 1)
+		return err(p,-1,"cgats.sread_open(), stream_sets must be at least 1");
+
+	if ((rv = is_bin(p, fp, &size)) < 0)
+		return rv;
+	if (rv)
+		return err(p,-1,"cgats.sread_open(), binary file '%s' can't be streamed",fp->fname(fp));
+
+	if ((p->rs = (cgats_rstate *)p->al->malloc(p->al, sizeof(cgats_rstate))) == NULL)
+		return err(p,-2,"cgats.sread_open(), malloc failed!");
+
+	if (begin_read(p, p->rs, fp, 1) < 0
+	 || (rv = read_tokens(p, p->rs)) < 0) {
+		sread_close(p);
+		return p->e.c;
+	}
+	if (p->ntables == 0) {
+		sread_close(p);
+		return err(p,-1,"No CGATS table found in file '%s'",fp->fname(fp));
+	}
+	if (rv == 0)			/* End of file before any data */
+		p->rs->tend = 1;
+
+	return 0;
+}
+
+/* Read the next batch of sets of the last table. */
+/* Return the number of sets read, 0 at the end of the table's data, */
+/* -ve, errc & err if there was an error */
+static int
+sread_sets(cgats *p) {
+	cgats_rstate *rs = p->rs;
+	cgats_table *ct;
+	int rv;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	if (rs == NULL)
+		return err(p,-1,"cgats.sread_sets(), no streaming read is open");
+	if (rs->tend)
+		return 0;
+
+	ct = &p->t[p->ntables-1];
+	rs->nread += ct->nsets;
+	discard_sets(p, ct);
+
+	if ((rv = read_tokens(p, rs)) < 0)
+		return rv;
+	if (rv == 0) {		/* End of file without END_DATA */
+		if (ct->ndf != 0)
+			return err(p,-1,"Unexpected end of file '%s' in the middle of a set",rs->fp->fname(rs->fp));
+		if (convert_sets(p, rs, ct) < 0)
+			return p->e.c;
+		rs->tend = 1;
+	}
+
+	return ct->nsets;
+}
+
+/* Skip the rest of the last table, and read the next one up to its data. */
+/* Return 0 normally, 1 if there are no more tables, */
+/* -ve, errc & err if there was an error */
+static int
+sread_table(cgats *p) {
+	cgats_rstate *rs = p->rs;
+	int ntables, rv;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	if (rs == NULL)
+		return err(p,-1,"cgats.sread_table(), no streaming read is open");
+
+	while (!rs->tend) {
+		if ((rv = sread_sets(p)) < 0)
+			return rv;
+	}
+	discard_sets(p, &p->t[p->ntables-1]);
+	rs->nread = 0;
+	rs->tend = 0;
+
+	ntables = p->ntables;
+	if ((rv = read_tokens(p, rs)) < 0)
+		return rv;
+	if (p->ntables == ntables) {	/* No more tables */
+		rs->tend = 1;
+		return 1;
+	}
+	if (rv == 0)			/* End of file before any data */
+		rs->tend = 1;
+
+	return 0;
+}
+
+/* Finish a streaming read */
+static void
+sread_close(cgats *p) {
+	if (p->rs != NULL) {
+		end_read(p, p->rs);
+		p->al->free(p->al, p->rs);
+		p->rs = NULL;
+	}
+}
+
 /* Define the (one) variable CGATS type */
 /* Return -2 & set errc and err on system error */
 static int
@@ -1066,12 +1622,23 @@ add_field(cgats *p, int table, const char *fsym, data_type ftype) {
 		                                                                               == NULL) {
 			return err(p,-2,"cgats.add_field(), realloc failed!");
 		}
+		if ((t->cdata = (void **)al->realloc(al, t->cdata, t->nfieldsa * sizeof(void *))) == NULL) {
+			return err(p,-2,"cgats.add_field(), realloc failed!");
+		}
 	}
 	if ((t->fsym[t->nfields-1] = (char *)alloc_copy_data_type(al, cs_t, (void *)fsym)) == NULL) {
 		return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
 	}
 
 	t->ftype[t->nfields-1] = ftype;
+	t->cdata[t->nfields-1] = NULL;
+
+	/* If the sets have been reset, add a column to match */
+	if (t->nsetsa > 0) {
+		if ((t->cdata[t->nfields-1] = al->calloc(al, t->nsetsa, col_elem_size(ftype))) == NULL
+		 || layout_fdata(t))
+			return err(p,-2,"cgats.add_field(), malloc failed!");
+	}
 
 	return t->nfields-1;
 }
@@ -1108,9 +1675,26 @@ clear_fields(cgats *p, int table) {
 		al->free(al, t->ftype);
 	t->ftype = NULL;
 
+	/* Free any field value columns */
+	if (t->cdata != NULL) {
+		for (i = 0; i < t->nfields; i++)
+			if (t->cdata[i] != NULL)
+				al->free(al, t->cdata[i]);
+		al->free(al, t->cdata);
+		t->cdata = NULL;
+	}
+	if (t->fdata != NULL)
+		al->free(al, t->fdata);
+	t->fdata = NULL;
+	if (t->fdblk != NULL)
+		al->free(al, t->fdblk);
+	t->fdblk = NULL;
+	free_sidx(t);
+
 	/* Zero all the field counters */
 	t->nfields = 0;
 	t->nfieldsa = 0;
+	t->nsetsa = 0;
 
 	return 0;
 }
@@ -1122,7 +1706,7 @@ static int
 add_set(cgats *p, int table, ...) {
 	cgatsAlloc *al = p->al;
 	va_list args;
-	int i;
+	int i, j;
 	cgats_table *t;
 
 	va_start(args, table);
@@ -1136,41 +1720,30 @@ add_set(cgats *p, int table, ...) {
 	if (t->nfields == 0)
 		return err(p,-1,"cgats.add_set(), attempt to add set when no fields are defined");
 
+	free_sidx(t);		/* The SAMPLE_ID index is rebuilt when next needed */
 	t->nsets++;
 	
-	if (t->nsets > t->nsetsa) /* Allocate space for more sets */ {
-		/* Allocate set pointers in groups of 100 */
-		t->nsetsa += 100;
-		if ((t->fdata = (void ***)al->realloc(al, t->fdata, t->nsetsa * sizeof(void **))) == NULL)
-			return err(p,-2,"cgats.add_set(), realloc failed!");
-	}
-	/* Allocate set pointer to data element values */
-	if ((t->fdata[t->nsets-1] = (void **)al->calloc(al, t->nfields, sizeof(void *))) == NULL)
-		return err(p,-2,"cgats.add_set(), malloc failed!");
+	if (alloc_sets(t, t->nsets)) /* Allocate space for more sets */
+		return err(p,-2,"cgats.add_set(), realloc failed!");
+	j = t->nsets-1;
 
-	/* Allocate and copy data to new set */
+	/* Copy data to new set */
 	for (i = 0; i < t->nfields; i++) {
 		switch(t->ftype[i]) {
-			case r_t: {
-				double dv;
-				dv = va_arg(args, double);
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)&dv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+			case r_t:
+				((double *)t->cdata[i])[j] = va_arg(args, double);
 				break;
-			}
-			case i_t: {
-				int iv;
-				iv = va_arg(args, int);
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)&iv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+			case i_t:
+				((int *)t->cdata[i])[j] = va_arg(args, int);
 				break;
-			}
 			case cs_t:
 			case nqcs_t: {
 				char *sv;
 				sv = va_arg(args, char *);
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)sv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+				if ((sv = strblk_dup(al, &t->sblk, sv)) == NULL)
+					return err(p,-2,"cgats.add_set(), malloc failed!");
+				((char **)t->cdata[i])[j] = sv;
+				t->fdata[j][i] = (void *)sv;
 				break;
 			}
 			default:
@@ -1179,6 +1752,10 @@ add_set(cgats *p, int table, ...) {
 	}
 	va_end(args);
 
+	/* If the table is being streamed, write out a full batch of sets */
+	if (p->ws != NULL && p->ws->table == table && t->nsets >= p->stream_sets)
+		return flush_sets(p);
+
 	return 0;
 }
 
@@ -1189,7 +1766,7 @@ add_set(cgats *p, int table, ...) {
 static int
 add_setarr(cgats *p, int table, cgats_set_elem *args) {
 	cgatsAlloc *al = p->al;
-	int i;
+	int i, j;
 	cgats_table *t;
 
 	p->e.c = 0;
@@ -1201,47 +1778,40 @@ add_setarr(cgats *p, int table, cgats_set_elem *args) {
 	if (t->nfields == 0)
 		return err(p,-1,"cgats.add_setarr(), attempt to add set when no fields are defined");
 
+	free_sidx(t);		/* The SAMPLE_ID index is rebuilt when next needed */
 	t->nsets++;
 	
-	if (t->nsets > t->nsetsa) /* Allocate space for more sets */ {
-		/* Allocate set pointers in groups of 100 */
-		t->nsetsa += 100;
-		if ((t->fdata = (void ***)al->realloc(al,t->fdata, t->nsetsa * sizeof(void **))) == NULL)
-			return err(p,-2,"cgats.add_set(), realloc failed!");
-	}
-	/* Allocate set pointer to data element values */
-	if ((t->fdata[t->nsets-1] = (void **)al->calloc(al, t->nfields, sizeof(void *))) == NULL)
-		return err(p,-2,"cgats.add_set(), malloc failed!");
+	if (alloc_sets(t, t->nsets)) /* Allocate space for more sets */
+		return err(p,-2,"cgats.add_setarr(), realloc failed!");
+	j = t->nsets-1;
 
-	/* Allocate and copy data to new set */
+	/* Copy data to new set */
 	for (i = 0; i < t->nfields; i++) {
 		switch(t->ftype[i]) {
-			case r_t: {
-				double dv;
-				dv = args[i].d;
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)&dv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+			case r_t:
+				((double *)t->cdata[i])[j] = args[i].d;
 				break;
-			}
-			case i_t: {
-				int iv;
-				iv = args[i].i;
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)&iv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+			case i_t:
+				((int *)t->cdata[i])[j] = args[i].i;
 				break;
-			}
 			case cs_t:
 			case nqcs_t: {
 				char *sv;
-				sv = args[i].c;
-				if ((t->fdata[t->nsets-1][i] = alloc_copy_data_type(al, t->ftype[i], (void *)sv)) == NULL)
-					return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+				if ((sv = strblk_dup(al, &t->sblk, args[i].c)) == NULL)
+					return err(p,-2,"cgats.add_setarr(), malloc failed!");
+				((char **)t->cdata[i])[j] = sv;
+				t->fdata[j][i] = (void *)sv;
 				break;
 			}
 			default:
-				return err(p,-1,"cgats.add_set(), field has unknown data type");
+				return err(p,-1,"cgats.add_setarr(), field has unknown data type");
 		}
 	}
+
+	/* If the table is being streamed, write out a full batch of sets */
+	if (p->ws != NULL && p->ws->table == table && t->nsets >= p->stream_sets)
+		return flush_sets(p);
+
 	return 0;
 }
 
@@ -1265,14 +1835,14 @@ get_setarr(cgats *p, int table, int set_index, cgats_set_elem *args) {
 	for (i = 0; i < t->nfields; i++) {
 		switch(t->ftype[i]) {
 			case r_t:
-				args[i].d = *((double *)t->fdata[set_index][i]);
+				args[i].d = ((double *)t->cdata[i])[set_index];
 				break;
 			case i_t:
-				args[i].i = *((int *)t->fdata[set_index][i]);
+				args[i].i = ((int *)t->cdata[i])[set_index];
 				break;
 			case cs_t:
 			case nqcs_t:
-				args[i].c = ((char *)t->fdata[set_index][i]);
+				args[i].c = ((char **)t->cdata[i])[set_index];
 				break;
 			default:
 				return err(p,-1,"cgats.get_setarr(), field has unknown data type");
@@ -1281,11 +1851,79 @@ get_setarr(cgats *p, int table, int set_index, cgats_set_elem *args) {
 	return 0;
 }
 
-/* Add an item of data to rgdata[][] from the read file. */
-/* return 0 normally. */
-/* return -2, -1, errc & err on error */
+/* Check the table and field for a get_xcol() method */
+/* Return the table, or NULL, errc & err on error */
+static cgats_table *
+check_col(cgats *p, const char *fname, int table, int field) {
+	cgats_table *t;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+	if (table < 0 || table >= p->ntables) {
+		err(p,-1,"cgats.%s(), table parameter out of range",fname);
+		return NULL;
+	}
+	t = &p->t[table];
+	if (field < 0 || field >= t->nfields) {
+		err(p,-1,"cgats.%s(), field parameter out of range",fname);
+		return NULL;
+	}
+	return t;
+}
+
+/* Return the column of values of a real field. */
+/* return NULL, errc & err on error */
+static double *
+get_dcol(cgats *p, int table, int field) {
+	cgats_table *t;
+
+	if ((t = check_col(p, "get_dcol", table, field)) == NULL)
+		return NULL;
+	if (t->ftype[field] != r_t) {
+		err(p,-1,"cgats.get_dcol(), field '%s' is not real",t->fsym[field]);
+		return NULL;
+	}
+	return (double *)t->cdata[field];
+}
+
+/* Return the column of values of an integer field. */
+/* return NULL, errc & err on error */
+static int *
+get_icol(cgats *p, int table, int field) {
+	cgats_table *t;
+
+	if ((t = check_col(p, "get_icol", table, field)) == NULL)
+		return NULL;
+	if (t->ftype[field] != i_t) {
+		err(p,-1,"cgats.get_icol(), field '%s' is not integer",t->fsym[field]);
+		return NULL;
+	}
+	return (int *)t->cdata[field];
+}
+
+/* Return the column of values of a character string field. */
+/* Note the returned strings are in *p */
+/* return NULL, errc & err on error */
+static char **
+get_scol(cgats *p, int table, int field) {
+	cgats_table *t;
+
+	if ((t = check_col(p, "get_scol", table, field)) == NULL)
+		return NULL;
+	if (t->ftype[field] != cs_t && t->ftype[field] != nqcs_t) {
+		err(p,-1,"cgats.get_scol(), field '%s' is not a string",t->fsym[field]);
+		return NULL;
+	}
+	return (char **)t->cdata[field];
+}
+
+/* Add an item of data to rtext[] from the read file. */
+/* If copy is nz, the text is copied, else it must remain valid */
+/* until the END_DATA conversion. nhint is the expected number of sets. */
+/* return 0 normally. */
+/* return -2, -1, errc & err on error */
 static int
-add_data_item(cgats *p, int table, void *data) {
+add_data_item(cgats *p, int table, void *data, int copy, int nhint) {
 	cgatsAlloc *al = p->al;
 	cgats_table *t;
 
@@ -1301,26 +1939,24 @@ add_data_item(cgats *p, int table, void *data) {
 	if (t->ndf == 0) {	/* We're about to do the first element of a new set */
 		t->nsets++;
 		
-		if (t->nsets > t->nsetsa) { /* Allocate space for more sets */
-			/* Allocate set pointers in groups of 100 */
-			t->nsetsa += 100;
-			if ((t->rfdata = (char ***)al->realloc(al, t->rfdata, t->nsetsa * sizeof(void **)))
-			                                                                        == NULL)
-				return err(p,-2,"cgats.add_item(), realloc failed!");
-			if ((t->fdata = (void ***)al->realloc(al, t->fdata, t->nsetsa * sizeof(void **)))
-			                                                                        == NULL)
+		if (t->nsets > t->nrsetsa) { /* Allocate space for more sets */
+			t->nrsetsa *= 2;
+			if (t->nrsetsa < 100)
+				t->nrsetsa = 100;
+			if (t->nrsetsa < nhint)
+				t->nrsetsa = nhint;
+			if ((t->rtext = (char **)al->realloc(al, t->rtext,
+			                (size_t)t->nrsetsa * t->nfields * sizeof(char *))) == NULL)
 				return err(p,-2,"cgats.add_item(), realloc failed!");
 		}
-		/* Allocate set pointer to data element values */
-		if ((t->rfdata[t->nsets-1] = (char **)al->calloc(al, t->nfields, sizeof(void *))) == NULL)
-			return err(p,-2,"cgats.add_item(), malloc failed!");
-		if ((t->fdata[t->nsets-1] = (void **)al->calloc(al, t->nfields, sizeof(void *))) == NULL)
-			return err(p,-2,"cgats.add_item(), malloc failed!");
 	}
 
 	/* Data type is always cs_t at this point, because we haven't decided the type */
-	if ((t->rfdata[t->nsets-1][t->ndf] = alloc_copy_data_type(al, cs_t, data)) == NULL)
-		return err(p,-2,"cgats.alloc_copy_data_type() malloc fail");
+	if (!copy)
+		t->rtext[(size_t)(t->nsets-1) * t->nfields + t->ndf] = (char *)data;
+	else if ((t->rtext[(size_t)(t->nsets-1) * t->nfields + t->ndf]
+	                             = strblk_dup(al, &t->rblk, (char *)data)) == NULL)
+		return err(p,-2,"cgats.add_item(), malloc failed!");
 
 	if (++t->ndf >= t->nfields)
 		t->ndf = 0;
@@ -1328,319 +1964,873 @@ add_data_item(cgats *p, int table, void *data) {
 	return 0;
 }
 
-/* Write structure into cgats file */
+/* Write the header of a table, up to the start of its data. */
+/* sfield[nfields] is set to flag the standard fields. */
+/* NUMBER_OF_SETS is omitted if nsets < 0 */
 /* Return -ve, errc & err if there was an error */
 static int
-cgats_write(cgats *p, cgatsFile *fp) {
+write_head(cgats *p, cgatsFile *fp, int table, int *sfield, int nsets) {
 	cgatsAlloc *al = p->al;
-	int i;
-	int table,set,field;
-	int *sfield = NULL;	/* Standard field flag */
-	p->e.c = 0;
-	p->e.m[0] = '\000';
+	cgats_table *t = &p->t[table];
+	int i, field;
 
-	DBGF((DBGA,"CGATS write called, ntables = %d\n",p->ntables));
-	for (table = 0; table < p->ntables; table++) {
-		cgats_table *t = &p->t[table];
+	DBGF((DBGA,"CGATS writing table %d\n",table));
 
-		DBGF((DBGA,"CGATS writing table %d\n",table));
+	/* Figure out the standard and non-standard fields */
+	for (field = 0; field < t->nfields; field++) {
+		if (standard_field(t->fsym[field]) != none_t)
+			sfield[field] = 1;	/* Is standard */
+		else
+			sfield[field] = 0;
+	}
 
-		/* Figure out the standard and non-standard fields */
-		if (t->nfields > 0)
-			if ((sfield = (int *)al->calloc(al, t->nfields, sizeof(int))) == NULL)
-				return err(p,-2,"cgats.write(), malloc failed!");
-		for (field = 0; field < t->nfields; field++) {
-				if (standard_field(t->fsym[field]) != none_t)
-					sfield[field] = 1;	/* Is standard */
-				else
-					sfield[field] = 0;
-			}
-	
-		if (!t->sup_kwords)	/* If not suppressed */ {
-			/* Make sure table has basic keywords */
-			if ((i = p->find_kword(p,table,"ORIGINATOR")) < 0)	/* Create it */
-				if (p->add_kword(p,table,"ORIGINATOR","Not specified", NULL) < 0) {
-					al->free(al, sfield);
-					return p->e.c;
-				}
-			if ((i = p->find_kword(p,table,"DESCRIPTOR")) < 0)	/* Create it */
-				if (p->add_kword(p,table,"DESCRIPTOR","Not specified", NULL) < 0) {
-					al->free(al, sfield);
-					return p->e.c;
-				}
-			if ((i = p->find_kword(p,table,"CREATED")) < 0) {	/* Create it */
-				static char *amonths[] = {"January","February","March","April",
-				                          "May","June","July","August","September",
-				                          "October","November","December"};
-				time_t ctime;
-				struct tm *ptm;
-				char tcs[100];
-				ctime = time(NULL);
-				ptm = localtime(&ctime);
-				sprintf(tcs,"%s %d, %d",amonths[ptm->tm_mon],ptm->tm_mday,1900+ptm->tm_year);
-				if (p->add_kword(p,table,"CREATED",tcs, NULL) < 0) {
-					al->free(al, sfield);
-					return p->e.c;
-				}
-			}
-	
-			/* And table type specific keywords */
-			/* (Not sure this is correct - CGATS.5 appendix J is not specific enough) */
-			switch(t->tt) {
-				case it8_7_1:
-				case it8_7_2:	/* Physical target reference files */
-					if ((i = p->find_kword(p,table,"MANUFACTURER")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"MANUFACTURER","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					if ((i = p->find_kword(p,table,"PROD_DATE")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"PROD_DATE","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					if ((i = p->find_kword(p,table,"SERIAL")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"SERIAL","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					if ((i = p->find_kword(p,table,"MATERIAL")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"MATERIAL","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					break;
-				case it8_7_3:	/* Target measurement files */
-				case it8_7_4:
-				case cgats_5:
-				case cgats_X:
-					if ((i = p->find_kword(p,table,"INSTRUMENTATION")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"INSTRUMENTATION","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					if ((i = p->find_kword(p,table,"MEASUREMENT_SOURCE")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"MEASUREMENT_SOURCE","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					if ((i = p->find_kword(p,table,"PRINT_CONDITIONS")) < 0)	/* Create it */
-						if (p->add_kword(p,table,"PRINT_CONDITIONS","Not specified", NULL) < 0) {
-							al->free(al, sfield);
-							return p->e.c;
-						}
-					break;
-				case tt_other:
-					/* We enforce no pre-defined keywords for user defined file types */
-					break;
-				default:
-					break;
-			}
+	if (!t->sup_kwords)	/* If not suppressed */ {
+		/* Make sure table has basic keywords */
+		if ((i = p->find_kword(p,table,"ORIGINATOR")) < 0)	/* Create it */
+			if (p->add_kword(p,table,"ORIGINATOR","Not specified", NULL) < 0)
+				return p->e.c;
+		if ((i = p->find_kword(p,table,"DESCRIPTOR")) < 0)	/* Create it */
+			if (p->add_kword(p,table,"DESCRIPTOR","Not specified", NULL) < 0)
+				return p->e.c;
+		if ((i = p->find_kword(p,table,"CREATED")) < 0) {	/* Create it */
+			static char *amonths[] = {"January","February","March","April",
+			                          "May","June","July","August","September",
+			                          "October","November","December"};
+			time_t ctime;
+			struct tm *ptm;
+			char tcs[100];
+			ctime = time(NULL);
+			ptm = localtime(&ctime);
+			sprintf(tcs,"%s %d, %d",amonths[ptm->tm_mon],ptm->tm_mday,1900+ptm->tm_year);
+			if (p->add_kword(p,table,"CREATED",tcs, NULL) < 0)
+				return p->e.c;
 		}
 
-		/* Output the table */
+		/* And table type specific keywords */
+		/* (Not sure this is correct - CGATS.5 appendix J is not specific enough) */
+		switch(t->tt) {
+			case it8_7_1:
+			case it8_7_2:	/* Physical target reference files */
+				if ((i = p->find_kword(p,table,"MANUFACTURER")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"MANUFACTURER","Not specified", NULL) < 0)
+						return p->e.c;
+				if ((i = p->find_kword(p,table,"PROD_DATE")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"PROD_DATE","Not specified", NULL) < 0)
+						return p->e.c;
+				if ((i = p->find_kword(p,table,"SERIAL")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"SERIAL","Not specified", NULL) < 0)
+						return p->e.c;
+				if ((i = p->find_kword(p,table,"MATERIAL")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"MATERIAL","Not specified", NULL) < 0)
+						return p->e.c;
+				break;
+			case it8_7_3:	/* Target measurement files */
+			case it8_7_4:
+			case cgats_5:
+			case cgats_X:
+				if ((i = p->find_kword(p,table,"INSTRUMENTATION")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"INSTRUMENTATION","Not specified", NULL) < 0)
+						return p->e.c;
+				if ((i = p->find_kword(p,table,"MEASUREMENT_SOURCE")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"MEASUREMENT_SOURCE","Not specified", NULL) < 0)
+						return p->e.c;
+				if ((i = p->find_kword(p,table,"PRINT_CONDITIONS")) < 0)	/* Create it */
+					if (p->add_kword(p,table,"PRINT_CONDITIONS","Not specified", NULL) < 0)
+						return p->e.c;
+				break;
+			case tt_other:
+				/* We enforce no pre-defined keywords for user defined file types */
+				break;
+			default:
+				break;
+		}
+	}
 
-		/* First the table identifier */
-		if (!t->sup_id)	/* If not suppressed */ {
-			switch(t->tt) {
-				case it8_7_1:
-					if (fp->gprintf(fp,"IT8.7/1\n\n") < 0)
-						goto write_error;
-					break;
-				case it8_7_2:
-					if (fp->gprintf(fp,"IT8.7/2\n\n") < 0)
-						goto write_error;
-					break;
-				case it8_7_3:
-					if (fp->gprintf(fp,"IT8.7/3\n\n") < 0)
-						goto write_error;
-					break;
-				case it8_7_4:
-					if (fp->gprintf(fp,"IT8.7/4\n\n") < 0)
-						goto write_error;
-					break;
-				case cgats_5:
-					if (fp->gprintf(fp,"CGATS.5\n\n") < 0)
-						goto write_error;
-					break;
-				case cgats_X:				/* variable CGATS type */
-					if (p->cgats_type == NULL)
-						goto write_error;
-					if (fp->gprintf(fp,"%-7s\n\n", p->cgats_type) < 0)
-						goto write_error;
-					break;
-				case tt_other:	/* User defined file identifier */
-					if (fp->gprintf(fp,"%-7s\n\n",p->others[t->oi]) < 0)
-						goto write_error;
-					break;
-				case tt_none:
-					break;
-			}
-		} else {	/* At least space the next table out a bit */
-			if (table == 0) {
-				al->free(al, sfield);
-				return err(p,-1,"cgats_write(), ID should not be suppressed on first table");
-			}
-			if (t->tt != p->t[table-1].tt || (t->tt == tt_other && t->oi != p->t[table-1].oi)) {
-				al->free(al, sfield);
-				return err(p,-1,"cgats_write(), ID should not be suppressed when table %d type is not the same as previous table",table);
-			}
-			if (fp->gprintf(fp,"\n\n") < 0)
-				goto write_error;
+	/* Output the table */
+
+	/* First the table identifier */
+	if (!t->sup_id)	/* If not suppressed */ {
+		switch(t->tt) {
+			case it8_7_1:
+				if (fp->gprintf(fp,"IT8.7/1\n\n") < 0)
+					goto write_error;
+				break;
+			case it8_7_2:
+				if (fp->gprintf(fp,"IT8.7/2\n\n") < 0)
+					goto write_error;
+				break;
+			case it8_7_3:
+				if (fp->gprintf(fp,"IT8.7/3\n\n") < 0)
+					goto write_error;
+				break;
+			case it8_7_4:
+				if (fp->gprintf(fp,"IT8.7/4\n\n") < 0)
+					goto write_error;
+				break;
+			case cgats_5:
+				if (fp->gprintf(fp,"CGATS.5\n\n") < 0)
+					goto write_error;
+				break;
+			case cgats_X:				/* variable CGATS type */
+				if (p->cgats_type == NULL)
+					goto write_error;
+				if (fp->gprintf(fp,"%-7s\n\n", p->cgats_type) < 0)
+					goto write_error;
+				break;
+			case tt_other:	/* User defined file identifier */
+				if (fp->gprintf(fp,"%-7s\n\n",p->others[t->oi]) < 0)
+					goto write_error;
+				break;
+			case tt_none:
+				break;
 		}
+	} else {	/* At least space the next table out a bit */
+		if (table == 0)
+			return err(p,-1,"cgats_write(), ID should not be suppressed on first table");
+		if (t->tt != p->t[table-1].tt || (t->tt == tt_other && t->oi != p->t[table-1].oi))
+			return err(p,-1,"cgats_write(), ID should not be suppressed when table %d type is not the same as previous table",table);
+		if (fp->gprintf(fp,"\n\n") < 0)
+			goto write_error;
+	}
 
-		/* Then all the keywords */
-		for (i = 0; i < t->nkwords; i++) {
-			char *qs = NULL;
+	/* Then all the keywords */
+	for (i = 0; i < t->nkwords; i++) {
+		char *qs = NULL;
 
-			DBGF((DBGA,"CGATS writing keyword %d\n",i));
+		DBGF((DBGA,"CGATS writing keyword %d\n",i));
 
-			/* Keyword and data if it is present */
-			if (t->ksym[i] != NULL && t->kdata[i] != NULL) {
-				if (p->emit_keywords && !standard_kword(t->ksym[i])) {	/* Do the right thing */
-					if ((qs = quote_cs(al, t->ksym[i])) == NULL) {
-						al->free(al, sfield);
-						return err(p,-2,"quote_cs() malloc failed!");
-					}
-					if (fp->gprintf(fp,"KEYWORD %s\n",qs) < 0) {
-						al->free(al, qs);
-						goto write_error;
-					}
-					al->free(al, qs);
-				}
-	
-				if ((qs = quote_cs(al, t->kdata[i])) == NULL) {
-					al->free(al, sfield);
+		/* Keyword and data if it is present */
+		if (t->ksym[i] != NULL && t->kdata[i] != NULL) {
+			if (p->emit_keywords && !standard_kword(t->ksym[i])) {	/* Do the right thing */
+				if ((qs = quote_cs(al, t->ksym[i])) == NULL)
 					return err(p,-2,"quote_cs() malloc failed!");
-				}
-				if (fp->gprintf(fp,"%s %s%s",t->ksym[i],qs,
-				    t->kcom[i] == NULL ? "\n":"\t") < 0) {
+				if (fp->gprintf(fp,"KEYWORD %s\n",qs) < 0) {
 					al->free(al, qs);
 					goto write_error;
 				}
 				al->free(al, qs);
 			}
-			/* Comment if its present */
-			if (t->kcom[i] != NULL) {
-				if (fp->gprintf(fp,"# %s\n",t->kcom[i]) < 0) {
-					al->free(al, qs);
-					goto write_error;
-				}
-			}
-		}
 
-		/* Then the field specification */
-		if (!t->sup_fields) {	/* If not suppressed */
-			if (fp->gprintf(fp,"\n") < 0)
+			if ((qs = quote_cs(al, t->kdata[i])) == NULL)
+				return err(p,-2,"quote_cs() malloc failed!");
+			if (fp->gprintf(fp,"%s %s%s",t->ksym[i],qs,
+			    t->kcom[i] == NULL ? "\n":"\t") < 0) {
+				al->free(al, qs);
 				goto write_error;
-	
-			/* Declare any non-standard fields */
-			for (field = 0; field < t->nfields; field++) {
-				if (p->emit_keywords && !sfield[field])	/* Non-standard */ {
-					char *qs;
-					if ((qs = quote_cs(al, t->fsym[field])) == NULL) {
-						al->free(al, sfield);
-						return err(p,-2,"quote_cs() malloc failed!");
-					}
-					if (fp->gprintf(fp,"KEYWORD %s\n",qs) < 0) {
-						al->free(al, qs);
-						goto write_error;
-					}
-					al->free(al, qs);
-				}
 			}
-	
-			if (fp->gprintf(fp,"NUMBER_OF_FIELDS %d\n",t->nfields) < 0)
-				goto write_error;
-			if (fp->gprintf(fp,"BEGIN_DATA_FORMAT\n") < 0)
+			al->free(al, qs);
+		}
+		/* Comment if its present */
+		if (t->kcom[i] != NULL) {
+			if (fp->gprintf(fp,"# %s\n",t->kcom[i]) < 0) {
+				al->free(al, qs);
 				goto write_error;
-			for (field = 0; field < t->nfields; field ++) {
-				DBGF((DBGA,"CGATS writing field %d\n",field));
-				if (fp->gprintf(fp,"%s ",t->fsym[field]) < 0)
+			}
+		}
+	}
+
+	/* Then the field specification */
+	if (!t->sup_fields) {	/* If not suppressed */
+		if (fp->gprintf(fp,"\n") < 0)
+			goto write_error;
+
+		/* Declare any non-standard fields */
+		for (field = 0; field < t->nfields; field++) {
+			if (p->emit_keywords && !sfield[field])	/* Non-standard */ {
+				char *qs;
+				if ((qs = quote_cs(al, t->fsym[field])) == NULL)
+					return err(p,-2,"quote_cs() malloc failed!");
+				if (fp->gprintf(fp,"KEYWORD %s\n",qs) < 0) {
+					al->free(al, qs);
 					goto write_error;
+				}
+				al->free(al, qs);
 			}
-			if (fp->gprintf(fp,"\nEND_DATA_FORMAT\n") < 0)
+		}
+
+		if (fp->gprintf(fp,"NUMBER_OF_FIELDS %d\n",t->nfields) < 0)
+			goto write_error;
+		if (fp->gprintf(fp,"BEGIN_DATA_FORMAT\n") < 0)
+			goto write_error;
+		for (field = 0; field < t->nfields; field ++) {
+			DBGF((DBGA,"CGATS writing field %d\n",field));
+			if (fp->gprintf(fp,"%s ",t->fsym[field]) < 0)
 				goto write_error;
-		} else { /* Check that it is safe to suppress fields */
-			cgats_table *pt = &p->t[table-1];
-			if (table == 0) {
-				al->free(al, sfield);
-				return err(p,-1,"cgats_write(), Fields should not be suppressed on first table");
-			}
-			if (t->nfields != pt->nfields) {
-				al->free(al, sfield);
-				return err(p,-1,"cgats_write(), Fields should not be suppressed when table %d different number than previous table",table);
-			}
-			for (field = 0; field < t->nfields; field ++)
-				if (strcmp(t->fsym[field],pt->fsym[field]) != 0
-				 || t->ftype[field] != pt->ftype[field]) {
-					al->free(al, sfield);
-					return err(p,-1,"cgats_write(), Fields should not be suppressed when table %d types is not the same as previous table",table);
-				}
 		}
+		if (fp->gprintf(fp,"\nEND_DATA_FORMAT\n") < 0)
+			goto write_error;
+	} else { /* Check that it is safe to suppress fields */
+		cgats_table *pt = &p->t[table-1];
+		if (table == 0)
+			return err(p,-1,"cgats_write(), Fields should not be suppressed on first table");
+		if (t->nfields != pt->nfields)
+			return err(p,-1,"cgats_write(), Fields should not be suppressed when table %d different number than previous table",table);
+		for (field = 0; field < t->nfields; field ++)
+			if (strcmp(t->fsym[field],pt->fsym[field]) != 0
+			 || t->ftype[field] != pt->ftype[field])
+				return err(p,-1,"cgats_write(), Fields should not be suppressed when table %d types is not the same as previous table",table);
+	}
 
-		/* Then the actual data */
-		if (fp->gprintf(fp,"\nNUMBER_OF_SETS %d\n",t->nsets) < 0)
+	/* Then the start of the data */
+	if (nsets >= 0) {
+		if (fp->gprintf(fp,"\nNUMBER_OF_SETS %d\n",nsets) < 0)
 			goto write_error;
-		if (fp->gprintf(fp,"BEGIN_DATA\n") < 0)
+	} else {
+		if (fp->gprintf(fp,"\n") < 0)
 			goto write_error;
-		for (set = 0; set < t->nsets; set++) {
-			DBGF((DBGA,"CGATS writing set %d\n",set));
-			for (field = 0; field < t->nfields; field++) {
-				data_type tt;
-				if (t->ftype[field] == r_t) {
-					char fmt[30];
-					double val = *((double *)t->fdata[set][field]);
-					real_format(val, REAL_SIGDIG, fmt);
+	}
+	if (fp->gprintf(fp,"BEGIN_DATA\n") < 0)
+		goto write_error;
+	return 0;
+
+write_error:
+	return err(p,-1,"Write error to file '%s'",fp->fname(fp));
+}
+
+/* Write the sets of a table from set s0 onwards */
+/* Return -ve, errc & err if there was an error */
+static int
+write_sets(cgats *p, cgatsFile *fp, int table, int *sfield, int s0) {
+	cgatsAlloc *al = p->al;
+	cgats_table *t = &p->t[table];
+	int set, field;
+
+	for (set = s0; set < t->nsets; set++) {
+		DBGF((DBGA,"CGATS writing set %d\n",set));
+		for (field = 0; field < t->nfields; field++) {
+			data_type tt;
+			if (t->ftype[field] == r_t) {
+				char fmt[30];
+				double val = ((double *)t->cdata[field])[set];
+				real_format(val, REAL_SIGDIG, fmt);
  					strcat(fmt," ");
-					if (fp->gprintf(fp,fmt,val) < 0)
-						goto write_error;
-				} else if (t->ftype[field] == i_t) {
-					if (fp->gprintf(fp,"%d ",*((int *)t->fdata[set][field])) < 0)
-						goto write_error;
-				} else if (t->ftype[field] == nqcs_t
-				      && !cs_has_ws((char *)t->fdata[set][field])
-				      && (sfield[field] || (tt = guess_type((char *)t->fdata[set][field]),
-				                            tt != i_t && tt != r_t))) {
-					/* We can only print a non-quote string if it doesn't contain white space, */
-					/* quote or comment characters, and if it is a standard field or */
-					/* can't be mistaken for a number. */
-					if (fp->gprintf(fp,"%s ",(char *)t->fdata[set][field]) < 0)
-						goto write_error;
-				} else if (t->ftype[field] == nqcs_t
-				      || t->ftype[field] == cs_t) {
-					char *qs;
-					if ((qs = quote_cs(al, (char *)t->fdata[set][field])) == NULL) {
-						al->free(al, sfield);
-						return err(p,-2,"quote_cs() malloc failed!");
-					}
-					if (fp->gprintf(fp,"%s ",qs) < 0) {
-						al->free(al, qs);
-						goto write_error;
-					}
+				if (fp->gprintf(fp,fmt,val) < 0)
+					goto write_error;
+			} else if (t->ftype[field] == i_t) {
+				if (fp->gprintf(fp,"%d ",((int *)t->cdata[field])[set]) < 0)
+					goto write_error;
+			} else if (t->ftype[field] == nqcs_t
+			      && !cs_has_ws(((char **)t->cdata[field])[set])
+			      && (sfield[field] || (tt = guess_type(((char **)t->cdata[field])[set]),
+			                            tt != i_t && tt != r_t))) {
+				/* We can only print a non-quote string if it doesn't contain white space, */
+				/* quote or comment characters, and if it is a standard field or */
+				/* can't be mistaken for a number. */
+				if (fp->gprintf(fp,"%s ",((char **)t->cdata[field])[set]) < 0)
+					goto write_error;
+			} else if (t->ftype[field] == nqcs_t
+			      || t->ftype[field] == cs_t) {
+				char *qs;
+				if ((qs = quote_cs(al, ((char **)t->cdata[field])[set])) == NULL)
+					return err(p,-2,"quote_cs() malloc failed!");
+				if (fp->gprintf(fp,"%s ",qs) < 0) {
 					al->free(al, qs);
-				} else {
-					al->free(al, sfield);
-					return err(p,-1,"cgats_write(), illegal data type found");
+					goto write_error;
 				}
-			}
-			if (fp->gprintf(fp,"\n") < 0)
-				goto write_error;
+				al->free(al, qs);
+			} else
+				return err(p,-1,"cgats_write(), illegal data type found");
 		}
-		if (fp->gprintf(fp,"END_DATA\n") < 0)
+		if (fp->gprintf(fp,"\n") < 0)
 			goto write_error;
-
-		if (sfield != NULL)
-			al->free(al, sfield);
-		sfield = NULL;
 	}
 	return 0;
 
 write_error:
-	err(p,-1,"Write error to file '%s'",fp->fname(fp));
+	return err(p,-1,"Write error to file '%s'",fp->fname(fp));
+}
+
+/* Write a whole table */
+/* Return -ve, errc & err if there was an error */
+static int
+write_table(cgats *p, cgatsFile *fp, int table) {
+	cgatsAlloc *al = p->al;
+	cgats_table *t = &p->t[table];
+	int *sfield = NULL;	/* Standard field flag */
+
+	if (t->nfields > 0)
+		if ((sfield = (int *)al->calloc(al, t->nfields, sizeof(int))) == NULL)
+			return err(p,-2,"cgats.write(), malloc failed!");
+
+	if (write_head(p, fp, table, sfield, t->nsets) < 0
+	 || write_sets(p, fp, table, sfield, 0) < 0) {
+		if (sfield != NULL)
+			al->free(al, sfield);
+		return p->e.c;
+	}
 	if (sfield != NULL)
 		al->free(al, sfield);
-	return p->e.c;
+
+	if (fp->gprintf(fp,"END_DATA\n") < 0)
+		return err(p,-1,"Write error to file '%s'",fp->fname(fp));
+
+	return 0;
+}
+
+/* Write structure into cgats file */
+/* Return -ve, errc & err if there was an error */
+static int
+cgats_write(cgats *p, cgatsFile *fp) {
+	int table;
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	DBGF((DBGA,"CGATS write called, ntables = %d\n",p->ntables));
+	for (table = 0; table < p->ntables; table++) {
+		if (write_table(p, fp, table) < 0)
+			return p->e.c;
+	}
+	return 0;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Streaming write. The sets of the table being streamed */
+/* are written out a batch at a time as they are added. */
+
+/* Start streaming a table */
+/* Return -ve, errc & err if there was an error */
+static int
+swrite_table(cgats *p, int table, cgatsFile *fp, int nsets) {
+	cgatsAlloc *al = p->al;
+	cgats_wstate *ws;
+	cgats_table *t;
+	int i;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+	if (table < 0 || table >= p->ntables)
+		return err(p,-1,"cgats.swrite_table(), table parameter out of range");
+	if (p->stream_sets < 1)
+		return err(p,-1,"cgats.swrite_table(), stream_sets must be at least 1");
+
+	if (p->ws == NULL) {
+		if ((p->ws = (cgats_wstate *)al->calloc(al, 1, sizeof(cgats_wstate))) == NULL)
+			return err(p,-2,"cgats.swrite_table(), malloc failed!");
+		p->ws->table = -1;
+	}
+	ws = p->ws;
+	if (ws->table >= 0)
+		return err(p,-1,"cgats.swrite_table(), table %d is still being streamed",ws->table);
+	if (table < ws->ntw)
+		return err(p,-1,"cgats.swrite_table(), table %d has already been written",table);
+
+	/* Write any preceding tables */
+	for (i = ws->ntw; i < table; i++) {
+		if (write_table(p, fp, i) < 0)
+			return p->e.c;
+	}
+	ws->ntw = table;
+
+	t = &p->t[table];
+	if (t->nfields > 0)
+		if ((ws->sfield = (int *)al->calloc(al, t->nfields, sizeof(int))) == NULL)
+			return err(p,-2,"cgats.swrite_table(), malloc failed!");
+
+	if (write_head(p, fp, table, ws->sfield, nsets) < 0) {
+		if (ws->sfield != NULL)
+			al->free(al, ws->sfield);
+		ws->sfield = NULL;
+		return p->e.c;
+	}
+	ws->fp = fp;
+	ws->table = table;
+	ws->ntw = table + 1;
+	ws->nsets = nsets;
+	ws->nw = 0;
+
+	if (t->nsets > 0)
+		return flush_sets(p);
+
+	return 0;
+}
+
+/* Write out and discard the sets held by the table being streamed */
+/* Return -ve, errc & err if there was an error */
+static int
+flush_sets(cgats *p) {
+	cgats_wstate *ws = p->ws;
+	cgats_table *t = &p->t[ws->table];
+
+	if (write_sets(p, ws->fp, ws->table, ws->sfield, 0) < 0)
+		return p->e.c;
+	ws->nw += t->nsets;
+	discard_sets(p, t);
+
+	return 0;
+}
+
+/* Finish streaming a table */
+/* Return -ve, errc & err if there was an error */
+static int
+swrite_end(cgats *p) {
+	cgats_wstate *ws = p->ws;
+	int rv = 0;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+	if (ws == NULL || ws->table < 0)
+		return err(p,-1,"cgats.swrite_end(), no table is being streamed");
+
+	if ((rv = flush_sets(p)) == 0) {
+		if (ws->fp->gprintf(ws->fp,"END_DATA\n") < 0)
+			rv = err(p,-1,"Write error to file '%s'",ws->fp->fname(ws->fp));
+		else if (ws->nsets >= 0 && ws->nw != ws->nsets)
+			rv = err(p,-1,"cgats.swrite_end(), wrote %d sets, expected %d",ws->nw,ws->nsets);
+	}
+
+	if (ws->sfield != NULL)
+		p->al->free(p->al, ws->sfield);
+	ws->sfield = NULL;
+	ws->table = -1;
+
+	return rv;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - */
+/* Binary format. This holds the same tables as the text format, with */
+/* each field's values as a contiguous column, and the SAMPLE_ID index, */
+/* so that it can be loaded without parsing and written back as */
+/* exactly the same text. All values are little endian:
+
+	"CGATSBIN", u32 version, u32 ntables, and for each table:
+	u32 table type, str identifier, u32 flags (1 = sup_id, 2 = sup_kwords, 4 = sup_fields)
+	u32 nkwords, [nkwords] of str ksym, str kdata, str kcom
+	u32 nfields, [nfields] of str fsym, u32 ftype
+	u32 nsets, [nfields] columns of [nsets] values
+	    (IEEE double for r_t, s32 for i_t, str for cs_t & nqcs_t)
+	u32 nsidx, [nsidx] of u32 SAMPLE_ID index slot
+
+   A str is a u32 length including the nul, 0 for NULL, followed by the characters.
+ */
+
+#define BIN_MAGIC "CGATSBIN"
+#define BIN_VERSION 1
+#define BIN_BUFSIZE 8192
+
+/* Return nz if the host is little endian */
+static int
+bin_le(void) {
+	unsigned int v = 1;
+	return *((unsigned char *)&v) == 1;
+}
+
+/* Buffered binary writer */
+typedef struct {
+	cgatsFile *fp;
+	int bad;			/* NZ if a write failed */
+	size_t n;			/* Bytes in b[] */
+	unsigned char b[BIN_BUFSIZE];
+} bin_wbuf;
+
+static void
+bw_flush(bin_wbuf *w) {
+	if (w->n > 0 && !w->bad && w->fp->write(w->fp, w->b, 1, w->n) != w->n)
+		w->bad = 1;
+	w->n = 0;
+}
+
+static void
+bw_bytes(bin_wbuf *w, const void *buf, size_t len) {
+	const unsigned char *s = (const unsigned char *)buf;
+
+	while (len > 0) {
+		size_t n = BIN_BUFSIZE - w->n;
+		if (n > len)
+			n = len;
+		memcpy(w->b + w->n, s, n);
+		w->n += n;
+		s += n;
+		len -= n;
+		if (w->n >= BIN_BUFSIZE)
+			bw_flush(w);
+	}
+}
+
+static void
+bw_u32(bin_wbuf *w, unsigned int v) {
+	unsigned char b[4];
+
+	b[0] = (unsigned char)(v & 0xff);
+	b[1] = (unsigned char)((v >> 8) & 0xff);
+	b[2] = (unsigned char)((v >> 16) & 0xff);
+	b[3] = (unsigned char)((v >> 24) & 0xff);
+	bw_bytes(w, b, 4);
+}
+
+static void
+bw_dbl(bin_wbuf *w, double v) {
+	unsigned char b[8];
+
+	memcpy(b, &v, 8);
+	if (!bin_le()) {
+		int i;
+		for (i = 0; i < 4; i++) {
+			unsigned char t = b[i];
+			b[i] = b[7-i];
+			b[7-i] = t;
+		}
+	}
+	bw_bytes(w, b, 8);
+}
+
+static void
+bw_str(bin_wbuf *w, const char *s) {
+	if (s == NULL) {
+		bw_u32(w, 0);
+	} else {
+		size_t len = strlen(s) + 1;
+		bw_u32(w, (unsigned int)len);
+		bw_bytes(w, s, len);
+	}
+}
+
+/* Write structure into a binary file */
+/* Return -ve, errc & err if there was an error */
+static int
+write_bin(cgats *p, cgatsFile *fp) {
+	cgatsAlloc *al = p->al;
+	bin_wbuf *w;
+	int table, i, j;
+	int rv = 0;
+
+	p->e.c = 0;
+	p->e.m[0] = '\000';
+
+	if ((w = (bin_wbuf *)al->malloc(al, sizeof(bin_wbuf))) == NULL)
+		return err(p,-2,"cgats.write_bin(), malloc failed!");
+	w->fp = fp;
+	w->bad = 0;
+	w->n = 0;
+
+	bw_bytes(w, BIN_MAGIC, 8);
+	bw_u32(w, BIN_VERSION);
+	bw_u32(w, p->ntables);
+
+	for (table = 0; table < p->ntables && rv == 0; table++) {
+		cgats_table *t = &p->t[table];
+		char *ident = NULL;
+		int field;
+
+		if (t->tt == cgats_X)
+			ident = p->cgats_type;
+		else if (t->tt == tt_other)
+			ident = p->others[t->oi];
+		bw_u32(w, t->tt);
+		bw_str(w, ident);
+		bw_u32(w, (t->sup_id ? 1 : 0) | (t->sup_kwords ? 2 : 0) | (t->sup_fields ? 4 : 0));
+
+		bw_u32(w, t->nkwords);
+		for (i = 0; i < t->nkwords; i++) {
+			bw_str(w, t->ksym[i]);
+			bw_str(w, t->kdata[i]);
+			bw_str(w, t->kcom[i]);
+		}
+
+		bw_u32(w, t->nfields);
+		for (i = 0; i < t->nfields; i++) {
+			bw_str(w, t->fsym[i]);
+			bw_u32(w, t->ftype[i]);
+		}
+
+		bw_u32(w, t->nsets);
+		for (i = 0; i < t->nfields && rv == 0; i++) {
+			switch(t->ftype[i]) {
+				case r_t:
+					for (j = 0; j < t->nsets; j++)
+						bw_dbl(w, ((double *)t->cdata[i])[j]);
+					break;
+				case i_t:
+					for (j = 0; j < t->nsets; j++)
+						bw_u32(w, (unsigned int)((int *)t->cdata[i])[j]);
+					break;
+				case cs_t:
+				case nqcs_t:
+					for (j = 0; j < t->nsets; j++)
+						bw_str(w, ((char **)t->cdata[i])[j]);
+					break;
+				default:
+					rv = err(p,-1,"cgats.write_bin(), illegal data type found");
+					break;
+			}
+		}
+		if (rv != 0)
+			break;
+
+		/* The SAMPLE_ID index */
+		if ((field = find_field(p, table, "SAMPLE_ID")) >= 0) {
+			if (t->sidx == NULL && build_sidx(t, field)) {
+				rv = err(p,-2,"cgats.write_bin(), malloc failed!");
+				break;
+			}
+			bw_u32(w, t->nsidx);
+			for (i = 0; i < t->nsidx; i++)
+				bw_u32(w, t->sidx[i]);
+		} else {
+			bw_u32(w, 0);
+		}
+	}
+
+	if (rv == 0) {
+		bw_flush(w);
+		if (w->bad)
+			rv = err(p,-1,"Write error to file '%s'",fp->fname(fp));
+	}
+	al->free(al, w);
+
+	return rv;
+}
+
+/* Check whether a file is binary. If it is, the file is left positioned */
+/* after the magic number and *size is set to the file size, */
+/* else it is left at the start. Only sized files are checked. */
+/* Return 1 if binary, 0 if not, -ve, errc & err if there was an error */
+static int
+is_bin(cgats *p, cgatsFile *fp, size_t *size) {
+	char magic[8];
+
+	if ((*size = fp->get_size(fp)) < 8)
+		return 0;
+	if (fp->read(fp, magic, 1, 8) == 8 && memcmp(magic, BIN_MAGIC, 8) == 0)
+		return 1;
+	if (fp->seek(fp, 0) != 0)
+		return err(p,-1,"Unable to seek in file '%s'",fp->fname(fp));
+	return 0;
+}
+
+/* Binary reader, with bounds checking */
+typedef struct {
+	unsigned char *b;	/* Next byte */
+	unsigned char *e;	/* End of the data */
+	int bad;			/* NZ if the data is corrupt */
+} bin_rbuf;
+
+static unsigned int
+br_u32(bin_rbuf *r) {
+	unsigned int v;
+
+	if (r->bad || (r->e - r->b) < 4) {
+		r->bad = 1;
+		return 0;
+	}
+	v = r->b[0] | (r->b[1] << 8) | (r->b[2] << 16) | ((unsigned int)r->b[3] << 24);
+	r->b += 4;
+	return v;
+}
+
+static double
+br_dbl(bin_rbuf *r) {
+	unsigned char b[8];
+	double v;
+	int i;
+
+	if (r->bad || (r->e - r->b) < 8) {
+		r->bad = 1;
+		return 0.0;
+	}
+	for (i = 0; i < 8; i++)
+		b[i] = r->b[bin_le() ? i : 7-i];
+	r->b += 8;
+	memcpy(&v, b, 8);
+	return v;
+}
+
+/* Return a string in place in the data, NULL if it is NULL or corrupt */
+static char *
+br_str(bin_rbuf *r) {
+	unsigned int len = br_u32(r);
+	char *s;
+
+	if (len == 0 || r->bad)
+		return NULL;
+	if ((size_t)(r->e - r->b) < len || r->b[len-1] != '\000') {
+		r->bad = 1;
+		return NULL;
+	}
+	s = (char *)r->b;
+	r->b += len;
+	return s;
+}
+
+/* Read a table of a binary file, and append it to the structure. */
+/* Return -ve, errc & err if there was an error, 0 with r->bad set if corrupt */
+static int
+read_bin_table(cgats *p, cgatsFile *fp, bin_rbuf *r) {
+	cgatsAlloc *al = p->al;
+	cgats_table *t;
+	unsigned int tt, flags, nkwords, nfields, nsets, nsidx, nused, i, j;
+	char *ident;
+	int table, oi = 0;
+
+	tt = br_u32(r);
+	ident = br_str(r);
+	flags = br_u32(r);
+	if (r->bad || tt > tt_none) {
+		r->bad = 1;
+		return 0;
+	}
+
+	/* The identifier must be known, as for a text file */
+	if (tt == cgats_X) {
+		if (ident != NULL && set_cgats_type(p, ident) < 0)
+			return p->e.c;
+	} else if (tt == tt_other) {
+		int iswild = 0;
+		if (ident == NULL) {
+			r->bad = 1;
+			return 0;
+		}
+		for (oi = 0; oi < p->nothers; oi++) {
+			if (p->others[oi][0] == '\000')
+				iswild = 1;
+			else if (strcmp(ident, p->others[oi]) == 0)
+				break;
+		}
+		if (oi >= p->nothers) {
+			if (!iswild)
+				return err(p,-1,"Error in table %d of file '%s': No CGATS file identifier found",p->ntables,fp->fname(fp));
+			if ((oi = add_other(p, ident)) < 0)
+				return p->e.c;
+		}
+	}
+
+	if ((table = add_table(p, (table_type)tt, oi)) < 0)
+		return p->e.c;
+	t = &p->t[table];
+	t->sup_id = (flags & 1) ? 1 : 0;
+	t->sup_kwords = (flags & 2) ? 1 : 0;
+	t->sup_fields = (flags & 4) ? 1 : 0;
+
+	nkwords = br_u32(r);
+	for (i = 0; i < nkwords && !r->bad; i++) {
+		char *ksym, *kdata, *kcom;
+		ksym = br_str(r);
+		kdata = br_str(r);
+		kcom = br_str(r);
+		if (r->bad)
+			return 0;
+		if (add_kword_at(p, table, -1, ksym, kdata, kcom) < 0)
+			return p->e.c;
+	}
+
+	nfields = br_u32(r);
+	for (i = 0; i < nfields && !r->bad; i++) {
+		char *fsym;
+		unsigned int ftype;
+		fsym = br_str(r);
+		ftype = br_u32(r);
+		if (r->bad || fsym == NULL || ftype >= none_t) {
+			r->bad = 1;
+			return 0;
+		}
+		if (add_field(p, table, fsym, none_t) < 0)
+			return p->e.c;
+		t->ftype[i] = (data_type)ftype;
+	}
+
+	/* Each value takes at least 4 bytes, so check before allocating */
+	nsets = br_u32(r);
+	if (r->bad || nsets > 0x7fffffff
+	 || (nsets > 0 && (nfields == 0 || nsets > (size_t)(r->e - r->b) / 4 / nfields))) {
+		r->bad = 1;
+		return 0;
+	}
+
+	if (nsets > 0) {
+		if (alloc_sets(t, nsets))
+			return err(p,-2,"cgats.read(), malloc failed!");
+		for (i = 0; i < nfields; i++) {
+			switch(t->ftype[i]) {
+				case r_t:
+					for (j = 0; j < nsets; j++)
+						((double *)t->cdata[i])[j] = br_dbl(r);
+					break;
+				case i_t:
+					for (j = 0; j < nsets; j++)
+						((int *)t->cdata[i])[j] = (int)br_u32(r);
+					break;
+				default:
+					for (j = 0; j < nsets; j++) {
+						char *sv;
+						if ((sv = br_str(r)) == NULL) {
+							r->bad = 1;
+							return 0;
+						}
+						if ((sv = strblk_dup(al, &t->sblk, sv)) == NULL)
+							return err(p,-2,"cgats.read(), malloc failed!");
+						((char **)t->cdata[i])[j] = sv;
+						t->fdata[j][i] = (void *)sv;
+					}
+					break;
+			}
+		}
+		t->nsets = nsets;
+	}
+
+	/* The SAMPLE_ID index. There must be at least one empty slot. */
+	nsidx = br_u32(r);
+	if (r->bad || nsidx == 0)
+		return 0;
+	if ((nsidx & (nsidx-1)) != 0 || nsidx <= nsets
+	 || nsidx > (size_t)(r->e - r->b) / 4) {
+		r->bad = 1;
+		return 0;
+	}
+	if ((t->sidx = (int *)al->malloc(al, nsidx * sizeof(int))) == NULL)
+		return err(p,-2,"cgats.read(), malloc failed!");
+	t->nsidx = nsidx;
+	for (nused = i = 0; i < nsidx; i++) {
+		unsigned int v = br_u32(r);
+		if (v > nsets) {
+			r->bad = 1;
+			return 0;
+		}
+		if (v != 0)
+			nused++;
+		t->sidx[i] = v;
+	}
+	if (nused > nsets)
+		r->bad = 1;
+
+	return 0;
+}
+
+/* Read a binary file of the given size, positioned after the magic number. */
+/* The tables are appended to the structure. */
+/* Return -ve, errc & err if there was an error */
+static int
+read_bin(cgats *p, cgatsFile *fp, size_t size) {
+	cgatsAlloc *al = p->al;
+	unsigned char *buf;
+	bin_rbuf r;
+	unsigned int ntables, i;
+	int rv = 0;
+
+	size -= 8;
+	if ((buf = (unsigned char *)al->malloc(al, size + 1)) == NULL)
+		return err(p,-2,"cgats.read(), malloc failed!");
+	if (fp->read(fp, buf, 1, size) != size) {
+		al->free(al, buf);
+		return err(p,-1,"Unable to read file '%s'",fp->fname(fp));
+	}
+	r.b = buf;
+	r.e = buf + size;
+	r.bad = 0;
+
+	if (br_u32(&r) != BIN_VERSION) {
+		al->free(al, buf);
+		return err(p,-1,"Binary CGATS file '%s' is an unknown version",fp->fname(fp));
+	}
+	ntables = br_u32(&r);
+	for (i = 0; i < ntables && !r.bad; i++) {
+		if ((rv = read_bin_table(p, fp, &r)) < 0)
+			break;
+	}
+	al->free(al, buf);
+
+	if (rv == 0 && r.bad)
+		rv = err(p,-1,"Binary CGATS file '%s' is corrupt",fp->fname(fp));
+
+	return rv;
 }
 
 /* Allocate space for data with given type, and copy it from source */
@@ -1960,6 +3150,92 @@ guess_type(const char *cs)
 	return i_t;
 	}
 
+/* Convert a real value string the same as atof(). */
+/* A plain decimal number of up to 15 significant digits and a */
+/* decimal exponent within +/-22 is converted directly, since both */
+/* the mantissa and the power of 10 are exact in a double, and a */
+/* single multiply or divide is then correctly rounded. */
+/* Anything else is left to atof(). */
+static double
+read_real(const char *cs) {
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	static double p10[23] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *s = cs;
+	double mant = 0.0;
+	int neg = 0;
+	int nd = 0;			/* Number of mantissa digits */
+	int nsd = 0;		/* Number of significant mantissa digits */
+	int dexp = 0;		/* Decimal exponent */
+
+	if (*s == '-') {
+		neg = 1;
+		s++;
+	} else if (*s == '+')
+		s++;
+
+	for (; *s >= '0' && *s <= '9'; s++, nd++) {
+		if (nsd > 0 || *s != '0')
+			nsd++;
+		mant = 10.0 * mant + (*s - '0');
+	}
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++, nd++) {
+			if (nsd > 0 || *s != '0')
+				nsd++;
+			mant = 10.0 * mant + (*s - '0');
+			dexp--;
+		}
+	}
+	if (nd > 0 && nsd <= 15) {
+		if (*s == 'e' || *s == 'E') {
+			int eneg = 0, ev = 0, ned = 0;
+			s++;
+			if (*s == '-') {
+				eneg = 1;
+				s++;
+			} else if (*s == '+')
+				s++;
+			for (; *s >= '0' && *s <= '9' && ned < 5; s++, ned++)
+				ev = 10 * ev + (*s - '0');
+			if (ned == 0 || ned >= 5)
+				return atof(cs);
+			dexp += eneg ? -ev : ev;
+		}
+		if (*s == '\000') {
+			if (dexp < 0 && dexp >= -22)
+				mant /= p10[-dexp];
+			else if (dexp >= 0 && dexp <= 22)
+				mant *= p10[dexp];
+			else if (mant != 0.0)
+				return atof(cs);
+			return neg ? -mant : mant;
+		}
+	}
+#endif /* FLT_EVAL_METHOD == 0 */
+	return atof(cs);
+}
+
+/* Convert an integer value string the same as atoi(). */
+static int
+read_int(const char *cs) {
+	const char *s = cs;
+	int neg = 0, nd, iv = 0;
+
+	if (*s == '-') {
+		neg = 1;
+		s++;
+	} else if (*s == '+')
+		s++;
+	for (nd = 0; *s >= '0' && *s <= '9' && nd < 9; s++, nd++)
+		iv = 10 * iv + (*s - '0');
+	if (*s != '\000')
+		return atoi(cs);		/* Long or unusual number */
+	return neg ? -iv : iv;
+}
+
 /* Set the character format to the appropriate printf() */
 /* format given the real value and the desired number of significant digits. */
 /* We try to do this while not using the %e format for normal values. */
@@ -40,6 +40,13 @@ union _cgats_set_elem {
 	char *c;
 }; typedef union _cgats_set_elem cgats_set_elem;
 
+/* Block of string storage, private to cgats.c */
+struct _cgats_strblk; typedef struct _cgats_strblk cgats_strblk;
+
+/* Streaming read and write state, private to cgats.c */
+struct _cgats_rstate; typedef struct _cgats_rstate cgats_rstate;
+struct _cgats_wstate; typedef struct _cgats_wstate cgats_wstate;
+
 struct _cgats_table {
 	cgatsAlloc *al;		/* Copy of parent memory allocator */
 	table_type tt;		/* Table type */
@@ -55,25 +62,39 @@ struct _cgats_table {
 	
 	char **fsym;		/* Pointer to [nfields] array of pointers to field symbols */
 	data_type *ftype;	/* Pointer to [nfields] array of field types */
+	void **cdata;		/* Pointer to [nfields] array of pointers to field value columns, */
+						/*  each [nsets] of double for r_t, int for i_t, char * for cs_t & nqcs_t */
 	char ***rfdata;		/* Pointer to [nsets] array of pointers */
 						/*         to [nfields] array of pointers to read file field text values */
+						/*  (NULL unless keep_text was set on the cgats object when read) */
 	void ***fdata;		/* Pointer to [nsets] array of pointers */
 						/*         to [nfields] array of pointers to field set values of ftype */
+						/*  (A view into cdata[], invalidated by adding sets or fields) */
 	/* Private */
 	int nkwordsa;		/* Number of keywords allocated */
 	int nfieldsa;		/* Number of fields allocated */
-	int nsetsa;			/* Number of sets allocated */
+	int nsetsa;			/* Number of sets allocated in cdata[] columns and fdata[] */
+	void **fdblk;		/* [nsetsa * nfields] block of value pointers fdata[] points into */
+	cgats_strblk *sblk;	/* Storage for string field values */
+	char **rtext;		/* [nrsetsa * nfields] read text values, set major */
+	int nrsetsa;		/* Number of sets allocated in rtext[] */
+	cgats_strblk *rblk;	/* Storage for read text values */
 	char **kcom;		/* Pointer to [nkwords] array of pointers to keyword comments */
 	int ndf;			/* Next data field - used by add_data_item() */
 	int sup_id;			/* Set to non-zero if table ID output is to be suppressed */
 	int sup_kwords;		/* Set to non-zero if table default keyword output is to be suppressed */
 	int sup_fields;		/* Set to non-zero if table field output is to be suppressed */
+	int *sidx;			/* [nsidx] SAMPLE_ID hash index slots, set index + 1, 0 if empty */
+						/*  (NULL until built by find_set() or loaded from a binary file) */
+	int nsidx;			/* Number of sidx[] slots, a power of 2 */
 }; typedef struct _cgats_table cgats_table;
 
 struct _cgats {
 	/* Private */
 	cgatsAlloc *al;		/* Memory allocator */
 	int del_al;			/* Flag to indicate we al->del() */
+	cgats_rstate *rs;	/* Streaming read state, NULL if not streaming */
+	cgats_wstate *ws;	/* Streaming write state, NULL if never streamed */
 
 	/* Read only Variables */
 	int ntables;		/* Number of tables */
@@ -89,6 +110,9 @@ struct _cgats {
 
 	/* Options */
 	int emit_keywords;	/* NZ to emit "KEYWORD" for non-standard keywords (default no) */
+	int keep_text;		/* NZ to keep the text of values read in t[].rfdata (default no) */
+	int stream_sets;	/* Maximum number of sets held by a streaming read or write */
+						/* (default 1000) */
 
 	/* Public Methods */
 	int (*set_cgats_type)(struct _cgats *p, const char *osym);
@@ -119,6 +143,10 @@ struct _cgats {
 	int (*find_field)(struct _cgats *p, int table, const char *fsym);
 												/* Return index of the field, -1 on fail */
 												/* -2 on illegal table index, e.c & e.m */
+	int (*find_set)(struct _cgats *p, int table, const char *id);
+												/* Return index of the set with the given */
+												/* SAMPLE_ID, -1 on fail, -2 on illegal */
+												/* table index or malloc failure, e.c & e.m */
 
 	int (*add_table)(struct _cgats *p, table_type tt, int oi);
 	                                        /* Add a new (empty) table to the structure */
@@ -152,10 +180,60 @@ struct _cgats {
 	int (*get_setarr)(struct _cgats *p, int table, int set_index, cgats_set_elem *ary);
 						/* Fill a suitable set_element with a line of data */
 						/* Return 0 normally, -1, -2, e.c & e.m if error */
+	double *(*get_dcol)(struct _cgats *p, int table, int field);
+						/* Return the [nsets] column of values of a real field */
+						/* Return NULL, e.c & e.m if error or field is not r_t */
+						/* (Numeric column values may be modified in place) */
+	int *(*get_icol)(struct _cgats *p, int table, int field);
+						/* Return the [nsets] column of values of an integer field */
+						/* Return NULL, e.c & e.m if error or field is not i_t */
+	char **(*get_scol)(struct _cgats *p, int table, int field);
+						/* Return the [nsets] column of values of a string field */
+						/* Return NULL, e.c & e.m if error or field is not cs_t or nqcs_t */
+						/* (Strings are in *p and should be treated as read only) */
 	/* NULL if SEPARATE_STD is defined: */ 
 	int (*write_name)(struct _cgats *p, const char *filename);	/* Standard file I/O */
 										/* return -ve and e.c & e.m set on error */
 
+	int (*write_bin)(struct _cgats *p, cgatsFile *fp);	/* Write structure into binary file */
+										/* return -ve and e.c & e.m set on error */
+	/* NULL if SEPARATE_STD is defined: */ 
+	int (*write_bin_name)(struct _cgats *p, const char *filename);	/* Standard file I/O */
+										/* return -ve and e.c & e.m set on error */
+
+	/* Streaming read, for files too large to hold in memory. */
+	int (*sread_open)(struct _cgats *p, cgatsFile *fp);
+						/* Start reading a cgats file a batch of sets at a time. */
+						/* Reads the file up to the data of the first table, which is */
+						/* then the last table, with no sets and none_t field types. */
+						/* Return 0 normally, -ve and e.c & e.m set on error */
+	int (*sread_sets)(struct _cgats *p);
+						/* Read the next batch of up to stream_sets sets of the last table, */
+						/* replacing the previous batch. The field types are guessed from the */
+						/* values read so far, and may be promoted by a later batch. */
+						/* Return the number of sets read, 0 at the end of the table's data, */
+						/* -ve and e.c & e.m set on error */
+	int (*sread_table)(struct _cgats *p);
+						/* Discard the sets and any unread data of the last table, and read */
+						/* the following table up to its data. */
+						/* Return 0 normally, 1 if there are no more tables, */
+						/* -ve and e.c & e.m set on error */
+	void (*sread_close)(struct _cgats *p);
+						/* Finish a streaming read. (The file is not deleted) */
+
+	/* Streaming write. (Use write() for non-streamed tables) */
+	int (*swrite_table)(struct _cgats *p, int table, cgatsFile *fp, int nsets);
+						/* Start writing a table a batch of sets at a time. Any earlier */
+						/* tables not yet streamed are written in full, followed by the */
+						/* header of this table and any sets it already has. Sets added to */
+						/* the table are then written out and discarded each time stream_sets */
+						/* are held. nsets is the number of sets the table will have, or -1 */
+						/* if it is not known, in which case NUMBER_OF_SETS is omitted. */
+						/* Return 0 normally, -ve and e.c & e.m set on error */
+	int (*swrite_end)(struct _cgats *p);
+						/* Write any remaining sets and the end of the table being streamed. */
+						/* Return 0 normally, -ve and e.c & e.m set on error */
+
 
 	int (*error)(struct _cgats *p, char **mes);		/* Return error code and message */
 													/* for the first error, if any error */
@@ -181,6 +259,7 @@ extern cgats *new_cgats(void);							/* Standard allocator */
 /* Available from cgatsstd.obj SEPARATE_STD is defined: */ 
 CGATS_STATIC int cgats_read_name(cgats *p, const char *filename);
 CGATS_STATIC int cgats_write_name(cgats *p, const char *filename);
+CGATS_STATIC int cgats_write_bin_name(cgats *p, const char *filename);
 
 #ifdef __cplusplus
 	}
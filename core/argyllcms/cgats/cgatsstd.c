@@ -112,4 +112,20 @@ cgats_write_name(cgats *p, const char *filename) {
 	return rv;
 }
 
+/* Write a cgats structure into a binary file */
+/* Return -ve, errc & err if there was an error */
+CGATS_STATIC
+int
+cgats_write_bin_name(cgats *p, const char *filename) {
+	int rv;
+	cgatsFile *fp;
+
+	if ((fp = new_cgatsFileStd_name(filename, "w")) == NULL)
+		return err(p,-1,"Unable to open file '%s' for writing",filename);
+	rv = p->write_bin(p, fp);
+	fp->del(fp);
+
+	return rv;
+}
+
 #endif /* defined(SEPARATE_STD) || defined(COMBINED_STD) */
@@ -53,6 +53,8 @@ extern void error(const char *fmt, ...), warning(const char *fmt, ...);
 
 #undef DEBUG			/* Print each token returned */
 
+#define PARS_IBSIZE 65536	/* File input buffer size if file size is unknown */
+
 static void del_parse(parse *p);
 static int read_line(parse *p);
 static void reset_del(parse *p);
@@ -76,11 +78,16 @@ cgatsFile *fp		/* File to read from */
 
 	p->fp = fp;
 	p->b = NULL;	/* Init line buffer */
-	p->bs = 0;
 	p->bo = 0;
-	p->tb = NULL;	/* Init token buffer */
-	p->tbs = 0;
+	p->image = 0;
+	p->block = 0;
 	p->to = 0;
+	p->sc = -1;
+	p->ib = NULL;	/* Init input buffer */
+	p->ibs = 0;
+	p->ibo = 0;
+	p->ibe = 0;
+	p->ieof = 0;
 	p->line = 0;
 	p->token = 0;
 	p->ltflag = 0;
@@ -405,10 +412,8 @@ del_parse(parse *p) {
 	cgatsAlloc *al = p->al;
 	int del_al     = p->del_al;
 
-	if (p->b != NULL)
-		al->free(al, p->b);
-	if (p->tb != NULL)
-		al->free(al, p->tb);
+	if (p->ib != NULL)		/* (Line buffer is in here) */
+		al->free(al, p->ib);
 	al->free(al, p);
 
 	if (del_al)			/* We are responsible for deleting allocator */
@@ -416,7 +421,62 @@ del_parse(parse *p) {
 }
 
 
+/* Read more of the file into the input buffer, keeping the part */
+/* of the current line read so far, which starts at offset *ls. */
+/* If the size of the file is known, the whole of it is read the */
+/* first time, otherwise (or if block is set) it is read a block at a time. */
+/* Return nz on a malloc failure. */
+static int
+fill_buf(parse *p, size_t *ls) {
+	size_t n;
+
+	if (p->ieof)
+		return 0;
+
+	if (p->ib == NULL) {
+		if (!p->block && (n = p->fp->get_size(p->fp)) > 0) {
+			p->ibs = n + 2;		/* Room to terminate the last line */
+			p->image = 1;
+		} else {
+			p->ibs = PARS_IBSIZE;
+		}
+		if ((p->ib = (unsigned char *) p->al->malloc(p->al, p->ibs)) == NULL)
+			return 1;
+		p->ibo = p->ibe = 0;
+	} else {
+		/* Move the current line to the start of the buffer */
+		n = p->bo > 0 ? p->ibe - *ls : 0;
+		if (n > 0)
+			memmove(p->ib, p->ib + *ls, n);
+		*ls = 0;
+		p->ibo = p->ibe = n;
+	}
+
+	for (;;) {
+		/* Expand the buffer if it is full, or if there is not much */
+		/* room left in it to read the next block into */
+		if ((p->ibs - 1 - p->ibe) == 0
+		 || (!p->image && (p->ibs - p->ibe) < (PARS_IBSIZE/2))) {
+			unsigned char *nib;
+			if ((nib = (unsigned char *) p->al->realloc(p->al, p->ib, 2 * p->ibs)) == NULL)
+				return 1;
+			p->ib = nib;
+			p->ibs *= 2;
+		}
+		/* (Always leave room for a nul after the data) */
+		if ((n = p->fp->read(p->fp, p->ib + p->ibe, 1, p->ibs - 1 - p->ibe)) == 0) {
+			p->ieof = 1;
+			break;
+		}
+		p->ibe += n;
+		if (!p->image)
+			break;
+	}
+	return 0;
+}
+
 /* Read the next line from the file into the line buffer. */
+/* The line is kept in place in the input buffer. */
 /* Return 0 if the read fails due to reaching EOF before */
 /* putting anything in the buffer. */
 /* Return -1 if there was some other sort of failure, */
@@ -424,12 +484,36 @@ del_parse(parse *p) {
 static int
 read_line(parse *p) {
 	int c;
+	size_t ls = 0;		/* Offset of the start of the line in the input buffer */
+
 	p->bo = 0;			/* Reset pointer to the start of the line buffer */
 	p->q = 0;			/* Reset quoted flag */
+	p->sc = -1;			/* Nothing to restore in the line buffer */
 	p->e.c = 0;		/* Reset error status */
 	p->e.m[0] = '\000';
 	do {
-		if ((c = p->fp->getch(p->fp)) == EOF) {
+		/* Take any run of characters that need no handling as they are */
+		if (p->ltflag == 0 && p->ibo < p->ibe) {
+			unsigned char *sp = p->ib + p->ibo, *ep = p->ib + p->ibe, *cp;
+			size_t n;
+
+			for (cp = sp; cp < ep && (p->delf[*cp] & PARS_LINE) == 0; cp++)
+				;
+			if ((n = cp - sp) > 0) {
+				if (p->bo == 0)
+					ls = p->ibo;
+				else if ((ls + p->bo) != p->ibo)
+					memmove(p->ib + ls + p->bo, sp, n);
+				p->bo += n;
+				p->ibo += n;
+			}
+		}
+
+		if (p->ibo >= p->ibe && fill_buf(p, &ls)) {
+			sprintf(p->e.m,"parse.read_line(), malloc failed!");
+			return (p->e.c = -1);
+		}
+		if (p->ibo >= p->ibe) {		/* EOF */
 			if (p->bo == 0) {	/* If there is nothing in the buffer */
 				p->line = 0;
 #ifdef DEBUG
@@ -438,7 +522,9 @@ read_line(parse *p) {
 				return 0;
 			}
 			c = 0;			/* Finish the line */
-		}
+		} else
+			c = p->ib[p->ibo++];
+
 		if (p->ltflag == 1) {		/* Finished last line on '\r' */
 			p->ltflag = 0;
 			if (c == '\n') {
@@ -480,16 +566,14 @@ read_line(parse *p) {
 				p->q = 0;		/* End quoted section */
 		}
 
-		/* Can put the character in the buffer now */
-		if (p->bo == p->bs) {				/* Run out of buffer space */
-			p->bs = (p->bs + 100) * 2;	/* Expand line buffer size */
-			if ((p->b = (char *) p->al->realloc(p->al, p->b, p->bs)) == NULL) {
-				sprintf(p->e.m,"parse.read_line(), realloc failed!");
-				return (p->e.c = -1);
-			}
-		}
-		p->b[p->bo++] = c;		/* Stash character away */
+		/* Put the character in the line (never past where it was read from) */
+		if (p->bo == 0)
+			ls = p->ibo > 0 ? p->ibo - 1 : 0;
+		p->ib[ls + p->bo++] = c;		/* Stash character away */
 	} while (c != 0);	/* Null means we've done the end of the line */
+	if (p->bo == 0)			/* Hit a nul in a comment */
+		ls = p->ibo - 1;
+	p->b = (char *)p->ib + ls;
 	p->to = 0;			/* Reset token pointer to the start of the line buffer */
 	p->q = 0;			/* Reset quoted flag */
 #ifdef DEBUG
@@ -498,6 +582,19 @@ read_line(parse *p) {
 	return 1;
 }
 
+/* Mark the characters that read_line() has to deal with one at a time */
+static void
+set_line_del(parse *p) {
+	int i;
+	for (i = 0; i < 256; i++) {
+		if (i == 0 || i == '\r' || i == '\n'
+		 || (p->delf[i] & (PARS_COMM | PARS_QUOTE)) != 0)
+			p->delf[i] |= PARS_LINE;
+		else
+			p->delf[i] &= ~PARS_LINE;
+	}
+}
+
 /* Reset the delimiter character set */
 static void
 reset_del(parse *p) {
@@ -505,6 +602,7 @@ reset_del(parse *p) {
 	for (i = 0; i < 256; i++)
 		p->delf[i] = 0;
 	p->delf[0] = PARS_TERM;
+	set_line_del(p);
 }
 	
 /* Add to the parsing characters */
@@ -529,14 +627,17 @@ add_del(
 	if (q != NULL)
 		for (i = 0; q[i] != '\000'; i++)
 			p->delf[(int)q[i]] |= PARS_QUOTE;
+	set_line_del(p);
 	}
 
 /* Using the current token delimiter table and the current line, */
 /* parse it from the current location and return a pointer to the */
 /* null terminated token. Return NULL if there is no token found */
 /* set the parse err and e.c to non-zero if there was some other error */
+/* The token is assembled in place in the line buffer. */
 static char *
 get_token(parse *p) {
+	int ts;			/* Token start offset in line buffer */
 	int tbo = 0;	/* Token buffer offset */
 	int term = 0;	/* flag to trigger token termination */
 	char c;
@@ -549,8 +650,44 @@ get_token(parse *p) {
 #endif
 		return NULL;
 	}
+	if (p->sc >= 0) {		/* Restore character overwritten by last token */
+		p->b[p->sco] = (char)p->sc;
+		p->sc = -1;
+	}
 	p->token++;		/* Increment token number */
 	p->q = 0;
+
+	/* Skip initial non-reader terminators */
+	while ((p->delf[(unsigned char)p->b[p->to]] & (PARS_TERM | PARS_SKIP | PARS_QUOTE))
+	                                                            == (PARS_TERM | PARS_SKIP))
+		p->to++;
+	ts = p->to;
+
+	/* Fast path for a token of ordinary characters, */
+	/* ended by the end of line or a non-reader terminator. */
+	while ((p->delf[(unsigned char)p->b[p->to]] & (PARS_TERM | PARS_SKIP | PARS_QUOTE)) == 0)
+		p->to++;
+	if ((tbo = p->to - ts) > 0) {
+		c = p->b[p->to];
+		if (c == '\000') {
+#ifdef DEBUG
+			printf("pars: read_token() returning '%s'\n",p->b + ts);
+#endif
+			return p->b + ts;
+		}
+		if ((p->delf[(unsigned char)c] & (PARS_TERM | PARS_SKIP | PARS_QUOTE))
+		                                             == (PARS_TERM | PARS_SKIP)) {
+			p->b[p->to++] = '\000';
+#ifdef DEBUG
+			printf("pars: read_token() returning '%s'\n",p->b + ts);
+#endif
+			return p->b + ts;
+		}
+	}
+
+	/* Deal with anything else a character at a time. */
+	/* Since no more characters are stored than have been read, */
+	/* the token can be compacted in place. */
 	do {
 		if (term)
 			c = '\000';		/* end token */
@@ -558,31 +695,28 @@ get_token(parse *p) {
 			p->to--;							/* Safety - don't pass end */
 
 		/* Deal with starting/stopping a quoted section */
-		if ((p->delf[c] & PARS_QUOTE) != 0) {
+		if ((p->delf[(unsigned char)c] & PARS_QUOTE) != 0) {
 			if (p->q == 0)		/* We weren't in a quoted section */
 				p->q = c;		/* Start of quoted section */
 			else if (c == p->q)	/* If matching quote */
 				p->q = 0;		/* End quoted section */
 		}
 
-		if (tbo == p->tbs) {				/* Run out of buffer space */
-			p->tbs = (p->tbs + 100) * 2;	/* Expand token buffer size */
-			if ((p->tb = (char *) p->al->realloc(p->al, p->tb, p->tbs)) == NULL) {
-				sprintf(p->e.m,"parse.get_token(), realloc failed!");
-				p->e.c = -1;
-				return NULL;
-			}
-		}
-
-		if ((p->q != 0 && (p->q != c || (p->delf[c] & PARS_SKIP) == 0))
+		if ((p->q != 0 && (p->q != c || (p->delf[(unsigned char)c] & PARS_SKIP) == 0))
 				/* If quoted, store if trigger quite is not being skipped */
-		 || (!(tbo == 0 && (p->delf[c] & PARS_TERM) != 0 && (p->delf[c] & PARS_SKIP) != 0)
+		 || (!(tbo == 0 && (p->delf[(unsigned char)c] & PARS_TERM) != 0
+		                && (p->delf[(unsigned char)c] & PARS_SKIP) != 0)
 											/* Skip initial non-reader terminators */
-		   && (p->delf[c] & PARS_SKIP) == 0))	/* Skip non-readers */
-			p->tb[tbo++] = c;		/* Stash character away in token */
+		   && (p->delf[(unsigned char)c] & PARS_SKIP) == 0)) {	/* Skip non-readers */
+			if (c == '\000' && (ts + tbo) == p->to && p->b[p->to] != '\000') {
+				p->sc = (unsigned char)p->b[p->to];	/* Remember unread character */
+				p->sco = p->to;
+			}
+			p->b[ts + tbo++] = c;		/* Stash character away in token */
+		}
 
 		if (p->q == 0	/* If not quoted and if token is non-empty and we have a terminator */
-		 && tbo != 0 && (p->delf[c] & PARS_TERM) != 0)
+		 && tbo != 0 && (p->delf[(unsigned char)c] & PARS_TERM) != 0)
 			term = 1;									/* Finish token off next time around */
 	} while (c != '\000');	/* Null means we've done the end of the token */
 	p->q = 0;
@@ -594,9 +728,9 @@ get_token(parse *p) {
 		return NULL;		/* Haven't read anything useful */
 	}
 #ifdef DEBUG
-	printf("pars: read_token() returning '%s'\n",p->tb);
+	printf("pars: read_token() returning '%s'\n",p->b + ts);
 #endif
-	return p->tb;
+	return p->b + ts;
 }
 
 /* ========================================================== */
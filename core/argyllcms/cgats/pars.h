@@ -211,6 +211,10 @@ struct _parse {
 	/* Public Variables */
 	int line;		/* Current line number */
 	int token;		/* Current token number */
+	int image;		/* NZ if the whole file has been read into memory, in which case */
+					/* tokens ended by a non-read terminator remain valid until del() */
+	int block;		/* Set NZ before the first read_line() to always read the file */
+					/* a block at a time, so that memory use is bounded */
 
 	/* Public Methods */
 	void (*del)(struct _parse *p);				/* Delete the object */
@@ -222,6 +226,8 @@ struct _parse {
 												/* -1 on other error */
 	char *(*get_token)(struct _parse *p);		/* Return a pointer to the next token, */
 												/* NULL if no tokens. set e.c NZ on other error */
+												/* (Token is in the line buffer, and is valid */
+												/*  until the next get_token() or read_line()) */
 
 	/* Private */
 	cgatsAlloc *al;	/* Memory allocator */
@@ -229,18 +235,23 @@ struct _parse {
 	cgatsFile *fp;	/* File we're dealing with */
 	int ltflag;		/* Last terminator flag */
 	int q;			/* Quote */
-	char *b;		/* Line buffer */
-	int bs;			/* Buffer size */
-	int bo;			/* Next buffer offset */
+	char *b;		/* Current line, in place in the input buffer */
+	size_t bo;		/* Line length so far */
 	int to;			/* Token parsing offset into b */
-	char *tb;		/* Token buffer */
-	int tbs;		/* Token buffer size */
+	int sc;			/* Character overwritten by last token's nul, -1 if none */
+	int sco;		/* Offset into b of overwritten character */
+	unsigned char *ib;	/* File input buffer */
+	size_t ibs;		/* Input buffer size */
+	size_t ibo;		/* Next input buffer offset */
+	size_t ibe;		/* End of data in input buffer */
+	int ieof;		/* NZ if input has reached EOF */
 	char delf[256];		/* Parsing delimiter flags */
 	/* Parsing flags */
 #define PARS_TERM	0x01		/* Terminates a token */
 #define PARS_SKIP	0x02		/* Character is not read */
 #define PARS_COMM	0x04		/* Character starts a comment */
 #define PARS_QUOTE	0x08		/* Character starts/ends a quoted string */
+#define PARS_LINE	0x10		/* Character needs handling by read_line() (set automatically) */
 
 	cgats_err e;			/* Error message * code */
 
@@ -522,6 +522,11 @@ static void invdomap1(gammap *s, double *out, double *in);
 #ifdef PLOT_GAMUTS
 static void map_trans(void *cntx, double out[3], double in[3]);
 #endif
+static char *gmc_name(gamut *sc_gam, gamut *isi_gam, gamut *d_gam,
+	icxGMappingIntent *gmi, gamut *sh_gam, int src_kbp, int dst_kbp, int dst_cmymap,
+	int rel_oride, int mapres, double *mn, double *mx, ORD64 *pkey);
+static int gmc_read(gammap *s, char *fname, ORD64 key);
+static void gmc_write(gammap *s, char *fname, ORD64 key);
 
 /* Return a gammap to map from the input space to the output space */
 /* Return NULL on error. */
@@ -582,6 +587,8 @@ gammap *new_gammap(
 	int ngreyp = 0;		/* Number of grey axis mapping points */
 	int ngamp = 0;		/* Number of gamut mapping points */
 	double xvra = XVRA;	/* Extra ss vertex ratio to src gamut vertex count */
+	char *gmcname = NULL;	/* Cache file name, NULL if not caching */
+	ORD64 gmckey = 0;		/* Cache key */
 	int j;
 
 #if defined(PLOT_LMAP) || defined(PLOT_GAMUTS) || defined(PLOT_3DKNEES)
@@ -609,6 +616,18 @@ gammap *new_gammap(
 	s->inv_domap = inv_domap;
 	s->invdomap1 = invdomap1;
 
+	/* See if we have already created this mapping */
+	if (diagname == NULL
+	 && (gmcname = gmc_name(sc_gam, isi_gam, d_gam, gmi, sh_gam, src_kbp, dst_kbp,
+	                        dst_cmymap, rel_oride, mapres, mn, mx, &gmckey)) != NULL) {
+		if (gmc_read(s, gmcname, gmckey) == 0) {
+			if (verb)
+				printf("Using cached gamut mapping '%s'\n",gmcname);
+			free(gmcname);
+			return s;
+		}
+	}
+
 	/* Now create everything */
 
 	s->cent[0] = d_gam->cent[0];
@@ -2315,6 +2334,12 @@ typedef struct {
 	if (si_gam != sc_gam)
 		si_gam->del(si_gam);
 
+	/* Save the result for next time */
+	if (gmcname != NULL) {
+		gmc_write(s, gmcname, gmckey);
+		free(gmcname);
+	}
+
 	return s;
 }
 
@@ -2343,6 +2368,383 @@ gammap *s
 	free(s);
 }
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/* Gamut mapping cache. */
+
+/* If the ARGYLL_GAMMAP_CACHE environment variable names a directory, */
+/* the fitted rspls and transforms are saved there in a file named */
+/* from a hash of all the new_gammap() parameters, and are reloaded */
+/* rather than re-computed when the same mapping is asked for again. */
+/* All values are little endian: */
+/*
+	ORD8   magic[8]		"AGMCACH\0"
+	ORD32  version		GMC_VERSION
+	ORD64  key			Hash of the parameters
+	FLT64  grot[3][4], igrot[3][4], imin[3], imax[3], cent[3]
+	then for each of grey, igrey, map:
+	ORD32  present
+	if present:
+		ORD32  di, fdi, gres[di]
+		FLT64  glow[di], ghigh[di], vl[fdi], vw[fdi]
+		FLT32  grid[gres[0] * .. gres[di-1]][fdi]
+ */
+
+#define GMC_MAGIC "AGMCACH"		/* + nul */
+#define GMC_VERSION 1			/* Bump if mapping algorithm changes */
+
+static ORD64 gmc_dbls(ORD64 h, double *v, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		h = hash64_dbl(h, v[i]);
+	return h;
+}
+
+/* Hash everything about a gamut that affects the mapping */
+static ORD64 gmc_gamut(ORD64 h, gamut *g) {
+	int i;
+
+	if (g == NULL)
+		return hash64_int(h, 0);
+	h = hash64_int(h, 1);
+	h = hash64_dbl(h, g->sres);
+	h = hash64_int(h, g->isJab);
+	h = hash64_int(h, g->isRast);
+	h = gmc_dbls(h, g->cent, 3);
+	h = hash64_int(h, g->nv);
+	for (i = 0; i < g->nv; i++)
+		h = gmc_dbls(h, g->verts[i]->p, 3);
+	h = hash64_int(h, g->cswbset);
+	if (g->cswbset) {
+		h = gmc_dbls(h, g->cs_wp, 3);
+		h = gmc_dbls(h, g->cs_bp, 3);
+		h = gmc_dbls(h, g->cs_kp, 3);
+	}
+	h = hash64_int(h, g->gawbset);
+	if (g->gawbset) {
+		h = gmc_dbls(h, g->ga_wp, 3);
+		h = gmc_dbls(h, g->ga_bp, 3);
+		h = gmc_dbls(h, g->ga_kp, 3);
+	}
+	h = hash64_int(h, g->cu_inited);
+	if (g->cu_inited) {
+		for (i = 0; i < 6; i++)
+			h = gmc_dbls(h, g->cusps[i], 3);
+	}
+	return h;
+}
+
+/* Return the allocated cache file name and key for the given */
+/* new_gammap() parameters, or NULL if the cache isn't enabled. */
+static char *gmc_name(
+	gamut *sc_gam, gamut *isi_gam, gamut *d_gam,
+	icxGMappingIntent *gmi,
+	gamut *sh_gam,
+	int src_kbp, int dst_kbp, int dst_cmymap, int rel_oride,
+	int mapres,
+	double *mn, double *mx,
+	ORD64 *pkey
+) {
+	ORD64 h;
+	char *dir, *fname;
+
+	if ((dir = getenv("ARGYLL_GAMMAP_CACHE")) == NULL || dir[0] == '\000')
+		return NULL;
+
+	h = HASH64_INIT;
+	h = hash64_int(h, GMC_VERSION);
+
+	h = gmc_gamut(h, sc_gam);
+	h = gmc_gamut(h, isi_gam == sc_gam ? NULL : isi_gam);
+	h = gmc_gamut(h, d_gam);
+	h = gmc_gamut(h, sh_gam);
+
+	h = hash64_int(h, gmi->usecas);
+	h = hash64_int(h, gmi->usemap);
+	h = hash64_dbl(h, gmi->greymf);
+	h = hash64_dbl(h, gmi->glumwcpf);
+	h = hash64_dbl(h, gmi->glumwexf);
+	h = hash64_dbl(h, gmi->glumbcpf);
+	h = hash64_dbl(h, gmi->glumbexf);
+	h = hash64_dbl(h, gmi->glumknf);
+	h = hash64_int(h, (int)gmi->bph);
+	h = hash64_dbl(h, gmi->gamcpf);
+	h = hash64_dbl(h, gmi->gamexf);
+	h = hash64_dbl(h, gmi->gamcknf);
+	h = hash64_dbl(h, gmi->gamxknf);
+	h = hash64_dbl(h, gmi->gampwf);
+	h = hash64_dbl(h, gmi->gamlpwf);
+	h = hash64_dbl(h, gmi->gamswf);
+	h = hash64_dbl(h, gmi->satenh);
+	h = hash64_dbl(h, gmi->hkscale);
+
+	h = hash64_int(h, src_kbp);
+	h = hash64_int(h, dst_kbp);
+	h = hash64_int(h, dst_cmymap);
+	h = hash64_int(h, rel_oride);
+	h = hash64_int(h, mapres);
+	h = hash64_int(h, mn != NULL);
+	if (mn != NULL)
+		h = gmc_dbls(h, mn, 3);
+	h = hash64_int(h, mx != NULL);
+	if (mx != NULL)
+		h = gmc_dbls(h, mx, 3);
+
+	*pkey = h;
+	if ((fname = malloc(strlen(dir) + 1 + 7 + 16 + 4 + 1)) == NULL)
+		return NULL;
+	sprintf(fname, "%s/gammap_%08x%08x.gmc", dir,
+	        (unsigned int)(h >> 32), (unsigned int)(h & 0xffffffff));
+
+	return fname;
+}
+
+/* Context for reading or writing rspl grid values */
+typedef struct {
+	int di, fdi;
+	int gres[MXDI];
+	ORD8 *bp;			/* Base of grid values in buffer */
+} gmcrctx;
+
+/* Return the linear grid index of a scan/set_rspl callback location */
+static int gmc_gix(gmcrctx *cx, double *in) {
+	int e, ix = 0;
+
+	for (e = cx->di-1; e >= 0; e--)
+		ix = ix * cx->gres[e] + *((int *)&in[-e-1]);
+	return ix;
+}
+
+static void gmc_get_func(void *cntx, double *out, double *in) {
+	gmcrctx *cx = (gmcrctx *)cntx;
+	ORD8 *bp = cx->bp + gmc_gix(cx, in) * cx->fdi * 4;
+	int f;
+
+	for (f = 0; f < cx->fdi; f++)
+		write_FLT32_le(bp + f * 4, out[f]);
+}
+
+static void gmc_set_func(void *cntx, double *out, double *in) {
+	gmcrctx *cx = (gmcrctx *)cntx;
+	ORD8 *bp = cx->bp + gmc_gix(cx, in) * cx->fdi * 4;
+	int f;
+
+	for (f = 0; f < cx->fdi; f++)
+		out[f] = read_FLT32_le(bp + f * 4);
+}
+
+/* Return the cache file size of an rspl */
+static size_t gmc_rspl_size(rspl *r) {
+	size_t sz = 4;
+	int e, no = 1;
+
+	if (r == NULL)
+		return sz;
+	for (e = 0; e < r->di; e++)
+		no *= r->g.res[e];
+	sz += 4 * (2 + r->di) + 8 * (2 * r->di + 2 * r->fdi) + (size_t)no * r->fdi * 4;
+	return sz;
+}
+
+/* Write an rspl to the buffer, and return the next location */
+static ORD8 *gmc_write_rspl(ORD8 *bp, rspl *r) {
+	gmcrctx cx;
+	int e, f, no = 1;
+
+	write_ORD32_le(bp, r != NULL);						bp += 4;
+	if (r == NULL)
+		return bp;
+
+	cx.di = r->di;
+	cx.fdi = r->fdi;
+	write_ORD32_le(bp, r->di);							bp += 4;
+	write_ORD32_le(bp, r->fdi);							bp += 4;
+	for (e = 0; e < r->di; e++, bp += 4) {
+		write_ORD32_le(bp, r->g.res[e]);
+		cx.gres[e] = r->g.res[e];
+		no *= r->g.res[e];
+	}
+	for (e = 0; e < r->di; e++, bp += 8)
+		write_FLT64_le(bp, r->g.l[e]);
+	for (e = 0; e < r->di; e++, bp += 8)
+		write_FLT64_le(bp, r->g.h[e]);
+	for (f = 0; f < r->fdi; f++, bp += 8)
+		write_FLT64_le(bp, r->d.vl[f]);
+	for (f = 0; f < r->fdi; f++, bp += 8)
+		write_FLT64_le(bp, r->d.vw[f]);
+
+	cx.bp = bp;
+	r->scan_rspl(r, 0, (void *)&cx, gmc_get_func);
+
+	return bp + (size_t)no * r->fdi * 4;
+}
+
+/* Read an rspl from the buffer, and return the next location, */
+/* or NULL on error. */
+static ORD8 *gmc_read_rspl(ORD8 *bp, ORD8 *ep, rspl **pr) {
+	gmcrctx cx;
+	datai glow, ghigh;
+	datao vlow, vhigh, vw;
+	rspl *r;
+	int e, f, no = 1;
+
+	*pr = NULL;
+	if ((ep - bp) < 4)
+		return NULL;
+	if (read_ORD32_le(bp) == 0)
+		return bp + 4;
+	bp += 4;
+
+	if ((ep - bp) < 8)
+		return NULL;
+	cx.di = read_ORD32_le(bp);							bp += 4;
+	cx.fdi = read_ORD32_le(bp);							bp += 4;
+	if (cx.di < 1 || cx.di > MXDI || cx.fdi < 1 || cx.fdi > MXDO
+	 || (ep - bp) < (4 * cx.di + 8 * (2 * cx.di + 2 * cx.fdi)))
+		return NULL;
+	for (e = 0; e < cx.di; e++, bp += 4) {
+		cx.gres[e] = read_ORD32_le(bp);
+		if (cx.gres[e] < 2 || cx.gres[e] > 1024)
+			return NULL;
+		no *= cx.gres[e];
+	}
+	for (e = 0; e < cx.di; e++, bp += 8)
+		glow[e] = read_FLT64_le(bp);
+	for (e = 0; e < cx.di; e++, bp += 8)
+		ghigh[e] = read_FLT64_le(bp);
+	for (f = 0; f < cx.fdi; f++, bp += 8)
+		vlow[f] = read_FLT64_le(bp);
+	for (f = 0; f < cx.fdi; f++, bp += 8) {
+		vw[f] = read_FLT64_le(bp);
+		vhigh[f] = vlow[f] + vw[f];
+	}
+	if ((size_t)(ep - bp) < (size_t)no * cx.fdi * 4)
+		return NULL;
+
+	if ((r = new_rspl(RSPL_NOFLAGS, cx.di, cx.fdi)) == NULL)
+		return NULL;
+	cx.bp = bp;
+	r->set_rspl(r, 0, (void *)&cx, gmc_set_func, glow, ghigh, cx.gres, vlow, vhigh);
+	for (f = 0; f < cx.fdi; f++)
+		r->d.vw[f] = vw[f];		/* Exactly as it was */
+
+	*pr = r;
+	return bp + (size_t)no * cx.fdi * 4;
+}
+
+/* Read the gammap from the cache file. */
+/* Return nz if it can't be read */
+static int gmc_read(gammap *s, char *fname, ORD64 key) {
+	FILE *fp;
+	ORD8 *buf, *bp, *ep;
+	size_t bsize;
+	int i, j;
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(fname,"rb")) == NULL)
+#else
+	if ((fp = fopen(fname,"r")) == NULL)
+#endif
+		return 1;
+
+	if (fseek(fp, 0, SEEK_END) != 0
+	 || (bsize = (size_t)ftell(fp)) < (8 + 4 + 8 + 8 * (12 + 12 + 9))
+	 || fseek(fp, 0, SEEK_SET) != 0
+	 || (buf = (ORD8 *)malloc(bsize)) == NULL) {
+		fclose(fp);
+		return 1;
+	}
+	if (fread(buf, 1, bsize, fp) != bsize) {
+		fclose(fp);
+		free(buf);
+		return 1;
+	}
+	fclose(fp);
+
+	bp = buf;
+	ep = buf + bsize;
+	if (memcmp(bp, GMC_MAGIC, 8) != 0
+	 || read_ORD32_le(bp + 8) != GMC_VERSION
+	 || read_ORD64_le(bp + 12) != key) {
+		free(buf);
+		return 1;
+	}
+	bp += 8 + 4 + 8;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 4; j++, bp += 8)
+			s->grot[i][j] = read_FLT64_le(bp);
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 4; j++, bp += 8)
+			s->igrot[i][j] = read_FLT64_le(bp);
+	}
+	for (j = 0; j < 3; j++, bp += 8)
+		s->imin[j] = read_FLT64_le(bp);
+	for (j = 0; j < 3; j++, bp += 8)
+		s->imax[j] = read_FLT64_le(bp);
+	for (j = 0; j < 3; j++, bp += 8)
+		s->cent[j] = read_FLT64_le(bp);
+
+	if ((bp = gmc_read_rspl(bp, ep, &s->grey)) == NULL
+	 || (bp = gmc_read_rspl(bp, ep, &s->igrey)) == NULL
+	 || (bp = gmc_read_rspl(bp, ep, &s->map)) == NULL
+	 || s->grey == NULL) {
+		if (s->grey != NULL)
+			s->grey->del(s->grey);
+		if (s->igrey != NULL)
+			s->igrey->del(s->igrey);
+		if (s->map != NULL)
+			s->map->del(s->map);
+		s->grey = s->igrey = s->map = NULL;
+		free(buf);
+		return 1;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Write the gammap to the cache file. */
+/* (Errors are ignored - it will just be re-computed next time) */
+static void gmc_write(gammap *s, char *fname, ORD64 key) {
+	ORD8 *buf, *bp;
+	size_t bsize;
+	int i, j;
+
+	bsize = 8 + 4 + 8 + 8 * (12 + 12 + 9)
+	      + gmc_rspl_size(s->grey) + gmc_rspl_size(s->igrey) + gmc_rspl_size(s->map);
+
+	if ((buf = (ORD8 *)calloc(bsize, 1)) == NULL)
+		return;
+
+	bp = buf;
+	memcpy(bp, GMC_MAGIC, 8);							bp += 8;
+	write_ORD32_le(bp, GMC_VERSION);					bp += 4;
+	write_ORD64_le(bp, key);							bp += 8;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 4; j++, bp += 8)
+			write_FLT64_le(bp, s->grot[i][j]);
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 4; j++, bp += 8)
+			write_FLT64_le(bp, s->igrot[i][j]);
+	}
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->imin[j]);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->imax[j]);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cent[j]);
+
+	bp = gmc_write_rspl(bp, s->grey);
+	bp = gmc_write_rspl(bp, s->igrey);
+	bp = gmc_write_rspl(bp, s->map);
+
+	/* Write via a temporary file, so a concurrent reader never sees a partial file */
+	write_file_renamed(fname, NULL, 0, buf, bsize);
+	free(buf);
+}
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 /* Apply the gamut mapping to the given color value */
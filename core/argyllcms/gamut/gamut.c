@@ -44,6 +44,7 @@
 #include "vrml.h"
 #include "cgats.h"
 #include "gamut.h"
+#include "conv.h"
 #include "sort.h"			/* ../h sort macro */
 #include "counters.h"		/* ../h counter macros */
 #include "xlist.h"			/* ../h expandable list macros */
@@ -81,6 +82,8 @@
 							/* and isect & isect2 vis plot if deb_insect set to 1 */
 #undef INTERSECT_VERIFY		/* Verify compute_vector_isect against brute force search */
 
+#define USE_ISECT_BVH		/* [def] Use BVH rather than BSP for vector intersection */
+
 /* These routines support:
 
    representing the 3D gamut boundary of a device or image as
@@ -137,6 +140,7 @@
 static void triangulate(gamut *s);
 static void del_gamut(gamut *s);
 static gvert *expand_gamut(gamut *s, double in[3]);
+static void expand_n(gamut *s, double (*in)[3], int n);
 static void set_cs_bp_kp_ovrd(gamut *s, double *bk, double *kp);
 static double getsres(gamut *s);
 static int getisjab(gamut *s);
@@ -163,10 +167,19 @@ static int write_vrml(gamut *s, char *filename, int doaxes, int docusps);
 static int write_gam(gamut *s, char *filename);
 static int read_gam(gamut *s, char *filename);
 static int read_gam_fp(gamut *s, cgatsFile *fp, char *filename);
+static int write_bgam(gamut *s, char *filename);
+static int read_bgam(gamut *s, char *filename);
+static int connect_edges(gamut *s, unsigned int *adj);
 static double radial(gamut *s, double out[3], double in[3]);
 static double nradial(gamut *s, double out[3], double in[3]);
 static void nearest(gamut *s, double out[3], double in[3]);
 static void nearest_tri(gamut *s, double out[3], double in[3], gtri **ctri);
+static void prep_query(gamut *s);
+static void init_bvh(gamut *s);
+static gquery *new_query(gamut *s);
+static void nearest_q(gamut *s, gquery *q, double out[3], double in[3], gtri **ctri);
+static void radial_n(gamut *s, double *rad, double (*out)[3], double (*in)[3], int n);
+static void nearest_n(gamut *s, gquery *q, double (*out)[3], double (*in)[3], int n);
 static void setwb(gamut *s, double *wp, double *bp, double *kp);
 static int getwb(gamut *s, double *cswp, double *csbp, double *cskp, double *gawp, double *gabp, double *gakp);
 static void setcusps(gamut *s, int flag, double in[3]);
@@ -183,9 +196,6 @@ static int expdstbysrcmdst(gamut *s, gamut *s1, gamut *s2, gamut *s3,
 static int vect_intersect(gamut *s, double *rvp, double *ip, double *p1, double *p2, gtri *t);
 static void compgawb(gamut *s);
 
-/* in isecvol.c: */
-extern double isect_volume(gamut *s1, gamut *s2);
-
 /* ------------------------------------ */
 
 /* Generic hue directions in degrees for Lab and Jab */
@@ -640,6 +650,7 @@ int isRast				/* Flag indicating Raster rather than colorspace, */
 	/* Setup methods */
 	s->del         = del_gamut;
 	s->expand      = expand_gamut;
+	s->expand_n    = expand_n;
 	s->set_cs_bp_kp_ovrd = set_cs_bp_kp_ovrd;
 	s->getsres     = getsres;
 	s->getisjab    = getisjab;
@@ -668,6 +679,11 @@ int isRast				/* Flag indicating Raster rather than colorspace, */
 	s->nradial     = nradial;
 	s->nearest     = nearest;
 	s->nearest_tri = nearest_tri;
+	s->prep_query  = prep_query;
+	s->new_query   = new_query;
+	s->nearest_q   = nearest_q;
+	s->radial_n    = radial_n;
+	s->nearest_n   = nearest_n;
 	s->vector_isect = compute_vector_isect;
 	s->vector_isectns = compute_vector_isectns;
 	s->setwb       = setwb;
@@ -680,12 +696,14 @@ int isRast				/* Flag indicating Raster rather than colorspace, */
 	s->write_gam   = write_gam;
 	s->read_gam    = read_gam;
 	s->read_gam_fp = read_gam_fp;
+	s->write_bgam  = write_bgam;
 
 	return s;
 }
 
 static void del_gnn(gnn *p);
 static void del_gbsp(gbsp *n);
+static void del_gbvh(gbvh *p);
 
 /* Free and clear the triangulation structures, */
 /* and clear the triangulation vertex flags. */
@@ -723,6 +741,15 @@ static void del_triang(gamut *s) {
 	
 	s->lu_inited = 0;
 
+	if (s->bvh != NULL) {
+		del_gbvh(s->bvh);
+		s->bvh = NULL;
+	}
+
+	if (s->nnq != NULL) {
+		s->nnq->del(s->nnq);
+		s->nnq = NULL;
+	}
 	if (s->nns != NULL) {
 		del_gnn(s->nns);
 		s->nns = NULL;
@@ -847,6 +874,53 @@ gvert *v2		/* Existing vertex */
 }
 
 
+/* The coordinates of a point being added, that don't */
+/* depend on the state of the gamut. */
+typedef struct {
+	double rr[3];	/* Radial coordinate version of pp[] */
+	double sp[3];	/* Unit shere mapped version of pp[] relative to center */
+	double ch[3];	/* Convex hull testing mapped version of pp[] relative to center */
+	double lrr0;	/* log scaled rr[0] */
+	double hang, vang;	/* Critical angles for this points depth */
+} gexpnt;
+
+/* Compute the coordinates of a point being added */
+static void expand_coords(
+gamut *s,
+gexpnt *ep,			/* Return coordinates */
+double pp[3]		/* rectangular coordinate of point */
+) {
+	double aa, hang;
+	int j;
+
+	/* Convert to radial coords */
+	gamut_rect2radial(s, ep->rr, pp);
+
+	if (ep->rr[0] < 1e-6) 		/* Point right at the center will be ignored */
+		return;
+
+	/* Figure log scaled radius */
+	ep->lrr0 = log_scale(s, ep->rr[0]);
+
+	/* Compute unit shere mapped location */
+	aa = 1.0/ep->rr[0];				/* Adjustment to put in on unit sphere */
+	for (j = 0; j < 3; j++)
+		ep->sp[j] = (pp[j] - s->cent[j]) * aa;
+
+	/* Compute hull testing mapped version */
+	for (j = 0; j < 3; j++)
+		ep->ch[j] = ep->sp[j] * ep->lrr0;
+
+	/* compute twice angle resolution required (will compare to parent size) */
+	hang = pow(ep->rr[0], 1.01) * fabs(cos(ep->rr[2]));
+	if (hang < 1e-9)
+		hang = 1e-9;
+	ep->hang = 4.0 * s->sres/hang;
+	ep->vang = 4.0 * s->sres/pow(ep->rr[0], 1.01);
+}
+
+static gvert *expand_gamut_imp(gamut *s, double pp[3], gexpnt *ep);
+
 /* Expand the gamut by adding a point. */
 /* If nofilter is set, return NULL if the point */
 /* is discarded, or the address of the point  representing */
@@ -854,18 +928,29 @@ gvert *v2		/* Existing vertex */
 static gvert *expand_gamut(
 gamut *s,
 double pp[3]		/* rectangular coordinate of point */
+) {
+	gexpnt ep;
+
+	expand_coords(s, &ep, pp);
+	return expand_gamut_imp(s, pp, &ep);
+}
+
+/* expand_gamut() given the points coordinates */
+static gvert *expand_gamut_imp(
+gamut *s,
+double pp[3],		/* rectangular coordinate of point */
+gexpnt *ep			/* Coordinates from expand_coords() */
 ) {
 	gnode *n;		/* Current node */
 	gvert *nv, *ov;	/* new vertex, old vertex */
 	gquad *q;		/* Parent quad */
 	int i;			/* Sub element within quad */
 	int k;			/* Index of direction slot */
-	double rr[3];	/* Radial coordinate version of pp[] */
-	double sp[3];	/* Unit shere mapped version of pp[] relative to center */
-	double ch[3];	/* Convex hull testing mapped version of pp[] relative to center */
+	double *rr = ep->rr;	/* Radial coordinate version of pp[] */
+	double *sp = ep->sp;	/* Unit shere mapped version of pp[] relative to center */
+	double *ch = ep->ch;	/* Convex hull testing mapped version of pp[] relative to center */
 	double lrr0;	/* log scaled rr[0] */
 	double hang, vang;	/* Critical angles for this points depth */
-	double aa;
 	int j;
 
 	if (s->tris != NULL || s->read_inited || s->lu_inited || s->ne_inited) {
@@ -884,30 +969,12 @@ double pp[3]		/* rectangular coordinate of point */
 			s->mn[j] = pp[j];
 	}
 
-	/* Convert to radial coords */
-	gamut_rect2radial(s, rr, pp);
-
 	if (rr[0] < 1e-6) 		/* Ignore a point right at the center */
 		return NULL;
 
-	/* Figure log scaled radius */
-	lrr0 = log_scale(s, rr[0]);
-
-	/* Compute unit shere mapped location */
-	aa = 1.0/rr[0];				/* Adjustment to put in on unit sphere */
-	for (j = 0; j < 3; j++)
-		sp[j] = (pp[j] - s->cent[j]) * aa;
-
-	/* Compute hull testing mapped version */
-	for (j = 0; j < 3; j++)
-		ch[j] = sp[j] * lrr0;
-
-	/* compute twice angle resolution required (will compare to parent size) */
-	hang = pow(rr[0], 1.01) * fabs(cos(rr[2]));
-	if (hang < 1e-9)
-		hang = 1e-9;
-	hang = 4.0 * s->sres/hang;
-	vang = 4.0 * s->sres/pow(rr[0], 1.01);
+	lrr0 = ep->lrr0;
+	hang = ep->hang;
+	vang = ep->vang;
 
 //printf("~1 Point at %f %f %f, radial %f %f %f\n", pp[0], pp[1], pp[2], rr[0], rr[1], rr[2]);
 //printf("~1     shere at %f %f %f, log %f %f %f, vhang %f %f\n", sp[0], sp[1], sp[2], ch[0], ch[1], ch[2], vang, hang);
@@ -1070,6 +1137,80 @@ double pp[3]		/* rectangular coordinate of point */
 	return NULL;
 }
 
+/* Number of points expand_n() converts at a time */
+#define EXPN_BLK 16384
+
+/* Context for expand_n() coordinate conversion */
+typedef struct {
+	gamut *s;
+	double (*in)[3];	/* Points of this block */
+	gexpnt *ep;			/* Coordinates of this block */
+} expnctx;
+
+static int expand_n_task(void *cntx, int thix, int ix0, int ix1) {
+	expnctx *cx = (expnctx *)cntx;
+	int i;
+
+	for (i = ix0; i < ix1; i++)
+		expand_coords(cx->s, &cx->ep[i], cx->in[i]);
+	return 0;
+}
+
+/* Expand the gamut by adding n points. The result is the same as */
+/* calling expand() with each point in turn. The point coordinates are */
+/* computed on a thread pool, while the points are added in order. */
+/* A point identical to the one before it can't change the gamut, */
+/* so is skipped. */
+static void expand_n(
+gamut *s,
+double (*in)[3],	/* rectangular coordinates of points */
+int n				/* Number of points */
+) {
+	athreadpool *pool = NULL;
+	expnctx cx;
+	double *lp = NULL;		/* Last point added */
+	int i, j, bn;
+
+	if (n <= 0)
+		return;
+
+	if ((cx.ep = (gexpnt *)malloc((n < EXPN_BLK ? n : EXPN_BLK) * sizeof(gexpnt))) == NULL) {
+		for (i = 0; i < n; i++)
+			expand_gamut(s, in[i]);
+		return;
+	}
+	cx.s = s;
+
+	if (n > 256 && (pool = new_athreadpool(0)) != NULL && pool->nthr <= 1) {
+		pool->del(pool);
+		pool = NULL;
+	}
+
+	for (i = 0; i < n; i += bn) {
+		bn = n - i;
+		if (bn > EXPN_BLK)
+			bn = EXPN_BLK;
+		cx.in = in + i;
+
+		if (pool != NULL)
+			pool->run(pool, bn, expand_n_task, (void *)&cx);
+		else
+			expand_n_task((void *)&cx, 0, 0, bn);
+
+		for (j = 0; j < bn; j++) {
+			if (lp != NULL && lp[0] == cx.in[j][0]
+			 && lp[1] == cx.in[j][1] && lp[2] == cx.in[j][2])
+				continue;
+			expand_gamut_imp(s, cx.in[j], &cx.ep[j]);
+			lp = cx.in[j];
+		}
+	}
+
+	if (pool != NULL)
+		pool->del(pool);
+	free(cx.ep);
+}
+
 /* ------------------------------------ */
 
 /* intersect implementation */
@@ -4140,15 +4281,19 @@ double *q		/* Target point (absolute) */
 /* Using nearest neighbourhood accelleration structure: */
 
 /* Given an absolute point, return the point on the gamut */
-/* surface that is closest to it. */
+/* surface that is closest to it, using the given query context. */
+/* Only qc is modified, so this is reentrant once prep_query() */
+/* has been called. */
 static void
-nearest_tri(
+nearest_q(
 gamut *s,
-double *rout,	/* result point (absolute) */
-double *q,		/* Target point (absolute) */
+gquery *qc,		/* Query context */
+double rout[3],	/* result point (absolute) */
+double q[3],	/* Target point (absolute) */
 gtri **ctri		/* If not NULL, return pointer to nearest triangle */
 ) {
 	gnn *p;				/* Pointer to nearest neighbor structure */
+	unsigned int *touch;	/* Per triangle touch counts */
 	int e, i;
 	double r[3] = {0.0, 0.0, 0.0 };		/* Possible solution point */
 	double out[3] = {0.0, 0.0, 0.0};	/* Current best output value */
@@ -4168,13 +4313,14 @@ gtri **ctri		/* If not NULL, return pointer to nearest triangle */
 		init_ne(s);				/* Init nn structure */
 	}
 	p = s->nns;
+	touch = qc->touch;
 
-	if ((p->tbase + 3) < p->tbase) {	/* Overflow of touch count */
-		for (i = 0; i < p->n; i++)
-			p->sax[0][i]->touch = 0;		/* reset it in all the objects */
-		p->tbase = 0;
+	if ((qc->tbase + 3) < qc->tbase) {	/* Overflow of touch count */
+		for (i = 0; i < qc->n; i++)
+			touch[i] = 0;				/* reset it in all the objects */
+		qc->tbase = 0;
 	}
-	p->ttarget = p->tbase + 3;		/* Target touch value */
+	qc->ttarget = qc->tbase + 3;		/* Target touch value */
 
 //printf("\n");
 //printf("Query point is %f %f %f\n",q[0], q[1], q[2]);
@@ -4343,17 +4489,17 @@ gtri **ctri		/* If not NULL, return pointer to nearest triangle */
 			ob = p->sax[ee][ii];
 
 			/* Touch value of current object */
-			ctv = ob->touch;
+			ctv = touch[ob->nix];
 
-			if (ctv < p->ttarget) {		/* Not been dealt with before */
+			if (ctv < qc->ttarget) {		/* Not been dealt with before */
 
 				/* Touch this new window boundary point */
-				ob->touch = ctv = ((ctv < p->tbase) ? p->tbase : ctv) + 1;
+				touch[ob->nix] = ctv = ((ctv < qc->tbase) ? qc->tbase : ctv) + 1;
 
-//printf("New touch count on %d is %d, target %d\n", ob->n, p->sax[ee][ii]->touch, p->ttarget);
+//printf("New touch count on %d is %d, target %d\n", ob->n, touch[ob->nix], qc->ttarget);
 
 				/* Check the point out */
-				if (ctv == (p->tbase + 3)) {	/* Is within window on all axes */
+				if (ctv == (qc->tbase + 3)) {	/* Is within window on all axes */
 					double tdist;
 
 					pcalced++;		/* Stats */
@@ -4394,7 +4540,7 @@ gtri **ctri		/* If not NULL, return pointer to nearest triangle */
 
 //printf("Searched %d points out of %d = %f%%\n",ptested, p->n, 100.0 * ptested/p->n);
 
-		p->tbase += 3;		/* Next touch */
+		qc->tbase += 3;		/* Next touch */
 
 		if (rout != NULL) {
 			rout[0] = out[0];	/* Copy results to output */
@@ -4409,6 +4555,25 @@ gtri **ctri		/* If not NULL, return pointer to nearest triangle */
 	}
 }
 
+/* Given an absolute point, return the point on the gamut */
+/* surface that is closest to it, and the triangle it's in. */
+/* Uses the gamut's own query context, so isn't reentrant. */
+static void
+nearest_tri(
+gamut *s,
+double *rout,	/* result point (absolute) */
+double *q,		/* Target point (absolute) */
+gtri **ctri		/* If not NULL, return pointer to nearest triangle */
+) {
+	if (s->nnq == NULL) {
+		if ((s->nnq = new_query(s)) == NULL) {
+			fprintf(stderr,"gamut: new_query failed\n");
+			exit(-1);
+		}
+	}
+	nearest_q(s, s->nnq, rout, q, ctri);
+}
+
 /* Given an absolute point, return the point on the gamut */
 /* surface that is closest to it. */
 static void
@@ -4459,7 +4624,6 @@ gamut *s
 	} END_FOR_ALL_ITEMS(tp);
 
 	p->n = ntris;
-	p->tbase = 0;		/* Initialse touch flag */
 
 	/* Allocate the arrays spaces */
 	for (k = 0; k < (3 * 2); k++) {
@@ -4478,6 +4642,7 @@ gamut *s
 	i = 0;
 	FOR_ALL_ITEMS(gtri, tp) {
 		int j;
+		tp->nix = i;
 		for (j = 0; j < 3; j++) {	/* Init */
 			tp->mix[0][j] = 1e38;
 			tp->mix[1][j] = -1e38;
@@ -4526,6 +4691,195 @@ static void del_gnn(gnn *p) {
 	free(p);
 }
 
+/* =================================== */
+/* Reentrant and batch queries */
+
+/* Create all the lazily initialised lookup structures */
+static void prep_query(gamut *s) {
+
+	if IS_LIST_EMPTY(s->tris)
+		triangulate(s);
+
+	if (s->lu_inited == 0)
+		init_lu(s);				/* Init BSP search tree */
+
+	if (s->ne_inited == 0)
+		init_ne(s);				/* Init nn structure */
+
+#ifdef USE_ISECT_BVH
+	if (s->bvh == NULL)
+		init_bvh(s);			/* Init vector intersect BVH */
+#endif
+}
+
+static void del_gquery(gquery *q) {
+	if (q != NULL) {
+		free(q->touch);
+		free(q);
+	}
+}
+
+/* Create a query context for nearest_q() */
+static gquery *new_query(gamut *s) {
+	gquery *q;
+
+	prep_query(s);
+
+	if ((q = (gquery *)calloc(1, sizeof(gquery))) == NULL) {
+		fprintf(stderr,"gamut: calloc failed - gquery structure\n");
+		return NULL;
+	}
+	q->s = s;
+	q->n = s->nns->n;
+	if ((q->touch = (unsigned int *)calloc(q->n > 0 ? q->n : 1, sizeof(unsigned int))) == NULL) {
+		fprintf(stderr,"gamut: calloc failed - gquery touch counts\n");
+		free(q);
+		return NULL;
+	}
+	q->tbase = 0;		/* Initialse touch flag */
+	q->del = del_gquery;
+
+	return q;
+}
+
+/* Batch lookup sort key */
+typedef struct {
+	unsigned int key;	/* Morton order key */
+	int ix;				/* Index of point */
+} gqsort;
+
+/* Return a 30 bit Morton order key for three values in the range 0.0 - 1.0 */
+static unsigned int gq_morton(double v[3]) {
+	unsigned int key = 0;
+	int j, b;
+
+	for (j = 0; j < 3; j++) {
+		unsigned int iv;
+
+		if (v[j] <= 0.0)
+			iv = 0;
+		else if (v[j] >= 1.0)
+			iv = 1023;
+		else
+			iv = (unsigned int)(v[j] * 1023.0 + 0.5);
+		for (b = 0; b < 10; b++)
+			key |= ((iv >> b) & 1) << (3 * b + j);
+	}
+	return key;
+}
+
+/* radial() of n points, looked up in order of direction */
+static void radial_n(
+gamut *s,
+double *rad,		/* Return radial radius to the surface points (may be NULL) */
+double (*out)[3],	/* Return surface points (absolute) (may be NULL) */
+double (*in)[3],	/* Input points (absolute) */
+int n				/* Number of points */
+) {
+	gqsort *sl;
+	int i, j;
+
+	if (n <= 0)
+		return;
+
+	/* Without a list, just do them in order */
+	if ((sl = (gqsort *)malloc(n * sizeof(gqsort))) == NULL) {
+		for (i = 0; i < n; i++) {
+			double rv = radial(s, out != NULL ? out[i] : NULL, in[i]);
+			if (rad != NULL)
+				rad[i] = rv;
+		}
+		return;
+	}
+
+	/* Key on the normalised direction from the center */
+	for (i = 0; i < n; i++) {
+		double nin[3], ss;
+
+		for (ss = 0.0, j = 0; j < 3; j++) {
+			nin[j] = in[i][j] - s->cent[j];
+			ss += nin[j] * nin[j];
+		}
+		ss = sqrt(ss);
+		if (ss > 1e-9)
+			ss = 0.5/ss;
+		for (j = 0; j < 3; j++)
+			nin[j] = nin[j] * ss + 0.5;
+		sl[i].key = gq_morton(nin);
+		sl[i].ix = i;
+	}
+
+#define 	HEAP_COMPARE(A,B) (A.key < B.key)
+	HEAPSORT(gqsort, sl, n)
+#undef HEAP_COMPARE
+
+	for (i = 0; i < n; i++) {
+		int ix = sl[i].ix;
+		double rv = radial(s, out != NULL ? out[ix] : NULL, in[ix]);
+		if (rad != NULL)
+			rad[ix] = rv;
+	}
+	free(sl);
+}
+
+/* nearest() of n points using a query context, looked up in order of location */
+static void nearest_n(
+gamut *s,
+gquery *q,			/* Query context */
+double (*out)[3],	/* Return surface points (absolute) */
+double (*in)[3],	/* Input points (absolute) */
+int n				/* Number of points */
+) {
+	gqsort *sl;
+	double mn[3], sc[3];
+	int i, j;
+
+	if (n <= 0)
+		return;
+
+	if ((sl = (gqsort *)malloc(n * sizeof(gqsort))) == NULL) {
+		for (i = 0; i < n; i++)
+			nearest_q(s, q, out[i], in[i], NULL);
+		return;
+	}
+
+	/* Key on the location within the range of the points */
+	for (j = 0; j < 3; j++) {
+		mn[j] = in[0][j];
+		sc[j] = in[0][j];
+	}
+	for (i = 1; i < n; i++) {
+		for (j = 0; j < 3; j++) {
+			if (in[i][j] < mn[j])
+				mn[j] = in[i][j];
+			if (in[i][j] > sc[j])
+				sc[j] = in[i][j];
+		}
+	}
+	for (j = 0; j < 3; j++) {
+		sc[j] -= mn[j];
+		sc[j] = sc[j] > 1e-9 ? 1.0/sc[j] : 0.0;
+	}
+	for (i = 0; i < n; i++) {
+		double v[3];
+
+		for (j = 0; j < 3; j++)
+			v[j] = (in[i][j] - mn[j]) * sc[j];
+		sl[i].key = gq_morton(v);
+		sl[i].ix = i;
+	}
+
+#define 	HEAP_COMPARE(A,B) (A.key < B.key)
+	HEAPSORT(gqsort, sl, n)
+#undef HEAP_COMPARE
+
+	for (i = 0; i < n; i++) {
+		int ix = sl[i].ix;
+		nearest_q(s, q, out[ix], in[ix], NULL);
+	}
+	free(sl);
+}
+
 /* ===================================================== */
 /* Define the colorspaces white and black point. May be NULL if unknown. */
 /* Note that as in all of the gamut library, we assume that we are in */
@@ -4962,6 +5316,7 @@ vrml *wrl		/* Diagnostic plot */
 # define ISDBG(xxx)
 #endif	/* !INTERSECT_DEBUG */
 
+#ifndef USE_ISECT_BVH
 /* Recursive vector intersect using BSP accelleration. */
 static void vector_isect_rec(
 gamut *s,
@@ -5302,74 +5657,395 @@ int   *lu		/* Number used in list */
 		return;
 	}
 }
+#endif /* !USE_ISECT_BVH */
 
-/* Re-evaluate the intersections with an offset */
-static void reevaluate_isectns(
-gamut  *s,
-gispnt *lp,		/* List to set intersections in. */
-int    n,		/* Number to re-evaluate */
-double offset,	/* Amount to offset vector */
-double *ivb,	/* Center relative base point of vector */
-double *vv		/* Vector direction from base */
-) {
-	double vb[3];	/* Offset vb */
-	double sv;
-	int sj, j, i;
+/* ----------------------------------------------------- */
+/* BVH accelerated vector intersect. */
 
-	/* Decide which way to offset base */
-	sv = -1e20;
+/* The radial BSP tree is arranged to find the radial surface */
+/* point, and is not so good at locating arbitrary vector */
+/* intersections. A bounding volume hierarchy with several */
+/* triangles in each leaf is better at this. The triangle tests */
+/* use the same arithmetic as vector_isect_rec(), so the */
+/* intersections found are the same. */
+
+#define BVH_PAD 1e-4		/* Bounding box padding to allow for triangle test tollerance */
+#define BVH_MAXD 64			/* Maximum traversal stack depth */
+
+/* BVH build context */
+typedef struct {
+	gamut *s;
+	gtri **tl;			/* Triangle list being partitioned */
+	double (*cc)[3];	/* Triangle bounding box centers, indexed by tl[]->nix */
+	gbvh *p;
+} bvhbld;
+
+/* Recursively create the BVH nodes for tl[i0..i1-1] */
+static void bvh_split(bvhbld *b, int i0, int i1) {
+	gbvh *p = b->p;
+	gbvhn *n = &p->nodes[p->nn++];
+	double cmn[3], cmx[3];
+	int i, j, k;
+
+	/* Bounding box of the triangles and their centers */
 	for (j = 0; j < 3; j++) {
-		if (fabs(vv[j]) > sv) {		/* Locate largest direction */
-			sv = fabs(vv[j]);
-			sj = j;
+		n->bb[0][j] = cmn[j] = 1e300;
+		n->bb[1][j] = cmx[j] = -1e300;
+	}
+	for (i = i0; i < i1; i++) {
+		gtri *t = b->tl[i];
+		for (k = 0; k < 3; k++) {
+			for (j = 0; j < 3; j++) {
+				double v = t->v[k]->p[j] - b->s->cent[j];
+				if (v < n->bb[0][j])
+					n->bb[0][j] = v;
+				if (v > n->bb[1][j])
+					n->bb[1][j] = v;
+			}
+		}
+		for (j = 0; j < 3; j++) {
+			double v = b->cc[t->nix][j];
+			if (v < cmn[j])
+				cmn[j] = v;
+			if (v > cmx[j])
+				cmx[j] = v;
 		}
 	}
-
-	/* Apply the offset to other than largest */
 	for (j = 0; j < 3; j++) {
-		vb[j] = ivb[j];
-		if (j == sj)
-			continue;	
-		vb[j] += offset;
+		n->bb[0][j] -= BVH_PAD;
+		n->bb[1][j] += BVH_PAD;
 	}
 
-	for (i = 0; i < n; i++) {
-		double den, ti, ip[3], bds;
-		gtri *t = lp[i].tri;
+	if ((i1 - i0) <= BVH_TW) {		/* Make a leaf */
+		gbvhtb *bk = &p->blks[p->nb];
 
-		lp[i].dir = 0;
-		lp[i].edge = 2;		/* Assume no intersect */
+		n->leaf = 1;
+		n->ix = p->nb++;
+		for (k = 0; k < BVH_TW; k++) {
+			gtri *t = (i0 + k) < i1 ? b->tl[i0 + k] : NULL;
 
-		den = t->pe[0] * vv[0] + t->pe[1] * vv[1] + t->pe[2] * vv[2];
-		if (fabs(den) < 1e-12) {
-			continue;
+			bk->t[k] = t;
+			for (j = 0; j < 4; j++) {
+				bk->pe[j][k] = t != NULL ? t->pe[j] : 0.0;
+				bk->ee[0][j][k] = t != NULL ? t->ee[0][j] : 0.0;
+				bk->ee[1][j][k] = t != NULL ? t->ee[1][j] : 0.0;
+				bk->ee[2][j][k] = t != NULL ? t->ee[2][j] : 0.0;
+			}
 		}
+		return;
+	}
 
-		/* Compute the intersection of vector with the BSP plane */
-		ti = -(t->pe[0] * (vb[0] + s->cent[0]) 
-		     + t->pe[1] * (vb[1] + s->cent[1])
-		     + t->pe[2] * (vb[2] + s->cent[2])
-		     + t->pe[3])/den;
+	/* Split at the median of the axis with the largest center range */
+	k = 0;
+	for (j = 1; j < 3; j++) {
+		if ((cmx[j] - cmn[j]) > (cmx[k] - cmn[k]))
+			k = j;
+	}
 
-		/* Compute the actual intersection point */
-		ip[0] = vb[0] + ti * vv[0];
-		ip[1] = vb[1] + ti * vv[1];
-		ip[2] = vb[2] + ti * vv[2];
+#define 	HEAP_COMPARE(A,B) (b->cc[A->nix][k] < b->cc[B->nix][k])
+	HEAPSORT(gtri *, &b->tl[i0], i1 - i0)
+#undef HEAP_COMPARE
 
-		/* Check if the intersection point is within the triangle */
-		bds = -1e6;
-		for (j = 0; j < 3; j++) {
-			double ds;
-			ds = t->ee[j][0] * ip[0]
-			   + t->ee[j][1] * ip[1]
-		       + t->ee[j][2] * ip[2]
-			   + t->ee[j][3];
-			if (ds > 1e-8)
-				break;			/* Not within triangle */
-			if (ds > bds)
-				bds = ds;
-		}
-		if (j < 3) {
+	n->leaf = 0;
+	i = (i0 + i1)/2;
+	bvh_split(b, i0, i);
+	n->ix = p->nn;
+	bvh_split(b, i, i1);
+}
+
+/* Setup the vector intersect BVH */
+static void init_bvh(gamut *s) {
+	bvhbld b;
+	gbvh *p;
+	gtri *tp;
+	int i, j, k, ntris;
+
+	if IS_LIST_EMPTY(s->tris)
+		triangulate(s);
+
+	ntris = 0;
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		ntris++;
+	} END_FOR_ALL_ITEMS(tp);
+
+	if ((s->bvh = p = (gbvh *)calloc(1, sizeof(gbvh))) == NULL
+	 || (p->nodes = (gbvhn *)calloc(2 * ntris + 1, sizeof(gbvhn))) == NULL
+	 || (p->blks = (gbvhtb *)calloc(ntris + 1, sizeof(gbvhtb))) == NULL
+	 || (b.tl = (gtri **)malloc((ntris + 1) * sizeof(gtri *))) == NULL
+	 || (b.cc = (double (*)[3])malloc((ntris + 1) * sizeof(double [3]))) == NULL) {
+		fprintf(stderr,"gamut: malloc failed - BVH structure\n");
+		exit(-1);
+	}
+	b.s = s;
+	b.p = p;
+
+	/* (nix is also set by init_ne() to the same value) */
+	i = 0;
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		tp->nix = i;
+		b.tl[i] = tp;
+		for (j = 0; j < 3; j++) {
+			double mn = 1e300, mx = -1e300;
+			for (k = 0; k < 3; k++) {
+				if (tp->v[k]->p[j] < mn)
+					mn = tp->v[k]->p[j];
+				if (tp->v[k]->p[j] > mx)
+					mx = tp->v[k]->p[j];
+			}
+			b.cc[i][j] = 0.5 * (mn + mx);
+		}
+		i++;
+	} END_FOR_ALL_ITEMS(tp);
+
+	if (ntris > 0)
+		bvh_split(&b, 0, ntris);
+
+	free(b.cc);
+	free(b.tl);
+}
+
+static void del_gbvh(gbvh *p) {
+	free(p->blks);
+	free(p->nodes);
+	free(p);
+}
+
+/* Return nz if the line vb + t * vv, t0 <= t <= t1 may intersect */
+/* the box, and the parameter range within it. */
+static int bvh_box(
+gbvhn *n,
+double *vb,		/* Center relative base point of vector */
+double *vv,		/* Vector direction from base */
+double *iv,		/* 1/vv[], 0 if vv[] is 0 */
+double t0, double t1,
+double *bt0, double *bt1
+) {
+	int j;
+
+	for (j = 0; j < 3; j++) {
+		if (iv[j] == 0.0) {
+			if (vb[j] < n->bb[0][j] || vb[j] > n->bb[1][j])
+				return 0;
+		} else {
+			double ta = (n->bb[0][j] - vb[j]) * iv[j];
+			double tb = (n->bb[1][j] - vb[j]) * iv[j];
+			if (ta > tb) {
+				double tt = ta; ta = tb; tb = tt;
+			}
+			if (ta > t0)
+				t0 = ta;
+			if (tb < t1)
+				t1 = tb;
+			if (t0 > t1)
+				return 0;
+		}
+	}
+	*bt0 = t0;
+	*bt1 = t1;
+	return 1;
+}
+
+/* Vector intersect using BVH accelleration. */
+/* Same parameters and results as vector_isect_rec() */
+static void vector_isect_bvh(
+gamut *s,
+double *vb,		/* Center relative base point of vector */
+double *vv,		/* Vector direction from base */
+double t0,		/* Start parameter value of line */
+double t1,		/* End parameter value of line */
+gispnt *lp,		/* List to set intersections in. */
+int    ll,		/* Size of list. 0 == 2, min and max only */
+int   *lu		/* Number used in list */
+) {
+	gbvh *p = s->bvh;
+	int stack[BVH_MAXD];
+	int sp = 0, ni;
+	double avb[3], iv[3];
+	int j, k;
+
+	if (p->nn == 0)
+		return;
+
+	for (j = 0; j < 3; j++) {
+		avb[j] = vb[j] + s->cent[j];		/* Absolute base point */
+		iv[j] = fabs(vv[j]) > 1e-300 ? 1.0/vv[j] : 0.0;
+	}
+
+	stack[sp++] = 0;
+	while (sp > 0) {
+		gbvhn *n;
+		gbvhtb *bk;
+		double bt0, bt1;
+		double den[BVH_TW], ti[BVH_TW], bds[BVH_TW];
+		double ip[BVH_TW][3];
+		int ins[BVH_TW];
+
+		n = &p->nodes[ni = stack[--sp]];
+
+		if (!bvh_box(n, vb, vv, iv, t0, t1, &bt0, &bt1))
+			continue;
+
+		/* Can't improve either min or max */
+		if (ll == 0 && bt0 >= lp[0].pv && bt1 <= lp[1].pv)
+			continue;
+
+		if (!n->leaf) {
+			if (sp > (BVH_MAXD - 2))
+				error("gamut: BVH stack overflow");
+			stack[sp++] = n->ix;		/* Second child */
+			stack[sp++] = ni + 1;		/* First child */
+			continue;
+		}
+
+		/* Test all the triangles in the leaf */
+		bk = &p->blks[n->ix];
+		for (k = 0; k < BVH_TW; k++) {
+			den[k] = bk->pe[0][k] * vv[0] + bk->pe[1][k] * vv[1] + bk->pe[2][k] * vv[2];
+			ti[k] = -(bk->pe[0][k] * avb[0]
+			        + bk->pe[1][k] * avb[1]
+			        + bk->pe[2][k] * avb[2]
+			        + bk->pe[3][k]);
+		}
+		for (k = 0; k < BVH_TW; k++) {
+			if (fabs(den[k]) < 1e-12)
+				den[k] = 0.0;				/* Tangent or unused */
+			else
+				ti[k] /= den[k];
+		}
+		for (k = 0; k < BVH_TW; k++) {
+			double ds0, ds1, ds2;
+
+			ip[k][0] = vb[0] + ti[k] * vv[0];
+			ip[k][1] = vb[1] + ti[k] * vv[1];
+			ip[k][2] = vb[2] + ti[k] * vv[2];
+
+			ds0 = bk->ee[0][0][k] * ip[k][0]
+			    + bk->ee[0][1][k] * ip[k][1]
+			    + bk->ee[0][2][k] * ip[k][2]
+			    + bk->ee[0][3][k];
+			ds1 = bk->ee[1][0][k] * ip[k][0]
+			    + bk->ee[1][1][k] * ip[k][1]
+			    + bk->ee[1][2][k] * ip[k][2]
+			    + bk->ee[1][3][k];
+			ds2 = bk->ee[2][0][k] * ip[k][0]
+			    + bk->ee[2][1][k] * ip[k][1]
+			    + bk->ee[2][2][k] * ip[k][2]
+			    + bk->ee[2][3][k];
+			ins[k] = ds0 <= 1e-8 && ds1 <= 1e-8 && ds2 <= 1e-8;
+			bds[k] = -1e6;
+			if (ds0 > bds[k])
+				bds[k] = ds0;
+			if (ds1 > bds[k])
+				bds[k] = ds1;
+			if (ds2 > bds[k])
+				bds[k] = ds2;
+		}
+
+		for (k = 0; k < BVH_TW; k++) {
+			gtri *t = bk->t[k];
+
+			if (den[k] == 0.0 || !ins[k])
+				continue;
+
+			/* Add intersection to list */
+			if (ll > 0) {		/* List of all */
+				if (*lu < ll) {
+					lp[*lu].pv = ti[k];
+					icmAdd3(lp[*lu].ip,ip[k],s->cent);		/* Abs. intersection point */
+					lp[*lu].dir = den[k] > 0.0 ? 1 : 0;
+					lp[*lu].edge = bds[k] > 0.0 ? 1 : 0;
+					lp[*lu].tri = t;
+					(*lu)++;
+				}
+			} else {			/* Bigest/smallest list of 2 */
+				if (ti[k] < lp[0].pv) {
+					lp[0].pv = ti[k];
+					icmAdd3(lp[0].ip,ip[k],s->cent);		/* Abs. intersection point */
+					lp[0].dir = den[k] > 0.0 ? 1 : 0;
+					lp[0].edge = bds[k] > 0.0 ? 1 : 0;
+					lp[0].tri = t;
+				}
+				if (ti[k] > lp[1].pv) {
+					lp[1].pv = ti[k];
+					icmAdd3(lp[1].ip,ip[k],s->cent);		/* Abs. intersection point */
+					lp[1].dir = den[k] > 0.0 ? 1 : 0;
+					lp[1].edge = bds[k] > 0.0 ? 1 : 0;
+					lp[1].tri = t;
+				}
+			}
+		}
+	}
+}
+
+/* Re-evaluate the intersections with an offset */
+static void reevaluate_isectns(
+gamut  *s,
+gispnt *lp,		/* List to set intersections in. */
+int    n,		/* Number to re-evaluate */
+double offset,	/* Amount to offset vector */
+double *ivb,	/* Center relative base point of vector */
+double *vv		/* Vector direction from base */
+) {
+	double vb[3];	/* Offset vb */
+	double sv;
+	int sj, j, i;
+
+	/* Decide which way to offset base */
+	sv = -1e20;
+	for (j = 0; j < 3; j++) {
+		if (fabs(vv[j]) > sv) {		/* Locate largest direction */
+			sv = fabs(vv[j]);
+			sj = j;
+		}
+	}
+
+	/* Apply the offset to other than largest */
+	for (j = 0; j < 3; j++) {
+		vb[j] = ivb[j];
+		if (j == sj)
+			continue;	
+		vb[j] += offset;
+	}
+
+	for (i = 0; i < n; i++) {
+		double den, ti, ip[3], bds;
+		gtri *t = lp[i].tri;
+
+		lp[i].dir = 0;
+		lp[i].edge = 2;		/* Assume no intersect */
+
+		den = t->pe[0] * vv[0] + t->pe[1] * vv[1] + t->pe[2] * vv[2];
+		if (fabs(den) < 1e-12) {
+			continue;
+		}
+
+		/* Compute the intersection of vector with the BSP plane */
+		ti = -(t->pe[0] * (vb[0] + s->cent[0]) 
+		     + t->pe[1] * (vb[1] + s->cent[1])
+		     + t->pe[2] * (vb[2] + s->cent[2])
+		     + t->pe[3])/den;
+
+		/* Compute the actual intersection point */
+		ip[0] = vb[0] + ti * vv[0];
+		ip[1] = vb[1] + ti * vv[1];
+		ip[2] = vb[2] + ti * vv[2];
+
+		/* Check if the intersection point is within the triangle */
+		bds = -1e6;
+		for (j = 0; j < 3; j++) {
+			double ds;
+			ds = t->ee[j][0] * ip[0]
+			   + t->ee[j][1] * ip[1]
+		       + t->ee[j][2] * ip[2]
+			   + t->ee[j][3];
+			if (ds > 1e-8)
+				break;			/* Not within triangle */
+			if (ds > bds)
+				bds = ds;
+		}
+		if (j < 3) {
 			continue;			/* Not within triangle, so ignore */
 		}
 
@@ -5413,6 +6089,11 @@ gtri **omxtri
 	if (s->lu_inited == 0)
 		init_lu(s);				/* Init BSP search tree */
 
+#ifdef USE_ISECT_BVH
+	if (s->bvh == NULL)
+		init_bvh(s);			/* Init vector intersect BVH */
+#endif
+
 	/* Convert twp points to center relative base + vector direction */
 	for (tt = 0.0, j = 0; j < 3; j++) {
 		vv[j] = p2[j] - p1[j];
@@ -5471,8 +6152,12 @@ gtri **omxtri
 			rse1 = rsc;
 	}
 
+#ifdef USE_ISECT_BVH
+	vector_isect_bvh(s, vb, vv, t0, t1, islist, 0, &lu);
+#else
 	vector_isect_rec(s, s->lutree, vb, vv, t0, rs0, t1, rs1, tc, rsc, rse0, rse1,
 	                                                  islist, 0, &lu);   
+#endif
 
 	/* If we failed to locate a requested intersection */
 	if (((omin != NULL || omnt != NULL || omntri != NULL) && islist[0].pv == 1e68)
@@ -5634,6 +6319,11 @@ int     ll 		/* Size of list. */
 	if (s->lu_inited == 0)
 		init_lu(s);				/* Init BSP search tree */
 
+#ifdef USE_ISECT_BVH
+	if (s->bvh == NULL)
+		init_bvh(s);			/* Init vector intersect BVH */
+#endif
+
 	/* Convert twp points to relative base + vector direction */
 	for (tt = 0.0, j = 0; j < 3; j++) {
 		vv[j] = p2[j] - p1[j];
@@ -5696,9 +6386,14 @@ int     ll 		/* Size of list. */
 			rse1 = rsc;
 	}
 
+	/* Locate all the triangle intersections */
+#ifdef USE_ISECT_BVH
+	vector_isect_bvh(s, vb, vv, t0, t1, lp, ll, &lu);
+#else
 	/* Recursively locate all the triangle intersections using BSP */
 	vector_isect_rec(s, s->lutree, vb, vv, t0, rs0, t1, rs1, tc, rsc, rse0, rse1,
 	                                                  lp, ll, &lu);   
+#endif
 
 	if (lu <= 1) {
 #ifdef INTERSECT_DEBUG
@@ -6303,7 +6998,7 @@ char *filename
 }
 
 /* ----------------------------------- */
-/* Read from a CGATS .gam file */
+/* Read from a CGATS .gam file, or a binary gamut file */
 /* Return non-zero on error */
 static int read_gam(
 gamut *s,
@@ -6311,6 +7006,9 @@ char *filename
 ) {
 	cgatsFile *fp;
 
+	if (gamut_isbgam(filename))
+		return read_bgam(s, filename);
+
 	if ((fp = new_cgatsFileStd_name(filename, "r")) == NULL) {
 		fprintf(stderr,"Unable to open file '%s' for reading",filename);
 		return 1;
@@ -6326,9 +7024,8 @@ gamut *s,
 cgatsFile *fp,
 char *filename
 ) {
-	int i;
+	int i, j;
 	cgats *gam;
-	gtri *tp;
 	int nverts;
 	int ntris;
 	int Lf, af, bf;			/* Fields holding L, a & b data */
@@ -6501,6 +7198,14 @@ char *filename
 		v->p[2] = *((double *)gam->t[0].fdata[i][bf]);
 
 		gamut_rect2radial(s, v->r, v->p);
+
+		/* Track the range for getrange() */
+		for (j = 0; j < 3; j++) {
+			if (v->p[j] > s->mx[j])
+				s->mx[j] = v->p[j];
+			if (v->p[j] < s->mn[j])
+				s->mn[j] = v->p[j];
+		}
 	}
 	s->ntv = i;
 
@@ -6553,6 +7258,86 @@ char *filename
 	}
 
 	/* Connect edge information */
+	if (connect_edges(s, NULL)) {
+		gam->del(gam);
+		return 1;
+	}
+
+	gam->del(gam);			/* Clean up */
+
+	s->read_inited = 1;			/* It's now valid */
+
+#ifdef ASSERTS
+	check_triangulation(s, 1);	/* Check out our work */
+#endif
+
+	return 0;
+}
+
+/* ----------------------------------- */
+/* Connect the edge information of triangles that have been read */
+
+/* A directed triangle edge, used to find the matching edge */
+typedef struct {
+	int v0, v1;		/* Vertex numbers */
+	int ti;			/* Triangle index */
+	gtri *t;		/* Triangle */
+	int en;			/* Edge within triangle */
+} gredge;
+
+/* If adj is not NULL, it holds the index of each triangles edges */
+/* neighbour triangle * 3 + the neighbours edge number, otherwise */
+/* the neighbour edges are located by their vertices. */
+/* Return nz on error */
+static int connect_edges(gamut *s, unsigned int *adj) {
+	gtri *tp;
+	gtri **tl = NULL;
+	gredge *el = NULL;
+	int i, ntris, rv = 0;
+
+	ntris = 0;
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		ntris++;
+	} END_FOR_ALL_ITEMS(tp);
+
+	if (adj != NULL) {
+		if ((tl = (gtri **)malloc((ntris + 1) * sizeof(gtri *))) == NULL) {
+			fprintf(stderr,"gamut: malloc failed on triangle list\n");
+			return 2;
+		}
+		i = 0;
+		tp = s->tris; 
+		FOR_ALL_ITEMS(gtri, tp) {
+			tl[i++] = tp;
+		} END_FOR_ALL_ITEMS(tp);
+
+	} else {
+		/* Sort all the directed edges by their vertices */
+		if ((el = (gredge *)malloc((3 * ntris + 1) * sizeof(gredge))) == NULL) {
+			fprintf(stderr,"gamut: malloc failed on edge list\n");
+			return 2;
+		}
+		i = 0;
+		tp = s->tris; 
+		FOR_ALL_ITEMS(gtri, tp) {
+			int en;
+			for (en = 0; en < 3; en++, i++) {
+				el[i].v0 = tp->v[en]->n;
+				el[i].v1 = tp->v[en < 2 ? en+1 : 0]->n;
+				el[i].ti = i/3;
+				el[i].t = tp;
+				el[i].en = en;
+			}
+		} END_FOR_ALL_ITEMS(tp);
+
+#define 	HEAP_COMPARE(A,B) (A.v0 < B.v0 || (A.v0 == B.v0 \
+                          && (A.v1 < B.v1 || (A.v1 == B.v1 && A.ti < B.ti))))
+		HEAPSORT(gredge, el, 3 * ntris)
+#undef HEAP_COMPARE
+	}
+
+	i = 0;
 	tp = s->tris; 
 	FOR_ALL_ITEMS(gtri, tp) {
 		int en;
@@ -6560,9 +7345,8 @@ char *filename
 		for (en = 0; en < 3; en++) {	/* For each edge */
 			gedge *e;
 			gvert *v0, *v1;				/* The two vertices of the edge */
-			gtri *tp2;					/* The other triangle */
-			int em;						/* The other edge */
-			gvert *w0, *w1;				/* The other vertices */
+			gtri *tp2 = NULL;			/* The other triangle */
+			int em = 0;					/* The other edge */
 			
 			v0 = tp->v[en];
 			v1 = tp->v[en < 2 ? en+1 : 0];
@@ -6571,22 +7355,34 @@ char *filename
 				continue;				/* Skip every other edge */
 
 			/* Find the corresponding edge of the other triangle */
-			w0 = w1 = NULL;
-			tp2 = s->tris; 
-			FOR_ALL_ITEMS(gtri, tp2) {
-				for (em = 0; em < 3; em++) {	/* For each edge */
-					w0 = tp2->v[em];
-					w1 = tp2->v[em < 2 ? em+1 : 0];
-					if (v0 == w1 && v1 == w0)	/* Found it */
-						break;
+			if (adj != NULL) {
+				unsigned int ix = adj[3 * i + en];
+				if ((ix/3) < (unsigned int)ntris) {
+					tp2 = tl[ix/3];
+					em = ix % 3;
+					if (tp2->v[em] != v1 || tp2->v[em < 2 ? em+1 : 0] != v0)
+						tp2 = NULL;
 				}
-				if (em < 3)
-					break;
-			} END_FOR_ALL_ITEMS(tp2);
-			if (w0 == NULL) {
-				/* Should clean up ? */
+			} else {
+				int i0 = 0, i1 = 3 * ntris;
+
+				/* Find first edge v1 -> v0 */
+				while (i0 < i1) {
+					int im = (i0 + i1)/2;
+					if (el[im].v0 < v1->n || (el[im].v0 == v1->n && el[im].v1 < v0->n))
+						i0 = im + 1;
+					else
+						i1 = im;
+				}
+				if (i0 < 3 * ntris && el[i0].v0 == v1->n && el[i0].v1 == v0->n) {
+					tp2 = el[i0].t;
+					em = el[i0].en;
+				}
+			}
+			if (tp2 == NULL) {
 				fprintf(stderr,".gam file triangle data is not consistent\n");
-				return 1;
+				rv = 1;
+				goto done;
 			}
 
 			if (tp->e[en] != NULL
@@ -6594,7 +7390,8 @@ char *filename
 				fprintf(stderr,".gam file triangle data is not consistent\n");
 				fprintf(stderr,"tp1->e[%d] = 0x%p, tp2->e[%d]= 0x%p\n",en,
 						(void *)tp->e[en],em,(void *)tp2->e[em]);
-				return 1;
+				rv = 1;
+				goto done;
 			}
 
 			/* Creat the edge structure */
@@ -6611,9 +7408,361 @@ char *filename
 			e->v[0] = v0;			/* The two vertices */
 			e->v[1] = v1;
 		}
+		i++;
 	} END_FOR_ALL_ITEMS(tp);
 
-	gam->del(gam);			/* Clean up */
+  done:;
+	free(el);
+	free(tl);
+	return rv;
+}
+
+/* ----------------------------------- */
+/* Binary gamut file. */
+/* All values are little endian, doubles are IEEE754 64 bit. */
+/*
+	ORD8   magic[8]		"AGAMBIN\0"
+	ORD32  version		BGAM_VERSION
+	ORD32  flags		BGAM_FLAGS
+	ORD32  nverts
+	ORD32  ntris
+	FLT64  cent[3]
+	FLT64  cs_wp[3], cs_bp[3], ga_wp[3], ga_bp[3]
+	FLT64  cusps[6][3]
+	FLT64  verts[nverts][3]
+	ORD32  tris[ntris][3]		Vertex indexes
+	ORD32  adj[ntris][3]		if BGAM_ADJ, neighbour triangle index * 3 + edge no.
+ */
+
+#define BGAM_MAGIC "AGAMBIN"	/* + nul */
+#define BGAM_VERSION 1
+#define BGAM_HDRSZ (8 + 4 * 4 + 8 * (3 + 4 * 3 + 6 * 3))
+
+#define BGAM_JAB   0x0001		/* Jab rather than Lab */
+#define BGAM_RAST  0x0002		/* Raster surface type */
+#define BGAM_CSWB  0x0004		/* Colorspace white & black are valid */
+#define BGAM_GAWB  0x0008		/* Gamut white & black are valid */
+#define BGAM_CUSPS 0x0010		/* Cusps are valid */
+#define BGAM_ADJ   0x0020		/* Triangle adjacency is present */
+
+/* Return nz if the file is a binary gamut file */
+int gamut_isbgam(char *filename) {
+	FILE *fp;
+	char buf[8];
+	int rv = 0;
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(filename,"rb")) == NULL)
+#else
+	if ((fp = fopen(filename,"r")) == NULL)
+#endif
+		return 0;
+
+	if (fread(buf, 1, 8, fp) == 8 && memcmp(buf, BGAM_MAGIC, 8) == 0)
+		rv = 1;
+	fclose(fp);
+	return rv;
+}
+
+/* Write to a binary gamut file */
+/* Return non-zero on error */
+static int write_bgam(
+gamut *s,
+char *filename
+) {
+	FILE *fp;
+	ORD8 *buf, *bp;
+	size_t bsize;
+	gtri *tp;
+	int i, j, nverts, ntris;
+	unsigned int flags = BGAM_ADJ;
+
+	if IS_LIST_EMPTY(s->tris)
+		triangulate(s);
+
+	if (s->cswbset) {
+		compgawb(s);		/* make sure we have gamut white/black available */
+		flags |= BGAM_CSWB | BGAM_GAWB;
+	}
+	if (s->cu_inited != 0)
+		flags |= BGAM_CUSPS;
+	if (s->isJab)
+		flags |= BGAM_JAB;
+	if (s->isRast)
+		flags |= BGAM_RAST;
+
+	for (nverts = i = 0; i < s->nv; i++) {
+		if (s->verts[i]->f & GVERT_TRI)
+			nverts++;
+	}
+	ntris = 0;
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		tp->nix = ntris++;
+	} END_FOR_ALL_ITEMS(tp);
+
+	bsize = BGAM_HDRSZ + (size_t)nverts * 3 * 8 + (size_t)ntris * 6 * 4;
+	if ((buf = (ORD8 *)calloc(bsize, 1)) == NULL) {
+		fprintf(stderr,"gamut: malloc failed on binary gamut buffer\n");
+		return 2;
+	}
+
+	bp = buf;
+	memcpy(bp, BGAM_MAGIC, 8);							bp += 8;
+	write_ORD32_le(bp, BGAM_VERSION);					bp += 4;
+	write_ORD32_le(bp, flags);							bp += 4;
+	write_ORD32_le(bp, nverts);							bp += 4;
+	write_ORD32_le(bp, ntris);							bp += 4;
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cent[j]);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cswbset ? s->cs_wp[j] : 0.0);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cswbset ? s->cs_bp[j] : 0.0);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cswbset ? s->ga_wp[j] : 0.0);
+	for (j = 0; j < 3; j++, bp += 8)
+		write_FLT64_le(bp, s->cswbset ? s->ga_bp[j] : 0.0);
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 3; j++, bp += 8)
+			write_FLT64_le(bp, s->cu_inited ? s->cusps[i][j] : 0.0);
+	}
+
+	/* The vertex values, in order. */
+	for (i = 0; i < s->nv; i++) {
+		if (!(s->verts[i]->f & GVERT_TRI))
+			continue;
+		for (j = 0; j < 3; j++, bp += 8)
+			write_FLT64_le(bp, s->verts[i]->p[j]);
+	}
+
+	/* The triangles */
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		for (j = 0; j < 3; j++, bp += 4)
+			write_ORD32_le(bp, tp->v[j]->tn);
+	} END_FOR_ALL_ITEMS(tp);
+
+	/* and their neighbours */
+	tp = s->tris; 
+	FOR_ALL_ITEMS(gtri, tp) {
+		for (j = 0; j < 3; j++, bp += 4) {
+			gedge *e = tp->e[j];
+			int ei = tp->ei[j] ^ 1;
+			write_ORD32_le(bp, e->t[ei]->nix * 3 + e->ti[ei]);
+		}
+	} END_FOR_ALL_ITEMS(tp);
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(filename,"wb")) == NULL)
+#else
+	if ((fp = fopen(filename,"w")) == NULL)
+#endif
+	{
+		fprintf(stderr,"Unable to open file '%s' for writing\n",filename);
+		free(buf);
+		return 2;
+	}
+	if (fwrite(buf, 1, bsize, fp) != bsize || fclose(fp) != 0) {
+		fprintf(stderr,"Error writing to file '%s'\n",filename);
+		free(buf);
+		return 2;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Read from a binary gamut file */
+/* Return non-zero on error */
+static int read_bgam(
+gamut *s,
+char *filename
+) {
+	FILE *fp;
+	ORD8 *buf = NULL, *bp;
+	size_t bsize;
+	unsigned int version, flags, *adj = NULL;
+	int i, j, nverts, ntris;
+	int rv = 0;
+
+	if (s->tris != NULL || s->read_inited || s->lu_inited || s->ne_inited) {
+		fprintf(stderr,"Can't add read into gamut after it is initialised!\n");
+		return 1;
+	}
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(filename,"rb")) == NULL)
+#else
+	if ((fp = fopen(filename,"r")) == NULL)
+#endif
+	{
+		fprintf(stderr,"Unable to open file '%s' for reading\n",filename);
+		return 1;
+	}
+
+	/* Read the whole file in one go */
+	if (fseek(fp, 0, SEEK_END) != 0
+	 || (bsize = (size_t)ftell(fp)) < BGAM_HDRSZ
+	 || fseek(fp, 0, SEEK_SET) != 0) {
+		fprintf(stderr,"Input file '%s' is too short\n",filename);
+		fclose(fp);
+		return 1;
+	}
+	if ((buf = (ORD8 *)malloc(bsize)) == NULL) {
+		fprintf(stderr,"gamut: malloc failed on binary gamut buffer\n");
+		fclose(fp);
+		return 2;
+	}
+	if (fread(buf, 1, bsize, fp) != bsize) {
+		fprintf(stderr,"Error reading file '%s'\n",filename);
+		fclose(fp);
+		free(buf);
+		return 1;
+	}
+	fclose(fp);
+
+	bp = buf;
+	if (memcmp(bp, BGAM_MAGIC, 8) != 0) {
+		fprintf(stderr,"Input file '%s' isn't a binary gamut file\n",filename);
+		rv = 1;
+		goto done;
+	}
+	bp += 8;
+	version = read_ORD32_le(bp);						bp += 4;
+	flags = read_ORD32_le(bp);							bp += 4;
+	nverts = read_ORD32_le(bp);							bp += 4;
+	ntris = read_ORD32_le(bp);							bp += 4;
+
+	if (version != BGAM_VERSION) {
+		fprintf(stderr,"Input file '%s' is unknown binary gamut version %d\n",filename,version);
+		rv = 1;
+		goto done;
+	}
+	if (nverts <= 0) {
+		fprintf(stderr,"No vertices");
+		rv = 1;
+		goto done;
+	}
+	if (ntris <= 0) {
+		fprintf(stderr,"No triangles");
+		rv = 1;
+		goto done;
+	}
+	if (bsize < (BGAM_HDRSZ + (size_t)nverts * 3 * 8
+	           + (size_t)ntris * ((flags & BGAM_ADJ) ? 6 : 3) * 4)) {
+		fprintf(stderr,"Input file '%s' is truncated\n",filename);
+		rv = 1;
+		goto done;
+	}
+
+	/* Figure the basic colorspace information */
+	s->isJab = (flags & BGAM_JAB) ? 1 : 0;
+	s->isRast = (flags & BGAM_RAST) ? 1 : 0;
+	if (s->isRast) {
+		s->logpow = RAST_LOG_POW;	/* Wrap the surface more closely */
+		s->no2pass = 1;				/* Only do one pass */
+	} else {
+		s->logpow = NORM_LOG_POW;	/* Convex hull compression power */
+		s->no2pass = 0;				/* Do two passes */
+	}
+
+	bp += 3 * 8;		/* Skip the center, since it is always the default */
+	for (j = 0; j < 3; j++, bp += 8)
+		s->cs_wp[j] = read_FLT64_le(bp);
+	for (j = 0; j < 3; j++, bp += 8)
+		s->cs_bp[j] = read_FLT64_le(bp);
+	for (j = 0; j < 3; j++, bp += 8)
+		s->ga_wp[j] = read_FLT64_le(bp);
+	for (j = 0; j < 3; j++, bp += 8)
+		s->ga_bp[j] = read_FLT64_le(bp);
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 3; j++, bp += 8)
+			s->cusps[i][j] = read_FLT64_le(bp);
+	}
+	if (flags & BGAM_CSWB)
+		s->cswbset = 1;
+	if (flags & BGAM_GAWB)
+		s->gawbset = 1;
+	if (flags & BGAM_CUSPS)
+		s->cu_inited = 1;
+
+	/* Allocate an array to point at the verts */
+	if ((s->verts = (gvert **)malloc(nverts * sizeof(gvert *))) == NULL) {
+		fprintf(stderr,"gamut: malloc failed on gvert pointer\n");
+		rv = 2;
+		goto done;
+	}
+	s->nv = s->na = nverts;
+	
+	for (i = 0; i < nverts; i++) {
+		gvert *v;
+
+		/* Allocate and fill in each vertices basic information */
+		if ((v = (gvert *)calloc(1, sizeof(gvert))) == NULL) {
+			fprintf(stderr,"gamut: malloc failed on gvert object\n");
+			s->nv = i;
+			rv = 2;
+			goto done;
+		}
+		s->verts[i] = v;
+		v->tag = 1;
+		v->tn = v->n = i;
+		v->f = GVERT_SET | GVERT_TRI;		/* Will be part of the triangulation */
+
+		for (j = 0; j < 3; j++, bp += 8) {
+			v->p[j] = read_FLT64_le(bp);
+
+			/* Track the range for getrange() */
+			if (v->p[j] > s->mx[j])
+				s->mx[j] = v->p[j];
+			if (v->p[j] < s->mn[j])
+				s->mn[j] = v->p[j];
+		}
+
+		gamut_rect2radial(s, v->r, v->p);
+	}
+	s->ntv = i;
+
+	/* Compute the other vertex values */
+	compute_vertex_coords(s);
+
+	/* Create all the triangles */
+	for (i = 0; i < ntris; i++) {
+		gtri *t;
+		unsigned int vi[3];
+
+		for (j = 0; j < 3; j++, bp += 4) {
+			if ((vi[j] = read_ORD32_le(bp)) >= (unsigned int)nverts) {
+				fprintf(stderr,"Input file '%s' has bad vertex index\n",filename);
+				rv = 1;
+				goto done;
+			}
+		}
+
+		t = new_gtri();
+		ADD_ITEM_TO_BOT(s->tris, t);	/* Append to triangulation list */
+
+		t->v[0] = s->verts[vi[0]];
+		t->v[1] = s->verts[vi[1]];
+		t->v[2] = s->verts[vi[2]];
+
+		comptriattr(s, t);		/* Compute triangle attributes */
+	}
+
+	/* Read the triangle neighbours */
+	if (flags & BGAM_ADJ) {
+		if ((adj = (unsigned int *)malloc(3 * ntris * sizeof(unsigned int))) == NULL) {
+			fprintf(stderr,"gamut: malloc failed on adjacency list\n");
+			rv = 2;
+			goto done;
+		}
+		for (i = 0; i < (3 * ntris); i++, bp += 4)
+			adj[i] = read_ORD32_le(bp);
+	}
+
+	/* Connect edge information */
+	if ((rv = connect_edges(s, adj)) != 0)
+		goto done;
 
 	s->read_inited = 1;			/* It's now valid */
 
@@ -6621,7 +7770,10 @@ char *filename
 	check_triangulation(s, 1);	/* Check out our work */
 #endif
 
-	return 0;
+  done:;
+	free(adj);
+	free(buf);
+	return rv;
 }
 
 /* ===================================================== */
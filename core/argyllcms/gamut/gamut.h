@@ -149,7 +149,7 @@ struct _gtri {
 	int sort;			/* lookup: Plane sorting result for each try */
 	int bsort;			/* lookup: Current best tries sort */
 
-	unsigned int touch;	/* nn: Per value touch count */
+	int nix;			/* nn: Index of this triangle within the query touch counts */
 	double mix[2][3];	/* nn: Bounding box min and max */
 
 	double area;		/* Area - computed by nssverts() */
@@ -180,9 +180,50 @@ struct _gnn {
 	struct _gamut *s;		/* Base gamut object */
 	int n;					/* Number of points stored */
 	gtri **sax[3 * 2];		/* Sorted axis pointers, one for each direction */
+}; typedef struct _gnn gnn; 
+
+/* ------------------------------------ */
+
+#define BVH_TW 4		/* Number of triangles in a BVH leaf, tested together */
+
+/* A BVH leaf block of triangles, stored by element so */
+/* that the BVH_TW triangles can be tested together. */
+struct _gbvhtb {
+	double pe[4][BVH_TW];		/* Triangle plane equations (absolute) */
+	double ee[3][4][BVH_TW];	/* Triangle edge plane equations (relative) */
+	struct _gtri *t[BVH_TW];	/* Triangles, NULL for unused entries */
+}; typedef struct _gbvhtb gbvhtb;
+
+/* A flattened BVH node. A nodes first child immediately follows it */
+struct _gbvhn {
+	double bb[2][3];		/* Bounding box min & max (center relative) */
+	int ix;					/* Node: index of second child, leaf: index of block */
+	int leaf;				/* nz if this is a leaf */
+}; typedef struct _gbvhn gbvhn;
+
+/* The vector intersection bounding volume hierarchy */
+struct _gbvh {
+	int nn;					/* Number of nodes */
+	gbvhn *nodes;			/* Nodes in depth first order */
+	int nb;					/* Number of leaf blocks */
+	gbvhtb *blks;			/* Leaf blocks */
+}; typedef struct _gbvh gbvh;
+
+/* ------------------------------------ */
+
+/* A nearest query context. This holds the per search state of */
+/* nearest_q(), so that several threads can each make queries */
+/* on the same gamut at once. */
+struct _gquery {
+	struct _gamut *s;		/* Gamut it was created for */
+	int n;					/* Number of triangles */
+	unsigned int *touch;	/* Per triangle touch count [n] */
 	unsigned int tbase;		/* Touch base value for this pass */
 	unsigned int ttarget;	/* Touch target value for this pass */
-}; typedef struct _gnn gnn; 
+
+	void (*del)(struct _gquery *q);		/* Free ourselves */
+
+}; typedef struct _gquery gquery;
 
 /* ------------------------------------ */
 
@@ -229,6 +270,8 @@ struct _gamut {
 
 	gbsp  *lutree;		/* Lookup function BSP tree root */
 	gnn   *nns;			/* nearest neighbor acceleration structure */
+	gquery *nnq;		/* Query context used by nearest() and nearest_tri() */
+	gbvh  *bvh;			/* vector_isect() acceleration structure */
 
 	int cswbset;		/* Flag to indicate that the cs white & black points are set */
 	double cs_wp[3];	/* Color spaces white point */
@@ -259,6 +302,10 @@ struct _gamut {
 
 	gvert *(*expand)(struct _gamut *s, double in[3]);		/* Expand the gamut surface */
 
+	void (*expand_n)(struct _gamut *s, double (*in)[3], int n);
+								/* Expand the gamut surface by n points. Same result as */
+								/* expand() of each point in turn, but uses all processors. */
+
 	void (*set_cs_bp_kp_ovrd)(struct _gamut *s, double *bk, double *kp);	/* Override cs black points */
 
 	int (*getisjab)(struct _gamut *s);	/* Return the isJab flag value */
@@ -349,6 +396,29 @@ struct _gamut {
 	void (*nearest_tri)(struct _gamut *s, double out[3], double in[3], gtri **ctri);
 	                          /* return point on surface closest to input & triangle */
 
+	void (*prep_query)(struct _gamut *s);
+							/* Create all the lazily initialised lookup structures, */
+							/* so that radial(), nradial(), vector_isect(), radial_n() */
+							/* and the query context methods don't modify the gamut. */
+							/* Call this before making queries from more than one thread. */
+
+	gquery *(*new_query)(struct _gamut *s);
+							/* Create a query context for nearest_q() and nearest_n(). */
+							/* Calls prep_query(). Free with q->del(). A context is invalid */
+							/* once the gamut surface is changed. Return NULL on error. */
+
+	void (*nearest_q)(struct _gamut *s, gquery *q, double out[3], double in[3], gtri **ctri);
+							/* nearest_tri() using the given query context. ctri may be NULL */
+
+	void (*radial_n)(struct _gamut *s, double *rad, double (*out)[3], double (*in)[3], int n);
+							/* radial() of n points. The points are looked up sorted by */
+							/* direction, to keep the BSP traversal coherent. */
+							/* rad[] or out[] may be NULL */
+
+	void (*nearest_n)(struct _gamut *s, gquery *q, double (*out)[3], double (*in)[3], int n);
+							/* nearest() of n points using the given query context. */
+							/* The points are looked up sorted by location. */
+
 	int (*vector_isect)(struct _gamut *s, double *p1, double *p2, double *min, double *max,
 	                                                               double *mint, double *maxt,
 	                                                               gtri **mntri, gtri **mxtri);
@@ -399,6 +469,8 @@ struct _gamut {
 	int (*write_gam)(struct _gamut *s, char *filename);		/* Write to a CGATS .gam file */
 	int (*read_gam)(struct _gamut *s, char *filename);		/* Read from a CGATS .gam file */
 	int (*read_gam_fp)(struct _gamut *s, cgatsFile *fp, char *filename);	/* Read using fp */
+	int (*write_bgam)(struct _gamut *s, char *filename);	/* Write to a binary gamut file */
+														/* (read_gam() will read either type) */
 
 	int (*write_trans_vrml)(struct _gamut *s, char *filename, /* Write transformed VRML/X3D .wrl */
 		int doaxes, int docusps, void (*transform)(void *cntx, double out[3], double in[3]), /* with xform */
@@ -413,8 +485,15 @@ gamut *new_gamut(double sres, int isJab, int isRast);	/* Surface resolution, 0.0
 void gamut_rect2radial(gamut *s, double out[3], double in[3]);
 void gamut_radial2rect(gamut *s, double out[3], double in[3]);
 void gamut_Lab2RGB(double *in, double *out);
+int gamut_isbgam(char *filename);		/* Return nz if file is a binary gamut file */
 extern double gam_hues[2][7];	/* Generic Lab & Jab color hues in degrees */
 
+/* Intersection volume of two gamuts (in isecvol.c) */
+double isect_volume(gamut *s1, gamut *s2);			/* From the surface triangles */
+double isect_volume_mc(gamut *s1, gamut *s2, double errb, double *perr);
+												/* Monte-Carlo estimate to within errb */
+												/* Both return -1.0 if incompatible gamuts */
+
 
 #endif /* GAMUT_H */
 
@@ -15,6 +15,8 @@
 /*
  * TTBD:
  *
+ *	isect_volume() searches all the other gamut's triangles for
+ *	each partially contained triangle. Could use a spatial index.
  */
 
 
@@ -26,8 +28,23 @@
 #include <math.h>
 #include "icc.h"
 #include "numlib.h"
+#include "cgats.h"
+#include "conv.h"
 #include "gamut.h"
 
+#undef DEBUG
+
+#ifdef DEBUG
+# define DBG(xxx) printf xxx ;
+#else
+# define DBG(xxx) 
+#endif
+
+#define MC_BLK 4096			/* Monte-Carlo samples per block */
+#define MC_RBLKS 64			/* Monte-Carlo blocks per round */
+#define MC_MINBLKS 64		/* Minimum Monte-Carlo blocks before testing error */
+#define MC_MAXBLKS 65536	/* Maximum Monte-Carlo blocks */
+
 /* Compute a triangles area */
 static double tri_area(
 double v1[3],
@@ -114,207 +131,387 @@ gedge *e		/* edge to test (may be from another gamut) */
 }
 
 
-/* Return the total volume of the gamut */
+/* Return the signed volume contribution of the part of triangle tp1 */
+/* of gamut s1 that is within gamut s2. k is 0 for the first gamut */
+/* and 1 for the second, and sets the direction of the hysteresis. */
+static double tri_isect_volume(
+gamut *s1,
+gamut *s2,
+int k,
+gtri *tp1
+) {
+	int i, j;
+	gtri *tp2;				/* Triangle pointer */
+	double area;			/* Area of this triangle */
+	double dp;				/* Dot product of point in triangle and normal */
+	int inout[3];			/* 0 = inside, 1 = outside */
+	int nout;				/* Number that are out */ 
+	
+	DBG(("doing triangle %d from %s gamut\n",tp1->n,k == 0 ? "first" : "second"))
+
+	/* See how many vertices in the triangle are contained within */
+	/* the other gamut. */
+	nout = 0;
+	for (i = 0; i < 3; i++) {	/* For each vertex */
+		double pl;
+		pl = s2->nradial(s2, NULL, tp1->v[i]->p);
+
+		/* We add a slight hysterysis to avoid issues */
+		/* with identical triangles in two gamuts. */
+		if ((k == 0 && pl > (1.0 + 1e-10))
+		 || (k == 1 && pl > (1.0 - 1e-10))) {
+			nout++;
+			inout[i] = 1;
+		} else
+			inout[i] = 0;
+	}
+
+	DBG(("vertices outside = %d\n",nout))
+
+	/* If none are in, skip this triangle */
+	if (nout == 3)
+		return 0.0;
+
+	/* Compute the full triangles area */
+	area = tri_area(tp1->v[0]->p, tp1->v[1]->p, tp1->v[2]->p);
+	DBG(("full triangle area = %f\n",area))
+
+	/* If the triangle is not completely in, locate all the intersections */
+	/* between it and triangles in the other gamut */
+	if (nout != 0) {
+		gvert *opv;			/* Pointer to the one "in" or "out" vertex */
+		double parea = 0.0;	/* Total partial area */
+
+		/* Locate the odd point out of the three */
+		if (nout == 2) {		/* Look for the one "in" point */
+			for (j = 0; j < 3; j++) {
+				if (inout[j] == 0)
+					break;
+			}
+		} else {				/* Look for the one "out" point */
+			for (j = 0; j < 3; j++) {
+				if (inout[j] == 1)
+					break;
+			}
+		}
+		opv = tp1->v[j];
+
+		tp2 = s2->tris;
+		FOR_ALL_ITEMS(gtri, tp2) {		/* Other gamut triangles */
+			double isps[2][3];			/* Intersection npoints */
+			int nisps;					/* Number of intersection points */
+			double isp[3];				/* New intersection point */
+			int kk;
+
+			/* Do a min/max intersection elimination test */
+			for (i = 0; i < 3; i++) {
+				if (tp2->mix[1][i] < tp1->mix[0][i]
+				 || tp2->mix[0][i] > tp1->mix[1][i])
+					break;			/* min/max don't overlap */
+			}
+			if (i < 3)
+				continue;			/* Skip this triangle, it can't intersect */
+
+			/* Locate intersection of all sides of one triangle with */
+			/* the plane of the other. Keep the two points of */
+			/* intersection that lie within the triangles. */
+			nisps = 0;
+			for (kk = 0; kk < 2; kk++) {
+				gamut *ts;					/* Triangle gamut */
+				gtri *tpa;					/* Triangle pointer */
+				gtri *tpb;					/* Other triangle pointer */
+				if (kk == 0) {
+					ts = s1; 
+					tpa = tp1;
+					tpb = tp2;
+				} else {
+					ts = s2; 
+					tpa = tp2;
+					tpb = tp1;
+				}
+
+				/* For each edge */
+				for (j = 0; j < 3; j++) {
+					if (edge_tri_isect(ts, isp, tpa, tpb->e[j]) != 0) {
+						if (nisps < 2) {
+							icmAry2Ary(isps[nisps], isp);
+							nisps++;
+						} else {	/* Figure which one to replace */
+							int xx;
+							/* Replace the one closest to the new one, */
+							/* if the new one is further from the other one */
+
+							if (icmNorm33sq(isps[0], isp) < icmNorm33sq(isps[1], isp))
+								xx = 0;
+							else
+								xx = 1;
+
+							if (icmNorm33sq(isps[xx ^ 1], isp)
+							  > icmNorm33sq(isps[xx ^ 1], isps[xx])) {
+								icmAry2Ary(isps[xx], isp);
+							}
+						}
+					}
+				}
+			}
+			if (nisps == 0) {
+				continue;
+
+			} else if (nisps == 2)  {
+				double sarea;
+
+				/* Accumulate area of these two points + odd point */
+				sarea = tri_area(opv->p, isps[0], isps[1]);
+				DBG(("located intersecting triangle %d, sub area %f\n",tp2->n,sarea))
+				parea += sarea;
+			} else {	/* Hmm */
+				DBG(("unexpectedly got %d intersection points in triangle\n",nisps))
+			}
+		} END_FOR_ALL_ITEMS(tp2);
+		
+		if (nout == 2) {		/* One "in" point */
+			area = parea;
+		} else {				/* One "out" point */
+			area = area - parea;
+		}
+		DBG(("partial area = %f\n",area))
+	}
+
+	/* Dot product between first vertex in triangle and the unit normal vector */
+	dp = tp1->v[0]->p[0] * tp1->pe[0]
+	   + tp1->v[0]->p[1] * tp1->pe[1]
+	   + tp1->v[0]->p[2] * tp1->pe[2];
+
+	DBG(("vector volume = %f\n",dp * area))
+	return dp * area;
+}
+
+/* Triangle volume context */
+typedef struct {
+	gamut *s[2];		/* The two gamuts */
+	int nt[2];			/* Number of triangles in each gamut */
+	gtri **tl;			/* nt[0] + nt[1] triangles, first gamut then second */
+	double *vc;			/* Volume contribution of each triangle */
+} isvctx;
+
+/* Compute the volume contributions of triangles i0..i1-1 */
+static int isect_volume_task(void *cntx, int thix, int i0, int i1) {
+	isvctx *cx = (isvctx *)cntx;
+	int i;
+
+	for (i = i0; i < i1; i++) {
+		int k = i < cx->nt[0] ? 0 : 1;
+		cx->vc[i] = tri_isect_volume(cx->s[k], cx->s[k ^ 1], k, cx->tl[i]);
+	}
+	return 0;
+}
+
+/* Create a thread pool, or return NULL if it's not worth using one. */
+static athreadpool *isect_pool() {
+	athreadpool *pool;
+
+	if ((pool = new_athreadpool(0)) != NULL && pool->nthr <= 1) {
+		pool->del(pool);
+		pool = NULL;
+	}
+	return pool;
+}
+
+/* Run func over 0..n-1 on the thread pool, */
+/* or in the calling thread if it is NULL. */
+static int isect_run(athreadpool *pool, int n,
+                     int (*func)(void *cntx, int thix, int i0, int i1), void *cntx) {
+	if (pool == NULL)
+		return func(cntx, 0, 0, n);
+	return pool->run(pool, n, func, cntx);
+}
+
+/* Return the volume of the intersection of the two gamuts, */
+/* computed from the parts of each gamut surface that lie within the other. */
+/* The triangles are processed in parallel, and their contributions */
+/* summed in order, so the result doesn't depend on the number of threads. */
 /* Return -1.0 if incompatible gamuts */
 double isect_volume(
 gamut *s1,
 gamut *s2
 ) {
-	int i, j, k;
-	gtri *tp1, *tp2;		/* Triangle pointer */
+	isvctx cx;
+	athreadpool *pool;
+	gtri *tp;
+	int i, k, nt;
 	double vol;		/* Gamut volume */
 
 	if (s1->compatible(s1, s2) == 0)
 		return -1.0;
 
-	if IS_LIST_EMPTY(s1->tris)
-		s1->triangulate(s1);
-	if IS_LIST_EMPTY(s2->tris)
-		s2->triangulate(s2);
-
-	vol = 0.0;
+	/* Make the structures we use read only, so that */
+	/* nradial() can be called from several threads. */
+	s1->prep_query(s1);
+	s2->prep_query(s2);
 
-	/* For first gamut then second gamut */
+	cx.s[0] = s1;
+	cx.s[1] = s2;
 	for (k = 0; k < 2; k++) {
+		cx.nt[k] = 0;
+		tp = cx.s[k]->tris;
+		FOR_ALL_ITEMS(gtri, tp) {
+			cx.nt[k]++;
+		} END_FOR_ALL_ITEMS(tp);
+	}
+	nt = cx.nt[0] + cx.nt[1];
 
-		if (k == 1) {			/* Swap the two gamuts roles */
-			gamut *st = s1;
-			s1 = s2;
-			s2 = st;
-printf("~1 doing second gamut inside first\n");
-		} else {
-printf("~1 doing first gamut inside second\n");
+	if ((cx.tl = (gtri **)malloc((nt + 1) * sizeof(gtri *))) == NULL
+	 || (cx.vc = (double *)malloc((nt + 1) * sizeof(double))) == NULL) {
+		fprintf(stderr,"isect_volume: malloc failed\n");
+		exit(-1);
+	}
+
+	/* First gamut triangles inside second, then second inside first */
+	for (i = k = 0; k < 2; k++) {
+		tp = cx.s[k]->tris;
+		FOR_ALL_ITEMS(gtri, tp) {
+			cx.tl[i++] = tp;
+		} END_FOR_ALL_ITEMS(tp);
+	}
+
+	pool = isect_pool();
+	isect_run(pool, nt, isect_volume_task, (void *)&cx);
+	if (pool != NULL)
+		pool->del(pool);
+
+	for (vol = 0.0, i = 0; i < nt; i++)
+		vol += cx.vc[i];
+
+	free(cx.vc);
+	free(cx.tl);
+
+	DBG(("volume sum = %f\n",vol))
+	vol = fabs(vol)/3.0;
+
+	DBG(("final volume = %f\n",vol))
+	return vol;
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+/* Monte-Carlo volume context */
+typedef struct {
+	gamut *s1, *s2;
+	double min[3], max[3];	/* Sampling box */
+	int bb;					/* First block index of this round */
+	int *hits;				/* Hits in each block of the round */
+} mcvctx;
+
+/* Return a pseudo random number 0.0 .. 1.0 from the given state. */
+/* (We don't use d_rand(), since it's state is global) */
+static double mc_rand(unsigned int *st) {
+	*st = *st * 1664525 + 1013904223;
+	return (double)(*st >> 8) / (double)(1 << 24);
+}
+
+/* Count the samples in both gamuts for blocks i0..i1-1 of a round */
+static int isect_volume_mc_task(void *cntx, int thix, int i0, int i1) {
+	mcvctx *cx = (mcvctx *)cntx;
+	int i, j, k;
+
+	for (i = i0; i < i1; i++) {
+		/* Seed from the block number, so that the samples */
+		/* don't depend on how the blocks were split between threads. */
+		unsigned int st = (unsigned int)(cx->bb + i) * 2654435761u + 1;
+		int hits = 0;
+
+		for (k = 0; k < MC_BLK; k++) {
+			double pp[3];
+
+			for (j = 0; j < 3; j++)
+				pp[j] = cx->min[j] + mc_rand(&st) * (cx->max[j] - cx->min[j]);
+
+			if (cx->s1->nradial(cx->s1, NULL, pp) <= 1.0
+			 && cx->s2->nradial(cx->s2, NULL, pp) <= 1.0)
+				hits++;
 		}
+		cx->hits[i] = hits;
+	}
+	return 0;
+}
 
-		/* Compute the area of each triangle in the list that is within, */
-		/* the other gamut, and accumulate the gamut volume. */
-		tp1 = s1->tris;
-		FOR_ALL_ITEMS(gtri, tp1) {
-			double sp, ss[3];		/* Triangle side lengths */
-			double area;			/* Area of this triangle */
-			double dp;				/* Dot product of point in triangle and normal */
-			int inout[3];			/* 0 = inside, 1 = outside */
-			int nout;				/* Number that are out */ 
-			
-printf("~1 doing triangle %d from %s gamut\n",tp1->n,k == 0 ? "first" : "second");
-			/* See how many vertices in the triangle are contained within */
-			/* the other gamut. */
-			nout = 0;
-			for (i = 0; i < 3; i++) {	/* For each vertex */
-				double pl;
-				pl = s2->nradial(s2, NULL, tp1->v[i]->p);
-
-				/* We add a slight hysterysis to avoid issues */
-				/* with identical triangles in two gamuts. */
-				if ((k == 0 && pl > (1.0 + 1e-10))
-				 || (k == 1 && pl > (1.0 - 1e-10))) {
-					nout++;
-					inout[i] = 1;
-				} else
-					inout[i] = 0;
-			}
+/* Estimate the volume of the intersection of the two gamuts by */
+/* random sampling of their common bounding box. Sampling stops */
+/* when the estimated error is below errb cubic units (at about 95% */
+/* confidence), or the maximum number of samples is reached. */
+/* The estimate is repeatable, and doesn't depend on the number of threads. */
+/* Return the estimated error in *perr if it is not NULL. */
+/* Return -1.0 if incompatible gamuts */
+double isect_volume_mc(
+gamut *s1,
+gamut *s2,
+double errb,		/* Error bound in cubic units */
+double *perr		/* If not NULL, return the estimated error */
+) {
+	mcvctx cx;
+	athreadpool *pool;
+	double min2[3], max2[3];
+	double bvol, pp, vol, err;
+	double tot = 0.0, nsamp = 0.0;
+	int j, nb;
 
-printf("~1 vertices outside = %d\n",nout);
+	if (perr != NULL)
+		*perr = 0.0;
 
-			/* If none are in, skip this triangle */
-			if (nout == 3)
-				continue;
+	if (s1->compatible(s1, s2) == 0)
+		return -1.0;
 
-			/* Compute the full triangles area */
-			area = tri_area(tp1->v[0]->p, tp1->v[1]->p, tp1->v[2]->p);
-printf("~1 full triangle area = %f\n",area);
-
-			/* If the triangle is not completely in, locate all the intersections */
-			/* between it and triangles in the other gamut */
-			if (nout != 0) {
-				gvert *opv;			/* Pointer to the one "in" or "out" vertex */
-				double parea = 0.0;	/* Total partial area */
-
-				/* Locate the odd point out of the three */
-				if (nout == 2) {		/* Look for the one "in" point */
-					for (j = 0; j < 3; j++) {
-						if (inout[j] == 0)
-							break;
-					}
-				} else {				/* Look for the one "out" point */
-					for (j = 0; j < 3; j++) {
-						if (inout[j] == 1)
-							break;
-					}
-				}
-				opv = tp1->v[j];
-
-				tp2 = s2->tris;
-				FOR_ALL_ITEMS(gtri, tp2) {		/* Other gamut triangles */
-					double isps[2][3];			/* Intersection npoints */
-					int nisps;					/* Number of intersection points */
-					double isp[3];				/* New intersection point */
-					int kk;
-		
-					/* Do a min/max intersection elimination test */
-					for (i = 0; i < 3; i++) {
-						if (tp2->mix[1][i] < tp1->mix[0][i]
-						 || tp2->mix[0][i] > tp1->mix[1][i])
-							break;			/* min/max don't overlap */
-					}
-					if (i < 3)
-						continue;			/* Skip this triangle, it can't intersect */
-
-//printf("~1 located possible intersecting triangle %d\n",tp2->n);
-
-					/* Locate intersection of all sides of one triangle with */
-					/* the plane of the other. Keep the two points of */
-					/* intersection that lie within the triangles. */
-					nisps = 0;
-//printf("~1 initial nisps = %d\n",nisps);
-					for (kk = 0; kk < 2; kk++) {
-						gamut *ts;					/* Triangle gamut */
-						gtri *tpa;					/* Triangle pointer */
-						gtri *tpb;					/* Other triangle pointer */
-						if (kk == 0) {
-							ts = s1; 
-							tpa = tp1;
-							tpb = tp2;
-						} else {
-							ts = s2; 
-							tpa = tp2;
-							tpb = tp1;
-						}
+	s1->prep_query(s1);
+	s2->prep_query(s2);
+
+	cx.s1 = s1;
+	cx.s2 = s2;
+	s1->getrange(s1, cx.min, cx.max);
+	s2->getrange(s2, min2, max2);
+	for (bvol = 1.0, j = 0; j < 3; j++) {
+		if (min2[j] > cx.min[j])
+			cx.min[j] = min2[j];
+		if (max2[j] < cx.max[j])
+			cx.max[j] = max2[j];
+		if (cx.max[j] <= cx.min[j])
+			return 0.0;			/* Bounding boxes don't overlap */
+		bvol *= cx.max[j] - cx.min[j];
+	}
 
-						/* For each edge */
-						for (j = 0; j < 3; j++) {
-							if (edge_tri_isect(ts, isp, tpa, tpb->e[j]) != 0) {
-//printf("~1 isect %f %f %f\n", isp[0],isp[1],isp[2]);
-								if (nisps < 2) {
-//printf("~1 added at %d\n",nisps);
-									icmAry2Ary(isps[nisps], isp);
-									nisps++;
-								} else {	/* Figure which one to replace */
-									int xx;
-									/* Replace the one closest to the new one, */
-									/* if the new one is further from the other one */
-
-									if (icmNorm33sq(isps[0], isp) < icmNorm33sq(isps[1], isp))
-										xx = 0;
-									else
-										xx = 1;
-
-									if (icmNorm33sq(isps[xx ^ 1], isp)
-									  > icmNorm33sq(isps[xx ^ 1], isps[xx])) {
-//printf("~1 replaced %d\n",xx);
-										icmAry2Ary(isps[xx], isp);
-									}
-								}
-							}
-						}
-					}
-					if (nisps == 0) {
-//printf("~1 no intersection\n");
-						continue;
-
-					} else if (nisps == 2)  {
-						double sarea;
-
-printf("~1 sub triangle =\n");
-printf("~1 com %f %f %f\n", opv->p[0], opv->p[1], opv->p[2]);
-printf("~1 1st %f %f %f\n", isps[0][0], isps[0][1], isps[0][2]);
-printf("~1 2nd %f %f %f\n", isps[1][0], isps[1][1], isps[1][2]);
-
-						/* Accumulate area of these two points + odd point */
-						sarea = tri_area(opv->p, isps[0], isps[1]);
-printf("~1 located intersecting triangle %d\n",tp2->n);
-printf("~1 got sub area %f\n",sarea);
-						parea += sarea;
-					} else {	/* Hmm */
-printf("~1 unexpectedly got %d intersection points in triangle\n",nisps);
-					}
-				} END_FOR_ALL_ITEMS(tp2);
-				
-				if (nout == 2) {		/* One "in" point */
-					area = parea;
-				} else {				/* One "out" point */
-					area = area - parea;
-				}
-printf("~1 partial area = %f\n",area);
-			}
+	if ((cx.hits = (int *)malloc(MC_RBLKS * sizeof(int))) == NULL) {
+		fprintf(stderr,"isect_volume_mc: malloc failed\n");
+		exit(-1);
+	}
 
-			/* Dot product between first vertex in triangle and the unit normal vector */
-			dp = tp1->v[0]->p[0] * tp1->pe[0]
-			   + tp1->v[0]->p[1] * tp1->pe[1]
-			   + tp1->v[0]->p[2] * tp1->pe[2];
+	pool = isect_pool();
 
-printf("~1 vector volume = %f\n",dp * area);
-			/* Accumulate gamut volume */
-			vol += dp * area;
+	vol = err = 0.0;
+	for (nb = 0; nb < MC_MAXBLKS; nb += MC_RBLKS) {
+		int i;
 
-		} END_FOR_ALL_ITEMS(tp1);
+		cx.bb = nb;
+		isect_run(pool, MC_RBLKS, isect_volume_mc_task, (void *)&cx);
+
+		for (i = 0; i < MC_RBLKS; i++)
+			tot += cx.hits[i];
+		nsamp += (double)MC_RBLKS * MC_BLK;
+
+		/* Volume and binomial standard error scaled to 95% confidence */
+		pp = tot/nsamp;
+		vol = bvol * pp;
+		err = 1.96 * bvol * sqrt(pp * (1.0 - pp)/nsamp);
+		DBG(("MC %.0f samples, vol %f +/- %f\n",nsamp,vol,err))
+
+		if ((nb + MC_RBLKS) >= MC_MINBLKS && err <= errb)
+			break;
 	}
+	if (pool != NULL)
+		pool->del(pool);
+	free(cx.hits);
 
-printf("~1 volume sum = %f\n",vol);
-	vol = fabs(vol)/3.0;
+	if (perr != NULL)
+		*perr = err;
 
-printf("~1 final volume = %f\n",vol);
 	return vol;
 }
 
-
@@ -60,6 +60,7 @@
 #include "gamut.h"
 #include "nearsmth.h"
 #include "vrml.h"
+#include "conv.h"
 
 #undef SAVE_VRMLS		/* [Und] Save various vrml's */
 #undef PLOT_SMOOTHING_CHANGE	/* [Und] Dest point change due to smoothing in "dst_smvec.wrl" */
@@ -1803,6 +1804,349 @@ int near_smooth_np(
 }
 
 
+/* ============================================ */
+/* The per point optimisation passes are independent of each other, */
+/* so they are run on a thread pool. Each thread works on its own */
+/* copy of the smthopt, since that holds the point being optimised. */
+
+/* Context for a multi-threaded optimisation pass */
+typedef struct {
+	smthopt *opts;		/* Master optimisation context */
+	nearsmth *smp;		/* Points being optimised */
+	int notrials;		/* Number of trials per point */
+	double *roffs;		/* [nmpts * notrials * 2] random start offsets */
+	gamut *shgam;		/* Shrunken destination gamut for pass 3 */
+	gamut *dgam;		/* Destination gamut for pass 3 nearest queries */
+} nearpassctx;
+
+/* Pre-compute the random trial starting offsets, in the same order */
+/* a serial pass would have consumed them, so that the result doesn't */
+/* depend on the number of threads. Return NULL on malloc failure. */
+static double *near_roffs(int nmpts, int notrials) {
+	double *roffs;
+	int i, n = nmpts * notrials * 2;
+
+	if ((roffs = (double *)malloc(n * sizeof(double))) == NULL) {
+		fprintf(stderr,"gamut map: Malloc of random offsets failed\n");
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		roffs[i] = d_rand(-20.0, 20.0);
+	return roffs;
+}
+
+/* Make sure the lazily created search structures of a gamut exist, */
+/* so that it can be queried from several threads. */
+static void near_prep_gam(gamut *g) {
+	g->prep_query(g);
+}
+
+/* Run an optimisation pass over points 0..n-1. Return nz on error */
+static int near_run(int n, int (*func)(void *cntx, int thix, int i0, int i1), void *cntx) {
+	athreadpool *pool;
+	int rv;
+
+	if ((pool = new_athreadpool(0)) == NULL || pool->nthr <= 1) {
+		if (pool != NULL)
+			pool->del(pool);
+		return func(cntx, 0, 0, n);
+	}
+	rv = pool->run(pool, n, func, cntx);
+	pool->del(pool);
+	return rv;
+}
+
+/* First pass, locate the weighted nearest point of points i0..i1-1 */
+static int near_pass1(void *cntx, int thix, int i0, int i1) {
+	nearpassctx *cx = (nearpassctx *)cntx;
+	smthopt opts = *cx->opts;				/* Per thread copy, since it holds point state */
+	nearsmth *smp = cx->smp;
+	double s[2] = { 20.0, 20.0 };		/* 2D search area */
+	double iv[3];						/* Initial start value */
+	double nv[2];						/* 2D New value */
+	double tp[3];						/* Resultint value */
+	int notrials = cx->notrials;
+	int i;
+
+	for (i = i0; i < i1; i++) {		/* Move all the points */
+		double *roff = cx->roffs + i * cx->notrials * 2;	/* Random start offsets */
+		double bnv[2];					/* Best 2d value */
+		double brv;						/* Best return value */
+		int trial;
+
+		opts.pass = 0;		/* Itteration pass */
+		opts.ix = i;		/* Point to optimise */
+		opts.p = &smp[i];
+
+		/* If the img point is within the destination, then we're */
+		/* expanding, so temporarily swap src and radial dest. */
+		/* (??? should we use the cvect() direction to determine swap, */
+		/*      rather than radial ???) */
+		smp[i].swap = 0;
+		if (opts.useexp && smp[i].dr > (smp[i].sr + 1e-9)) {
+			gamut *tt;
+			double dd;
+
+			smp[i].swap = 1;
+			tt = smp[i].dgam; smp[i].dgam = smp[i].sgam; smp[i].sgam = tt;
+
+			smp[i].dr = smp[i].sr;
+			smp[i].dv[0] = smp[i].sv[0];
+			smp[i].dv[1] = smp[i].sv[1];
+			smp[i].dv[2] = smp[i].sv[2];
+
+			smp[i].sr = smp[i].drr;
+			smp[i].sv[0] = smp[i].drv[0];
+			smp[i].sv[1] = smp[i].drv[1];
+			smp[i].sv[2] = smp[i].drv[2];
+		}
+		opts.wngam = smp[i].dgam;		/* Nearest to dgam */ 
+		opts.wn = smp[i].sv;			/* minimize optfunc1 sv -> dgam */
+		
+		/* Convert our start value from 3D to 2D for speed. */
+		icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
+		nv[0] = iv[0] = iv[1];
+		nv[1] = iv[1] = iv[2];
+
+		/* Do several trials from different starting points to avoid */
+		/* any local minima, particularly with nearest mapping. */
+		brv = 1e38;
+		for (trial = 0; trial < notrials; trial++) {
+			double rv;			/* Temporary */
+
+			/* Optimise the point */
+			if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc1, (void *)(&opts), NULL, NULL) == 0
+			    && rv < brv) {
+				brv = rv;
+//printf("~1 point %d, trial %d, new best %f\n",i,trial,sqrt(rv));
+				bnv[0] = nv[0];
+				bnv[1] = nv[1];
+			}
+//else printf("~1 powell failed with rv = %f\n",rv);
+			/* Adjust the starting point with a random offset to avoid local minima */
+			nv[0] = iv[0] + roff[2 * trial + 0];
+			nv[1] = iv[1] + roff[2 * trial + 1];
+		}
+		if (brv == 1e38) {		/* We failed to get a result */
+			fprintf(stderr, "multiple powells failed to get a result (1)\n");
+#ifdef DEBUG_POWELL_FAILS
+			/* Optimise the point with debug on */
+			opts.debug = 1;
+			icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
+			nv[0] = iv[0] = iv[1];
+			nv[1] = iv[1] = iv[2];
+			powell(NULL, 2, nv, s, 0.01, 1000, optfunc1, (void *)(&opts), NULL, NULL);
+#endif
+			return 1;
+		}
+	
+		/* Convert best result 2D -> 3D */
+		tp[2] = bnv[1];
+		tp[1] = bnv[0];
+		tp[0] = 50.0;
+		icmMul3By3x4(tp, smp[i].m3d, tp);
+
+		/* Remap it to the destinaton gamut surface */
+		smp[i].dgam->radial(smp[i].dgam, tp, tp);
+		icmCpy3(smp[i].aodv, tp);
+
+		/* Undo any swap */
+		if (smp[i].swap) {
+			gamut *tt;
+			double dd;
+
+			tt = smp[i].dgam; smp[i].dgam = smp[i].sgam; smp[i].sgam = tt;
+
+			/* We get the point on the real src gamut out when swap */
+			smp[i]._sv[0] = smp[i].aodv[0];
+			smp[i]._sv[1] = smp[i].aodv[1];
+			smp[i]._sv[2] = smp[i].aodv[2];
+
+			/* So we need to compute cusp mapped sv */
+			comp_ce(&opts, smp[i].sv, smp[i]._sv, &smp[i].wt);
+			smp[i].sr = icmNorm33(smp[i].sv, smp[i].sgam->cent);
+
+			VB(("Exp Src %d = %f %f %f\n",i,smp[i]._sv[0],smp[i]._sv[1],smp[i]._sv[2]));
+			smp[i].aodv[0] = smp[i].drv[0];
+			smp[i].aodv[1] = smp[i].drv[1];
+			smp[i].aodv[2] = smp[i].drv[2];
+		}
+	}
+	return 0;
+}
+
+/* Second pass, locate the optimized overall weighted point of points i0..i1-1 */
+static int near_pass2(void *cntx, int thix, int i0, int i1) {
+	nearpassctx *cx = (nearpassctx *)cntx;
+	smthopt opts = *cx->opts;				/* Per thread copy, since it holds point state */
+	nearsmth *smp = cx->smp;
+	double s[2] = { 20.0, 20.0 };		/* 2D search area */
+	double iv[3];						/* Initial start value */
+	double nv[2];						/* 2D New value */
+	double tp[3];						/* Resultint value */
+	int notrials = cx->notrials;
+	int i;
+
+	for (i = i0; i < i1; i++) {		/* Move all the points */
+		double *roff = cx->roffs + i * cx->notrials * 2;	/* Random start offsets */
+		double bnv[2];					/* Best 2d value */
+		double brv;						/* Best return value */
+		int trial;
+
+		opts.pass = 0;		/* Itteration pass */
+		opts.ix = i;		/* Point to optimise */
+		opts.p = &smp[i];
+
+//printf("~1 point %d, sv %f %f %f\n",i,smp[i].sv[0],smp[i].sv[1],smp[i].sv[2]);
+
+		/* Convert our start value from 3D to 2D for speed. */
+		icmMul3By3x4(iv, smp[i].m2d, smp[i].aodv);
+
+		nv[0] = iv[0] = iv[1];
+		nv[1] = iv[1] = iv[2];
+//printf("~1 point %d, iv %f %f %f, 2D %f %f\n",i, smp[i].aodv[0], smp[i].aodv[1], smp[i].aodv[2], iv[0], iv[1]);
+
+		/* Do several trials from different starting points to avoid */
+		/* any local minima, particularly with nearest mapping. */
+		brv = 1e38;
+		for (trial = 0; trial < notrials; trial++) {
+			double rv;			/* Temporary */
+
+			/* Optimise the point */
+			if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc2, (void *)(&opts), NULL, NULL) == 0
+			    && rv < brv) {
+				brv = rv;
+//printf("~1 point %d, trial %d, new best %f at xy %f %f\n",i,trial,sqrt(rv), nv[0],nv[1]);
+				bnv[0] = nv[0];
+				bnv[1] = nv[1];
+			}
+//else printf("~1 powell failed with rv = %f\n",rv);
+			/* Adjust the starting point with a random offset to avoid local minima */
+			nv[0] = iv[0] + roff[2 * trial + 0];
+			nv[1] = iv[1] + roff[2 * trial + 1];
+		}
+		if (brv == 1e38) {		/* We failed to get a result */
+			fprintf(stderr, "multiple powells failed to get a result (2)\n");
+#ifdef DEBUG_POWELL_FAILS
+			/* Optimise the point with debug on */
+			opts.debug = 1;
+			icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
+			nv[0] = iv[0] = iv[1];
+			nv[1] = iv[1] = iv[2];
+			powell(NULL, 2, nv, s, 0.01, 1000, optfunc2, (void *)(&opts), NULL, NULL);
+#endif
+			return 1;
+		}
+	
+		/* Convert best result 3D -> 2D */
+		tp[2] = bnv[1];
+		tp[1] = bnv[0];
+		tp[0] = 50.0;
+		icmMul3By3x4(tp, smp[i].m3d, tp);
+
+		/* Remap it to the destinaton gamut surface */
+		smp[i].dgam->radial(smp[i].dgam, tp, tp);
+
+		icmCpy3(smp[i].dv, tp);			/* Default current solution */
+		icmCpy3(smp[i].nrdv, tp);		/* Non smoothed result */
+		icmCpy3(smp[i].anv, tp);		/* Starting point for smoothing */
+		smp[i].dr = icmNorm33(smp[i].dv, smp[i].dgam->cent);
+//printf("~1 %d: dv %f %f %f\n", i, smp[i].dv[0], smp[i].dv[1], smp[i].dv[2]);
+
+	}
+	return 0;
+}
+
+/* Locate the closest point on the shrunken gamut of points i0..i1-1 */
+static int near_pass3(void *cntx, int thix, int i0, int i1) {
+	nearpassctx *cx = (nearpassctx *)cntx;
+	smthopt opts = *cx->opts;				/* Per thread copy, since it holds point state */
+	nearsmth *smp = cx->smp;
+	double s[2] = { 20.0, 20.0 };		/* 2D search area */
+	double iv[3];						/* Initial start value */
+	double nv[2];						/* 2D New value */
+	double tp[3];						/* Resultint value */
+	int notrials = cx->notrials;
+	gquery *qc;							/* nearest_q() context for this thread */
+	int i;
+
+	if ((qc = cx->dgam->new_query(cx->dgam)) == NULL)
+		return 1;
+
+	for (i = i0; i < i1; i++) {		/* Move all the points */
+		gtri *ctri = NULL;
+		double tmp[3];
+		double *roff = cx->roffs + i * cx->notrials * 2;	/* Random start offsets */
+		double bnv[2];					/* Best 2d value */
+		double brv;						/* Best return value */
+		int trial;
+
+		opts.pass = 0;		/* Itteration pass */
+		opts.ix = i;		/* Point to optimise */
+		opts.p = &smp[i];
+		opts.wn = smp[i].dv;		/* minimize optfunc1a dv -> shgam */
+
+		/* Convert our start value from 3D to 2D for speed. */
+		icmMul3By3x4(iv, smp[i].m2d, smp[i].nrdv);
+		nv[0] = iv[0] = iv[1];
+		nv[1] = iv[1] = iv[2];
+
+		/* Do several trials from different starting points to avoid */
+		/* any local minima, particularly with nearest mapping. */
+		brv = 1e38;
+		for (trial = 0; trial < notrials; trial++) {
+			double rv;			/* Temporary */
+
+			/* Optimise the point */
+			if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc1a, (void *)(&opts), NULL, NULL) == 0
+			    && rv < brv) {
+				brv = rv;
+				bnv[0] = nv[0];
+				bnv[1] = nv[1];
+			}
+			/* Adjust the starting point with a random offset to avoid local minima */
+			nv[0] = iv[0] + roff[2 * trial + 0];
+			nv[1] = iv[1] + roff[2 * trial + 1];
+		}
+		if (brv == 1e38) {		/* We failed to get a result */
+			fprintf(stderr, "multiple powells failed to get a result (3)\n");
+#ifdef DEBUG_POWELL_FAILS
+			/* Optimise the point with debug on */
+			opts.debug = 1;
+			icmMul3By3x4(iv, smp[i].m2d, smp[i].nrdv);
+			nv[0] = iv[0] = iv[1];
+			nv[1] = iv[1] = iv[2];
+			powell(NULL, 2, nv, s, 0.01, 1000, optfunc1a, (void *)(&opts), NULL, NULL);
+#endif
+			qc->del(qc);
+			return 1;
+		}
+	
+		/* Convert best result 2D -> 3D */
+		tp[2] = bnv[1];
+		tp[1] = bnv[0];
+		tp[0] = 50.0;
+		icmMul3By3x4(tp, smp[i].m3d, tp);
+
+		/* Remap it to the destinaton gamut surface */
+		cx->shgam->radial(cx->shgam, tp, tp);
+
+		/* Compute mapping vector from dst to shdst */
+		icmSub3(smp[i].temp, tp, smp[i].nrdv);
+
+		/* In case shrunk vector is very short, add a small part */
+		/* of the nearest normal.  */
+		smp[i].dgam->nearest_q(smp[i].dgam, qc, NULL, smp[i].nrdv, &ctri);
+		icmScale3(tmp, ctri->pe, 0.1);		/* Scale to small inwards */
+		icmAdd3(smp[i].temp, smp[i].temp, tmp);
+
+		/* evector */
+		icmNormalize3(smp[i].temp, smp[i].temp, 1.0);
+	}
+	qc->del(qc);
+	return 0;
+}
+
 /* ============================================ */
 /* Return a list of points. Free list after use */
 /* Return NULL on error */
@@ -2384,125 +2728,29 @@ datao map_oh
 	if (verb) printf("Optimizing source to destination mapping...\n");
 
 	VA(("Doing first pass to locate the nearest point\n"));
+	near_prep_gam(src_gam);
+	near_prep_gam(dst_gam);
 	/* First pass to locate the weighted nearest point, to use in subsequent passes */
 	{
-		double s[2] = { 20.0, 20.0 };		/* 2D search area */
-		double iv[3];						/* Initial start value */
-		double nv[2];						/* 2D New value */
-		double tp[3];						/* Resultint value */
-		double ne;							/* New error */
-		int notrials = NO_TRIALS;
-
-		for (i = 0; i < nmpts; i++) {		/* Move all the points */
-			double bnv[2];					/* Best 2d value */
-			double brv;						/* Best return value */
-			int trial;
-			double mv;
-
-			opts.pass = 0;		/* Itteration pass */
-			opts.ix = i;		/* Point to optimise */
-			opts.p = &smp[i];
-
-			/* If the img point is within the destination, then we're */
-			/* expanding, so temporarily swap src and radial dest. */
-			/* (??? should we use the cvect() direction to determine swap, */
-			/*      rather than radial ???) */
-			smp[i].swap = 0;
-			if (useexp && smp[i].dr > (smp[i].sr + 1e-9)) {
-				gamut *tt;
-				double dd;
-
-				smp[i].swap = 1;
-				tt = smp[i].dgam; smp[i].dgam = smp[i].sgam; smp[i].sgam = tt;
-
-				smp[i].dr = smp[i].sr;
-				smp[i].dv[0] = smp[i].sv[0];
-				smp[i].dv[1] = smp[i].sv[1];
-				smp[i].dv[2] = smp[i].sv[2];
-
-				smp[i].sr = smp[i].drr;
-				smp[i].sv[0] = smp[i].drv[0];
-				smp[i].sv[1] = smp[i].drv[1];
-				smp[i].sv[2] = smp[i].drv[2];
-			}
-			opts.wngam = smp[i].dgam;		/* Nearest to dgam */ 
-			opts.wn = smp[i].sv;			/* minimize optfunc1 sv -> dgam */
-			
-			/* Convert our start value from 3D to 2D for speed. */
-			icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
-			nv[0] = iv[0] = iv[1];
-			nv[1] = iv[1] = iv[2];
-
-			/* Do several trials from different starting points to avoid */
-			/* any local minima, particularly with nearest mapping. */
-			brv = 1e38;
-			for (trial = 0; trial < notrials; trial++) {
-				double rv;			/* Temporary */
-
-				/* Optimise the point */
-				if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc1, (void *)(&opts), NULL, NULL) == 0
-				    && rv < brv) {
-					brv = rv;
-//printf("~1 point %d, trial %d, new best %f\n",i,trial,sqrt(rv));
-					bnv[0] = nv[0];
-					bnv[1] = nv[1];
-				}
-//else printf("~1 powell failed with rv = %f\n",rv);
-				/* Adjust the starting point with a random offset to avoid local minima */
-				nv[0] = iv[0] + d_rand(-20.0, 20.0);
-				nv[1] = iv[1] + d_rand(-20.0, 20.0);
-			}
-			if (brv == 1e38) {		/* We failed to get a result */
-				fprintf(stderr, "multiple powells failed to get a result (1)\n");
-#ifdef DEBUG_POWELL_FAILS
-				/* Optimise the point with debug on */
-				opts.debug = 1;
-				icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
-				nv[0] = iv[0] = iv[1];
-				nv[1] = iv[1] = iv[2];
-				powell(NULL, 2, nv, s, 0.01, 1000, optfunc1, (void *)(&opts), NULL, NULL);
-#endif
-				if (src_gam != sc_gam)
-					src_gam->del(src_gam);
-				if (dst_gam != src_gam && dst_gam != dc_gam)
-					dst_gam->del(dst_gam);
-				free_nearsmth(smp, nmpts);
-				*npp = 0;
-				return NULL;
-			}
-		
-			/* Convert best result 2D -> 3D */
-			tp[2] = bnv[1];
-			tp[1] = bnv[0];
-			tp[0] = 50.0;
-			icmMul3By3x4(tp, smp[i].m3d, tp);
-
-			/* Remap it to the destinaton gamut surface */
-			smp[i].dgam->radial(smp[i].dgam, tp, tp);
-			icmCpy3(smp[i].aodv, tp);
-
-			/* Undo any swap */
-			if (smp[i].swap) {
-				gamut *tt;
-				double dd;
-
-				tt = smp[i].dgam; smp[i].dgam = smp[i].sgam; smp[i].sgam = tt;
-
-				/* We get the point on the real src gamut out when swap */
-				smp[i]._sv[0] = smp[i].aodv[0];
-				smp[i]._sv[1] = smp[i].aodv[1];
-				smp[i]._sv[2] = smp[i].aodv[2];
-
-				/* So we need to compute cusp mapped sv */
-				comp_ce(&opts, smp[i].sv, smp[i]._sv, &smp[i].wt);
-				smp[i].sr = icmNorm33(smp[i].sv, smp[i].sgam->cent);
-
-				VB(("Exp Src %d = %f %f %f\n",i,smp[i]._sv[0],smp[i]._sv[1],smp[i]._sv[2]));
-				smp[i].aodv[0] = smp[i].drv[0];
-				smp[i].aodv[1] = smp[i].drv[1];
-				smp[i].aodv[2] = smp[i].drv[2];
-			}
+		nearpassctx cx;
+
+		cx.opts = &opts;
+		cx.smp = smp;
+		cx.notrials = NO_TRIALS;
+		cx.shgam = NULL;
+		cx.dgam = NULL;
+		if ((cx.roffs = near_roffs(nmpts, cx.notrials)) == NULL
+		 || near_run(nmpts, near_pass1, (void *)&cx) != 0) {
+			free(cx.roffs);
+			if (src_gam != sc_gam)
+				src_gam->del(src_gam);
+			if (dst_gam != src_gam && dst_gam != dc_gam)
+				dst_gam->del(dst_gam);
+			free_nearsmth(smp, nmpts);
+			*npp = 0;
+			return NULL;
 		}
+		free(cx.roffs);
 	}
 
 	VA(("Locating weighted mapping vectors without smoothing\n"));
@@ -2510,86 +2758,25 @@ datao map_oh
 	/* Second pass to locate the optimized overall weighted point nrdv[], */
 	/* which is a balance of absolute error, radial error, depth room weighting */
 	{
-		double s[2] = { 20.0, 20.0 };		/* 2D search area */
-		double iv[3];						/* Initial start value */
-		double nv[2];						/* 2D New value */
-		double tp[3];						/* Resultint value */
-		double ne;							/* New error */
-		int notrials = NO_TRIALS;
-
-		for (i = 0; i < nmpts; i++) {		/* Move all the points */
-			double bnv[2];					/* Best 2d value */
-			double brv;						/* Best return value */
-			int trial;
-			double mv;
-
-			opts.pass = 0;		/* Itteration pass */
-			opts.ix = i;		/* Point to optimise */
-			opts.p = &smp[i];
-
-//printf("~1 point %d, sv %f %f %f\n",i,smp[i].sv[0],smp[i].sv[1],smp[i].sv[2]);
-
-			/* Convert our start value from 3D to 2D for speed. */
-			icmMul3By3x4(iv, smp[i].m2d, smp[i].aodv);
-
-			nv[0] = iv[0] = iv[1];
-			nv[1] = iv[1] = iv[2];
-//printf("~1 point %d, iv %f %f %f, 2D %f %f\n",i, smp[i].aodv[0], smp[i].aodv[1], smp[i].aodv[2], iv[0], iv[1]);
-
-			/* Do several trials from different starting points to avoid */
-			/* any local minima, particularly with nearest mapping. */
-			brv = 1e38;
-			for (trial = 0; trial < notrials; trial++) {
-				double rv;			/* Temporary */
-
-				/* Optimise the point */
-				if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc2, (void *)(&opts), NULL, NULL) == 0
-				    && rv < brv) {
-					brv = rv;
-//printf("~1 point %d, trial %d, new best %f at xy %f %f\n",i,trial,sqrt(rv), nv[0],nv[1]);
-					bnv[0] = nv[0];
-					bnv[1] = nv[1];
-				}
-//else printf("~1 powell failed with rv = %f\n",rv);
-				/* Adjust the starting point with a random offset to avoid local minima */
-				nv[0] = iv[0] + d_rand(-20.0, 20.0);
-				nv[1] = iv[1] + d_rand(-20.0, 20.0);
-			}
-			if (brv == 1e38) {		/* We failed to get a result */
-				fprintf(stderr, "multiple powells failed to get a result (2)\n");
-#ifdef DEBUG_POWELL_FAILS
-				/* Optimise the point with debug on */
-				opts.debug = 1;
-				icmMul3By3x4(iv, smp[i].m2d, smp[i].dv);
-				nv[0] = iv[0] = iv[1];
-				nv[1] = iv[1] = iv[2];
-				powell(NULL, 2, nv, s, 0.01, 1000, optfunc2, (void *)(&opts), NULL, NULL);
-#endif
-				if (src_gam != sc_gam)
-					src_gam->del(src_gam);
-				if (dst_gam != src_gam && dst_gam != dc_gam)
-					dst_gam->del(dst_gam);
-				free_nearsmth(smp, nmpts);
-				*npp = 0;
-				return NULL;
-			}
-		
-			/* Convert best result 3D -> 2D */
-			tp[2] = bnv[1];
-			tp[1] = bnv[0];
-			tp[0] = 50.0;
-			icmMul3By3x4(tp, smp[i].m3d, tp);
-
-			/* Remap it to the destinaton gamut surface */
-			smp[i].dgam->radial(smp[i].dgam, tp, tp);
-
-			icmCpy3(smp[i].dv, tp);			/* Default current solution */
-			icmCpy3(smp[i].nrdv, tp);		/* Non smoothed result */
-			icmCpy3(smp[i].anv, tp);		/* Starting point for smoothing */
-			smp[i].dr = icmNorm33(smp[i].dv, smp[i].dgam->cent);
-//printf("~1 %d: dv %f %f %f\n", i, smp[i].dv[0], smp[i].dv[1], smp[i].dv[2]);
-
+		nearpassctx cx;
+
+		cx.opts = &opts;
+		cx.smp = smp;
+		cx.notrials = NO_TRIALS;
+		cx.shgam = NULL;
+		cx.dgam = NULL;
+		if ((cx.roffs = near_roffs(nmpts, cx.notrials)) == NULL
+		 || near_run(nmpts, near_pass2, (void *)&cx) != 0) {
+			free(cx.roffs);
+			if (src_gam != sc_gam)
+				src_gam->del(src_gam);
+			if (dst_gam != src_gam && dst_gam != dc_gam)
+				dst_gam->del(dst_gam);
+			free_nearsmth(smp, nmpts);
+			*npp = 0;
+			return NULL;
 		}
+		free(cx.roffs);
 	}
 
 	/* Make sure the input and output ranges encompas the points */ 
@@ -2672,13 +2859,6 @@ datao map_oh
 		double p[3], p2[3], rad;
 		int i;
 
-		double s[2] = { 20.0, 20.0 };		/* 2D search area */
-		double iv[3];						/* Initial start value */
-		double nv[2];						/* 2D New value */
-		double tp[3];						/* Resultint value */
-		double ne;							/* New error */
-		int notrials = NO_TRIALS;
-
 		cow *gpnts = NULL;	/* Mapping points to create 3D -> 3D mapping */
 		datai il, ih;
 		datao ol, oh;
@@ -2742,51 +2922,19 @@ datao map_oh
 		/* Now locate the closest points on the shrunken gamut */
 		/* and set them up for creating a rspl */
 		opts.wngam = shgam;
-		for (i = 0; i < nmpts; i++) {		/* Move all the points */
-			gtri *ctri = NULL;
-			double tmp[3];
-			double bnv[2];					/* Best 2d value */
-			double brv;						/* Best return value */
-			int trial;
-			double mv;
-
-			opts.pass = 0;		/* Itteration pass */
-			opts.ix = i;		/* Point to optimise */
-			opts.p = &smp[i];
-			opts.wn = smp[i].dv;		/* minimize optfunc1a dv -> shgam */
-
-			/* Convert our start value from 3D to 2D for speed. */
-			icmMul3By3x4(iv, smp[i].m2d, smp[i].nrdv);
-			nv[0] = iv[0] = iv[1];
-			nv[1] = iv[1] = iv[2];
-
-			/* Do several trials from different starting points to avoid */
-			/* any local minima, particularly with nearest mapping. */
-			brv = 1e38;
-			for (trial = 0; trial < notrials; trial++) {
-				double rv;			/* Temporary */
-
-				/* Optimise the point */
-				if (powell(&rv, 2, nv, s, 0.01, 1000, optfunc1a, (void *)(&opts), NULL, NULL) == 0
-				    && rv < brv) {
-					brv = rv;
-					bnv[0] = nv[0];
-					bnv[1] = nv[1];
-				}
-				/* Adjust the starting point with a random offset to avoid local minima */
-				nv[0] = iv[0] + d_rand(-20.0, 20.0);
-				nv[1] = iv[1] + d_rand(-20.0, 20.0);
-			}
-			if (brv == 1e38) {		/* We failed to get a result */
-				fprintf(stderr, "multiple powells failed to get a result (3)\n");
-#ifdef DEBUG_POWELL_FAILS
-				/* Optimise the point with debug on */
-				opts.debug = 1;
-				icmMul3By3x4(iv, smp[i].m2d, smp[i].nrdv);
-				nv[0] = iv[0] = iv[1];
-				nv[1] = iv[1] = iv[2];
-				powell(NULL, 2, nv, s, 0.01, 1000, optfunc1a, (void *)(&opts), NULL, NULL);
-#endif
+		near_prep_gam(shgam);
+		{
+			nearpassctx cx;
+
+			cx.opts = &opts;
+			cx.smp = smp;
+			cx.notrials = NO_TRIALS;
+			cx.shgam = shgam;
+			cx.dgam = dst_gam;
+			if ((cx.roffs = near_roffs(nmpts, cx.notrials)) == NULL
+			 || near_run(nmpts, near_pass3, (void *)&cx) != 0) {
+				free(cx.roffs);
+				free(gpnts);
 				shgam->del(shgam);		/* Done with this */
 				if (src_gam != sc_gam)
 					src_gam->del(src_gam);
@@ -2796,29 +2944,11 @@ datao map_oh
 				*npp = 0;
 				return NULL;
 			}
-		
-			/* Convert best result 2D -> 3D */
-			tp[2] = bnv[1];
-			tp[1] = bnv[0];
-			tp[0] = 50.0;
-			icmMul3By3x4(tp, smp[i].m3d, tp);
-
-			/* Remap it to the destinaton gamut surface */
-			shgam->radial(shgam, tp, tp);
-
-			/* Compute mapping vector from dst to shdst */
-			icmSub3(smp[i].temp, tp, smp[i].nrdv);
-
-			/* In case shrunk vector is very short, add a small part */
-			/* of the nearest normal.  */
-			smp[i].dgam->nearest_tri(smp[i].dgam, NULL, smp[i].nrdv, &ctri);
-			icmScale3(tmp, ctri->pe, 0.1);		/* Scale to small inwards */
-			icmAdd3(smp[i].temp, smp[i].temp, tmp);
-
-			/* evector */
-			icmNormalize3(smp[i].temp, smp[i].temp, 1.0);
+			free(cx.roffs);
+		}
 
-			/* Place it in rspl setup array */
+		/* Place them in rspl setup array */
+		for (i = 0; i < nmpts; i++) {
 			icmCpy3(gpnts[i].p, smp[i].nrdv);
 			icmCpy3(gpnts[i].v, smp[i].temp);
 			gpnts[i].w = 1.0;
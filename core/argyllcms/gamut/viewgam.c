@@ -62,13 +62,14 @@ void usage(char *diag, ...) {
 	fprintf(stderr," -t trans       Set transparency from 0.0 (opaque) to 1.0 (invisible)\n"); 
 	fprintf(stderr," -w             Show as a wireframe\n");
 	fprintf(stderr," -s             Show as a solid surace\n");
-	fprintf(stderr," infile.gam     Name of .gam file\n");
+	fprintf(stderr," infile.gam     Name of .gam or binary gamut file\n");
 	fprintf(stderr,"                Repeat above for each input file\n");
 	fprintf(stderr,"                Default is colored solid, then white, red etc. wireframes.\n\n");
 	fprintf(stderr," -n             Don't add Lab axes\n");
 	fprintf(stderr," -k             Add markers for prim. & sec. \"cusp\" points\n");
 	fprintf(stderr," -i             Compute and print intersecting volume of first 2 gamuts\n");
 	fprintf(stderr," -I isect.gam   Same as -i, but save intersection gamut to isect.gam\n");
+	fprintf(stderr," -e err         Same as -i, but estimate volume by sampling to within err cubic units\n");
 	fprintf(stderr,"                (Set env. ARGYLL_3D_DISP_FORMAT to VRML, X3D or X3DOM to change format)\n");
 	fprintf(stderr," -o             Print & plot points on first gamut that are outside second gamut\n");
 	fprintf(stderr," outfile        Base name of output %s file\n",vrml_ext());
@@ -169,6 +170,150 @@ static void set_default(gamdisp *gds, int n) {
 
 static int g_vect_isect(gamut *s, double *p, double *p1, double *p2);
 
+/* Read the surface of a CGATS .gam or binary gamut file. */
+/* Return allocated vertex and triangle arrays, and up to 6 cusps. */
+static void read_gam_surface(
+char *in_name,
+int *pnverts, double (**pverts)[3],
+int *pntris, int (**ptris)[3],
+int *pncusps, double cusps[6][3]
+) {
+	int i, j;
+	int nverts;
+	int ntris;
+	double (*verts)[3];
+	int (*tris)[3];
+
+	if (gamut_isbgam(in_name)) {
+		gamut *gg;
+		gtri *tp;
+
+		if ((gg = new_gamut(0.0, 0, 0)) == NULL)
+			error("Creating gamut object failed");
+
+		if (gg->read_gam(gg, in_name))
+			error("Input file '%s' read failed",in_name);
+
+		nverts = gg->nv;
+		ntris = 0;
+		tp = gg->tris;
+		FOR_ALL_ITEMS(gtri, tp) {
+			ntris++;
+		} END_FOR_ALL_ITEMS(tp);
+
+		if ((verts = (double (*)[3])malloc(nverts * sizeof(double [3]))) == NULL
+		 || (tris = (int (*)[3])malloc(ntris * sizeof(int [3]))) == NULL)
+			error("Malloc failed on gamut surface");
+
+		for (i = 0; i < nverts; i++) {
+			for (j = 0; j < 3; j++)
+				verts[i][j] = gg->verts[i]->p[j];
+		}
+		i = 0;
+		tp = gg->tris;
+		FOR_ALL_ITEMS(gtri, tp) {
+			for (j = 0; j < 3; j++)
+				tris[i][j] = tp->v[j]->tn;
+			i++;
+		} END_FOR_ALL_ITEMS(tp);
+
+		if (gg->getcusps(gg, cusps) == 0)
+			*pncusps = 6;
+		else
+			*pncusps = 0;
+
+		gg->del(gg);
+
+	} else {
+		cgats *pp;
+		int Lf, af, bf;			/* Fields holding L, a & b data */
+		int v0f, v1f, v2f;		/* Fields holding vertices 0, 1 & 2 */
+		int kk;
+		char buf1[50];
+		char *cnames[6] = { "RED", "YELLOW", "GREEN", "CYAN", "BLUE", "MAGENTA" };
+
+		pp = new_cgats();	/* Create a CGATS structure */
+	
+		/* Setup to cope with a gamut file */
+		pp->add_other(pp, "GAMUT");
+	
+		if (pp->read_name(pp, in_name))
+			error("Input file '%s' error : %s",in_name, pp->e.m);
+	
+		if (pp->t[0].tt != tt_other || pp->t[0].oi != 0)
+			error("Input file isn't a GAMUT format file");
+		if (pp->ntables != 2)
+			error("Input file doesn't contain exactly two tables");
+
+		if ((nverts = pp->t[0].nsets) <= 0)
+			error("No vertices");
+		if ((ntris = pp->t[1].nsets) <= 0)
+			error("No triangles");
+
+		if ((Lf = pp->find_field(pp, 0, "LAB_L")) < 0)
+			error("Input file doesn't contain field LAB_L");
+		if (pp->t[0].ftype[Lf] != r_t)
+			error("Field LAB_L is wrong type");
+		if ((af = pp->find_field(pp, 0, "LAB_A")) < 0)
+			error("Input file doesn't contain field LAB_A");
+		if (pp->t[0].ftype[af] != r_t)
+			error("Field LAB_A is wrong type");
+		if ((bf = pp->find_field(pp, 0, "LAB_B")) < 0)
+			error("Input file doesn't contain field LAB_B");
+		if (pp->t[0].ftype[bf] != r_t)
+			error("Field LAB_B is wrong type");
+
+		if ((v0f = pp->find_field(pp, 1, "VERTEX_0")) < 0)
+			error("Input file doesn't contain field VERTEX_0");
+		if (pp->t[1].ftype[v0f] != i_t)
+			error("Field VERTEX_0 is wrong type");
+		if ((v1f = pp->find_field(pp, 1, "VERTEX_1")) < 0)
+			error("Input file doesn't contain field VERTEX_1");
+		if (pp->t[1].ftype[v1f] != i_t)
+			error("Field VERTEX_1 is wrong type");
+		if ((v2f = pp->find_field(pp, 1, "VERTEX_2")) < 0)
+			error("Input file doesn't contain field VERTEX_2");
+		if (pp->t[1].ftype[v2f] != i_t)
+			error("Field VERTEX_2 is wrong type");
+
+		if ((verts = (double (*)[3])malloc(nverts * sizeof(double [3]))) == NULL
+		 || (tris = (int (*)[3])malloc(ntris * sizeof(int [3]))) == NULL)
+			error("Malloc failed on gamut surface");
+
+		for (i = 0; i < nverts; i++) {
+			verts[i][0] = *((double *)pp->t[0].fdata[i][Lf]);
+			verts[i][1] = *((double *)pp->t[0].fdata[i][af]);
+			verts[i][2] = *((double *)pp->t[0].fdata[i][bf]);
+		}
+
+		for (i = 0; i < ntris; i++) {
+			tris[i][0] = *((int *)pp->t[1].fdata[i][v0f]);
+			tris[i][1] = *((int *)pp->t[1].fdata[i][v1f]);
+			tris[i][2] = *((int *)pp->t[1].fdata[i][v2f]);
+		}
+
+		/* See if there are cusp values */
+		for (i = 0; i < 6; i++) {
+			sprintf(buf1,"CUSP_%s", cnames[i]);
+			if ((kk = pp->find_kword(pp, 0, buf1)) < 0)
+				break;
+
+			if (sscanf(pp->t[0].kdata[kk], "%lf %lf %lf",
+		           &cusps[i][0], &cusps[i][1], &cusps[i][2]) != 3) {
+				break;
+			}
+		}
+		*pncusps = i;
+
+		pp->del(pp);		/* Clean up */
+	}
+
+	*pnverts = nverts;
+	*pverts = verts;
+	*pntris = ntris;
+	*ptris = tris;
+}
+
 int
 main(int argc, char *argv[]) {
 	int fa, nfa, mfa;		/* argument we're looking at */
@@ -177,6 +322,7 @@ main(int argc, char *argv[]) {
 	int doaxes = 1;
 	int docusps = 0;
 	int isect = 0;
+	double isecterr = 0.0;	/* Sampled intersecting volume error bound, 0 if not sampled */
 	int dooogamut = 0;
 	vrml *wrl;
 	char out_name[MAXNAMEL+1+10];
@@ -292,16 +438,27 @@ main(int argc, char *argv[]) {
 			}
 
 			/* Print intersecting volume */
-			else if (argv[fa][1] == 'i') {
+			else if (argv[fa][1] == 'i' || argv[fa][1] == 'I') {
 				isect = 1;
 
 				/* There is an intersection output gamut file */
-				if (argv[fa][1] == 'I' && na != NULL) {
+				if (argv[fa][1] == 'I') {
 					fa = nfa;
+					if (na == NULL) usage("Expect argument after flag -I");
 					strncpy(iout_name, na, MAXNAMEL); iout_name[MAXNAMEL] = '\000';
 				}
 			}
 
+			/* Print estimated intersecting volume */
+			else if (argv[fa][1] == 'e') {
+				fa = nfa;
+				if (na == NULL) usage("Expect argument after flag -e");
+				isecterr = atof(na);
+				if (isecterr <= 0.0)
+					usage("Argument after flag -e must be > 0.0");
+				isect = 1;
+			}
+
 			/* Print out of gamut points */
 			else if (argv[fa][1] == 'o') {
 				dooogamut = 1;
@@ -328,6 +485,9 @@ main(int argc, char *argv[]) {
 	if (ng < 2)
 		usage("Not enough arguments to specify output %s files",vrml_format());
 
+	if (iout_name[0] != '\000' && isecterr > 0.0)
+		usage("Can't save a sampled intersection gamut (-I with -e)");
+
 
 	strncpy(out_name, gds[--ng].in_name,MAXNAMEL); out_name[MAXNAMEL] = '\000';
 
@@ -349,80 +509,33 @@ main(int argc, char *argv[]) {
 	/* Read each input in turn */
 	for (n = 0; n < ng; n++) {
 		int i;
-		cgats *pp;
 		int nverts;
 		int ntris;
-		int Lf, af, bf;			/* Fields holding L, a & b data */
-		int v0f, v1f, v2f;		/* Fields holding vertices 0, 1 & 2 */
+		double (*verts)[3];		/* Vertex locations */
+		int (*tris)[3];			/* Triangle vertex indexes */
+		int ncusps;
+		double cusps[6][3];
 
-		pp = new_cgats();	/* Create a CGATS structure */
-	
-		/* Setup to cope with a gamut file */
-		pp->add_other(pp, "GAMUT");
-	
-		if (pp->read_name(pp, gds[n].in_name))
-			error("Input file '%s' error : %s",gds[n].in_name, pp->e.m);
-	
-		if (pp->t[0].tt != tt_other || pp->t[0].oi != 0)
-			error("Input file isn't a GAMUT format file");
-		if (pp->ntables != 2)
-			error("Input file doesn't contain exactly two tables");
-
-		if ((nverts = pp->t[0].nsets) <= 0)
-			error("No vertices");
-		if ((ntris = pp->t[1].nsets) <= 0)
-			error("No triangles");
-
-		if ((Lf = pp->find_field(pp, 0, "LAB_L")) < 0)
-			error("Input file doesn't contain field LAB_L");
-		if (pp->t[0].ftype[Lf] != r_t)
-			error("Field LAB_L is wrong type");
-		if ((af = pp->find_field(pp, 0, "LAB_A")) < 0)
-			error("Input file doesn't contain field LAB_A");
-		if (pp->t[0].ftype[af] != r_t)
-			error("Field LAB_A is wrong type");
-		if ((bf = pp->find_field(pp, 0, "LAB_B")) < 0)
-			error("Input file doesn't contain field LAB_B");
-		if (pp->t[0].ftype[bf] != r_t)
-			error("Field LAB_B is wrong type");
+		read_gam_surface(gds[n].in_name, &nverts, &verts, &ntris, &tris, &ncusps, cusps);
 
 		wrl->start_line_set(wrl, 0);
 
 		/* Spit out the point values, in order. */
 		/* Note that a->x, b->y, L->z */
-		for (i = 0; i < nverts; i++) {
-			double pos[3];
-			pos[0] = *((double *)pp->t[0].fdata[i][Lf]);
-			pos[1] = *((double *)pp->t[0].fdata[i][af]);
-			pos[2] = *((double *)pp->t[0].fdata[i][bf]);
-			
-			wrl->add_vertex(wrl, 0, pos);
-		}
+		for (i = 0; i < nverts; i++)
+			wrl->add_vertex(wrl, 0, verts[i]);
 
 		/* Write the triangles/wires out */
-		if ((v0f = pp->find_field(pp, 1, "VERTEX_0")) < 0)
-			error("Input file doesn't contain field VERTEX_0");
-		if (pp->t[1].ftype[v0f] != i_t)
-			error("Field VERTEX_0 is wrong type");
-		if ((v1f = pp->find_field(pp, 1, "VERTEX_1")) < 0)
-			error("Input file doesn't contain field VERTEX_1");
-		if (pp->t[1].ftype[v1f] != i_t)
-			error("Field VERTEX_1 is wrong type");
-		if ((v2f = pp->find_field(pp, 1, "VERTEX_2")) < 0)
-			error("Input file doesn't contain field VERTEX_2");
-		if (pp->t[1].ftype[v2f] != i_t)
-			error("Field VERTEX_2 is wrong type");
-
 		for (i = 0; i < ntris; i++) {
 			int v0, v1, v2;
-			v0 = *((int *)pp->t[1].fdata[i][v0f]);
-			v1 = *((int *)pp->t[1].fdata[i][v1f]);
-			v2 = *((int *)pp->t[1].fdata[i][v2f]);
+			v0 = tris[i][0];
+			v1 = tris[i][1];
+			v2 = tris[i][2];
 
 #ifdef HALF_HACK 
-			if (*((double *)pp->t[0].fdata[v0][Lf]) < HALF_HACK
-			 || *((double *)pp->t[0].fdata[v1][Lf]) < HALF_HACK
-			 || *((double *)pp->t[0].fdata[v2][Lf]) < HALF_HACK)
+			if (verts[v0][0] < HALF_HACK
+			 || verts[v1][0] < HALF_HACK
+			 || verts[v2][0] < HALF_HACK)
 				continue;
 #endif /* HALF_HACK */
 
@@ -465,30 +578,17 @@ main(int argc, char *argv[]) {
 				wrl->make_triangles(wrl, 0, gds[n].in_trans, color_rgb[gds[n].in_colors].rgb);
 		}
 
-		/* See if there are cusp values */
+		/* Add cusp markers */
 		if (docusps) {
-			int kk;
-			double rgb[3], Lab[3];
-			char buf1[50];
-			char *cnames[6] = { "RED", "YELLOW", "GREEN", "CYAN", "BLUE", "MAGENTA" };
-	
-			for (i = 0; i < 6; i++) {
-				sprintf(buf1,"CUSP_%s", cnames[i]);
-				if ((kk = pp->find_kword(pp, 0, buf1)) < 0)
-					break;
-	
-				if (sscanf(pp->t[0].kdata[kk], "%lf %lf %lf",
-			           &Lab[0], &Lab[1], &Lab[2]) != 3) {
-					break;
-				}
-
+			for (i = 0; i < ncusps; i++) {
 				if (gds[n].in_colors != gam_natural)
-					wrl->add_marker(wrl, Lab, color_rgb[gds[n].in_colors].rgb, 2.0);
+					wrl->add_marker(wrl, cusps[i], color_rgb[gds[n].in_colors].rgb, 2.0);
 				else
-					wrl->add_marker(wrl, Lab, NULL, 2.0);
+					wrl->add_marker(wrl, cusps[i], NULL, 2.0);
 			}
 		}
-		pp->del(pp);		/* Clean up */
+		free(tris);
+		free(verts);
 	}
 
 
@@ -519,16 +619,34 @@ main(int argc, char *argv[]) {
 		v1 = s1->volume(s1);
 		v2 = s2->volume(s2);
 
-		if (s->intersect(s, s1, s2))
-			error("Gamuts are not compatible! (Colorspace, gamut center ?)");
-		vi = s->volume(s);
+		if (isecterr > 0.0) {
+			double ve;
 
-		if (iout_name[0] != '\000') {
-			if (s->write_gam(s, iout_name))
-				error("Writing intersection gamut to '%s' failed",iout_name);
-		}
+			if ((vi = isect_volume_mc(s1, s2, isecterr, &ve)) < 0.0)
+				error("Gamuts are not compatible! (Colorspace, gamut center ?)");
 
-		printf("Intersecting volume = %.1f cubic units\n",vi);
+			printf("Intersecting volume = %.1f +/- %.1f cubic units\n",vi,ve);
+
+		/* Compute the volume directly from the two gamut surfaces */
+		} else if (iout_name[0] == '\000') {
+			if ((vi = isect_volume(s1, s2)) < 0.0)
+				error("Gamuts are not compatible! (Colorspace, gamut center ?)");
+
+			printf("Intersecting volume = %.1f cubic units\n",vi);
+
+		/* Create the intersection gamut to save it */
+		} else {
+			if (s->intersect(s, s1, s2))
+				error("Gamuts are not compatible! (Colorspace, gamut center ?)");
+			vi = s->volume(s);
+
+			if (iout_name[0] != '\000') {
+				if (s->write_gam(s, iout_name))
+					error("Writing intersection gamut to '%s' failed",iout_name);
+			}
+
+			printf("Intersecting volume = %.1f cubic units\n",vi);
+		}
 		printf("'%s' volume = %.1f cubic units, intersect = %.2f%%\n",gds[0].in_name,v1,100.0 * vi/v1);
 		printf("'%s' volume = %.1f cubic units, intersect = %.2f%%\n",gds[1].in_name,v2,100.0 * vi/v2);
 
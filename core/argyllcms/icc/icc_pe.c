@@ -251,23 +251,30 @@ static int icmPeCurveSet_cpy(icmPeCurveSet *dst, icmBase *isrc) {
 }
 
 /* Setup attr */
+/* (Only changed values are written, so that re-initialising a shared */
+/*  tag while other threads are doing lookups through it is benign.) */
 static int icmPeCurveSet_init(icmPeCurveSet *p) {
 	unsigned int i;
+	icmPeOp op = icmPeOp_NOP;
+	char fwd = 1, bwd = 1;
 
-	p->attr.op = icmPeOp_NOP;
-	p->attr.fwd = 1;
-	p->attr.bwd = 1;
 	for (i = 0; i < p->inputChan; i++) {
 		if (p->pe[i] != NULL) {
 			p->pe[i]->init(p->pe[i]);
 
 			/* This is a NOP if all channels are NOPs */
 			if (p->pe[i]->attr.op != icmPeOp_NOP)
-				p->attr.op = icmPeOp_perch;
-			p->attr.fwd &= p->pe[i]->attr.fwd;
-			p->attr.bwd &= p->pe[i]->attr.bwd;
+				op = icmPeOp_perch;
+			fwd &= p->pe[i]->attr.fwd;
+			bwd &= p->pe[i]->attr.bwd;
 		}
 	}
+	if (p->attr.op != op)
+		p->attr.op = op;
+	if (p->attr.fwd != fwd)
+		p->attr.fwd = fwd;
+	if (p->attr.bwd != bwd)
+		p->attr.bwd = bwd;
 	return ICM_ERR_OK;
 }
 
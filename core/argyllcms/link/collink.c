@@ -217,6 +217,8 @@ void usage(char *diag, ...) {
 	fprintf(stderr," -q lmhu         Quality - Low, Medium (def), High, Ultra\n");
 //	fprintf(stderr," -q fmsu         Speed - Fast, Medium (def), Slow, Ultra Slow\n");
 	fprintf(stderr," -r res          Override clut res. set by -q\n");
+	fprintf(stderr," -j threads      Number of threads to fill clut with (default one per processor)\n");
+	fprintf(stderr," -R plan         Re-use link plan file if it matches, else create it\n");
 	fprintf(stderr," -n [i|o]        Don't preserve device linearization curves in result\n");
 	fprintf(stderr," -f              Special :- Force neutral colors to be K only output\n");
 	fprintf(stderr," -fk             Special :- Force K only neutral colors to be K only output\n");
@@ -329,6 +331,8 @@ struct _profinfo {
 	icmHeader *h;
 	xicc *x;
 	icxLuBase *luo;				/* Base XLookup type object */
+	int luflags;				/* xicc flags luo was created with */
+	icmLookupFunc lufunc;		/* Direction luo was created with */
 	icmLuAlgType alg;			/* Type of lookup algorithm */
 	icColorSpaceSignature csp;	/* Colorspace */
 	int chan;					/* Channels */
@@ -357,6 +361,7 @@ struct _profinfo {
 	double rgb_bk[3];			/* Linear light input RGB black to bend to */		
 	double wp[3];				/* Lab/Jab white point for profile used by wphack & xyzscale */
 	icxLuBase *b2aluo;			/* B2A lookup for inking == 7 */
+	int b2aflags;				/* xicc flags b2aluo was created with */
 }; typedef struct _profinfo profinfo;
 
 /* Structure that holds all the color lookup information */
@@ -365,6 +370,7 @@ struct _clink {
 	int verb;
 	int gamdiag;	/* nz, create gammap diagnostic */
 	int total, count, last;	/* Progress count information */
+	int nthr;		/* Number of threads to fill clut with, 0 = one per processor */
 	int mode;		/* 0 = simple mode, 1 = mapping mode, 2 = mapping mode with inverse A2B */
 	int quality;	/* 0 = low, 1 = medium, 2 = high, 3 = ultra */
 	int clutres;	/* 0 = quality default, !0 = override, then actual during link */
@@ -393,6 +399,7 @@ struct _clink {
 	icc *abs_icc;
 	xicc *abs_xicc;
 	icxLuBase *abs_luo;	/* NULL if none */
+	int abs_flags;		/* xicc flags abs_luo was created with */
 
 	int addcal;		/* 1 = apply cal to 3dLut and set linear MadVR cal1 */ 
 					/* 2 = set MadVR cal1 to cal */ 
@@ -1659,7 +1666,7 @@ void devip_devop(void *cntx, double *out, double *in
 
 	} /* Not calonly */
 
-	if (p->verb) {		/* Output percent intervals */
+	if (p->verb && p->total > 0) {		/* Output percent intervals */
 		int pc;
 		p->count++;
 		pc = (int)(p->count * 100.0/p->total + 0.5);
@@ -1894,6 +1901,582 @@ static double xyzoptfunc(void *cntx, double *v) {
 	return rv;
 }
 
+/* ------------------------------------------- */
+/* Filling the clut using multiple threads. */
+
+/* create_lut_xforms() calls devip_devop() serially, but the values it */
+/* calls it with don't depend on the values it gets back. So we call it */
+/* once to record the clut inputs, compute the outputs in parallel with */
+/* each thread using its own copy of the clink and xicc lookups, and then */
+/* call it again to play the outputs back. The result is identical */
+/* to filling the clut with a single thread. */
+/* Each extra thread's xicc lookups have to build their own reverse */
+/* lookup acceleration structures, so small cluts are done serially. */
+
+#define MT_MIN_CLUT 100000	/* Minimum number of clut grid points worth using threads for */
+
+/* Record & playback of clut callbacks */
+typedef struct {
+	clink *li;			/* Link information */
+	clink **lis;		/* Per thread copies of li */
+	int inn, outn;		/* Number of clut input and output values */
+	int no, _no;		/* Number of clut callbacks recorded, allocated */
+	int *tn;			/* Table number of each callback */
+	double *in;			/* inn input values of each callback */
+	double *out;		/* outn output values of each callback */
+	int base;			/* Index of first callback of current block */
+	int ix;				/* Next callback to play back */
+	int wphacked;		/* li->wphacked and bkhacked for a link plan */
+	int bkhacked;
+} cluttab;
+
+static void rec_devi_devip(void *cntx, double *out, double *in, int tn) {
+	cluttab *t = (cluttab *)cntx;
+	devi_devip((void *)t->li, out, in, tn);
+}
+
+static void rec_devop_devo(void *cntx, double *out, double *in, int tn) {
+	cluttab *t = (cluttab *)cntx;
+	devop_devo((void *)t->li, out, in, tn);
+}
+
+/* Record a clut callback */
+static void rec_devip_devop(void *cntx, double *out, double *in, int tn) {
+	cluttab *t = (cluttab *)cntx;
+	int e, f;
+
+	if (t->no >= t->_no) {
+		t->_no = t->_no == 0 ? 4096 : 2 * t->_no;
+		if ((t->tn = (int *)realloc(t->tn, t->_no * sizeof(int))) == NULL
+		 || (t->in = (double *)realloc(t->in, (size_t)t->_no * t->inn * sizeof(double))) == NULL)
+			error("Malloc of clut callback record failed");
+	}
+	t->tn[t->no] = tn;
+	for (e = 0; e < t->inn; e++)
+		t->in[(size_t)t->no * t->inn + e] = in[e];
+	t->no++;
+
+	for (f = 0; f < t->outn; f++)		/* Placeholder */
+		out[f] = 0.0;
+}
+
+/* Play back a clut callback */
+static void play_devip_devop(void *cntx, double *out, double *in, int tn) {
+	cluttab *t = (cluttab *)cntx;
+	int e, f;
+
+	if (t->ix >= t->no || t->tn[t->ix] != tn)
+		error("Internal, clut callback playback got out of step");
+	for (e = 0; e < t->inn; e++) {
+		if (in[e] != t->in[(size_t)t->ix * t->inn + e])
+			error("Internal, clut callback playback got unexpected input");
+	}
+	for (f = 0; f < t->outn; f++)
+		out[f] = t->out[(size_t)t->ix * t->outn + f];
+	t->ix++;
+}
+
+/* Compute a range of recorded clut callbacks */
+static int clut_task(void *cntx, int thix, int i0, int i1) {
+	cluttab *t = (cluttab *)cntx;
+	clink *p = t->lis[thix];
+	double iv[MAX_CHAN];
+	size_t i;
+	int e, f;
+
+	for (i = t->base + i0; i < t->base + i1; i++) {
+		for (e = 0; e < t->inn; e++)
+			iv[e] = t->in[i * t->inn + e];
+		devip_devop((void *)p, iv, iv, t->tn[i]);
+		for (f = 0; f < t->outn; f++)
+			t->out[i * t->outn + f] = iv[f];
+	}
+	return 0;
+}
+
+/* Create a copy of the clink for another thread to use, with its */
+/* own xicc lookup objects, so that their caches aren't shared. */
+static clink *dup_clink(clink *li) {
+	clink *p;
+
+	if ((p = (clink *)malloc(sizeof(clink))) == NULL)
+		error("Malloc of clink copy failed");
+	*p = *li;
+	p->total = 0;			/* No progress from copies */
+	p->wphacked = 0;
+	p->bkhacked = 0;
+
+	if (li->in.luo != NULL
+	 && (p->in.luo = li->in.x->get_luobj(li->in.x, li->in.luflags & ~ICX_VERBOSE,
+	                 li->in.lufunc, li->in.intent, li->pcsor, icmLuOrdNorm,
+	                 &li->in.vc, &li->in.ink)) == NULL)
+		error("get xlookup object failed: %d, %s",li->in.x->e.c,li->in.x->e.m);
+
+	if (li->abs_luo != NULL
+	 && (p->abs_luo = li->abs_xicc->get_luobj(li->abs_xicc, li->abs_flags & ~ICX_VERBOSE,
+	                  icmFwd, li->abs_intent, li->pcsor, icmLuOrdNorm,
+	                  &li->out.vc, NULL)) == NULL)
+		error("get xlookup object failed: %d, %s",li->abs_xicc->e.c,li->abs_xicc->e.m);
+
+	if (li->out.luo != NULL
+	 && (p->out.luo = li->out.x->get_luobj(li->out.x, li->out.luflags & ~ICX_VERBOSE,
+	                  li->out.lufunc, li->out.intent, li->pcsor, icmLuOrdNorm,
+	                  &li->out.vc, &li->out.ink)) == NULL)
+		error("get xlookup object failed: %d, %s",li->out.x->e.c,li->out.x->e.m);
+
+	if (li->out.b2aluo != NULL
+	 && (p->out.b2aluo = li->out.x->get_luobj(li->out.x, li->out.b2aflags & ~ICX_VERBOSE,
+	                     icmBwd, li->out.intent, li->pcsor, icmLuOrdNorm,
+	                     &li->out.vc, NULL)) == NULL)
+		error("get B2A xlookup object failed: %d, %s",li->out.x->e.c,li->out.x->e.m);
+
+	return p;
+}
+
+static void del_dup_clink(clink *p) {
+	if (p->in.luo != NULL)
+		p->in.luo->del(p->in.luo);
+	if (p->abs_luo != NULL)
+		p->abs_luo->del(p->abs_luo);
+	if (p->out.luo != NULL)
+		p->out.luo->del(p->out.luo);
+	if (p->out.b2aluo != NULL)
+		p->out.b2aluo->del(p->out.b2aluo);
+	free(p);
+}
+
+/* - - - - - - - - - - - - - - - - */
+/* A link plan (-R) is the recorded clut callbacks and their computed */
+/* outputs, saved together with a hash of everything they depend on. */
+/* A later link with the same hash plays the clut back from the plan, */
+/* skipping the gamut mapping and clut computation. The per channel */
+/* curves (and any calibration applied to them) are always re-computed, */
+/* so the source and destination profile curves are left out of the hash */
+/* unless they are being folded into the clut (-n), or the clut depends */
+/* on them (an inverse A2B link with an ink limit, black generation or */
+/* B2A inking). */
+/*
+	File format (little endian):
+
+	ORD8   magic[8]		"ACLPLAN\0"
+	ORD32  version		PLAN_VERSION
+	ORD64  key			Hash of the link parameters
+	ORD32  inn, outn, no, wphacked, bkhacked
+	ORD32  tn[no]
+	FLT64  in[no][inn]
+	FLT64  out[no][outn]
+ */
+
+#define PLAN_MAGIC "ACLPLAN"		/* + nul */
+#define PLAN_VERSION 1				/* Bump if the clut computation changes */
+#define PLAN_HSIZE (8 + 4 + 8 + 5 * 4)
+
+/* Return the size of a lut8/lut16 clut with grid resolution gres, inn inputs */
+/* and output entries of esz bytes, or 0 if it is larger than lim. */
+static size_t plan_clut_size(int gres, int inn, size_t esz, size_t lim) {
+	size_t n = esz;
+	int i;
+
+	for (i = 0; i < inn; i++) {
+		n *= gres;
+		if (n > lim)
+			return 0;
+	}
+	return n;
+}
+
+/* Hash the parts of an ICC profile in buf[len] that the clut is built from, */
+/* leaving out the device side per channel curves, since they are re-computed */
+/* when a plan is played back. These are the TRC tags, the device side tables */
+/* of lut8/lut16 tags and the "A" curves of lutAtoB/lutBtoA tags. The header */
+/* size, date and ID are also left out, since editing the curves changes them. */
+/* Return nz if buf[] isn't a profile that can be parsed. */
+static int plan_icc(ORD64 *ph, ORD8 *buf, size_t len) {
+	ORD64 h = *ph;
+	unsigned int ntags, i;
+
+	if (len < 132 || memcmp(buf + 36, "acsp", 4) != 0)
+		return 1;
+	h = hash64_bytes(h, buf + 4, 24 - 4);
+	h = hash64_bytes(h, buf + 36, 84 - 36);
+	h = hash64_bytes(h, buf + 100, 128 - 100);
+
+	ntags = read_ORD32_be(buf + 128);
+	if (ntags > (len - 132) / 12)
+		return 1;
+
+	for (i = 0; i < ntags; i++) {
+		ORD8 *te = buf + 132 + 12 * i;
+		size_t off = read_ORD32_be(te + 4);
+		size_t sz = read_ORD32_be(te + 8);
+		ORD8 *tb = buf + off;
+		int a2b, b2a;
+
+		if (off > len || sz > (len - off) || sz < 8)
+			return 1;
+		h = hash64_bytes(h, te, 4);			/* Tag signature */
+
+		if (memcmp(te, "rTRC", 4) == 0 || memcmp(te, "gTRC", 4) == 0
+		 || memcmp(te, "bTRC", 4) == 0 || memcmp(te, "kTRC", 4) == 0)
+			continue;
+
+		a2b = memcmp(te, "A2B", 3) == 0;
+		b2a = memcmp(te, "B2A", 3) == 0;
+
+		if ((a2b || b2a) && (memcmp(tb, "mft1", 4) == 0 || memcmp(tb, "mft2", 4) == 0)) {
+			int inn = tb[8], outn = tb[9];
+			size_t esz = tb[3] == '1' ? 1 : 2;
+			size_t ients = 256, oents = 256, hsz = 48;
+			size_t isz, csz, osz;
+
+			if (sz < 52)
+				return 1;
+			if (esz == 2) {
+				ients = read_ORD16_be(tb + 48);
+				oents = read_ORD16_be(tb + 50);
+				hsz = 52;
+			}
+			isz = ients * inn * esz;
+			osz = oents * outn * esz;
+			if ((csz = plan_clut_size(tb[10], inn, outn * esz, sz)) == 0
+			 || (hsz + isz + csz + osz) > sz)
+				return 1;
+			h = hash64_bytes(h, tb, 48);			/* Header and matrix */
+			if (b2a)
+				h = hash64_bytes(h, tb + hsz, isz);
+			h = hash64_bytes(h, tb + hsz + isz, csz);
+			if (a2b)
+				h = hash64_bytes(h, tb + hsz + isz + csz, osz);
+			continue;
+		}
+
+		if ((a2b || b2a) && (memcmp(tb, "mAB ", 4) == 0 || memcmp(tb, "mBA ", 4) == 0)) {
+			size_t eoff[5];		/* B, matrix, M, CLUT, A element offsets */
+			int j, k;
+
+			if (sz < 32)
+				return 1;
+			h = hash64_bytes(h, tb, 12);			/* Type and channels */
+			for (j = 0; j < 5; j++) {
+				if ((eoff[j] = read_ORD32_be(tb + 12 + 4 * j)) > sz)
+					return 1;
+			}
+			/* Each element runs to the next one, or the end of the tag */
+			for (j = 0; j < 4; j++) {			/* All but the A curves */
+				size_t eend = sz;
+				if (eoff[j] == 0)
+					continue;
+				for (k = 0; k < 5; k++) {
+					if (eoff[k] > eoff[j] && eoff[k] < eend)
+						eend = eoff[k];
+				}
+				h = hash64_bytes(h, (ORD8 *)&"BXMC"[j], 1);
+				h = hash64_bytes(h, tb + eoff[j], eend - eoff[j]);
+			}
+			continue;
+		}
+
+		h = hash64_bytes(h, tb, sz);
+	}
+
+	*ph = h;
+	return 0;
+}
+
+/* Return the link plan key for the option arguments 1 to nargs-1 */
+/* that aren't marked in skip[], and the contents of the NULL */
+/* terminated list of files. (Empty file names are ignored.) */
+/* If curves[] is nz for a file, it's hashed with plan_icc(). */
+static ORD64 plan_key(int nargs, char *argv[], char *skip, char *fnames[], int *curves) {
+	ORD64 h = HASH64_INIT;
+	ORD8 *fbuf;
+	FILE *fp;
+	size_t n;
+	int i;
+
+	h = hash64_int(h, PLAN_VERSION);
+
+	for (i = 1; i < nargs; i++) {
+		if (!skip[i])
+			h = hash64_str(h, argv[i]);
+	}
+
+	for (i = 0; fnames[i] != NULL; i++) {
+		h = hash64_str(h, "");			/* Separator */
+		if (fnames[i][0] == '\000')
+			continue;
+#if defined(O_BINARY) || defined(_O_BINARY)
+		if ((fp = fopen(fnames[i],"rb")) == NULL)
+#else
+		if ((fp = fopen(fnames[i],"r")) == NULL)
+#endif
+			error("Can't open file '%s' to compute link plan key",fnames[i]);
+		if (fseek(fp, 0, SEEK_END) != 0
+		 || (n = (size_t)ftell(fp)) == (size_t)-1
+		 || fseek(fp, 0, SEEK_SET) != 0
+		 || (fbuf = (ORD8 *)malloc(n + 1)) == NULL
+		 || fread(fbuf, 1, n, fp) != n)
+			error("Can't read file '%s' to compute link plan key",fnames[i]);
+		fclose(fp);
+		if (!curves[i] || plan_icc(&h, fbuf, n) != 0)
+			h = hash64_bytes(h, fbuf, n);
+		free(fbuf);
+	}
+	return h;
+}
+
+static void del_plan(cluttab *t) {
+	if (t != NULL) {
+		free(t->tn);
+		free(t->in);
+		free(t->out);
+		free(t);
+	}
+}
+
+/* Read a link plan. */
+/* Return NULL if it doesn't exist, can't be read or has a different key */
+static cluttab *read_plan(char *fname, ORD64 key) {
+	FILE *fp;
+	ORD8 *buf, *bp;
+	size_t bsize;
+	cluttab *t;
+	size_t i;
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(fname,"rb")) == NULL)
+#else
+	if ((fp = fopen(fname,"r")) == NULL)
+#endif
+		return NULL;
+
+	if (fseek(fp, 0, SEEK_END) != 0
+	 || (bsize = (size_t)ftell(fp)) < PLAN_HSIZE
+	 || fseek(fp, 0, SEEK_SET) != 0
+	 || (buf = (ORD8 *)malloc(bsize)) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	if (fread(buf, 1, bsize, fp) != bsize) {
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+	fclose(fp);
+
+	if (memcmp(buf, PLAN_MAGIC, 8) != 0
+	 || read_ORD32_le(buf + 8) != PLAN_VERSION
+	 || read_ORD64_le(buf + 12) != key
+	 || (t = (cluttab *)calloc(1, sizeof(cluttab))) == NULL) {
+		free(buf);
+		return NULL;
+	}
+	bp = buf + 20;
+	t->inn      = read_ORD32_le(bp);		bp += 4;
+	t->outn     = read_ORD32_le(bp);		bp += 4;
+	t->no       = read_ORD32_le(bp);		bp += 4;
+	t->wphacked = read_ORD32_le(bp);		bp += 4;
+	t->bkhacked = read_ORD32_le(bp);		bp += 4;
+
+	if (t->inn < 1 || t->inn > MAX_CHAN || t->outn < 1 || t->outn > MAX_CHAN
+	 || t->no < 1
+	 || bsize != (PLAN_HSIZE + (size_t)t->no * (4 + 8 * (t->inn + t->outn)))
+	 || (t->tn = (int *)malloc(t->no * sizeof(int))) == NULL
+	 || (t->in = (double *)malloc((size_t)t->no * t->inn * sizeof(double))) == NULL
+	 || (t->out = (double *)malloc((size_t)t->no * t->outn * sizeof(double))) == NULL) {
+		del_plan(t);
+		free(buf);
+		return NULL;
+	}
+	t->_no = t->no;
+
+	for (i = 0; i < (size_t)t->no; i++, bp += 4)
+		t->tn[i] = read_ORD32_le(bp);
+	for (i = 0; i < (size_t)t->no * t->inn; i++, bp += 8)
+		t->in[i] = read_FLT64_le(bp);
+	for (i = 0; i < (size_t)t->no * t->outn; i++, bp += 8)
+		t->out[i] = read_FLT64_le(bp);
+
+	free(buf);
+	return t;
+}
+
+/* Write a link plan. Return nz on error */
+static int write_plan(cluttab *t, char *fname, ORD64 key) {
+	ORD8 *buf, *bp;
+	size_t bsize;
+	size_t i;
+	int rv;
+
+	bsize = PLAN_HSIZE + (size_t)t->no * (4 + 8 * (t->inn + t->outn));
+	if ((buf = (ORD8 *)calloc(bsize, 1)) == NULL)
+		return 1;
+
+	bp = buf;
+	memcpy(bp, PLAN_MAGIC, 8);				bp += 8;
+	write_ORD32_le(bp, PLAN_VERSION);		bp += 4;
+	write_ORD64_le(bp, key);				bp += 8;
+	write_ORD32_le(bp, t->inn);				bp += 4;
+	write_ORD32_le(bp, t->outn);			bp += 4;
+	write_ORD32_le(bp, t->no);				bp += 4;
+	write_ORD32_le(bp, t->wphacked);		bp += 4;
+	write_ORD32_le(bp, t->bkhacked);		bp += 4;
+
+	for (i = 0; i < (size_t)t->no; i++, bp += 4)
+		write_ORD32_le(bp, t->tn[i]);
+	for (i = 0; i < (size_t)t->no * t->inn; i++, bp += 8)
+		write_FLT64_le(bp, t->in[i]);
+	for (i = 0; i < (size_t)t->no * t->outn; i++, bp += 8)
+		write_FLT64_le(bp, t->out[i]);
+
+	/* Write via a temporary file, so an interrupted write doesn't leave a partial plan */
+	rv = write_file_renamed(fname, NULL, 0, buf, bsize);
+	free(buf);
+	return rv;
+}
+
+/* - - - - - - - - - - - - - - - - */
+
+/* Set the device link Lut tables, using li->nthr threads. */
+/* If plan is not NULL, play the clut back from it. */
+/* If plan_name is not NULL, save the clut as a link plan. */
+/* Return the create_lut_xforms() error code */
+static int set_link_luts(
+	icc *wr_icc,
+	clink *li,
+	cluttab *plan,
+	char *plan_name,
+	ORD64 plan_key,
+	int flags,
+	int nsigs,
+	icmXformSigs *sigs,
+	unsigned int inputEnt,
+	unsigned int *agres,
+	unsigned int outputEnt,
+	int *apxls_min, int *apxls_max
+) {
+	athreadpool *pool = NULL;
+	cluttab t;
+	double npts;
+	int i, nthr, bsz, total, rv;
+
+	/* Play back a link plan */
+	if (plan != NULL) {
+		if (plan->inn != icmCSSig2nchan(li->in.csp)
+		 || plan->outn != icmCSSig2nchan(li->out.csp))
+			error("Link plan doesn't match the link colorspaces");
+		plan->li = li;
+		plan->ix = 0;
+		rv = wr_icc->create_lut_xforms(wr_icc, flags, (void *)plan,
+		     nsigs, sigs, 2, inputEnt, agres, outputEnt, li->in.csp, li->out.csp,
+		     NULL, NULL, rec_devi_devip, NULL, NULL, play_devip_devop,
+		     NULL, NULL, rec_devop_devo, apxls_min, apxls_max);
+		li->wphacked = plan->wphacked;
+		li->bkhacked = plan->bkhacked;
+		return rv;
+	}
+
+	for (npts = (double)nsigs, i = 0; i < icmCSSig2nchan(li->in.csp); i++)
+		npts *= agres[i];
+
+	if (li->nthr != 1 && npts >= MT_MIN_CLUT)
+		pool = new_athreadpool(li->nthr);
+	nthr = pool != NULL ? pool->nthr : 1;
+
+	if (nthr <= 1 && plan_name == NULL) {
+		if (pool != NULL)
+			pool->del(pool);
+		return wr_icc->create_lut_xforms(wr_icc, flags, (void *)li,
+		       nsigs, sigs, 2, inputEnt, agres, outputEnt, li->in.csp, li->out.csp,
+		       NULL, NULL, devi_devip, NULL, NULL, devip_devop,
+		       NULL, NULL, devop_devo, apxls_min, apxls_max);
+	}
+
+	memset((void *)&t, 0, sizeof(cluttab));
+	t.li = li;
+	t.inn = icmCSSig2nchan(li->in.csp);
+	t.outn = icmCSSig2nchan(li->out.csp);
+
+	/* Record the clut inputs */
+	if ((rv = wr_icc->create_lut_xforms(wr_icc, flags, (void *)&t,
+	          nsigs, sigs, 2, inputEnt, agres, outputEnt, li->in.csp, li->out.csp,
+	          NULL, NULL, rec_devi_devip, NULL, NULL, rec_devip_devop,
+	          NULL, NULL, rec_devop_devo, apxls_min, apxls_max)) != ICM_ERR_OK) {
+		if (pool != NULL)
+			pool->del(pool);
+		free(t.tn);
+		free(t.in);
+		return rv;
+	}
+
+	if ((t.out = (double *)malloc((size_t)t.no * t.outn * sizeof(double))) == NULL
+	 || (t.lis = (clink **)calloc(nthr, sizeof(clink *))) == NULL)
+		error("Malloc of clut callback outputs failed");
+
+	if (li->verb && nthr > 1)
+		printf("%cUsing %d threads\n",cr_char,nthr);
+
+	/* The first thread uses li, since its lookups are already set up */
+	total = li->total;
+	li->total = 0;		/* Suppress devip_devop() progress */
+	t.lis[0] = li;
+	for (i = 1; i < nthr; i++)
+		t.lis[i] = dup_clink(li);
+
+	/* Compute the outputs, in blocks so that we can show progress */
+	bsz = (t.no + 99)/100;
+	if (bsz < (16 * nthr))
+		bsz = 16 * nthr;
+	for (t.base = 0; t.base < t.no; t.base += bsz) {
+		int n = t.no - t.base;
+		if (n > bsz)
+			n = bsz;
+		if (nthr > 1)
+			pool->run(pool, n, clut_task, (void *)&t);
+		else
+			clut_task((void *)&t, 0, 0, n);
+
+		if (li->verb) {
+			int pc = (int)((t.base + n) * 100.0/t.no + 0.5);
+			if (pc != li->last) {
+				printf("%c%2d%%",cr_char,pc); fflush(stdout);
+				li->last = pc;
+			}
+		}
+	}
+
+	li->total = total;
+	for (i = 1; i < nthr; i++) {
+		li->wphacked += t.lis[i]->wphacked;
+		li->bkhacked += t.lis[i]->bkhacked;
+		del_dup_clink(t.lis[i]);
+	}
+	free(t.lis);
+	if (pool != NULL)
+		pool->del(pool);
+
+	/* Play the outputs back */
+	rv = wr_icc->create_lut_xforms(wr_icc, flags, (void *)&t,
+	     nsigs, sigs, 2, inputEnt, agres, outputEnt, li->in.csp, li->out.csp,
+	     NULL, NULL, rec_devi_devip, NULL, NULL, play_devip_devop,
+	     NULL, NULL, rec_devop_devo, apxls_min, apxls_max);
+
+	if (rv == ICM_ERR_OK && plan_name != NULL) {
+		t.wphacked = li->wphacked;
+		t.bkhacked = li->bkhacked;
+		if (write_plan(&t, plan_name, plan_key) != 0)
+			warning("Writing link plan '%s' failed",plan_name);
+		else if (li->verb)
+			printf("%cSaved link plan '%s'\n",cr_char,plan_name);
+	}
+
+	free(t.tn);
+	free(t.in);
+	free(t.out);
+
+	return rv;
+}
+
 /* ------------------------------------------- */
 
 int write_eeColor1DinputLuts(clink *li, char *tdlut_name);
@@ -1916,6 +2499,11 @@ main(int argc, char *argv[]) {
 	char tdlut_name[MAXNAMEL+1] = "\000";
 	static char tcalname[MAXNAMEL+1] = ""; /* .cal overide for destination icc */
     xcal *tcal = NULL;			/* TAC calibration override for destination icc */
+	char plan_name[MAXNAMEL+1] = "\000";	/* Link plan file name */
+	char *planskip = NULL;		/* nz for arguments that don't affect the link plan */
+	int nopts;					/* Number of option arguments + 1 */
+	ORD64 plankey = 0;			/* Link plan key */
+	cluttab *plan = NULL;		/* Link plan to play back, NULL if none */
 	icmErr err = { 0, { '\000'} };
 	int verify = 0;				/* Do verify pass */
 	int outinkset = 0;			/* The user specfied an output inking */
@@ -1947,6 +2535,7 @@ main(int argc, char *argv[]) {
 	li.verb = 0;
 	li.count = 0;
 	li.last = -1;
+	li.nthr = 0;						/* One thread per processor */
 	li.mode = 0;						/* Default simple link mode */
 	li.quality = -1;					/* Not set */
 	li.clutres = 0;						/* No resolution override */	
@@ -2017,6 +2606,9 @@ main(int argc, char *argv[]) {
 	if (argc < 4)
 		usage("Too few arguments, got %d expect at least 3",argc-1);
 
+	if ((planskip = (char *)calloc(argc, sizeof(char))) == NULL)
+		error("Malloc failed");
+
 
 	/* Process the arguments */
 	mfa = 3;        /* Minimum final arguments */
@@ -2043,11 +2635,13 @@ main(int argc, char *argv[]) {
 			/* Verbosity */
 			else if (argv[fa][1] == 'v') {
 				li.verb = 1;
+				planskip[fa] = 1;
 			}
 
 			/* Manufacturer description string */
 			else if (argv[fa][1] == 'A') {
 				if (na == NULL) usage("Expect argument to manufacturer description flag -A");
+				planskip[fa] = planskip[nfa] = 1;
 				fa = nfa;
 				xpi.deviceMfgDesc = na;
 			}
@@ -2055,6 +2649,7 @@ main(int argc, char *argv[]) {
 			/* Model description string */
 			else if (argv[fa][1] == 'M') {
 				if (na == NULL) usage("Expect argument to model description flag -M");
+				planskip[fa] = planskip[nfa] = 1;
 				fa = nfa;
 				xpi.modelDesc = na;
 			}
@@ -2062,6 +2657,7 @@ main(int argc, char *argv[]) {
 			/* Profile Description */
 			else if (argv[fa][1] == 'D') {
 				if (na == NULL) usage("Expect argument to profile description flag -D");
+				planskip[fa] = planskip[nfa] = 1;
 				fa = nfa;
 				xpi.profDesc = na;
 			}
@@ -2069,6 +2665,7 @@ main(int argc, char *argv[]) {
 			/* Copyright string */
 			else if (argv[fa][1] == 'C') {
 				if (na == NULL) usage("Expect argument to copyright flag -C");
+				planskip[fa] = planskip[nfa] = 1;
 				fa = nfa;
 				xpi.copyright = na;
 			}
@@ -2166,6 +2763,23 @@ main(int argc, char *argv[]) {
 				li.clutres = rr;
 			}
 
+			/* Number of threads */
+			else if (argv[fa][1] == 'j') {
+				if (na == NULL) usage("Threads flag (-j) needs an argument");
+				planskip[fa] = planskip[nfa] = 1;
+				fa = nfa;
+				li.nthr = atoi(na);
+				if (li.nthr < 0 || li.nthr > 256) usage("Threads flag (-j) argument out of range (%d)",li.nthr);
+			}
+
+			/* Link plan */
+			else if (argv[fa][1] == 'R') {
+				if (na == NULL) usage("Expected link plan filename after -R");
+				planskip[fa] = planskip[nfa] = 1;
+				fa = nfa;
+				strncpy(plan_name,na,MAXNAMEL); plan_name[MAXNAMEL] = '\000';
+			}
+
 			/* Abstract profile */
 			else if (argv[fa][1] == 'p') {
 				if (na == NULL) usage("Expected abstract profile filename after -p");
@@ -2193,6 +2807,8 @@ main(int argc, char *argv[]) {
 					}
 				}
 				if (na == NULL) usage("Expected calibration filename after -%c",argv[fa][1]);
+				if (argv[fa][1] != 'O')		/* Contents are used in plan key if needed */
+					planskip[fa] = planskip[nfa] = 1;
 				fa = nfa;
 				strncpy(cal_name,na,MAXNAMEL); cal_name[MAXNAMEL] = '\000';
 			}
@@ -2671,6 +3287,7 @@ main(int argc, char *argv[]) {
 		} else
 			break;
 	}
+	nopts = fa;
 
 
 
@@ -2704,6 +3321,10 @@ main(int argc, char *argv[]) {
 	if (fa >= argc || argv[fa][0] == '-') usage("Missing result profile");
 	strncpy(link_name,argv[fa++],MAXNAMEL); link_name[MAXNAMEL] = '\000';
 
+	/* These need the gamut mapping as well as the clut */
+	if (plan_name[0] != '\000' && (li.tdlut || li.in.bt1886 || verify))
+		usage("Link plan (-R) can't be used with 3DLut, BT.1886 or verify options");
+
 	if (li.tdlut) {
 		char *xl;
 		if (li.tdlut == 1) {		/* eeColor */
@@ -3388,6 +4009,8 @@ main(int argc, char *argv[]) {
 		                                    li.pcsor, icmLuOrdNorm, &li.in.vc, &li.in.ink)) == NULL) {
 			error("get xlookup object failed: %d, %s",li.in.x->e.c,li.in.x->e.m);
 		}
+		li.in.luflags = fl;
+		li.in.lufunc = icmFwd;
 	
 		/* Get details of overall conversion */
 		li.in.luo->spaces(li.in.luo, &li.in.csp, &li.in.chan, NULL, NULL, &li.in.alg,
@@ -3424,6 +4047,7 @@ main(int argc, char *argv[]) {
 			if ((li.abs_luo = li.abs_xicc->get_luobj(li.abs_xicc, flb, icmFwd, li.abs_intent,
 			        li.pcsor, icmLuOrdNorm, &li.out.vc, NULL)) == NULL)
 					error ("%d, %s",li.abs_icc->e.c, li.abs_icc->e.m);
+			li.abs_flags = flb;
 		}
 
 		// Figure out whether the output profile is a Lut profile or not */
@@ -3453,6 +4077,8 @@ main(int argc, char *argv[]) {
 			                              li.pcsor, icmLuOrdNorm, &li.out.vc, &li.out.ink)) == NULL) {
 				error("get xlookup object failed: %d, %s",li.out.x->e.c,li.out.x->e.m);
 			}
+			li.out.luflags = flb;
+			li.out.lufunc = icmBwd;
 			/* Get details of overall conversion */
 			li.out.luo->spaces(li.out.luo, NULL, NULL, NULL, &li.out.chan, &li.out.alg,
 			                   NULL, NULL, NULL);
@@ -3496,6 +4122,8 @@ main(int argc, char *argv[]) {
 			                  &li.out.ink)) == NULL) {
 				error("get xlookup object failed: %d, %s",li.out.x->e.c,li.out.x->e.m);
 			}
+			li.out.luflags = fl;
+			li.out.lufunc = icmFwd;
 		
 			/* Get details of overall conversion */
 			li.out.luo->spaces(li.out.luo, &li.out.csp, &li.out.chan, NULL, NULL, &li.out.alg,
@@ -3516,6 +4144,7 @@ main(int argc, char *argv[]) {
 					li.out.intent, li.pcsor, icmLuOrdNorm, &li.out.vc, NULL)) == NULL) {
 					error("get B2A xlookup object failed: %d, %s",li.out.x->e.c,li.out.x->e.m);
 				}
+				li.out.b2aflags = flb;
 			}
 		}
 		
@@ -3727,6 +4356,45 @@ main(int argc, char *argv[]) {
 		}
 	}
 
+	/* - - - - - - - - - - - - - - - - - - - */
+	/* See if there is a link plan we can re-use */
+	if (plan_name[0] != '\000') {
+		char *fnames[7];
+		int curves[7] = { 0 };
+
+		fnames[0] = in_name;
+		fnames[1] = out_name;
+		fnames[2] = abs_name;
+		fnames[3] = sgam_name;
+		fnames[4] = tcalname;
+		/* Calibration only affects the plan if it's applied in the clut */
+		if (li.cal != NULL && li.addcal == 1 && (li.out.nocurve || li.calonly))
+			fnames[5] = cal_name;
+		else
+			fnames[5] = "";
+		fnames[6] = NULL;
+		/* The profile per channel curves are re-computed, unless they're in the clut */
+		curves[0] = !li.in.nocurve;
+		curves[1] = !li.out.nocurve;
+		/* The inverse A2B ink limit and black generation are applied to device */
+		/* values, and B2A inking looks up the device values, so the destination */
+		/* curves (and the source curves if its K is transferred) affect the clut. */
+		if (li.mode >= 2 && li.out.alg == icmLutType
+		 && (li.out.ink.tlimit >= 0.0 || li.out.ink.klimit >= 0.0
+		  || li.out.chan > 3 || li.out.inking == 7)) {
+			curves[1] = 0;
+			if (li.out.inking == 0 || li.out.inking == 6)
+				curves[0] = 0;
+		}
+		plankey = plan_key(nopts, argv, planskip, fnames, curves);
+
+		if ((plan = read_plan(plan_name, plankey)) != NULL) {
+			if (li.verb)
+				printf("Re-using link plan '%s'\n",plan_name);
+		} else if (li.verb)
+			printf("No matching link plan '%s', creating it\n",plan_name);
+	}
+
 	/* - - - - - - - - - - - - - - - - - - - */
 	/* Setup the gamut mapping */
 // ~~~~ need to account for possible abstract profile after source !!!!
@@ -3745,7 +4413,7 @@ main(int argc, char *argv[]) {
 	/* lab or Jab space, with the given in/out viewing conditions */
 	/* for the latter. The xluo->get_gamut work in the set li.pcsor */
 	/* for each xluo. */
-	if (li.mode > 0 && li.gmi.usemap) {
+	if (li.mode > 0 && li.gmi.usemap && plan == NULL) {
 		gamut *csgam, *igam, *ogam;
 		double sgres;			/* Source gamut surface feature resolution */
 		double dgres;			/* Destination gamut surface feature resolution */
@@ -3844,7 +4512,7 @@ main(int argc, char *argv[]) {
 	/* If we've got a request for Absolute Appearance mode with scaling */
 	/* to avoid clipping the source white point, compute the needed XYZ scaling factor. */
 	/* We assume that the white point hack can't be used at the same time. */
-	if (li.mode > 0 && li.wphack == 0 && (li.gmi.usecas & 0x100) != 0) {
+	if (li.mode > 0 && li.wphack == 0 && (li.gmi.usecas & 0x100) != 0 && plan == NULL) {
 		double xyzscale[1], sa[1];
 
 		/* We already have the source space white point in li.in.wp[] */
@@ -4642,25 +5310,21 @@ main(int argc, char *argv[]) {
 			for (i = 0; i < li.in.chan; i++)
 				 agres[i] = clutPoints;
 
-			if (wr_icc->create_lut_xforms(
+			/* (Bytes per value 2, default color space ranges, */
+			/*  devi_devip, devip_devop and devop_devo transfer functions) */
+			if (set_link_luts(
 				wr_icc,
+				&li,				/* Context */
+				plan,				/* Link plan to play back */
+				plan_name[0] != '\000' && plan == NULL ? plan_name : NULL,
+				plankey,
 #ifdef USE_LEASTSQUARES_APROX
 				ICM_CLUT_SET_APXLS | 
 #endif
 				0,					/* flags */
-				&li,				/* Context */
 				nsigs,				/* Number of tables */
 				sigs,				/* signatures and tag types for each table */
-				2,					/* Bytes per value of AToB or BToA CLUT, 1 or 2 */
     			inputEnt, agres, outputEnt,	/* Table resolutions */
-				li.in.csp,					/* Input color space */
-				li.out.csp,					/* Output color space */
-				NULL, NULL,					/* Use default input range */
-				devi_devip,					/* Input transfer tables devi->devi' */
-				NULL, NULL,					/* Use default input colorspace range */
-				devip_devop,				/* devi' -> devo' transfer function */
-				NULL, NULL,					/* Default output colorspace range */
-				devop_devo,					/* Output transfer tables, devo'->devo */
 				apxls_min, apxls_max		/* Limit APXLS to inside colorspace */
 			) != ICM_ERR_OK)
 				error("Setting 16 bit Lut failed: %d, %s",wr_icc->e.c,wr_icc->e.m);
@@ -4939,6 +5603,8 @@ main(int argc, char *argv[]) {
 		li.map->del(li.map);
 	if (li.Kmap != NULL)
 		li.Kmap->del(li.Kmap);
+	del_plan(plan);
+	free(planskip);
 
 	if (li.abs_luo != NULL) {		/* Free up abstract transform */
 		li.abs_luo->del(li.abs_luo);
@@ -0,0 +1,250 @@
+/*
+ * Link plan test code. Check that a collink -R link plan is re-used
+ * when only the destination device curves are edited, except when the
+ * clut depends on them, i.e. for an ink limited inverse A2B link.
+ *
+ * Author:  Graeme W. Gill
+ * Date:    18/10/2026
+ * Version: 1.00
+ *
+ * Copyright 2026 Graeme W. Gill
+ * All rights reserved.
+ *
+ * This material is licenced under the GNU AFFERO GENERAL PUBLIC LICENSE Version 3 :-
+ * see the License.txt file for licencing details.
+ */
+
+/*
+	The destination must be a CMYK profile with lut16 A2B tags,
+	such as ref/cmyk.icm. A copy of it is made with the A2B
+	input (device side) curves edited, and collink is run on
+	each with the same link plan. The plan file is rewritten
+	with a different key if it wasn't re-used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <string.h>
+#include <math.h>
+#include "copyright.h"
+#include "aconfig.h"
+#include "numlib.h"
+
+#define PLAN_NAME "plantest.plan"
+#define EDIT_NAME "plantest_d.icm"
+#define LINK_NAME "plantest_l.icm"
+
+void usage(void) {
+	fprintf(stderr,"Test link plan invalidation, Version %s\n",ARGYLL_VERSION_STR);
+	fprintf(stderr,"Author: Graeme W. Gill, licensed under the AGPL Version 3\n");
+	fprintf(stderr,"usage: plantest [options] src.icm cmyk.icm\n");
+	fprintf(stderr," -v                Verbose\n");
+	fprintf(stderr," -c collink        collink executable to test (default collink)\n");
+	exit(1);
+}
+
+/* Read a whole file. Return NULL on error */
+static ORD8 *read_file(char *fname, size_t *plen) {
+	FILE *fp;
+	ORD8 *buf;
+	long len;
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(fname,"rb")) == NULL)
+#else
+	if ((fp = fopen(fname,"r")) == NULL)
+#endif
+		return NULL;
+	if (fseek(fp, 0, SEEK_END) != 0
+	 || (len = ftell(fp)) < 0
+	 || fseek(fp, 0, SEEK_SET) != 0
+	 || (buf = (ORD8 *)malloc(len + 1)) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	if (fread(buf, 1, len, fp) != (size_t)len) {
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+	fclose(fp);
+	*plen = (size_t)len;
+	return buf;
+}
+
+/* Raise the input curves of each lut16 A2B tag in buf[len] to the power 0.8. */
+/* Return the number of tags edited. */
+static int edit_curves(ORD8 *buf, size_t len) {
+	unsigned int ntags, i;
+	size_t done[10];
+	int ndone = 0, j;
+
+	if (len < 132)
+		return 0;
+	ntags = read_ORD32_be(buf + 128);
+	if (ntags > (len - 132) / 12)
+		return 0;
+
+	for (i = 0; i < ntags; i++) {
+		ORD8 *te = buf + 132 + 12 * i;
+		size_t off = read_ORD32_be(te + 4);
+		size_t sz = read_ORD32_be(te + 8);
+		ORD8 *tb = buf + off;
+		size_t k, n;
+
+		if (memcmp(te, "A2B", 3) != 0 || off > len || sz > (len - off)
+		 || sz < 52 || memcmp(tb, "mft2", 4) != 0)
+			continue;
+		for (j = 0; j < ndone; j++) {		/* Tags may be shared */
+			if (done[j] == off)
+				break;
+		}
+		if (j < ndone || ndone >= 10)
+			continue;
+		done[ndone++] = off;
+
+		n = (size_t)read_ORD16_be(tb + 48) * tb[8];
+		if (52 + 2 * n > sz)
+			continue;
+		for (k = 0; k < n; k++) {
+			double v = read_ORD16_be(tb + 52 + 2 * k)/65535.0;
+			write_ORD16_be(tb + 52 + 2 * k, (unsigned int)(pow(v, 0.8) * 65535.0 + 0.5));
+		}
+	}
+	return ndone;
+}
+
+/* Run collink with the given options, and return the resulting plan key */
+static ORD64 run_link(int verb, char *collink, char *opts, char *src, char *dst) {
+	char cmd[3 * MAXNAMEL + 200];
+	ORD8 *buf;
+	size_t len;
+	ORD64 key;
+
+	sprintf(cmd, "%s -qm %s -R %s %s %s %s", collink, opts, PLAN_NAME, src, dst, LINK_NAME);
+	if (verb)
+		printf("Running '%s'\n",cmd);
+	if (system(cmd) != 0)
+		error("'%s' failed",cmd);
+
+	if ((buf = read_file(PLAN_NAME, &len)) == NULL || len < 20)
+		error("Can't read link plan '%s'",PLAN_NAME);
+	key = read_ORD64_le(buf + 12);
+	free(buf);
+	return key;
+}
+
+int
+main(int argc, char *argv[]) {
+	int fa, nfa;
+	char collink[MAXNAMEL+1] = "collink";
+	char src_name[MAXNAMEL+1];
+	char dst_name[MAXNAMEL+1];
+	int verb = 0;
+	ORD8 *buf;
+	size_t len;
+	FILE *fp;
+	ORD64 k1, k2;
+	int fails = 0;
+
+	error_program = argv[0];
+
+	if (argc < 3)
+		usage();
+
+	/* Process the arguments */
+	for(fa = 1;fa < argc;fa++) {
+		nfa = fa;					/* skip to nfa if next argument is used */
+		if (argv[fa][0] == '-')	{	/* Look for any flags */
+			char *na = NULL;		/* next argument after flag, null if none */
+
+			if (argv[fa][2] != '\000')
+				na = &argv[fa][2];		/* next is directly after flag */
+			else {
+				if ((fa+1) < argc) {
+					if (argv[fa+1][0] != '-') {
+						nfa = fa + 1;
+						na = argv[nfa];		/* next is seperate non-flag argument */
+					}
+				}
+			}
+
+			if (argv[fa][1] == '?')
+				usage();
+
+			/* Verbosity */
+			else if (argv[fa][1] == 'v' || argv[fa][1] == 'V') {
+				verb = 1;
+			}
+
+			/* collink executable */
+			else if (argv[fa][1] == 'c') {
+				fa = nfa;
+				if (na == NULL) usage();
+				strncpy(collink,na,MAXNAMEL); collink[MAXNAMEL] = '\000';
+			}
+			else
+				usage();
+		} else
+			break;
+	}
+
+	if (fa >= argc || argv[fa][0] == '-') usage();
+	strncpy(src_name,argv[fa++],MAXNAMEL); src_name[MAXNAMEL] = '\000';
+
+	if (fa >= argc || argv[fa][0] == '-') usage();
+	strncpy(dst_name,argv[fa++],MAXNAMEL); dst_name[MAXNAMEL] = '\000';
+
+	/* - - - - - - - - - - - - - - - - - - - */
+	/* Make a copy of the destination with edited device curves */
+	if ((buf = read_file(dst_name, &len)) == NULL)
+		error("Can't read destination profile '%s'",dst_name);
+	if (edit_curves(buf, len) == 0)
+		error("Destination profile '%s' has no lut16 A2B tags",dst_name);
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(EDIT_NAME,"wb")) == NULL)
+#else
+	if ((fp = fopen(EDIT_NAME,"w")) == NULL)
+#endif
+		error("Can't create '%s'",EDIT_NAME);
+	if (fwrite(buf, 1, len, fp) != len || fclose(fp) != 0)
+		error("Can't write '%s'",EDIT_NAME);
+	free(buf);
+
+	/* - - - - - - - - - - - - - - - - - - - */
+	/* The device curves aren't part of a simple link's clut, */
+	/* so the plan should be re-used. */
+	remove(PLAN_NAME);
+	k1 = run_link(verb, collink, "", src_name, dst_name);
+	k2 = run_link(verb, collink, "", src_name, EDIT_NAME);
+	if (k1 != k2) {
+		printf("Simple link plan wasn't re-used when only the device curves changed\n");
+		fails++;
+	} else
+		printf("Simple link plan re-used OK\n");
+
+	/* The ink limit of an inverse A2B link is applied to the device values, */
+	/* so the plan must be re-computed. */
+	remove(PLAN_NAME);
+	k1 = run_link(verb, collink, "-G -l250", src_name, dst_name);
+	k2 = run_link(verb, collink, "-G -l250", src_name, EDIT_NAME);
+	if (k1 == k2) {
+		printf("Ink limited link plan was re-used when the device curves changed\n");
+		fails++;
+	} else
+		printf("Ink limited link plan invalidated OK\n");
+
+	remove(PLAN_NAME);
+	remove(EDIT_NAME);
+	remove(LINK_NAME);
+
+	if (fails) {
+		printf("Link plan test FAILED\n");
+		return 1;
+	}
+	printf("Link plan test passed OK\n");
+	return 0;
+}
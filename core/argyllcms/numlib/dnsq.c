@@ -1349,10 +1349,10 @@ static double denorm(
 		static double rdwarf = 3.834e-20;
 		static double rgiant = 1.304e19;
 	
-		/* Local variables */
-		static double xabs, x1max, x3max;
-		static int i;
-		static double s1, s2, s3, agiant, floatn;
+		/* Local variables (not static, so that dnsq() is re-entrant) */
+		double xabs, x1max, x3max;
+		int i;
+		double s1, s2, s3, agiant, floatn;
 		double ret_val, td;
 	
 		s1 = 0.0;	/* Large component */
@@ -0,0 +1,115 @@
+/*
+ * Argyll Color Management System
+ * Convert a CGATS file to or from the binary CGATS format.
+ *
+ * Author: Graeme W. Gill
+ * Date:   18/10/2026
+ *
+ * Copyright 2005, 2010 Graeme W. Gill
+ * All rights reserved.
+ *
+ * (Based on splitti3.c)
+ *
+ * This material is licenced under the GNU AFFERO GENERAL PUBLIC LICENSE Version 3 :-
+ * see the License.txt file for licencing details.
+ */
+
+/*
+ * This program takes in a CGATS .ti3 (or other CGATS like) file,
+ * and writes it out in the binary CGATS format, which loads
+ * without parsing and has an index of the SAMPLE_ID values.
+ * Since the binary format is read transparently, the same program
+ * converts a binary file back to text.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "copyright.h"
+#include "aconfig.h"
+#include "numlib.h"
+#include "cgats.h"
+
+void
+usage(void) {
+	fprintf(stderr,"Convert a CGATS file to or from binary, Version %s\n",ARGYLL_VERSION_STR);
+	fprintf(stderr,"Author: Graeme W. Gill, licensed under the AGPL Version 3\n");
+	fprintf(stderr,"usage: cgatsbin [-options] input output\n");
+	fprintf(stderr," -v              Verbose - print each table\n");
+	fprintf(stderr," -t              Write a text file rather than a binary one\n");
+	fprintf(stderr," input           Text or binary CGATS file to be converted.\n");
+	fprintf(stderr," output          Output file\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int fa;					/* current argument we're looking at */
+	int verb = 0;
+	int totext = 0;			/* Write text rather than binary */
+
+	cgats *cgf = NULL;			/* cgats file data */
+	char in_name[MAXNAMEL+1];	/* Input filename  */
+	char out_name[MAXNAMEL+1];	/* Output filename  */
+
+	int i;
+
+	error_program = "cgatsbin";
+
+	if (argc <= 1)
+		usage();
+
+	/* Process the arguments */
+	for (fa = 1;fa < argc;fa++) {
+		if (argv[fa][0] == '-') {	/* Look for any flags */
+			if (argv[fa][1] == '?') {
+				usage();
+
+			} else if (argv[fa][1] == 'v') {
+				verb = 1;
+
+			} else if (argv[fa][1] == 't') {
+				totext = 1;
+			}
+
+			else
+				usage();
+		} else
+			break;
+	}
+
+	/* Get the file name arguments */
+	if (fa >= argc || argv[fa][0] == '-') usage();
+	strncpy(in_name,argv[fa++],MAXNAMEL); in_name[MAXNAMEL] = '\000';
+
+	if (fa >= argc || argv[fa][0] == '-') usage();
+	strncpy(out_name,argv[fa++],MAXNAMEL); out_name[MAXNAMEL] = '\000';
+
+	if ((cgf = new_cgats()) == NULL)
+		error("Failed to create cgats object");
+	cgf->add_other(cgf, ""); 	/* Allow any signature file */
+
+	if (cgf->read_name(cgf, in_name))
+		error("CGATS file '%s' read error : %s",in_name,cgf->e.m);
+
+	if (verb) {
+		for (i = 0; i < cgf->ntables; i++) {
+			printf("Table %d has %d keywords, %d fields and %d sets%s\n",i,
+			       cgf->t[i].nkwords, cgf->t[i].nfields, cgf->t[i].nsets,
+			       cgf->find_field(cgf, i, "SAMPLE_ID") >= 0 ? ", indexed by SAMPLE_ID" : "");
+		}
+	}
+
+	if (totext) {
+		if (cgf->write_name(cgf, out_name))
+			error("Write error : %s",cgf->e.m);
+	} else {
+		if (cgf->write_bin_name(cgf, out_name))
+			error("Write error : %s",cgf->e.m);
+	}
+
+	if (verb)
+		printf("Wrote %s file '%s'\n",totext ? "text" : "binary",out_name);
+
+	cgf->del(cgf);
+
+	return 0;
+}
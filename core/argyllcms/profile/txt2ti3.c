@@ -254,6 +254,7 @@ int main(int argc, char *argv[])
 
 	/* Open up the Input CMYK/RGB reference file (might be same as ncie/spec) */
 	cmy = new_cgats();	/* Create a CGATS structure */
+	cmy->keep_text = 1;		/* We compare the location text */
 	cmy->add_other(cmy, "LGOROWLENGTH"); 	/* Gretag/Logo Target file */
 	cmy->add_other(cmy, "Date:");			/* Gretag/Logo Target file */
 	cmy->add_other(cmy, "ECI2002");			/* Gretag/Logo Target file */
@@ -363,6 +364,7 @@ int main(int argc, char *argv[])
 
 	/* Open up the input nCIE or Spectral device data file */
 	ncie = new_cgats();	/* Create a CGATS structure */
+	ncie->keep_text = 1;		/* We compare the location text */
 	ncie->add_other(ncie, "LGOROWLENGTH"); 	/* Gretag/Logo Target file */
 	ncie->add_other(ncie, "ECI2002"); 		/* Gretag/Logo Target file */
 	ncie->add_other(ncie, ""); 				/* Wildcard */
@@ -465,6 +467,7 @@ int main(int argc, char *argv[])
 		char bufs[6][50];
 
 		spec = new_cgats();	/* Create a CGATS structure */
+		spec->keep_text = 1;		/* We compare the location text */
 		spec->add_other(spec, "LGOROWLENGTH"); 	/* Gretag/Logo Target file */
 		spec->add_other(spec, "ECI2002"); 		/* Gretag/Logo Target file */
 		spec->add_other(spec, ""); 				/* Wildcard */
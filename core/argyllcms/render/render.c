@@ -32,11 +32,13 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include "copyright.h"
 #include "aconfig.h"
 #include "sort.h"
 #include "numlib.h"
+#include "conv.h"
 #ifdef RENDER_TIFF
 # include "tiffio.h"
 #endif	/* TIFF */
@@ -303,6 +305,550 @@ static int colordiff(render2d *s, color2d c1, color2d c2) {
 
 #define MIXPOW 2.0			// Blending power
 #define OSAMLS 16			// [16] Oversampling
+#define RBANDH 64			/* Rows in each band rendered by a thread (power of 2) */
+#define STRIPSZ 1048576		/* Target maximum TIFF strip size in bytes */
+
+/* Return nz if the primitive is an axis aligned rectangle, */
+/* so that the pixels it covers on a line form a single span. */
+#define IS_RECT2D(p) ((p)->rend == rect2d_rend || (p)->rend == rectvs2d_rend)
+
+static int rect2d_rend(prim2d *ss, color2d rv, double x, double y);
+static int rectvs2d_rend(prim2d *ss, color2d rv, double x, double y);
+
+/* Return a pointer to the rx0, ry0, rx1, ry1 extent of a rectangle primitive */
+static double *rect2d_ext(prim2d *p) {
+	if (p->rend == rect2d_rend)
+		return &((rect2d *)p)->rx0;
+	return &((rectvs2d *)p)->rx0;
+}
+
+/* Per thread band rendering state. The active lists are arrays */
+/* rather than the prim2d links, so that bands can be rendered in parallel. */
+typedef struct {
+	int nrow;				/* Next line that can be rendered without re-starting */
+	sobol *so;				/* Random sampler for anti-aliasing */
+	int yli;				/* Index into Y sorted list */
+	int nyact;				/* Number in active Y list */
+	prim2d **yact;			/* Active Y list */
+	prim2d **xlist;			/* X sorted start list */
+	prim2d **xact;			/* Active X list of non-rectangle primitives */
+	prim2d **sact;			/* Active X list of rectangle primitives */
+	prim2d **sown;			/* Rectangle primitive owning each pixel sample */
+	color2d *pixv0, *_pixv0;	/* Storage for pixel values around current */
+	color2d *pixv1, *_pixv1;
+	char *flat0, *flat1;	/* nz if pixel value is a flat color, prev. & current lines */
+} rband;
+
+/* Free a band state */
+static void del_rband(rband *b) {
+	if (b->so != NULL)
+		b->so->del(b->so);
+	free(b->yact);
+	free(b->xlist);
+	free(b->xact);
+	free(b->sact);
+	if (b->sown != NULL)
+		free(b->sown-1);
+	free(b->_pixv0);
+	free(b->_pixv1);
+	if (b->flat0 != NULL)
+		free(b->flat0-1);
+	if (b->flat1 != NULL)
+		free(b->flat1-1);
+}
+
+/* Allocate a band state. Return nz on error */
+static int init_rband(render2d *s, rband *b) {
+	int nix = s->ix > 0 ? s->ix : 1;
+
+	memset((void *)b, 0, sizeof(rband));
+	b->nrow = -2;
+
+	if ((b->so = new_sobol(2)) == NULL
+	 || (b->yact = malloc(sizeof(prim2d *) * nix)) == NULL
+	 || (b->xlist = malloc(sizeof(prim2d *) * nix)) == NULL
+	 || (b->xact = malloc(sizeof(prim2d *) * nix)) == NULL
+	 || (b->sact = malloc(sizeof(prim2d *) * nix)) == NULL
+	 || (b->sown = malloc(sizeof(prim2d *) * (s->pw+1))) == NULL
+	 || (b->_pixv0 = malloc(sizeof(color2d) * (s->pw+2))) == NULL
+	 || (b->_pixv1 = malloc(sizeof(color2d) * (s->pw+2))) == NULL
+	 || (b->flat0 = malloc(s->pw+1)) == NULL
+	 || (b->flat1 = malloc(s->pw+1)) == NULL) {
+		del_rband(b);
+		return 1;
+	}
+	b->sown++;
+	b->flat0++;
+	b->flat1++;
+	b->pixv0 = b->_pixv0+1;
+	b->pixv1 = b->_pixv1+1;
+	return 0;
+}
+
+/* Compute the range of pixels xa..xb on a line whose sample */
+/* point falls inside a rectangle primitive that is in range of the line. */
+/* This matches the X list and rend() tests exactly, so */
+/* that only the pixel owner needs to be rendered. */
+static void rect2d_span(render2d *s, prim2d *p, int *pxa, int *pxb) {
+	double *ext = rect2d_ext(p);
+	double fx;
+	int xa, xb;
+
+	/* Estimate and then adjust using the exact per pixel tests */
+	fx = ext[0] * s->hres - 0.5;
+	xa = fx < -1.0 ? -1 : fx > (double)s->pw ? s->pw : (int)ceil(fx);
+	while (xa > -1 && (xa - 1 + 0.5) / s->hres > p->x0
+	                 && !((xa - 1 + 0.5) / s->hres < ext[0]))
+		xa--;
+	while (xa < s->pw && ((xa + 0.5) / s->hres <= p->x0
+	                  ||  (xa + 0.5) / s->hres < ext[0]))
+		xa++;
+
+	fx = ext[2] * s->hres - 0.5;
+	xb = fx < -2.0 ? -2 : fx > (double)(s->pw-1) ? s->pw-1 : (int)floor(fx);
+	while (xb < (s->pw-1) && !((xb + 1 + 0.5) / s->hres > ext[2]))
+		xb++;
+	while (xb >= -1 && (xb + 0.5) / s->hres > ext[2])
+		xb--;
+
+	*pxa = xa;
+	*pxb = xb;
+}
+
+/* Render one line of pixel samples into the band state. If emit is nz, */
+/* anti-alias and convert the previous line and column samples into */
+/* output pixels, writing them to outbuf or to dithbuf16 if dithering, */
+/* and set bgrow[] nz for pixels solely from the background (if not NULL). */
+/* Return nz if the line contains forground pixels. */
+static int render2d_row(
+	render2d *s,
+	rband *b,
+	prim2d **ylist,			/* Y sorted start list */
+	int y,					/* Line to render */
+	int emit,				/* nz to output the line */
+	unsigned char *outbuf,	/* Line output buffer at depth and pixel size */
+	unsigned short *dithbuf16,	/* 16 bit line buffer for dithering */
+	char *bgrow				/* Background flag for each pixel */
+) {
+	int foundfg = 0;		/* Found a forground object in this line */
+	color2d *pixv0 = b->pixv0, *pixv1 = b->pixv1;
+	char *flat0 = b->flat0, *flat1 = b->flat1;
+	double lastflat = -2.0;	/* Primitive index of previous pixel if flat */
+	prim2d *th;
+	int xli, noix;			/* Index into and number in X list */
+	int nxact, nsact;		/* Number of active X list primitives */
+	int i, j, k;
+	double rx0, rx1, ry0, ry1;	/* Box being processed, newest sample is rx1, ry1 */
+	int x;					/* Pixel x index */
+
+	/* Convert to coordinate order */
+	ry0 = (((s->ph-1) - y) - 0.5) / s->vres;
+	ry1 = (((s->ph-1) - y) + 0.5) / s->vres;
+
+	/* Remove any objects from the y list that are now out of range */
+	for (i = j = 0; i < b->nyact; i++) {
+		if (ry1 < b->yact[i]->y0)
+			continue;
+		b->yact[j++] = b->yact[i];
+	}
+	b->nyact = j;
+
+	/* Add any objects that are now within this range to our y list */
+	for(; b->yli < s->ix && ry0 < ylist[b->yli]->y1; b->yli++)
+		b->yact[b->nyact++] = ylist[b->yli];
+
+	/* Initialise the current X list, and note which rectangle */
+	/* covers each pixel sample, filling whole spans at a time. */
+	for (x = -1; x < s->pw; x++)
+		b->sown[x] = NULL;
+	for (i = noix = 0; i < b->nyact; i++) {
+		th = b->xlist[noix++] = b->yact[i];
+
+		if (IS_RECT2D(th)) {
+			double *ext = rect2d_ext(th);
+			int xa, xb;
+
+			if (ry0 < ext[1] || ry0 > ext[3])
+				continue;
+
+			rect2d_span(s, th, &xa, &xb);
+			for (x = xa; x <= xb; x++) {
+				if (b->sown[x] == NULL || th->ix > b->sown[x]->ix)
+					b->sown[x] = th;
+			}
+		}
+	}
+
+	/* Sort the X lists by x0 */
+#define HEAP_COMPARE(A,B) (A->x0 < B->x0)
+	HEAPSORT(prim2d *,b->xlist,noix)
+#undef HEAP_COMPARE
+	xli = nxact = nsact = 0;
+
+	for (x = -1; x < s->pw; x++) {
+		color2d rv;
+
+		rx0 = (x - 0.5) / s->hres;
+		rx1 = (x + 0.5) / s->hres;
+
+		/* Add any objects that are now within this range to our x lists */
+		for(; xli < noix && rx1 > b->xlist[xli]->x0; xli++) {
+			if (IS_RECT2D(b->xlist[xli]))
+				b->sact[nsact++] = b->xlist[xli];
+			else
+				b->xact[nxact++] = b->xlist[xli];
+		}
+
+		/* Set the default current color */
+		for (j = 0; j < s->ncc; j++)
+			pixv1[x][j] = s->defc[j];
+		pixv1[x][PRIX2D] = -1;			/* Make sure all primitive ovewrite the default */
+
+		flat1[x] = 1;
+
+		/* Allow callback to set per pixel background color (or not) */
+		if (s->bgfunc != NULL) {
+			s->bgfunc(s->cntx, pixv1[x], x, y);
+			flat1[x] = 0;
+		}
+
+		/* Overwrite it with the rectangle that owns this pixel */
+		if ((th = b->sown[x]) != NULL && th->ix > pixv1[x][PRIX2D]) {
+			if (th->rend == rect2d_rend && ((rect2d *)th)->dpat == NULL) {
+				for (j = 0; j < s->ncc; j++)
+					pixv1[x][j] = ((rect2d *)th)->c[j];
+				pixv1[x][PRIX2D] = th->ix;
+			} else if (th->rend(th, rv, rx1, ry0)) {
+				for (j = 0; j < s->ncc; j++)
+					pixv1[x][j] = rv[j];
+				pixv1[x][PRIX2D] = rv[PRIX2D];
+				flat1[x] = 0;
+			}
+		}
+
+		/* Overwrite it with any other primitives, */
+		/* and remove any that are out of range now */
+		for (i = k = 0; i < nxact; i++) {
+			th = b->xact[i];
+			if (rx0 > th->x1)
+				continue;
+			b->xact[k++] = th;
+
+			if (th->rend(th, rv, rx1, ry0) && th->ix > pixv1[x][PRIX2D]) {
+				/* Overwrite the current color */
+				/* (This is where we should handle depth and opacity */
+				for (j = 0; j < s->ncc; j++)
+					pixv1[x][j] = rv[j];
+				pixv1[x][PRIX2D] = rv[PRIX2D];
+				flat1[x] = 0;
+			}
+		}
+		nxact = k;
+
+		/* Check if anti-aliasing is needed for previous lines previous pixel */
+		if (emit && x >= 0) {
+			color2d cc;
+			int flat;
+
+			/* If all four samples are the same flat color, and so were the */
+			/* previous pixels, then the output is the same as the previous pixel. */
+			flat = flat1[x] && flat1[x-1] && flat0[x] && flat0[x-1]
+			    && pixv1[x][PRIX2D] == pixv1[x-1][PRIX2D]
+			    && pixv1[x][PRIX2D] == pixv0[x][PRIX2D]
+			    && pixv1[x][PRIX2D] == pixv0[x-1][PRIX2D];
+
+			if (flat && pixv1[x][PRIX2D] == lastflat) {
+				if (s->dpth == bpc8_2d && s->dither) {
+					unsigned short *p = dithbuf16 + x * s->ncc;
+					for (j = 0; j < s->ncc; j++)
+						p[j] = p[j - s->ncc];
+				} else if (s->dpth == bpc8_2d) {
+					unsigned char *p = outbuf + x * s->ncc;
+					for (j = 0; j < s->ncc; j++)
+						p[j] = p[j - s->ncc];
+				} else {
+					unsigned short *p = ((unsigned short *)outbuf) + x * s->ncc;
+					for (j = 0; j < s->ncc; j++)
+						p[j] = p[j - s->ncc];
+				}
+				continue;
+			}
+			lastflat = flat ? pixv1[x][PRIX2D] : -2.0;
+
+			for (j = 0; j < s->ncc; j++)
+				cc[j] = pixv1[x][j];
+			cc[PRIX2D] = pixv1[x][PRIX2D];
+
+			/* See if anti aliasing is needed */
+			if (!s->noavg
+			 && ((pixv0[x+0][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv0[x+0], cc))
+			  || (pixv0[x-1][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv0[x-1], cc))
+			  || (pixv1[x-1][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv1[x-1], cc)))) {
+				double nn = 0;
+
+				/* Remove any rectangles that are out of range now */
+				for (i = k = 0; i < nsact; i++) {
+					if (rx0 > b->sact[i]->x1)
+						continue;
+					b->sact[k++] = b->sact[i];
+				}
+				nsact = k;
+
+				b->so->reset(b->so);
+
+				for (j = 0; j < s->ncc; j++)
+					cc[j] = 0.0;
+				cc[PRIX2D] = -1;
+
+				/* Compute the sample value by re-sampling the region */
+				/* around the pixel. */
+				for (nn = 0; nn < OSAMLS; nn++) {
+					double pos[2];
+					double rx, ry;
+					color2d ccc;
+
+					b->so->next(b->so, pos);
+
+					rx = (rx1 - rx0) * pos[0] + rx0;
+					ry = (ry1 - ry0) * pos[1] + ry0;
+
+					/* Set the default current color */
+					for (j = 0; j < s->ncc; j++)
+						ccc[j] = s->defc[j];
+					ccc[PRIX2D] = -1;
+
+					for (i = 0; i < (nxact + nsact); i++) {
+						th = i < nxact ? b->xact[i] : b->sact[i - nxact];
+						if (th->rend(th, rv, rx, ry) && th->ix > ccc[PRIX2D]) {
+							/* Overwrite the current color */
+							/* (This is where we should handle depth and opacity */
+							for (j = 0; j < s->ncc; j++)
+								ccc[j] = rv[j];
+							ccc[PRIX2D] = rv[PRIX2D];
+						}
+					}
+					for (j = 0; j < s->ncc; j++)
+						cc[j] += pow(ccc[j], MIXPOW);
+					if (ccc[PRIX2D] > cc[PRIX2D])
+						cc[PRIX2D] = ccc[PRIX2D];	/* Note if not BG */
+				}
+				for (j = 0; j < s->ncc; j++)
+					cc[j] = pow(cc[j]/nn, 1.0/MIXPOW);
+
+#ifdef NEVER	/* Mark aliased pixels */
+				cc[0] = 0.5;
+				cc[1] = 0.0;
+				cc[2] = 1.0;
+#endif
+			} else if (s->noavg) {
+				/* Compute output value directly from primitive */
+
+				for (j = 0; j < s->ncc; j++)
+					cc[j] = cc[j];
+
+			} else {
+
+				/* Compute output value as mean of surrounding samples */
+				for (j = 0; j < s->ncc; j++) {
+					cc[j] = cc[j]
+					      + pixv0[x-1][j]
+					      + pixv0[x][j]
+					      + pixv1[x-1][j];
+					cc[j] = cc[j] * 0.25;
+				}
+				/* Note if not BG */
+				if (pixv0[x-1][PRIX2D] > cc[PRIX2D])
+					cc[PRIX2D] = pixv0[x-1][PRIX2D];
+				if (pixv0[x][PRIX2D] > cc[PRIX2D])
+					cc[PRIX2D] = pixv0[x][PRIX2D];
+				if (pixv1[x-1][PRIX2D] > cc[PRIX2D])
+					cc[PRIX2D] = pixv1[x-1][PRIX2D];
+			}
+			if (cc[PRIX2D] != -1)		/* Line is no longer background */
+				foundfg = 1;
+
+			/* Translate from render value to output pixel value */
+			if (s->dpth == bpc8_2d) {
+
+				/* if dithering and dithering all or found FG in line, */
+				/* start with 16 bit values to dither from */
+				if (s->dither) {
+					unsigned short *p = dithbuf16 + x * s->ncc;
+
+					if (s->csp == lab_2d) {
+						cvt_Lab_to_CIELAB16(cc, cc);
+						for (j = 0; j < s->ncc; j++)
+							p[j] = (int)(cc[j] + 0.5);
+					} else {
+						for (j = 0; j < s->ncc; j++)
+							p[j] = (int)(65535.0 * cc[j] + 0.5);
+					}
+
+				/* Else quantize to 8 bits */
+				} else {
+					unsigned char *p = outbuf + x * s->ncc;
+					if (s->csp == lab_2d) {
+						cvt_Lab_to_CIELAB8(cc, cc);
+						for (j = 0; j < s->ncc; j++)
+							p[j] = (int)(cc[j] + 0.5);
+					} else {
+						for (j = 0; j < s->ncc; j++)
+							p[j] = (int)(255.0 * cc[j] + 0.5);
+					}
+				}
+			} else {
+				unsigned short *p = ((unsigned short *)outbuf) + x * s->ncc;
+				if (s->csp == lab_2d) {
+					cvt_Lab_to_CIELAB16(cc, cc);
+					for (j = 0; j < s->ncc; j++)
+						p[j] = (int)(cc[j] + 0.5);
+				} else {
+					for (j = 0; j < s->ncc; j++)
+						p[j] = (int)(65535.0 * cc[j] + 0.5);
+				}
+			}
+		}
+	}
+
+	if (emit && bgrow != NULL) {
+		for (x = 0; x < s->pw; x++)
+			bgrow[x] = pixv1[x][PRIX2D] == -1;
+	}
+
+	/* Shuffle the pointers */
+	b->pixv0 = pixv1;
+	b->pixv1 = pixv0;
+	b->flat0 = flat1;
+	b->flat1 = flat0;
+	b->nrow = y+1;
+
+	return foundfg;
+}
+
+/* Screen or quantize a line of 16 bit values to 8 bit output pixels */
+static void render2d_screen_row(
+	render2d *s,
+	thscreens *screen,		/* dithering object */
+	int y,					/* Line being output */
+	unsigned char *outbuf,	/* Line output buffer */
+	unsigned short *dithbuf16,	/* 16 bit line to dither from */
+	char *bgrow,			/* Background flag for each pixel */
+	int foundfg				/* nz if line contains forground pixels */
+) {
+	int j, x;
+
+	// If we need to screen this line
+	if (!s->dithfgo || foundfg) {
+		/* If we are dithering only the foreground colors, */
+		/* Subsitute the quantized un-dithered color for any */
+		/* pixels soley from the background */
+		if (s->dithfgo) {
+			int st, ed;
+			unsigned short *ip = dithbuf16;
+			unsigned char *op = outbuf;
+
+			/* Copy pixels up to first non-BG */
+			for (st = 0; st < s->pw; st++, ip += s->ncc, op += s->ncc) {
+				if (bgrow[st]) {
+					for (j = 0; j < s->ncc; j++)
+						op[j] = (ip[j] * 255 + 128)/65535;
+				} else {
+					break;
+				}
+			}
+			if (st < s->pw) {	/* If there are some FG pixels */
+
+				/* Copy down to first non-BG */
+				ip = dithbuf16 + (s->pw-1) * s->ncc;
+				op = outbuf + (s->pw-1) * s->ncc;
+				for (ed = s->pw-1; ed >= st; ed--, ip -= s->ncc, op -= s->ncc) {
+					if (bgrow[ed]) {
+						for (j = 0; j < s->ncc; j++)
+							op[j] = (ip[j] * 255 + 128)/65535;
+					} else {
+						break;
+					}
+				}
+				/* Screen just the FG pixels */
+				ip = dithbuf16 + st * s->ncc;
+				op = outbuf + st * s->ncc;
+				screen->screen(screen, ed-st+1, 1, st, y,
+			                       op, s->pw * s->ncc,
+			                       (unsigned char*)ip, s->pw * s->ncc);
+			}
+
+		/* Dither/screen the whole lot */
+		} else {
+			screen->screen(screen, s->pw, 1, 0, y,
+			                       outbuf, s->pw * s->ncc,
+			                       (unsigned char *)dithbuf16, s->pw * s->ncc);
+		}
+	// Don't need to screen this line - quantize from 16 bit
+	} else {
+		unsigned short *ip = dithbuf16;
+		unsigned char *op = outbuf;
+		for (x = 0; x < s->pw; x++, ip += s->ncc, op += s->ncc) {
+			for (j = 0; j < s->ncc; j++)
+				op[j] = (ip[j] * 255 + 128)/65535;
+		}
+	}
+}
+
+/* Context for rendering a pass of lines as bands */
+typedef struct {
+	render2d *s;
+	prim2d **ylist;			/* Y sorted start list */
+	rband *bs;				/* Per thread band state */
+	int y0, ny;				/* First line and number of lines in this pass */
+	int bh;					/* Lines per band */
+	unsigned char *obuf;	/* Output buffer */
+	int oy0;				/* Line at the start of obuf */
+	size_t opitch;			/* Output buffer line pitch */
+	unsigned short *dbuf;	/* 16 bit lines to dither from for this pass, NULL if none */
+	char *bgbuf;			/* Background pixel flags for this pass, NULL if not needed */
+	int *foundfg;			/* Found foreground flag for each line of this pass */
+	thscreens *screen;		/* Threshold screen to dither bands with, NULL if none */
+} rbandcx;
+
+/* Render bands ix0..ix1-1 of a pass, using band state thix. */
+/* The state carries on from the previous band if it ended on the line */
+/* above, otherwise it re-starts by rendering the line above. */
+/* (Called from the thread pool) */
+static int render2d_band_task(void *cntx, int thix, int ix0, int ix1) {
+	rbandcx *cx = (rbandcx *)cntx;
+	render2d *s = cx->s;
+	rband *b = &cx->bs[thix];
+	int i, y;
+
+	for (i = ix0; i < ix1; i++) {
+		int ys = cx->y0 + i * cx->bh;
+		int ye = ys + cx->bh;
+
+		if (ye > (cx->y0 + cx->ny))
+			ye = cx->y0 + cx->ny;
+
+		if (b->nrow != ys) {
+			b->nrow = -2;
+			b->yli = b->nyact = 0;
+			render2d_row(s, b, cx->ylist, ys-1, 0, NULL, NULL, NULL);
+		}
+		for (y = ys; y < ye; y++) {
+			int r = y - cx->y0;
+
+			unsigned char *obuf = cx->obuf + (y - cx->oy0) * cx->opitch;
+			unsigned short *dbuf = cx->dbuf != NULL ? cx->dbuf + r * s->pw * s->ncc : NULL;
+			char *bgrow = cx->bgbuf != NULL ? cx->bgbuf + r * s->pw : NULL;
+
+			cx->foundfg[r] = render2d_row(s, b, cx->ylist, y, 1, obuf, dbuf, bgrow);
+
+			/* Threshold screening doesn't depend on the previous lines */
+			if (cx->screen != NULL)
+				render2d_screen_row(s, cx->screen, y, obuf, dbuf, bgrow, cx->foundfg[r]);
+		}
+	}
+	return 0;
+}
+
 
 /* Render and write to a TIFF or PNG file or memory buffer */
 /* Return NZ on error */
@@ -322,9 +868,11 @@ static int render2d_write(
 	uint16 photometric = 0;
 	uint16 inkset = 0xffff;
 	char *inknames = NULL;
+	int rps = 1;				/* Rows per strip */
 #endif
 
 #ifdef RENDER_PNG
+	png_bytep *png_rows = NULL;		/* Pointers to the lines of a pass */
 	FILE *png_fp = NULL;
 	png_mem_info png_minfo = { NULL, 0, 0 };
 	png_structp png_ptr = NULL;
@@ -340,21 +888,22 @@ static int render2d_write(
 	int ppitch;
 	int lpitch;
 
-	unsigned char *outbuf = NULL;		/* Line output buffer at depth and pixel size */ 
-	unsigned char *dithbuf16 = NULL;	/* 16 bit buffer for dithering */
+	unsigned char *outbuf = NULL;		/* Lines output buffer at depth and pixel size */ 
+	size_t opitch = 0;					/* Output buffer line pitch */
+	unsigned short *dithbuf16 = NULL;	/* 16 bit lines buffer for dithering */
+	char *bgbuf = NULL;					/* Background pixel flags for dithering FG only */
+	int *foundfg = NULL;				/* Found a forground object in each line */
 	thscreens *screen = NULL;			/* dithering object */
-	int foundfg;						/* Found a forground object in this line */
-	prim2d *th, **pthp;
-	prim2d **xlist, **ylist;	/* X, Y sorted start lists */
-	int xli, yli;				/* Indexes into X, Y list */
-	int noix;					/* Number in x list */
-	color2d *pixv0, *_pixv0;	/* Storage for pixel values around current */
-	color2d *pixv1, *_pixv1;
-	sobol *so;					/* Random sampler for anti-aliasing */
-	int i, j;
+	athreadpool *pool = NULL;			/* Threads to render bands with */
+	int nthr = 1;						/* Number of bands rendered in parallel */
+	int prows;							/* Lines rendered in each pass */
+	rband *bs = NULL;					/* Per thread band state */
+	rbandcx cx;
+	prim2d *th;
+	prim2d **ylist;				/* Y sorted start lists */
+	int i;
 
-	double rx0, rx1, ry0, ry1;	/* Box being processed, newest sample is rx1, ry1 */
-	int x, y;					/* Pixel x & y index */
+	int y;						/* Pixel y index */
 
 #ifdef CCTEST_PATTERN		// For testing by making screen visible
 #pragma message("######### render.c TEST_PATTERN defined ! ##")
@@ -372,8 +921,13 @@ static int render2d_write(
 	}
 #endif
 
-	if ((so = new_sobol(2)) == NULL)
-		return 1;
+	/* Render bands of lines in parallel, unless the background */
+	/* callback is set, since it needn't be thread safe. */
+	/* (The pool is created once everything else is set up.) */
+	if (s->bgfunc == NULL && s->ph >= (2 * RBANDH)
+	 && (nthr = system_processors()) < 1)
+		nthr = 1;
+	prows = nthr * RBANDH;
 
 	if (fmt == tiff_file) {
 #ifdef RENDER_TIFF
@@ -412,8 +966,8 @@ static int render2d_write(
 				extrasamples = 0;
 				if (samplesperpixel > 4) {
 					extrasamples = samplesperpixel - 4;	/* Call samples > 4 "alpha" samples */
-					for (j = 0; j < extrasamples; j++)
-						extrainfo[j] = EXTRASAMPLE_UNASSALPHA;
+					for (i = 0; i < extrasamples; i++)
+						extrainfo[i] = EXTRASAMPLE_UNASSALPHA;
 				}
 				photometric = PHOTOMETRIC_SEPARATED;
 				inkset = 0;			// ~~99 should fix this
@@ -471,8 +1025,18 @@ static int render2d_write(
 		}
 		TIFFSetField(wh, TIFFTAG_IMAGEDESCRIPTION, "Test chart created with Argyll");
 
-		/* Allocate one TIFF line buffer */
-		outbuf = _TIFFmalloc(TIFFScanlineSize(wh));
+		/* Allocate a TIFF line buffer for each line of a pass */
+		opitch = TIFFScanlineSize(wh);
+		if ((outbuf = _TIFFmalloc(opitch * prows)) == NULL) {
+			a1loge(g_log, 1, "malloc of TIFF line buffers failed\n");
+			return 1;
+		}
+
+		/* Each pass is written as whole strips. Make the strips */
+		/* a divisor of the band height that aren't too big. */
+		for (rps = RBANDH; rps > 1 && (rps * opitch) > STRIPSZ; rps /= 2)
+			;
+		TIFFSetField(wh, TIFFTAG_ROWSPERSTRIP, rps);
 #else
 		a1loge(g_log, 1, "render2d: TIFF format not compiled in\n");
 		return 1;
@@ -595,8 +1159,10 @@ static int render2d_write(
 				png_set_swap(png_ptr);
 		}
 
-		/* Allocate one PNG line buffer */
-		if ((outbuf = malloc((png_bit_depth >> 3) * png_samplesperpixel * s->pw) ) == NULL) {
+		/* Allocate a PNG line buffer for each line of a pass */
+		opitch = (png_bit_depth >> 3) * png_samplesperpixel * s->pw;
+		if ((outbuf = malloc(opitch * prows)) == NULL
+		 || (png_rows = (png_bytep *)malloc(sizeof(png_bytep) * prows)) == NULL) {
 			a1loge(g_log, 1, "malloc of PNG line buffer failed\n");
 			return 1;
 		}
@@ -624,7 +1190,7 @@ static int render2d_write(
 		s->lpitch = (s->lpitch + 7) & ~7;
 
 		/* Allocate raster */
-		rast_len = s->lpitch * s->pw;
+		rast_len = s->lpitch * s->ph;
 		if ((rast = malloc(rast_len)) == NULL) {
 			a1loge(g_log, 1, "malloc of memory raster failed\n");
 			return 1;
@@ -635,14 +1201,6 @@ static int render2d_write(
 		return 1;
 	}
 
-	/* Allocate pixel value storage for aliasing detection */
-	if ((_pixv0 = malloc(sizeof(color2d) * (s->pw+2))) == NULL)
-		return 1;
-	pixv0 = _pixv0+1;
-	if ((_pixv1 = malloc(sizeof(color2d) * (s->pw+2))) == NULL)
-		return 1;
-	pixv1 = _pixv1+1;
-
 	if (s->dpth == bpc8_2d && s->dither) {
 #ifdef TEST_SCREENING		// For testing by making screen visible
 #pragma message("######### render TEST_SCREENING defined! ##")
@@ -660,20 +1218,23 @@ static int render2d_write(
 		                           s->dither == 2 ? 1 : 0, s->quant, s->qcntx, s->mxerr)) == NULL)
 #endif
 			return 1;
-		if ((dithbuf16 = malloc(s->pw * s->ncc * 2)) == NULL)
+		if ((dithbuf16 = malloc(prows * s->pw * s->ncc * 2)) == NULL)
+			return 1;
+		if (s->dithfgo && (bgbuf = malloc(prows * s->pw)) == NULL)
 			return 1;
 	}
+	if ((foundfg = malloc(sizeof(int) * prows)) == NULL)
+		return 1;
 
 	/* To accelerate rendering, we keep sorted Y and X lists, */
-	/* and Y and X active linked lists derived from them. */
+	/* and Y and X active lists derived from them. */
 	/* Typically this means that we're calling render on */
 	/* none, 1 or a handful of the primitives, greatly speeding up */
-	/* rendering. */
+	/* rendering. Rectangles are filled as spans, so only the */
+	/* rectangle that owns a pixel gets rendered. */
 
-	/* Allocate X and Y ordered lists */
-	if ((ylist = malloc(sizeof(prim2d *) * s->ix)) == NULL)
-		return 1;
-	if ((xlist = malloc(sizeof(prim2d *) * s->ix)) == NULL)
+	/* Allocate Y ordered list */
+	if ((ylist = malloc(sizeof(prim2d *) * (s->ix > 0 ? s->ix : 1))) == NULL)
 		return 1;
 
 	/* Initialise the Y list */
@@ -684,321 +1245,105 @@ static int render2d_write(
 #define HEAP_COMPARE(A,B) (A->y1 > B->y1)
 	HEAPSORT(prim2d *,ylist,s->ix)
 #undef HEAP_COMPARE
-	yli = 0;
-	s->yl = NULL;
-
-	/* Render each line and write it, in raster order. */
-	/* We sample +- half a pixel around the pixel we want. */
-	/* We make the active element list encompass this region, */
-	/* so that we can super sample it for anti-aliasing. */
-	for (y = -1; y < s->ph; y++) {
-		foundfg = 0;
-
-		/* Convert to coordinate order */
-		ry0 = (((s->ph-1) - y) - 0.5) / s->vres;
-		ry1 = (((s->ph-1) - y) + 0.5) / s->vres;
-
-		/* Remove any objects from the y list that are now out of range */
-		for (pthp = &s->yl, th = s->yl; th != NULL;) {
-			if (ry1 < th->y0) {
-				*pthp = th->yl;
-				th = th->yl;
-			} else {
-				pthp = &th->yl;
-				th = th->yl;
-			}
-		}
-
-		/* Add any objects that are now within this range to our y list */
-		for(; yli < s->ix && ry0 < ylist[yli]->y1; yli++) {
-			ylist[yli]->yl = s->yl;
-			s->yl = ylist[yli];
-		}
-
-		/* Initialise the current X list */
-		for (th = s->yl, noix = 0; th != NULL; th = th->yl, noix++)
-			xlist[noix] = th;
-		
-		/* Sort the X lists by x0 */
-#define HEAP_COMPARE(A,B) (A->x0 < B->x0)
-		HEAPSORT(prim2d *,xlist,noix)
-#undef HEAP_COMPARE
-		xli = 0;
-		s->xl = NULL;
-
-		
-		if (fmt == mem_rast)
-			outbuf = rast + y * s->lpitch;
-
-		for (x = -1; x < s->pw; x++) {
-			int j;
-			color2d rv;
-
-			rx0 = (x - 0.5) / s->hres;
-			rx1 = (x + 0.5) / s->hres;
-
-			/* Add any objects that are now within this range to our x list */
-			for(; xli < noix && rx1 > xlist[xli]->x0; xli++) {
-				xlist[xli]->xl = s->xl;
-				s->xl = xlist[xli];
-			}
-
-			/* Set the default current color */
-			for (j = 0; j < s->ncc; j++)
-				pixv1[x][j] = s->defc[j];
-			pixv1[x][PRIX2D] = -1;			/* Make sure all primitive ovewrite the default */
-
-			/* Allow callback to set per pixel background color (or not) */
-			if (s->bgfunc != NULL)
-				s->bgfunc(s->cntx, pixv1[x], x, y);
-
-			/* Overwrite it with any primitives, */
-			/* and remove any that are out of range now */
-			for (pthp = &s->xl, th = s->xl; th != NULL;) {
-				if (rx0 > th->x1) {
-					*pthp = th->xl;
-					th = th->xl;
-				} else {
-//printf("x %d y %d, rx1 %f, ry0 %f\n",x,y,rx1, ry0);
-
-					if (th->rend(th, rv, rx1, ry0) && th->ix > pixv1[x][PRIX2D]) {
-						/* Overwrite the current color */
-						/* (This is where we should handle depth and opacity */
-						for (j = 0; j < s->ncc; j++)
-							pixv1[x][j] = rv[j];
-						pixv1[x][PRIX2D] = rv[PRIX2D];
-//printf("x %d y %d, set %f %f %f ix %f\n",x,y,rv[0],rv[1],rv[2], rv[PRIX2D]);
-					}
-					pthp = &th->xl;
-					th = th->xl;
-				}
-			}
-			/* Check if anti-aliasing is needed for previous lines previous pixel */
-			if (y >= 0 && x >= 0) {
-				color2d cc;
-
-				for (j = 0; j < s->ncc; j++)
-					cc[j] = pixv1[x][j];
-				cc[PRIX2D] = pixv1[x][PRIX2D];
-
-				/* See if anti aliasing is needed */
-				if (!s->noavg
-				 && ((pixv0[x+0][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv0[x+0], cc))
-				  || (pixv0[x-1][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv0[x-1], cc))
-				  || (pixv1[x-1][PRIX2D] != cc[PRIX2D] && colordiff(s, pixv1[x-1], cc)))) {
-					double nn = 0;
-
-					so->reset(so);
-
-					for (j = 0; j < s->ncc; j++)
-						cc[j] = 0.0;
-					cc[PRIX2D] = -1;
-
-					/* Compute the sample value by re-sampling the region */
-					/* around the pixel. */
-					for (nn = 0; nn < OSAMLS; nn++) {
-						double pos[2];
-						double rx, ry;
-						color2d ccc;
-
-						so->next(so, pos);
 
-						rx = (rx1 - rx0) * pos[0] + rx0;
-						ry = (ry1 - ry0) * pos[1] + ry0;
-
-						/* Set the default current color */
-						for (j = 0; j < s->ncc; j++)
-							ccc[j] = s->defc[j];
-						ccc[PRIX2D] = -1;
-
-						for (th = s->xl; th != NULL; th = th->xl) {
-							if (th->rend(th, rv, rx, ry) && th->ix > ccc[PRIX2D]) {
-								/* Overwrite the current color */
-								/* (This is where we should handle depth and opacity */
-								for (j = 0; j < s->ncc; j++)
-									ccc[j] = rv[j];
-								ccc[PRIX2D] = rv[PRIX2D];
-							}
-						}
-						for (j = 0; j < s->ncc; j++)
-							cc[j] += pow(ccc[j], MIXPOW);
-						if (ccc[PRIX2D] > cc[PRIX2D])
-							cc[PRIX2D] = ccc[PRIX2D];	/* Note if not BG */
-					}
-					for (j = 0; j < s->ncc; j++)
-						cc[j] = pow(cc[j]/nn, 1.0/MIXPOW);
-
-#ifdef NEVER	/* Mark aliased pixels */
-					cc[0] = 0.5;
-					cc[1] = 0.0;
-					cc[2] = 1.0;
-#endif
-				} else if (s->noavg) {
-					/* Compute output value directly from primitive */
-
-					for (j = 0; j < s->ncc; j++)
-						cc[j] = cc[j];
-
-				} else {
-
-					/* Compute output value as mean of surrounding samples */
-					for (j = 0; j < s->ncc; j++) {
-						cc[j] = cc[j]
-						      + pixv0[x-1][j]
-						      + pixv0[x][j]
-						      + pixv1[x-1][j];
-						cc[j] = cc[j] * 0.25;
-					}
-					/* Note if not BG */
-					if (pixv0[x-1][PRIX2D] > cc[PRIX2D])
-						cc[PRIX2D] = pixv0[x-1][PRIX2D];
-					if (pixv0[x][PRIX2D] > cc[PRIX2D])
-						cc[PRIX2D] = pixv0[x][PRIX2D];
-					if (pixv1[x-1][PRIX2D] > cc[PRIX2D])
-						cc[PRIX2D] = pixv1[x-1][PRIX2D];
-				}
-				if (cc[PRIX2D] != -1)		/* Line is no longer background */
-					foundfg = 1;
-
-				/* Translate from render value to output pixel value */
-				if (s->dpth == bpc8_2d) {
-
-					/* if dithering and dithering all or found FG in line, */
-					/* start with 16 bit values to dither from */
-					if (s->dither) {
-						unsigned short *p = ((unsigned short *)dithbuf16) + x * s->ncc;
-
-						if (s->csp == lab_2d) {
-							cvt_Lab_to_CIELAB16(cc, cc);
-							for (j = 0; j < s->ncc; j++)
-								p[j] = (int)(cc[j] + 0.5);
-						} else {
-							for (j = 0; j < s->ncc; j++)
-								p[j] = (int)(65535.0 * cc[j] + 0.5);
-						}
-
-					/* Else quantize to 8 bits */
-					} else {
-						unsigned char *p = ((unsigned char *)outbuf) + x * s->ncc;
-						if (s->csp == lab_2d) {
-							cvt_Lab_to_CIELAB8(cc, cc);
-							for (j = 0; j < s->ncc; j++)
-								p[j] = (int)(cc[j] + 0.5);
-						} else {
-							for (j = 0; j < s->ncc; j++)
-								p[j] = (int)(255.0 * cc[j] + 0.5);
-						}
-					}
-				} else {
-					unsigned short *p = ((unsigned short *)outbuf) + x * s->ncc;
-					if (s->csp == lab_2d) {
-						cvt_Lab_to_CIELAB16(cc, cc);
-						for (j = 0; j < s->ncc; j++)
-							p[j] = (int)(cc[j] + 0.5);
-					} else {
-						for (j = 0; j < s->ncc; j++)
-							p[j] = (int)(65535.0 * cc[j] + 0.5);
-					}
-				}
-			}
-		}
+	/* Allocate the per thread band state */
+	if ((bs = (rband *)calloc(sizeof(rband), nthr)) == NULL)
+		return 1;
+	for (i = 0; i < nthr; i++) {
+		if (init_rband(s, &bs[i]))
+			return 1;
+	}
 
-		if (y >= 0) {
-			/* if dithering and dithering all or found FG in line */
-			if (s->dpth == bpc8_2d && s->dither) {
-				// If we need to screen this line
-				if (!s->dithfgo || foundfg) {
-					/* If we are dithering only the foreground colors, */
-					/* Subsitute the quantized un-dithered color for any */
-					/* pixels soley from the background */
-					if (s->dithfgo) {
-						int st, ed;
-						unsigned short *ip = ((unsigned short *)dithbuf16);
-						unsigned char *op = ((unsigned char *)outbuf);
-
-						/* Copy pixels up to first non-BG */
-						for (st = 0; st < s->pw; st++, ip += s->ncc, op += s->ncc) {
-							if (pixv1[st][PRIX2D] == -1) {
-								for (j = 0; j < s->ncc; j++)
-									op[j] = (ip[j] * 255 + 128)/65535;
-							} else {
-								break;
-							}
-						}
-						if (st < s->pw) {	/* If there are some FG pixels */
-
-							/* Copy down to first non-BG */
-							ip = ((unsigned short *)dithbuf16) + (s->pw-1) * s->ncc;
-							op = ((unsigned char *)outbuf) + (s->pw-1) * s->ncc;
-							for (ed = s->pw-1; ed >= st; ed--, ip -= s->ncc, op -= s->ncc) {
-								if (pixv1[ed][PRIX2D] == -1) {
-									for (j = 0; j < s->ncc; j++)
-										op[j] = (ip[j] * 255 + 128)/65535;
-								} else {
-									break;
-								}
-							}
-							/* Screen just the FG pixels */
-							ip = ((unsigned short *)dithbuf16) + st * s->ncc;
-							op = ((unsigned char *)outbuf) + st * s->ncc;
-							screen->screen(screen, ed-st+1, 1, st, y,
-						                       op, s->pw * s->ncc,
-						                       (unsigned char*)ip, s->pw * s->ncc);
-						}
+	if (nthr > 1)
+		pool = new_athreadpool(nthr);
+
+	cx.s = s;
+	cx.ylist = ylist;
+	cx.bs = bs;
+	cx.dbuf = dithbuf16;
+	cx.bgbuf = bgbuf;
+	cx.foundfg = foundfg;
+	cx.screen = screen != NULL && !screen->edif ? screen : NULL;
+	if (fmt == mem_rast) {
+		cx.obuf = rast;
+		cx.opitch = s->lpitch;
+	} else {
+		cx.obuf = outbuf;
+		cx.opitch = opitch;
+	}
 
-					/* Dither/screen the whole lot */
-					} else {
-						screen->screen(screen, s->pw, 1, 0, y,
-						                       (unsigned char *)outbuf, s->pw * s->ncc,
-						                       dithbuf16, s->pw * s->ncc);
-					}
-				// Don't need to screen this line - quantize from 16 bit
-				} else {
-					unsigned short *ip = ((unsigned short *)dithbuf16);
-					unsigned char *op = ((unsigned char *)outbuf);
-					for (x = 0; x < s->pw; x++, ip += s->ncc, op += s->ncc) {
-						for (j = 0; j < s->ncc; j++)
-							op[j] = (ip[j] * 255 + 128)/65535;
-					}
-				}
-			}
+	/* Render the lines a pass at a time, with each pass split into a band */
+	/* per thread. We sample +- half a pixel around the pixel we want, */
+	/* so that we can super sample it for anti-aliasing. Then dither */
+	/* and write each line of the pass, in raster order. */
+	for (cx.y0 = 0; cx.y0 < s->ph; cx.y0 += prows) {
+		int nb;
+
+		cx.ny = s->ph - cx.y0;
+		if (cx.ny > prows)
+			cx.ny = prows;
+		cx.oy0 = fmt == mem_rast ? 0 : cx.y0;
+		cx.bh = (cx.ny + nthr - 1)/nthr;
+		nb = (cx.ny + cx.bh - 1)/cx.bh;
+
+		if (pool != NULL && nb > 1)
+			pool->run(pool, nb, render2d_band_task, (void *)&cx);
+		else
+			render2d_band_task((void *)&cx, 0, 0, nb);
+
+		for (y = cx.y0; y < (cx.y0 + cx.ny); y++) {
+			int r = y - cx.y0;
+			unsigned char *obuf = cx.obuf + (y - cx.oy0) * cx.opitch;
+			unsigned short *dbuf = dithbuf16 != NULL ? dithbuf16 + r * s->pw * s->ncc : NULL;
+			char *bgrow = bgbuf != NULL ? bgbuf + r * s->pw : NULL;
+
+			/* if dithering using error diffusion, screen in raster order */
+			if (screen != NULL && cx.screen == NULL)
+				render2d_screen_row(s, screen, y, obuf, dbuf, bgrow, foundfg[r]);
 
 #ifdef CCTEST_PATTERN		// Substitute the testing pattern
 			if (do_test_pattern) {
+				int x;
 				for (x = 0; x < s->pw; x++)
-					test_value(s, outbuf, x, y);
+					test_value(s, obuf, x, y);
 			}
 #endif
-			if (fmt == tiff_file) {
+		}
+
+		/* Hand the pass of lines to the encoder in one go */
+		if (fmt == tiff_file) {
 #ifdef RENDER_TIFF
+			for (y = cx.y0; y < (cx.y0 + cx.ny); y += rps) {
+				int nr = cx.y0 + cx.ny - y;
 
-				if (TIFFWriteScanline(wh, outbuf, y, 0) < 0) {
+				if (nr > rps)
+					nr = rps;
+				if (TIFFWriteEncodedStrip(wh, y / rps, outbuf + (y - cx.y0) * opitch,
+				                          nr * opitch) < 0) {
 					a1loge(g_log, 1, "Failed to write TIFF file '%s' line %d\n",filename,y);
 					return 1;
 				}
+			}
 #endif	/* TIFF */
-			} else if (fmt == png_file
-			        || fmt == png_mem) {
+		} else if (fmt == png_file
+		        || fmt == png_mem) {
 #ifdef RENDER_PNG
-				png_bytep pixdata = (png_bytep)outbuf;
-				png_write_rows(png_ptr, &pixdata, 1);
+			for (i = 0; i < cx.ny; i++)
+				png_rows[i] = (png_bytep)(outbuf + i * opitch);
+			png_write_rows(png_ptr, png_rows, cx.ny);
 #endif	/* PNG */
-			}
-		}
-
-		/* Shuffle the pointers */
-		{
-			color2d *ttt;
-			ttt = pixv0;
-			pixv0 = pixv1;
-			pixv1 = ttt;
 		}
 	}
 
+	if (pool != NULL)
+		pool->del(pool);
+	for (i = 0; i < nthr; i++)
+		del_rband(&bs[i]);
+	free(bs);
 	free(ylist);
-	free(xlist);
-	free(_pixv0);
-	free(_pixv1);
+	free(foundfg);
+	if (bgbuf != NULL)
+		free(bgbuf);
 
 	if (dithbuf16 != NULL)
 		free(dithbuf16);
@@ -1016,6 +1361,7 @@ static int render2d_write(
 
 #ifdef RENDER_PNG
 		free(outbuf);
+		free(png_rows);
 		png_write_end(png_ptr, NULL);
 //		png_destroy_info_struct(png_ptr, &png_info);
 		png_destroy_write_struct(&png_ptr, &png_info);
@@ -1036,8 +1382,6 @@ static int render2d_write(
 		rast = NULL;
 	}
 
-	so->del(so);
-
 	return 0;
 }
 
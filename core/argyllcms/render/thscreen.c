@@ -472,11 +472,17 @@ void thscreen16_8(
 		unsigned short *ip = in;	/* Horizontal input pointer */
 		unsigned char *op = out;	/* Horizontal output pointer */
 
-		/* Do pixels one output byte at a time */
-		for (; ip < ein1; ip += ipinc, op += opinc) {
-			int tt = lut[*ip];
-			*op = (unsigned char)th[0][tt];
-			if (++th >= eth)
+		/* Do pixels one output byte at a time, in runs */
+		/* up to where the screen wraps horizontally. */
+		while (ip < ein1) {
+			long n = eth - th;			/* Pixels to horizontal wrap */
+			unsigned short *eip;
+
+			if (n > ((ein1 - ip) / (long)ipinc))
+				n = (ein1 - ip) / (long)ipinc;
+			for (eip = ip + n * ipinc; ip < eip; ip += ipinc, op += opinc, th++)
+				*op = (unsigned char)th[0][lut[*ip]];
+			if (th >= eth)
 				th -= t->swidth;
 		}
 
@@ -95,6 +95,7 @@
 # include <windows.h>
 #else
 # include <unistd.h>
+# include <pthread.h>
 # ifdef __APPLE__
 #  include <fcntl.h>
 #  include <sys/types.h>
@@ -287,6 +288,29 @@ size_t g_test_ram = 0;			/* Amount of memory that has been tested to be allocata
 int g_no_rev_cache_instances = 0;
 rev_struct *g_rev_instances = NULL;
 
+/* The above are shared by every rspl, and rspl's may be used from more */
+/* than one thread at a time (each thread using its own rspl), so */
+/* they are protected by a lock. An rspl's own cache is only ever trimmed */
+/* by the thread using it - other instances just get a new max_sz, */
+/* and trim themselves the next time they add to their cache. */
+#ifdef NT
+static CRITICAL_SECTION g_rev_lock;
+static int g_rev_lock_inited = 0;
+
+static void rev_lock() {
+	if (!g_rev_lock_inited) {		/* First instance is created before any threads */
+		InitializeCriticalSection(&g_rev_lock);
+		g_rev_lock_inited = 1;
+	}
+	EnterCriticalSection(&g_rev_lock);
+}
+# define rev_unlock() LeaveCriticalSection(&g_rev_lock)
+#else
+static pthread_mutex_t g_rev_lock = PTHREAD_MUTEX_INITIALIZER;
+# define rev_lock() pthread_mutex_lock(&g_rev_lock)
+# define rev_unlock() pthread_mutex_unlock(&g_rev_lock)
+#endif
+
 /* ------------------------------------------------------ */
 /* Retry allocation routines - if the malloc fails,       */
 /* try reducing the cache size and trying again */
@@ -294,8 +318,10 @@ rev_struct *g_rev_instances = NULL;
 
 /* When a malloc fails, reduce the maximum cache to */
 /* it's current allocation minus the given size. */
-static void rev_reduce_cache(size_t size) {
+/* (Must be called with g_rev_lock held) */
+static void rev_reduce_cache(rspl *s, size_t size) {
 	rev_struct *rsi;
+	revcache *rc = s->rev.cache;
 	size_t ram;
 
 	/* Compute how much ram is currently allocated */
@@ -309,19 +335,20 @@ static void rev_reduce_cache(size_t size) {
 //printf("~1 rev: Reducing cache because alloc of %" PFSTPREC "u bytes failed. Reduced from %lu to %lu MB\n", size, (unsigned long)(g_avail_ram/1000000), (unsigned long)((ram - size)/1000000));
 	ram = g_avail_ram = ram - size;
 
-	/* Aportion the memory, and reduce the cache allocation to match */
+	/* Aportion the memory, and reduce our cache allocation to match. */
+	/* Other instances will reduce theirs when they next add to it. */
 	ram /= g_no_rev_cache_instances; 
-	for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next) {
-		revcache *rc = rsi->cache;
-
+	for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next)
 		rsi->max_sz = ram;
-		while (rc->nunlocked > 0 && rsi->sz > rsi->max_sz) {
-			if (decrease_revcache(rc) == 0)
-				break;
-		}
-//printf("~1 rev instance ram = %lu MB\n",(unsigned long)(rsi->sz/1000000));
+	s->rev.max_sz = ram;
+
+	while (rc != NULL && rc->nunlocked > 0 && s->rev.sz > s->rev.max_sz) {
+		if (decrease_revcache(rc) == 0)
+			break;
 	}
-	if (g_rev_instances != NULL && g_rev_instances->sb->s->verbose)
+//printf("~1 rev instance ram = %lu MB\n",(unsigned long)(s->rev.sz/1000000));
+
+	if (s->verbose)
 		printf("%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
               cr_char,
 				g_no_rev_cache_instances > 1 ? "are" : "is",
@@ -334,7 +361,8 @@ static void rev_reduce_cache(size_t size) {
 /* can be allocated, and if not, reduce the rev-cache limit. */
 /* This is so as to detect running out of VM before */
 /* we actually run out and (on OS X) avoid emitting a warning. */
-static void rev_test_vram(size_t size) {
+/* (Must be called with g_rev_lock held) */
+static void rev_test_vram(rspl *s, size_t size) {
 	char *a1;
 #ifdef __APPLE__
 	int old_stderr, new_stderr;
@@ -348,7 +376,7 @@ static void rev_test_vram(size_t size) {
 #endif
 	size += 20 * 1024 * 1024;	/* This depends on the VM region allocation size */
 	if ((a1 = malloc(size)) == NULL) {
-		rev_reduce_cache(size);
+		rev_reduce_cache(s, size);
 	} else {
 		free(a1);
 	}
@@ -364,14 +392,21 @@ static void rev_test_vram(size_t size) {
 static void *rev_malloc(rspl *s, size_t size) {
 	void *rv;
 
+	rev_lock();
 	if ((size + 1 * 1024 * 1024) > g_test_ram)
-		rev_test_vram(size);
+		rev_test_vram(s, size);
+	rev_unlock();
 	if ((rv = malloc(size)) == NULL) {
-		rev_reduce_cache(size);
+		rev_lock();
+		rev_reduce_cache(s, size);
+		rev_unlock();
 		rv = malloc(size);
 	}
-	if (rv != NULL)
+	if (rv != NULL) {
+		rev_lock();
 		g_test_ram -= size;
+		rev_unlock();
+	}
 
 	return rv;
 }
@@ -379,14 +414,21 @@ static void *rev_malloc(rspl *s, size_t size) {
 static void *rev_calloc(rspl *s, size_t num, size_t size) {
 	void *rv;
 
+	rev_lock();
 	if (((num * size) + 1 * 1024 * 1024) > g_test_ram)
-		rev_test_vram(size);
+		rev_test_vram(s, size);
+	rev_unlock();
 	if ((rv = calloc(num, size)) == NULL) {
-		rev_reduce_cache(num * size);
+		rev_lock();
+		rev_reduce_cache(s, num * size);
+		rev_unlock();
 		rv = calloc(num, size);
 	}
-	if (rv != NULL)
+	if (rv != NULL) {
+		rev_lock();
 		g_test_ram -= size;
+		rev_unlock();
+	}
 
 	return rv;
 }
@@ -394,14 +436,21 @@ static void *rev_calloc(rspl *s, size_t num, size_t size) {
 static void *rev_realloc(rspl *s, void *ptr, size_t size) {
 	void *rv;
 
+	rev_lock();
 	if ((size + 1 * 1024 * 1024) > g_test_ram)
-		rev_test_vram(size);
+		rev_test_vram(s, size);
+	rev_unlock();
 	if ((rv = realloc(ptr, size)) == NULL) {
-		rev_reduce_cache(size);		/* approximation */
+		rev_lock();
+		rev_reduce_cache(s, size);		/* approximation */
+		rev_unlock();
 		rv = realloc(ptr, size);
 	}
-	if (rv != NULL)
+	if (rv != NULL) {
+		rev_lock();
 		g_test_ram -= size;
+		rev_unlock();
+	}
 
 	return rv;
 }
@@ -6407,7 +6456,10 @@ rspl *s		/* Pointer to rspl grid */
 
 	if (di > 1 && s->rev.rev_valid) {
 		rev_struct *rsi, **rsp;
-		size_t ram_portion = g_avail_ram;
+		size_t ram_portion;
+		int no_instances;
+
+		rev_lock();
 
 		/* Remove it from the linked list */
 		for (rsp = &g_rev_instances; *rsp != NULL; rsp = &((*rsp)->next)) {
@@ -6418,20 +6470,23 @@ rspl *s		/* Pointer to rspl grid */
 		}
 
 		/* Aportion the memory */
-		g_no_rev_cache_instances--;
+		ram_portion = g_avail_ram;
+		no_instances = --g_no_rev_cache_instances;
 
-		if (g_no_rev_cache_instances > 0) {
-			ram_portion /= g_no_rev_cache_instances; 
+		if (no_instances > 0) {
+			ram_portion /= no_instances; 
 			for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next)
 				rsi->max_sz = ram_portion;
-			if (s->verbose)
-				fprintf(stdout, "%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
-				                cr_char,
-								g_no_rev_cache_instances > 1 ? "are" : "is",
-			                    g_no_rev_cache_instances,
-								g_no_rev_cache_instances > 1 ? "s" : "",
-			                    (unsigned long)(ram_portion/1000000));
 		}
+		rev_unlock();
+
+		if (no_instances > 0 && s->verbose)
+			fprintf(stdout, "%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
+			                cr_char,
+							no_instances > 1 ? "are" : "is",
+		                    no_instances,
+							no_instances > 1 ? "s" : "",
+		                    (unsigned long)(ram_portion/1000000));
 	}
 
 	s->rev.rev_valid = 0;
@@ -9440,32 +9495,38 @@ rspl *s
 	/* Add this instance into memory management */
 	if (s->rev.rev_valid == 0 && di > 1) {
 		rev_struct *rsi;
-		size_t ram_portion = g_avail_ram;
+		size_t ram_portion;
+		revcache *rc = s->rev.cache;
+		int no_instances;
+
+		rev_lock();
 
 		/* Add into linked list */
 		s->rev.next = g_rev_instances;
 		g_rev_instances = &s->rev;
 
-		/* Aportion the memory, and reduce cache if it is over new limit. */
-		g_no_rev_cache_instances++;
-		ram_portion /= g_no_rev_cache_instances; 
-		for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next) {
-			revcache *rc = rsi->cache;
-
+		/* Aportion the memory, and reduce our cache if it is over new limit. */
+		/* Other instances reduce theirs when they next add to it. */
+		ram_portion = g_avail_ram;
+		no_instances = ++g_no_rev_cache_instances;
+		ram_portion /= no_instances; 
+		for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next)
 			rsi->max_sz = ram_portion;
-			while (rc->nunlocked > 0 && rsi->sz > rsi->max_sz) {
-				if (decrease_revcache(rc) == 0)
-					break;
-			}
-//printf("~1 rev instance ram = %lu MB\n",(unsigned long)(rsi->sz/1000000));
+
+		rev_unlock();
+
+		while (rc->nunlocked > 0 && s->rev.sz > s->rev.max_sz) {
+			if (decrease_revcache(rc) == 0)
+				break;
 		}
+//printf("~1 rev instance ram = %lu MB\n",(unsigned long)(s->rev.sz/1000000));
 		
 		if (s->verbose)
 			fprintf(stdout, "%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
 			                    cr_char,
-								g_no_rev_cache_instances > 1 ? "are" : "is",
-			                    g_no_rev_cache_instances,
-								g_no_rev_cache_instances > 1 ? "s" : "",
+								no_instances > 1 ? "are" : "is",
+			                    no_instances,
+								no_instances > 1 ? "s" : "",
 			                    (unsigned long)(ram_portion/1000000));
 	}
 
@@ -11867,7 +11928,10 @@ rspl *s		/* Pointer to rspl grid */
 
 	if (di > 1 && s->rev.rev_valid) {
 		rev_struct *rsi, **rsp;
-		size_t ram_portion = g_avail_ram;
+		size_t ram_portion;
+		int no_instances;
+
+		rev_lock();
 
 		/* Remove it from the linked list */
 		for (rsp = &g_rev_instances; *rsp != NULL; rsp = &((*rsp)->next)) {
@@ -11878,20 +11942,23 @@ rspl *s		/* Pointer to rspl grid */
 		}
 
 		/* Aportion the memory */
-		g_no_rev_cache_instances--;
+		ram_portion = g_avail_ram;
+		no_instances = --g_no_rev_cache_instances;
 
-		if (g_no_rev_cache_instances > 0) {
-			ram_portion /= g_no_rev_cache_instances; 
+		if (no_instances > 0) {
+			ram_portion /= no_instances; 
 			for (rsi = g_rev_instances; rsi != NULL; rsi = rsi->next)
 				rsi->max_sz = ram_portion;
-			if (s->verbose)
-				fprintf(stdout, "%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
-				                cr_char,
-								g_no_rev_cache_instances > 1 ? "are" : "is",
-			                    g_no_rev_cache_instances,
-								g_no_rev_cache_instances > 1 ? "s" : "",
-			                    (unsigned long)(ram_portion/1000000));
 		}
+		rev_unlock();
+
+		if (no_instances > 0 && s->verbose)
+			fprintf(stdout, "%cThere %s %d rev cache instance%s with %lu Mbytes limit\n",
+			                cr_char,
+							no_instances > 1 ? "are" : "is",
+		                    no_instances,
+							no_instances > 1 ? "s" : "",
+		                    (unsigned long)(ram_portion/1000000));
 	}
 	s->rev.rev_valid = 0;
 }
@@ -12296,6 +12363,7 @@ rspl *s
 	/* Figure out how much RAM we can use for the rev cache. */
 	/* (We compute this for each rev instance, to account for any VM */
 	/* limit changes due to intervening allocations) */
+	rev_lock();
 	if (di > 1 || g_avail_ram == 0) {
 	#ifdef NT 
 		{
@@ -12458,6 +12526,7 @@ rspl *s
 		fprintf(stdout, "%cRev cache RAM = %lu Mbytes\n",cr_char,(unsigned long)(g_avail_ram/1000000));
 		repsr = 1;
 	}
+	rev_unlock();
 
 	/* Sub-simplex information for each sub dimension */
 	for (e = 0; e <= di; e++) {
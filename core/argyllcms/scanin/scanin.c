@@ -114,7 +114,10 @@ usage(void) {
 	fprintf(stderr,"   :- inputs pbase.ti2 and outputs printer pbase.ti3, or\n");
 	fprintf(stderr,"\n");
 	fprintf(stderr,"usage: scanin -r [options] input.tif recogin.cht pbase [diag.tif]\n");
-	fprintf(stderr,"   :- inputs pbase.ti2+.ti3 and outputs pbase.ti3\n");
+	fprintf(stderr,"   :- inputs pbase.ti2+.ti3 and outputs pbase.ti3, or\n");
+	fprintf(stderr,"\n");
+	fprintf(stderr,"usage: scanin -b [-o] [options] recogin.cht [valin.cie] input1.tif [input2.tif ...]\n");
+	fprintf(stderr,"   :- inputs each 'inputN.tif' and outputs scanner 'inputN.ti3', or 'inputN.val' if -o\n");
 	fprintf(stderr,"\n");
 	fprintf(stderr," -g                   Generate a chart reference (.cht) file\n");
 	fprintf(stderr," -o                   Output patch values in .val file\n");
@@ -123,12 +126,14 @@ usage(void) {
 	fprintf(stderr,"                       from subsequent pages\n");
 	fprintf(stderr," -r                   Replace device values in pbase .ti2/.ti3\n");
 	fprintf(stderr,"                      Default is to create a scanner .ti3 file\n");
+	fprintf(stderr," -b                   Batch, read several input.tif of the same chart in parallel\n");
 	fprintf(stderr," -F x1,y1,x2,y2,x3,y3,x4,y4\n");
 	fprintf(stderr,"                      Don't auto recognize, locate using four fiducual marks\n");
 	fprintf(stderr," -p                   Compensate for perspective distortion\n");
 	fprintf(stderr," -a                   Recognise chart in normal orientation only (-A fallback as is)\n");
 	fprintf(stderr,"                      Default is to recognise all possible chart angles\n");
 	fprintf(stderr," -m                   Return true mean (default is robust mean)\n");
+	fprintf(stderr," -f                   Fast mean & std. dev. from pixel sums, histogram if noisy\n");
 	fprintf(stderr," -G gamma             Approximate gamma encoding of image\n");
 	fprintf(stderr," -v [n]               Verbosity level 0-9\n");
 	fprintf(stderr," -d [ihvglLIcrsonap]    Generate diagnostic output (try -dipn)\n");
@@ -150,6 +155,709 @@ usage(void) {
 	exit(1);
 	}
 
+/* Set the creation time string for an output file */
+static void
+set_atm(char *atm) {
+	time_t clk = time(0);
+	struct tm *tsp = localtime(&clk);
+
+	strcpy(atm, asctime(tsp));		/* Ascii time */
+	atm[strlen(atm)-1] = '\000';	/* Remove \n from end */
+}
+
+/* Create the default output file name from the input raster name */
+static void
+set_outname(
+char *datout_name,		/* Output name, MAXNAMEL+4+1 */
+char *tiffin_name,		/* Input raster name */
+int outo				/* NZ if outputing .val rather than .ti3 */
+) {
+	char *xl;
+
+	strncpy(datout_name,tiffin_name,MAXNAMEL); datout_name[MAXNAMEL] = '\000';
+	if ((xl = strrchr(datout_name, '.')) == NULL)	/* Figure where extention is */
+		xl = datout_name + strlen(datout_name);
+	if (outo == 0)	/* Creating scan calib data */
+		strcpy(xl,".ti3");
+	else			/* Just outputing values for some other purpose */
+		strcpy(xl,".val");
+}
+
+/* An input raster */
+typedef struct {
+	TIFF *rh;					/* TIFF file handle */
+	int width, height;			/* x and y size */
+	uint16 depth, bps;			/* Useful depth, bits per sample */
+	uint16 tdepth;				/* Total depth including alpha */
+	icColorSpaceSignature tiffs;	/* Type of tiff color space */
+	int gotres;					/* NZ if resolution is valid */
+	uint16 resunits;
+	float resx, resy;
+} tiffin;
+
+/* Open up an input tiff file ready for reading, and check that */
+/* it's something we can read. */
+/* Return non-zero and set errm[MAXNAMEL+100] on error */
+static int
+open_tiffin(
+tiffin *ti,
+char *tiffin_name,
+int verb,
+char *errm
+) {
+	uint16 pconfig, photometric;
+	uint16 rextrasamples;		/* Extra "alpha" samples */
+	uint16 *rextrainfo;			/* Info about extra samples */
+
+	memset((void *)ti, 0, sizeof(tiffin));
+
+	if ((ti->rh = TIFFOpen(tiffin_name, "r")) == NULL) {
+		sprintf(errm,"error opening read file '%s'",tiffin_name);
+		return 1;
+	}
+
+	TIFFGetField(ti->rh, TIFFTAG_IMAGEWIDTH,  &ti->width);
+	TIFFGetField(ti->rh, TIFFTAG_IMAGELENGTH, &ti->height);
+
+	TIFFGetField(ti->rh, TIFFTAG_BITSPERSAMPLE, &ti->bps);
+	if (ti->bps != 8 && ti->bps != 16) {
+		sprintf(errm,"TIFF Input file '%s' must be 8 or 16 bits/channel",tiffin_name);
+		goto terr;
+	}
+
+	/* See if there are alpha planes */
+	TIFFGetFieldDefaulted(ti->rh, TIFFTAG_EXTRASAMPLES, &rextrasamples, &rextrainfo);
+
+	TIFFGetField(ti->rh, TIFFTAG_SAMPLESPERPIXEL, &ti->depth);
+
+	if (rextrasamples > 0 && verb)
+		printf("%d extra (alpha ?) samples will be ignored\n",rextrasamples);
+
+	ti->tdepth = ti->depth;
+	ti->depth = ti->tdepth - rextrasamples;
+
+	if (ti->depth != 1 && ti->depth != 3 && ti->depth != 4) {
+		sprintf(errm,"Input '%s' must be a Grey, RGB or CMYK tiff file",tiffin_name);
+		goto terr;
+	}
+
+	TIFFGetField(ti->rh, TIFFTAG_PHOTOMETRIC, &photometric);
+	if (ti->depth == 1 && photometric != PHOTOMETRIC_MINISBLACK
+	                   && photometric != PHOTOMETRIC_MINISWHITE) {
+		sprintf(errm,"1 chanel input '%s' must be a Grey tiff file",tiffin_name);
+		goto terr;
+	} else if (ti->depth == 3 && photometric != PHOTOMETRIC_RGB) {
+		sprintf(errm,"3 chanel input '%s' must be an RGB tiff file",tiffin_name);
+		goto terr;
+	} else if (ti->depth == 4 && photometric != PHOTOMETRIC_SEPARATED) {
+		sprintf(errm,"4 chanel input '%s' must be a CMYK tiff file",tiffin_name);
+		goto terr;
+	}
+
+	if (ti->depth == 1)
+		ti->tiffs = icSigGrayData;
+	else if (ti->depth == 3) 
+		ti->tiffs = icSigRgbData;
+	else if (ti->depth == 4)
+		ti->tiffs = icSigCmykData;
+
+	TIFFGetField(ti->rh, TIFFTAG_PLANARCONFIG, &pconfig);
+	if (pconfig != PLANARCONFIG_CONTIG) {
+		sprintf(errm,"TIFF Input file '%s' must be planar",tiffin_name);
+		goto terr;
+	}
+
+	if (TIFFGetField(ti->rh, TIFFTAG_RESOLUTIONUNIT, &ti->resunits) != 0) {
+		TIFFGetField(ti->rh, TIFFTAG_XRESOLUTION, &ti->resx);
+		TIFFGetField(ti->rh, TIFFTAG_YRESOLUTION, &ti->resy);
+
+		if (ti->resunits == RESUNIT_NONE		/* If it looks valid */
+		 || ti->resunits == RESUNIT_INCH
+		 || ti->resunits == RESUNIT_CENTIMETER)
+			ti->gotres = 1;
+	}
+
+	return 0;
+
+  terr:;
+	TIFFClose(ti->rh);
+	ti->rh = NULL;
+	return 1;
+}
+
+/* Output the raw patch values to a .val file */
+/* Return non-zero and set errm[MAXNAMEL+CGATS_ERRM_LENGTH+100] on error */
+static int
+write_val(
+scanrd *sr,				/* Scanrd object with the values read */
+int depth,				/* Useful depth of raster */
+int tmean,				/* Return true mean, rather than robust mean */
+char *atm,				/* Creation time */
+char *datout_name,		/* Output file name */
+int verb,
+int *pnotscan,			/* Incremented for each patch that wasn't scanned */
+char *errm
+) {
+	/* Note value range is raw 0..255, */
+	/* while all others output formats are out of 100 */
+	cgats *ocg;			/* output cgats structure */
+	int j;
+
+	/* Setup output cgats file */
+	ocg = new_cgats();	/* Create a CGATS structure */
+	ocg->add_other(ocg, "VALS"); 	/* Dummy type */
+	ocg->add_table(ocg, tt_other, 0);	/* Start the first table */
+
+	ocg->add_kword(ocg, 0, "DESCRIPTOR", "Argyll Calibration raster values",NULL);
+	ocg->add_kword(ocg, 0, "ORIGINATOR", "Argyll scanin", NULL);
+	ocg->add_kword(ocg, 0, "CREATED",atm, NULL);
+
+	ocg->add_field(ocg, 0, "SAMPLE_ID", nqcs_t);
+	if (depth == 1) {
+		ocg->add_field(ocg, 0, "GREY", r_t);
+	} else if (depth == 3) {
+		ocg->add_field(ocg, 0, "RGB_R", r_t);
+		ocg->add_field(ocg, 0, "RGB_G", r_t);
+		ocg->add_field(ocg, 0, "RGB_B", r_t);
+	} else if (depth == 4) {
+		ocg->add_field(ocg, 0, "CMYK_C", r_t);
+		ocg->add_field(ocg, 0, "CMYK_M", r_t);
+		ocg->add_field(ocg, 0, "CMYK_Y", r_t);
+		ocg->add_field(ocg, 0, "CMYK_K", r_t);
+	}
+
+	/* Initialise, ready to read out all the values */
+	for (j = 0; ; j++) {
+		char id[100];		/* Input patch id */
+		double P[4];		/* Robust/true mean values */
+		int pixcnt;			/* PIxel count */
+
+		if (tmean) {
+			if (sr->read(sr, id, NULL, P, NULL, &pixcnt) != 0)
+				break;
+		} else {
+			if (sr->read(sr, id, P, NULL, NULL, &pixcnt) != 0)
+				break;
+		}
+
+		if (pixcnt == 0)
+			(*pnotscan)++;
+
+		if (depth == 1) {
+			ocg->add_set( ocg, 0, id, P[0]);
+		} else if (depth == 3) {
+			ocg->add_set( ocg, 0, id, P[0], P[1], P[2]);
+		} else if (depth == 4) {
+			ocg->add_set( ocg, 0, id, P[0], P[1], P[2], P[3]);
+		}
+	}
+
+	if (verb)
+		printf("Writing output values to file '%s'\n",datout_name);
+		
+	if (ocg->write_name(ocg, datout_name)) {
+		sprintf(errm,"Write error to '%s' : %s",datout_name,ocg->e.m);
+		ocg->del(ocg);
+		return 1;
+	}
+
+	ocg->del(ocg);		/* Clean up */
+	return 0;
+}
+
+/* A reference chart values file (.cie, .q60 etc.) */
+typedef struct {
+	cgats *icg;			/* input cgats structure */
+	int sx;				/* Sample id index */
+	int isLab;			/* D50 Lab reference */
+	int Xx, Yx, Zx;		/* XYZ_X, XYZ_Y, XYZ_Z index */
+	int spec_n;			/* Number of spectral bands */
+	double spec_wl_short;/* First reading wavelength in nm (shortest) */
+	double spec_wl_long; /* Last reading wavelength in nm (longest) */
+	int spi[XSPECT_MAX_BANDS];  /* CGATS indexes for each wavelength */
+	int npat;			/* Number of test patches in it8 chart */
+	unsigned int *idhash; 	/* Array of reference id hashes */
+} cieref;
+
+/* Read a reference chart values file, and locate the fields we want */
+static void
+read_cieref(
+cieref *r,
+char *datin_name
+) {
+	int ti;				/* Temp index */
+	int i, j;
+
+	r->isLab = 0;
+	r->spec_n = 0;
+
+	r->icg = new_cgats();			/* Create a CGATS structure */
+	r->icg->add_other(r->icg, ""); 	/* Accept any type */
+	if (r->icg->read_name(r->icg, datin_name))
+		error("CGATS file '%s' read error : %s",datin_name,r->icg->e.m);
+
+	/* ~~ should accept ti2 file and convert RGB to XYZ using    */
+	/*    device cal., to make W/RGB/CMYK ->XYZ reading chart ~~ */
+	if (r->icg->ntables < 1)
+		error("Input file '%s' doesn't contain at least one table",datin_name);
+
+	if ((r->npat = r->icg->t[0].nsets) <= 0)
+		error("File '%s' no sets of data in first table",datin_name);
+
+	/* Fields we want from input chart reference file */
+	if ((r->sx = r->icg->find_field(r->icg, 0, "Sample_Name")) < 0) {
+		if ((r->sx = r->icg->find_field(r->icg, 0, "SAMPLE_NAME")) < 0) {
+			if ((r->sx = r->icg->find_field(r->icg, 0, "SAMPLE_LOC")) < 0) {
+				if ((r->sx = r->icg->find_field(r->icg, 0, "SAMPLE_ID")) < 0) {
+					error("Input file '%s' doesn't contain field SAMPLE_ID, Sample_Name or SAMPLE_NAME",datin_name);
+				}
+			}
+		}
+	}
+	if (r->icg->t[0].ftype[r->sx] != nqcs_t && r->icg->t[0].ftype[r->sx] != cs_t)
+		error("Input file '%s' field %s is wrong type", datin_name, r->icg->t[0].fsym[r->sx]);
+
+	if ((r->Xx = r->icg->find_field(r->icg, 0, "XYZ_X")) < 0) {
+		if ((r->Xx = r->icg->find_field(r->icg, 0, "LAB_L")) < 0)
+			error("Input file '%s' doesn't contain field XYZ_X or LAB_L",datin_name);
+		
+		r->isLab = 1;
+		if (r->icg->t[0].ftype[r->Xx] != r_t)
+			error("Input file '%s' field LAB_L is wrong type",datin_name);
+		if ((r->Yx = r->icg->find_field(r->icg, 0, "LAB_A")) < 0)
+			error("Input file doesn't contain field LAB_A",datin_name);
+		if (r->icg->t[0].ftype[r->Yx] != r_t)
+			error("Input file '%s' field LAB_A is wrong type",datin_name);
+		if ((r->Zx = r->icg->find_field(r->icg, 0, "LAB_B")) < 0)
+			error("Input file '%s' doesn't contain field LAB_B",datin_name);
+		if (r->icg->t[0].ftype[r->Zx] != r_t)
+			error("Input file '%s' field LAB_B is wrong type",datin_name);
+	} else {
+		if (r->icg->t[0].ftype[r->Xx] != r_t)
+			error("Input file '%s' field XYZ_X is wrong type",datin_name);
+		if ((r->Yx = r->icg->find_field(r->icg, 0, "XYZ_Y")) < 0)
+			error("Input file '%s' doesn't contain field XYZ_Y",datin_name);
+		if (r->icg->t[0].ftype[r->Yx] != r_t)
+			error("Input file '%s' field XYZ_Y is wrong type",datin_name);
+		if ((r->Zx = r->icg->find_field(r->icg, 0, "XYZ_Z")) < 0)
+			error("Input file '%s' doesn't contain field XYZ_Z",datin_name);
+		if (r->icg->t[0].ftype[r->Zx] != r_t)
+			error("Input file '%s' field XYZ_Z is wrong type",datin_name);
+	}
+
+	/* Find possible spectral fields in reference */
+	if ((ti = r->icg->find_kword(r->icg, 0, "SPECTRAL_BANDS")) >= 0) {
+		r->spec_n = atoi(r->icg->t[0].kdata[ti]);
+		if ((ti = r->icg->find_kword(r->icg, 0, "SPECTRAL_START_NM")) < 0)
+			error ("Input file '%s' doesn't contain keyword SPECTRAL_START_NM",datin_name);
+		r->spec_wl_short = atof(r->icg->t[0].kdata[ti]);
+		if ((ti = r->icg->find_kword(r->icg, 0, "SPECTRAL_END_NM")) < 0)
+			error ("Input file '%s' doesn't contain keyword SPECTRAL_END_NM",datin_name);
+		r->spec_wl_long = atof(r->icg->t[0].kdata[ti]);
+
+		/* Find the fields for spectral values */
+		for (i = 0; i < r->spec_n; i++) {
+			char buf[100];
+			int nm;
+	
+			/* Compute nearest integer wavelength */
+			nm = (int)(r->spec_wl_short + ((double)i/(r->spec_n-1.0))
+			            * (r->spec_wl_long - r->spec_wl_short) + 0.5);
+			
+			sprintf(buf,"SPEC_%03d",nm);
+
+			if ((r->spi[i] = r->icg->find_field(r->icg, 0, buf)) < 0)
+				error("Input file doesn't contain field %s",datin_name);
+		}
+	}
+
+	if ((r->idhash = (unsigned int *)malloc(sizeof(unsigned int) * r->npat)) == NULL)
+		error("Malloc failed!");
+
+	/* Setup hash list of reference labels to speed comparisons */
+	for (j = 0; j < r->npat; j++) {
+		char id[100];		/* Reference patch id */
+
+		/* Normalise reference labels */
+		fix_it8(id, ((char *)r->icg->t[0].fdata[j][r->sx]));	/* Copy and fix */
+
+		r->idhash[j] = shash(id);
+	}
+}
+
+/* Free a reference chart values file */
+static void
+free_cieref(
+cieref *r
+) {
+	free(r->idhash);
+	r->icg->del(r->icg);		/* Clean up */
+}
+
+/* Output the patch values and the matching reference values */
+/* to a scanner .ti3 file */
+/* Return non-zero and set errm[MAXNAMEL+CGATS_ERRM_LENGTH+100] on error */
+static int
+write_ti3(
+cieref *r,				/* Reference chart values */
+scanrd *sr,				/* Scanrd object with the values read */
+int depth,				/* Useful depth of raster */
+int tmean,				/* Return true mean, rather than robust mean */
+char *atm,				/* Creation time */
+char *datout_name,		/* Output file name */
+int verb,
+int *pnotscan,			/* Incremented for each patch that wasn't scanned */
+char *errm
+) {
+	cgats *ocg;			/* output cgats structure */
+	int nsetel = 0;		/* Number of output set elements */
+	cgats_set_elem *setel;  /* Array of set value elements */
+	int i, j;
+
+	/* Setup output cgats file */
+	ocg = new_cgats();	/* Create a CGATS structure */
+	ocg->add_other(ocg, "CTI3"); 	/* our special type is Calibration Target Information 3 */
+	ocg->add_table(ocg, tt_other, 0);	/* Start the first table */
+
+	ocg->add_kword(ocg, 0, "DESCRIPTOR", "Argyll Calibration Target chart information 3",NULL);
+	ocg->add_kword(ocg, 0, "ORIGINATOR", "Argyll target", NULL);
+	ocg->add_kword(ocg, 0, "CREATED",atm, NULL);
+
+	ocg->add_kword(ocg, 0, "DEVICE_CLASS","INPUT", NULL);	/* What sort of device this is */
+	ocg->add_kword(ocg, 0, "COLOR_REP","XYZ_RGB", NULL);
+
+	ocg->add_field(ocg, 0, "SAMPLE_ID", nqcs_t);
+	nsetel += 1;
+	ocg->add_field(ocg, 0, "XYZ_X", r_t);
+	ocg->add_field(ocg, 0, "XYZ_Y", r_t);
+	ocg->add_field(ocg, 0, "XYZ_Z", r_t);
+	nsetel += 3;
+
+	/* If we have spectral information, output it too */
+	if (r->spec_n > 0) {
+		char buf[100];
+
+		nsetel += r->spec_n;       /* Spectral values */
+		sprintf(buf,"%d", r->spec_n);
+		ocg->add_kword(ocg, 0, "SPECTRAL_BANDS",buf, NULL);
+		sprintf(buf,"%f", r->spec_wl_short);
+		ocg->add_kword(ocg, 0, "SPECTRAL_START_NM",buf, NULL);
+		sprintf(buf,"%f", r->spec_wl_long);
+		ocg->add_kword(ocg, 0, "SPECTRAL_END_NM",buf, NULL);
+
+		/* Generate fields for spectral values */
+		for (i = 0; i < r->spec_n; i++) {
+			int nm;
+	
+			/* Compute nearest integer wavelength */
+			nm = (int)(r->spec_wl_short + ((double)i/(r->spec_n-1.0))
+			            * (r->spec_wl_long - r->spec_wl_short) + 0.5);
+			
+			sprintf(buf,"SPEC_%03d",nm);
+			ocg->add_field(ocg, 0, buf, r_t);
+		}
+	}
+
+	if (depth == 1) {
+		ocg->add_field(ocg, 0, "GREY", r_t);
+		ocg->add_field(ocg, 0, "STDEV_GREY", r_t);
+	} else if (depth == 3) {
+		ocg->add_field(ocg, 0, "RGB_R", r_t);
+		ocg->add_field(ocg, 0, "RGB_G", r_t);
+		ocg->add_field(ocg, 0, "RGB_B", r_t);
+		ocg->add_field(ocg, 0, "STDEV_R", r_t);
+		ocg->add_field(ocg, 0, "STDEV_G", r_t);
+		ocg->add_field(ocg, 0, "STDEV_B", r_t);
+	} else if (depth == 4) {
+		ocg->add_field(ocg, 0, "CMYK_C", r_t);
+		ocg->add_field(ocg, 0, "CMYK_M", r_t);
+		ocg->add_field(ocg, 0, "CMYK_Y", r_t);
+		ocg->add_field(ocg, 0, "CMYK_K", r_t);
+		ocg->add_field(ocg, 0, "STDEV_C", r_t);
+		ocg->add_field(ocg, 0, "STDEV_M", r_t);
+		ocg->add_field(ocg, 0, "STDEV_Y", r_t);
+		ocg->add_field(ocg, 0, "STDEV_K", r_t);
+	}
+	nsetel += 2 * depth;
+
+	if ((setel = (cgats_set_elem *)malloc(sizeof(cgats_set_elem) * nsetel)) == NULL)
+		error("Malloc failed!");
+
+	/* Initialise, ready to read out all the values */
+	for (i = sr->reset(sr); i > 0; i--) {
+		char tod[100];			/* Temp output patch id */
+		char od[100];			/* Output patch id */
+		unsigned int odhash;	/* Chart id hashes */
+		double P[4];			/* Robust/true mean values */
+		double sdP[4];			/* Standard deviation */
+		int pixcnt;				/* Pixel count */
+
+		if (tmean)
+			sr->read(sr, tod, NULL, P, sdP, &pixcnt);
+		else
+			sr->read(sr, tod, P, NULL, sdP, &pixcnt);
+
+		fix_it8(od, tod);
+
+		odhash = shash(od);
+
+		if (pixcnt == 0)
+			(*pnotscan)++;
+
+		/* Search for matching id in reference */
+		for (j = 0; j < r->npat; j++) {
+			char id[100];		/* Reference patch id */
+
+			if (odhash != r->idhash[j]) {	/* Fast reject */
+				continue;
+			}
+
+			/* Normalise reference labels */
+			fix_it8(id, ((char *)r->icg->t[0].fdata[j][r->sx]));	/* Copy and fix */
+
+			if (strcmp(id, od) == 0) {
+				int k = 0, m;
+				double XYZ[3];
+
+				setel[k++].c = id;
+
+		        XYZ[0] = *((double *)r->icg->t[0].fdata[j][r->Xx]);
+		        XYZ[1] = *((double *)r->icg->t[0].fdata[j][r->Yx]);
+		        XYZ[2] = *((double *)r->icg->t[0].fdata[j][r->Zx]);
+				if (r->isLab) {
+					icmLab2XYZ(&icmD50, XYZ, XYZ);
+					XYZ[0] *= 100.0;
+					XYZ[1] *= 100.0;
+					XYZ[2] *= 100.0;
+				}
+
+				setel[k++].d = XYZ[0];
+				setel[k++].d = XYZ[1];
+				setel[k++].d = XYZ[2];
+
+				if (r->spec_n > 0) {
+					for (m = 0; m < r->spec_n; m++) {
+						setel[k++].d = *((double *)r->icg->t[0].fdata[j][r->spi[m]]);
+					}
+				}
+
+				for (m = 0; m < depth; m++) 
+					setel[k++].d = P[m] * 100.0/255.0;
+				for (m = 0; m < depth; m++) 
+					setel[k++].d = sdP[m] * 100.0/255.0;
+
+				ocg->add_setarr(ocg, 0, setel);
+
+				break;
+			}
+
+			if (j >= r->npat && verb >= 1)
+				printf("Warning: Couldn't match field '%s'\n",od);
+		}
+	}
+
+	if (verb)
+		printf("Writing output values to file '%s'\n",datout_name);
+		
+	if (ocg->write_name(ocg, datout_name)) {
+		sprintf(errm,"Output file '%s' write error : %s",datout_name, ocg->e.m);
+		free(setel);
+		ocg->del(ocg);
+		return 1;
+	}
+
+	free(setel);
+
+	ocg->del(ocg);		/* Clean up */
+	return 0;
+}
+
+/* Batch mode context */
+typedef struct {
+	int flags;			/* scanrd option flags */
+	int verb;			/* Verbosity level */
+	int tmean;			/* Return true mean, rather than robust mean */
+	int outo;			/* Output the values read, rather than creating scanner .ti3 */
+	double gamma;		/* Approximate gamma encoding of images */
+	double *sfid;		/* Specified fiducials, NULL if auto recognition */
+	char *recog_name;	/* Reference chart name (.cht) */
+	scanrd_ref *ref;	/* Chart recognition reference */
+	cieref *cr;			/* Reference chart values, NULL if outo */
+	char *atm;			/* Creation time */
+	char **names;		/* Input raster names */
+	int nim;			/* Number of input rasters */
+	amutex lock;		/* Lock for next and nfail */
+	int next;			/* Next input raster to process */
+	int nfail;			/* Number of input rasters that failed */
+} batchcx;
+
+/* Read one input raster of the batch, and write its output file */
+/* Return non-zero if the raster couldn't be read or its output file written */
+static int
+batch_scan(
+batchcx *cx,
+char *tiffin_name
+) {
+	char datout_name[MAXNAMEL+4+1];	/* Data output name (.ti3/.val) */
+	char errmb[MAXNAMEL+CGATS_ERRM_LENGTH+100];
+	tiffin ti;
+	scanrd *sr;				/* Scanrd object */
+	int err;	
+	char *errm;
+	int pnotscan = 0;		/* Number of patches that wern't scanned */
+
+	if (open_tiffin(&ti, tiffin_name, cx->verb, errmb)) {
+		warning("%s",errmb);
+		return 1;
+	}
+	set_outname(datout_name, tiffin_name, cx->outo);
+
+	if (cx->verb >= 2)
+		printf("Input file '%s': w=%d, h=%d, d = %d, bpp = %d\n",
+		        tiffin_name, ti.width, ti.height, ti.depth, ti.bps);
+
+	if ((sr = do_scanrd(
+		cx->flags,		/* option flags */
+		cx->verb,		/* verbosity level */
+
+		cx->gamma,
+		cx->sfid,		/* Specified fiducuals, if any */
+		ti.width, ti.height, ti.depth, ti.tdepth, ti.bps,	/* Width, Height and Depth of input in pixels */
+		read_line,		/* Read line function */
+		(void *)ti.rh,	/* Opaque data for read_line */
+
+		cx->recog_name,	/* reference file name */
+		cx->ref,		/* Reference read once for the batch */
+
+		NULL,			/* No diagnostic file */
+		NULL
+	)) == NULL) {
+		TIFFClose(ti.rh);
+		warning("Unable to allocate scanrd object for '%s'",tiffin_name);
+		return 1;
+	}
+
+	if ((err = sr->error(sr, &errm)) != 0) {
+		warning("Scanin of '%s' failed with code 0x%x, %s",tiffin_name,err,errm);
+		sr->free(sr);
+		TIFFClose(ti.rh);
+		return 1;
+	}
+
+	if (cx->outo != 0)
+		err = write_val(sr, ti.depth, cx->tmean, cx->atm, datout_name, cx->verb, &pnotscan, errmb);
+	else
+		err = write_ti3(cx->cr, sr, ti.depth, cx->tmean, cx->atm, datout_name, cx->verb, &pnotscan, errmb);
+
+	if (err != 0) {
+		warning("%s",errmb);
+		sr->free(sr);
+		TIFFClose(ti.rh);
+		return 1;
+	}
+
+	if (pnotscan > 0)
+		warning("A total of %d patches had no value set in '%s'!",pnotscan,tiffin_name);
+
+	sr->free(sr);
+	TIFFClose(ti.rh);
+
+	return 0;
+}
+
+/* Batch worker thread. Read input rasters until there are no more. */
+static int
+batch_worker(
+void *cntx,
+int thix,
+int ix0,
+int ix1
+) {
+	batchcx *cx = (batchcx *)cntx;
+
+	for (;;) {
+		int i, rv;
+
+		amutex_lock(cx->lock);
+		i = cx->next++;
+		amutex_unlock(cx->lock);
+
+		if (i >= cx->nim)
+			break;
+
+		rv = batch_scan(cx, cx->names[i]);
+
+		if (rv != 0) {
+			amutex_lock(cx->lock);
+			cx->nfail++;
+			amutex_unlock(cx->lock);
+		}
+	}
+	return 0;
+}
+
+/* Read a batch of input rasters of the same chart. The chart recognition */
+/* reference and reference values are read once, and the rasters are */
+/* read in parallel, each output file being written as soon as its */
+/* raster has been read. */
+/* Return the number of rasters that failed */
+static int
+do_batch(
+batchcx *cx,
+char *datin_name		/* Reference values file name, if not outo */
+) {
+	athreadpool *pool;
+	cieref cr;			/* Reference chart values */
+	char *errm;
+	int err;
+
+	if ((cx->ref = new_scanrd_ref(cx->verb, cx->recog_name)) == NULL)
+		error("Unable to allocate scanrd_ref object");
+
+	if ((err = cx->ref->error(cx->ref, &errm)) != 0)
+		error("Scanin failed with code 0x%x, %s",err,errm);
+
+	cx->cr = NULL;
+	if (cx->outo == 0) {
+		read_cieref(&cr, datin_name);
+		cx->cr = &cr;
+	}
+
+	amutex_init(cx->lock);
+	cx->next = 0;
+	cx->nfail = 0;
+
+	/* If there are enough rasters, read one per thread, */
+	/* otherwise read them one at a time, each using all the threads. */
+	if ((pool = new_athreadpool(0)) != NULL
+	 && (pool->nthr <= 1 || cx->nim < pool->nthr)) {
+		pool->del(pool);
+		pool = NULL;
+	}
+
+	if (cx->verb >= 2) {
+		if (pool != NULL)
+			printf("Reading %d input files, %d at a time\n",cx->nim, pool->nthr);
+		else
+			printf("Reading %d input files one at a time\n",cx->nim);
+	}
+
+	if (pool != NULL) {
+		cx->flags |= SI_NOTHREADS;
+		pool->run(pool, pool->nthr, batch_worker, (void *)cx);
+		pool->del(pool);
+	} else {
+		batch_worker((void *)cx, 0, 0, 1);
+	}
+
+	amutex_del(cx->lock);
+	if (cx->cr != NULL)
+		free_cieref(cx->cr);
+	cx->ref->free(cx->ref);
+
+	return cx->nfail;
+}
+
 
 int main(int argc, char *argv[]) {
 	int fa,nfa;					/* current argument we're looking at */
@@ -164,14 +872,13 @@ int main(int argc, char *argv[]) {
 	int repl = 0;		/* Replace .ti3 device values from raster file */
 	int outo = 0;		/* Output the values read, rather than creating scanner .ti3 */
 	int colm = 0;		/* Use inage values to measure color for print profile. > 1 == append */
+	int batch = 0;		/* Read a list of input rasters */
 	int flags = SI_GENERAL_ROT;	/* Default allow all rotations */
 
+	tiffin ti;					/* Input raster */
 	TIFF *rh = NULL, *wh = NULL;
 	uint16 depth, bps;			/* Useful depth, bits per sample */
 	uint16 tdepth;				/* Total depth including alpha */
-	uint16 pconfig, photometric;
-	uint16 rextrasamples;		/* Extra "alpha" samples */
-	uint16 *rextrainfo;			/* Info about extra samples */
 	int gotres = 0;
 	uint16 resunits;
 	float resx, resy;
@@ -186,6 +893,8 @@ int main(int argc, char *argv[]) {
 	scanrd *sr;				/* Scanrd object */
 	int err;	
 	char *errm;
+	char errmb[MAXNAMEL+CGATS_ERRM_LENGTH+100];
+	char atm[100];			/* Ascii time */
 	int pnotscan = 0;		/* Number of patches that wern't scanned */
 
 
@@ -225,6 +934,9 @@ int main(int argc, char *argv[]) {
 			} else if (argv[fa][1] == 'm') {
 				tmean = 1;
 
+			} else if (argv[fa][1] == 'f') {
+				flags |= SI_SUM_STATS;
+
 			} else if (argv[fa][1] == 'g') {
 				flags |= SI_BUILD_REF;
 				repl = 0;
@@ -248,6 +960,9 @@ int main(int argc, char *argv[]) {
 				if (argv[fa][2] != '\000' && argv[fa][2] == 'a')
 					colm = 2;
 
+			} else if (argv[fa][1] == 'b') {
+				batch = 1;
+
 			/* Approximate gamma encoding of image */
 			} else if (argv[fa][1] == 'G') {
 				fa = nfa;
@@ -345,6 +1060,51 @@ int main(int argc, char *argv[]) {
 			break;
 	}
 
+	if (batch) {
+		batchcx cx;
+
+		if ((flags & SI_BUILD_REF) || repl != 0 || colm != 0)
+			error("Batch mode can't be used with -g, -r or -c");
+		if (datout_name[0] != '\000')
+			error("Batch mode can't be used with -O");
+		if (flags & SI_SHOW_FLAGS)
+			error("Batch mode can't be used with -d");
+
+		/* .cht Reference file in */
+		if (fa >= argc || argv[fa][0] == '-') usage();
+		strncpy(recog_name,argv[fa],MAXNAMEL); recog_name[MAXNAMEL] = '\000';
+
+		/* CGATS Data file input */
+		if (outo == 0) {
+			if (++fa >= argc || argv[fa][0] == '-') usage();
+			strncpy(datin_name,argv[fa],MAXNAMEL); datin_name[MAXNAMEL] = '\000';
+		}
+
+		/* TIFF Raster input file names */
+		if (++fa >= argc) usage();
+		for (i = fa; i < argc; i++) {
+			if (argv[i][0] == '-')
+				usage();
+		}
+
+		cx.flags = flags;
+		cx.verb = verb;
+		cx.tmean = tmean;
+		cx.outo = outo;
+		cx.gamma = gamma;
+		cx.sfid = sfid;
+		cx.recog_name = recog_name;
+		set_atm(atm);
+		cx.atm = atm;
+		cx.names = &argv[fa];
+		cx.nim = argc - fa;
+
+		if ((i = do_batch(&cx, datin_name)) != 0)
+			error("%d of %d input files couldn't be read or written",i,cx.nim);
+
+		return 0;
+	}
+
 	/* TIFF Raster input file name */
 	if (fa >= argc || argv[fa][0] == '-') usage();
 	strncpy(tiffin_name,argv[fa],MAXNAMEL); tiffin_name[MAXNAMEL] = '\000';
@@ -355,14 +1115,7 @@ int main(int argc, char *argv[]) {
 	 && (flags & SI_BUILD_REF) == 0
 	 && repl == 0 && colm == 0) {		/* Not generate ref or replacing .ti3 dev */
 										// ~~~99 Hmm. Should we honour -O ??
-		char *xl;
-		strncpy(datout_name,argv[fa],MAXNAMEL); datout_name[MAXNAMEL] = '\000';
-		if ((xl = strrchr(datout_name, '.')) == NULL)	/* Figure where extention is */
-			xl = datout_name + strlen(datout_name);
-		if (outo == 0)	/* Creating scan calib data */
-			strcpy(xl,".ti3");
-		else			/* Just outputing values for some other purpose */
-			strcpy(xl,".val");
+		set_outname(datout_name, argv[fa], outo);
 	}
 
 	/* .cht Reference file in or out */
@@ -405,60 +1158,20 @@ int main(int argc, char *argv[]) {
 	/* ----------------------------------------- */
 	/* Open up input tiff file ready for reading */
 	/* Got arguments, so setup to process the file */
-	if ((rh = TIFFOpen(tiffin_name, "r")) == NULL)
-		error("error opening read file '%s'",tiffin_name);
-
-	TIFFGetField(rh, TIFFTAG_IMAGEWIDTH,  &width);
-	TIFFGetField(rh, TIFFTAG_IMAGELENGTH, &height);
-
-	TIFFGetField(rh, TIFFTAG_BITSPERSAMPLE, &bps);
-	if (bps != 8 && bps != 16)
-		error("TIFF Input file '%s' must be 8 or 16 bits/channel",tiffin_name);
-
-	/* See if there are alpha planes */
-	TIFFGetFieldDefaulted(rh, TIFFTAG_EXTRASAMPLES, &rextrasamples, &rextrainfo);
-
-	TIFFGetField(rh, TIFFTAG_SAMPLESPERPIXEL, &depth);
-
-	if (rextrasamples > 0 && verb)
-		printf("%d extra (alpha ?) samples will be ignored\n",rextrasamples);
-
-	tdepth = depth;
-	depth = tdepth - rextrasamples;
-
-	if (depth != 1 && depth != 3 && depth != 4)
-		error("Input '%s' must be a Grey, RGB or CMYK tiff file",tiffin_name);
-
-	TIFFGetField(rh, TIFFTAG_PHOTOMETRIC, &photometric);
-	if (depth == 1 && photometric != PHOTOMETRIC_MINISBLACK
-	               && photometric != PHOTOMETRIC_MINISWHITE)
-		error("1 chanel input '%s' must be a Grey tiff file",tiffin_name);
-	else if (depth == 3 && photometric != PHOTOMETRIC_RGB)
-		error("3 chanel input '%s' must be an RGB tiff file",tiffin_name);
-	else if (depth == 4 && photometric != PHOTOMETRIC_SEPARATED)
-		error("4 chanel input '%s' must be a CMYK tiff file",tiffin_name);
-
-	if (depth == 1)
-		tiffs = icSigGrayData;
-	else if (depth == 3) 
-		tiffs = icSigRgbData;
-	else if (depth == 4)
-		tiffs = icSigCmykData;
-
-	TIFFGetField(rh, TIFFTAG_PLANARCONFIG, &pconfig);
-	if (pconfig != PLANARCONFIG_CONTIG)
-		error("TIFF Input file '%s' must be planar",tiffin_name);
-
-
-	if (TIFFGetField(rh, TIFFTAG_RESOLUTIONUNIT, &resunits) != 0) {
-		TIFFGetField(rh, TIFFTAG_XRESOLUTION, &resx);
-		TIFFGetField(rh, TIFFTAG_YRESOLUTION, &resy);
-
-		if (resunits == RESUNIT_NONE		/* If it looks valid */
-		 || resunits == RESUNIT_INCH
-		 || resunits == RESUNIT_CENTIMETER)
-			gotres = 1;
-	}
+	if (open_tiffin(&ti, tiffin_name, verb, errmb))
+		error("%s",errmb);
+
+	rh = ti.rh;
+	width = ti.width;
+	height = ti.height;
+	depth = ti.depth;
+	tdepth = ti.tdepth;
+	bps = ti.bps;
+	tiffs = ti.tiffs;
+	gotres = ti.gotres;
+	resunits = ti.resunits;
+	resx = ti.resx;
+	resy = ti.resy;
 
 	/* -------------------------- */
 	/* setup the diag output file */
@@ -512,6 +1225,7 @@ int main(int argc, char *argv[]) {
 		(void *)rh,		/* Opaque data for read_line */
 
 		recog_name,		/* reference file name */
+		NULL,			/* Read the reference file */
 
 		write_line,		/* Write line function */
 		(void *)wh		/* Opaque data for write_line */
@@ -529,73 +1243,12 @@ int main(int argc, char *argv[]) {
 
 	/* Read an output the values */
 	if ((flags & SI_BUILD_REF) == 0) {	/* Not generate ref */
+		set_atm(atm);
 
 		/* -------------------------------------------------- */
 		if (outo != 0) {		/* Just output the values */
-								/* Note value range is raw 0..255, */
-								/* while all others output formats are out of 100 */
-			cgats *ocg;			/* output cgats structure */
-			time_t clk = time(0);
-			struct tm *tsp = localtime(&clk);
-			char *atm = asctime(tsp); /* Ascii time */
-	
-			/* Setup output cgats file */
-			ocg = new_cgats();	/* Create a CGATS structure */
-			ocg->add_other(ocg, "VALS"); 	/* Dummy type */
-			ocg->add_table(ocg, tt_other, 0);	/* Start the first table */
-	
-			ocg->add_kword(ocg, 0, "DESCRIPTOR", "Argyll Calibration raster values",NULL);
-			ocg->add_kword(ocg, 0, "ORIGINATOR", "Argyll scanin", NULL);
-			atm[strlen(atm)-1] = '\000';	/* Remove \n from end */
-			ocg->add_kword(ocg, 0, "CREATED",atm, NULL);
-	
-			ocg->add_field(ocg, 0, "SAMPLE_ID", nqcs_t);
-			if (depth == 1) {
-				ocg->add_field(ocg, 0, "GREY", r_t);
-			} else if (depth == 3) {
-				ocg->add_field(ocg, 0, "RGB_R", r_t);
-				ocg->add_field(ocg, 0, "RGB_G", r_t);
-				ocg->add_field(ocg, 0, "RGB_B", r_t);
-			} else if (depth == 4) {
-				ocg->add_field(ocg, 0, "CMYK_C", r_t);
-				ocg->add_field(ocg, 0, "CMYK_M", r_t);
-				ocg->add_field(ocg, 0, "CMYK_Y", r_t);
-				ocg->add_field(ocg, 0, "CMYK_K", r_t);
-			}
-	
-			/* Initialise, ready to read out all the values */
-			for (j = 0; ; j++) {
-				char id[100];		/* Input patch id */
-				double P[4];		/* Robust/true mean values */
-				int pixcnt;			/* PIxel count */
-
-				if (tmean) {
-					if (sr->read(sr, id, NULL, P, NULL, &pixcnt) != 0)
-						break;
-				} else {
-					if (sr->read(sr, id, P, NULL, NULL, &pixcnt) != 0)
-						break;
-				}
-		
-				if (pixcnt == 0)
-					pnotscan++;
-
-				if (depth == 1) {
-					ocg->add_set( ocg, 0, id, P[0]);
-				} else if (depth == 3) {
-					ocg->add_set( ocg, 0, id, P[0], P[1], P[2]);
-				} else if (depth == 4) {
-					ocg->add_set( ocg, 0, id, P[0], P[1], P[2], P[3]);
-				}
-			}
-	
-			if (verb)
-				printf("Writing output values to file '%s'\n",datout_name);
-				
-			if (ocg->write_name(ocg, datout_name))
-				error("Write error to '%s' : %s",datout_name,ocg->e.m);
-	
-			ocg->del(ocg);		/* Clean up */
+			if (write_val(sr, depth, tmean, atm, datout_name, verb, &pnotscan, errmb))
+				error("%s",errmb);
 
 		/* -------------------------------------------------- */
 		} else if (repl != 0) {	/* Replace .ti3 device values */
@@ -1178,272 +1831,12 @@ int main(int argc, char *argv[]) {
 		
 		/* ----------------------------------- */
 		} else {	/* Normal scan calibration */
-			cgats *icg;			/* input cgats structure */
-			cgats *ocg;			/* output cgats structure */
-			time_t clk = time(0);
-			struct tm *tsp = localtime(&clk);
-			char *atm = asctime(tsp); /* Ascii time */
-			int ti;				/* Temp index */
-			int sx;				/* Sample id index */
-			int isLab = 0;		/* D50 Lab reference */
-			int Xx, Yx, Zx;		/* XYZ_X, XYZ_Y, XYZ_Z index */
-			int spec_n = 0;		/* Number of spectral bands */
-			double spec_wl_short;/* First reading wavelength in nm (shortest) */
-			double spec_wl_long; /* Last reading wavelength in nm (longest) */
-			int spi[XSPECT_MAX_BANDS];  /* CGATS indexes for each wavelength */
-			int npat;			/* Number of test patches in it8 chart */
-			int nsetel = 0;		/* Number of output set elements */
-			cgats_set_elem *setel;  /* Array of set value elements */
-			unsigned int *idhash; 	/* Array of reference id hashes */
-	
-			icg = new_cgats();			/* Create a CGATS structure */
-			icg->add_other(icg, ""); 	/* Accept any type */
-			if (icg->read_name(icg, datin_name))
-				error("CGATS file '%s' read error : %s",datin_name,icg->e.m);
-	
-			/* ~~ should accept ti2 file and convert RGB to XYZ using    */
-			/*    device cal., to make W/RGB/CMYK ->XYZ reading chart ~~ */
-			if (icg->ntables < 1)
-				error("Input file '%s' doesn't contain at least one table",datin_name);
-	
-			if ((npat = icg->t[0].nsets) <= 0)
-				error("File '%s' no sets of data in first table",datin_name);
-	
-			/* Setup output cgats file */
-			ocg = new_cgats();	/* Create a CGATS structure */
-			ocg->add_other(ocg, "CTI3"); 	/* our special type is Calibration Target Information 3 */
-			ocg->add_table(ocg, tt_other, 0);	/* Start the first table */
-	
-			ocg->add_kword(ocg, 0, "DESCRIPTOR", "Argyll Calibration Target chart information 3",NULL);
-			ocg->add_kword(ocg, 0, "ORIGINATOR", "Argyll target", NULL);
-			atm[strlen(atm)-1] = '\000';	/* Remove \n from end */
-			ocg->add_kword(ocg, 0, "CREATED",atm, NULL);
-	
-			ocg->add_kword(ocg, 0, "DEVICE_CLASS","INPUT", NULL);	/* What sort of device this is */
-			ocg->add_kword(ocg, 0, "COLOR_REP","XYZ_RGB", NULL);
-	
-			/* Fields we want from input chart reference file */
-			if ((sx = icg->find_field(icg, 0, "Sample_Name")) < 0) {
-				if ((sx = icg->find_field(icg, 0, "SAMPLE_NAME")) < 0) {
-					if ((sx = icg->find_field(icg, 0, "SAMPLE_LOC")) < 0) {
-						if ((sx = icg->find_field(icg, 0, "SAMPLE_ID")) < 0) {
-							error("Input file '%s' doesn't contain field SAMPLE_ID, Sample_Name or SAMPLE_NAME",datin_name);
-						}
-					}
-				}
-			}
-			if (icg->t[0].ftype[sx] != nqcs_t && icg->t[0].ftype[sx] != cs_t)
-				error("Input file '%s' field %s is wrong type", datin_name, icg->t[0].fsym[sx]);
-
-			if ((Xx = icg->find_field(icg, 0, "XYZ_X")) < 0) {
-				if ((Xx = icg->find_field(icg, 0, "LAB_L")) < 0)
-					error("Input file '%s' doesn't contain field XYZ_X or LAB_L",datin_name);
-				
-				isLab = 1;
-				if (icg->t[0].ftype[Xx] != r_t)
-					error("Input file '%s' field LAB_L is wrong type",datin_name);
-				if ((Yx = icg->find_field(icg, 0, "LAB_A")) < 0)
-					error("Input file doesn't contain field LAB_A",datin_name);
-				if (icg->t[0].ftype[Yx] != r_t)
-					error("Input file '%s' field LAB_A is wrong type",datin_name);
-				if ((Zx = icg->find_field(icg, 0, "LAB_B")) < 0)
-					error("Input file '%s' doesn't contain field LAB_B",datin_name);
-				if (icg->t[0].ftype[Zx] != r_t)
-					error("Input file '%s' field LAB_B is wrong type",datin_name);
-			} else {
-				if (icg->t[0].ftype[Xx] != r_t)
-					error("Input file '%s' field XYZ_X is wrong type",datin_name);
-				if ((Yx = icg->find_field(icg, 0, "XYZ_Y")) < 0)
-					error("Input file '%s' doesn't contain field XYZ_Y",datin_name);
-				if (icg->t[0].ftype[Yx] != r_t)
-					error("Input file '%s' field XYZ_Y is wrong type",datin_name);
-				if ((Zx = icg->find_field(icg, 0, "XYZ_Z")) < 0)
-					error("Input file '%s' doesn't contain field XYZ_Z",datin_name);
-				if (icg->t[0].ftype[Zx] != r_t)
-					error("Input file '%s' field XYZ_Z is wrong type",datin_name);
-			}
-
-			/* Find possible spectral fields in reference */
-			if ((ti = icg->find_kword(icg, 0, "SPECTRAL_BANDS")) >= 0) {
-				spec_n = atoi(icg->t[0].kdata[ti]);
-				if ((ti = icg->find_kword(icg, 0, "SPECTRAL_START_NM")) < 0)
-					error ("Input file '%s' doesn't contain keyword SPECTRAL_START_NM",datin_name);
-				spec_wl_short = atof(icg->t[0].kdata[ti]);
-				if ((ti = icg->find_kword(icg, 0, "SPECTRAL_END_NM")) < 0)
-					error ("Input file '%s' doesn't contain keyword SPECTRAL_END_NM",datin_name);
-				spec_wl_long = atof(icg->t[0].kdata[ti]);
-		
-				/* Find the fields for spectral values */
-				for (i = 0; i < spec_n; i++) {
-					char buf[100];
-					int nm;
-			
-					/* Compute nearest integer wavelength */
-					nm = (int)(spec_wl_short + ((double)i/(spec_n-1.0))
-					            * (spec_wl_long - spec_wl_short) + 0.5);
-					
-					sprintf(buf,"SPEC_%03d",nm);
-		
-					if ((spi[i] = icg->find_field(icg, 0, buf)) < 0)
-						error("Input file doesn't contain field %s",datin_name);
-				}
-			}
-
-			ocg->add_field(ocg, 0, "SAMPLE_ID", nqcs_t);
-			nsetel += 1;
-			ocg->add_field(ocg, 0, "XYZ_X", r_t);
-			ocg->add_field(ocg, 0, "XYZ_Y", r_t);
-			ocg->add_field(ocg, 0, "XYZ_Z", r_t);
-			nsetel += 3;
-
-			/* If we have spectral information, output it too */
-			if (spec_n > 0) {
-				char buf[100];
-	
-				nsetel += spec_n;       /* Spectral values */
-				sprintf(buf,"%d", spec_n);
-				ocg->add_kword(ocg, 0, "SPECTRAL_BANDS",buf, NULL);
-				sprintf(buf,"%f", spec_wl_short);
-				ocg->add_kword(ocg, 0, "SPECTRAL_START_NM",buf, NULL);
-				sprintf(buf,"%f", spec_wl_long);
-				ocg->add_kword(ocg, 0, "SPECTRAL_END_NM",buf, NULL);
-	
-				/* Generate fields for spectral values */
-				for (i = 0; i < spec_n; i++) {
-					int nm;
-			
-					/* Compute nearest integer wavelength */
-					nm = (int)(spec_wl_short + ((double)i/(spec_n-1.0))
-					            * (spec_wl_long - spec_wl_short) + 0.5);
-					
-					sprintf(buf,"SPEC_%03d",nm);
-					ocg->add_field(ocg, 0, buf, r_t);
-				}
-			}
-
-			if (depth == 1) {
-				ocg->add_field(ocg, 0, "GREY", r_t);
-				ocg->add_field(ocg, 0, "STDEV_GREY", r_t);
-			} else if (depth == 3) {
-				ocg->add_field(ocg, 0, "RGB_R", r_t);
-				ocg->add_field(ocg, 0, "RGB_G", r_t);
-				ocg->add_field(ocg, 0, "RGB_B", r_t);
-				ocg->add_field(ocg, 0, "STDEV_R", r_t);
-				ocg->add_field(ocg, 0, "STDEV_G", r_t);
-				ocg->add_field(ocg, 0, "STDEV_B", r_t);
-			} else if (depth == 4) {
-				ocg->add_field(ocg, 0, "CMYK_C", r_t);
-				ocg->add_field(ocg, 0, "CMYK_M", r_t);
-				ocg->add_field(ocg, 0, "CMYK_Y", r_t);
-				ocg->add_field(ocg, 0, "CMYK_K", r_t);
-				ocg->add_field(ocg, 0, "STDEV_C", r_t);
-				ocg->add_field(ocg, 0, "STDEV_M", r_t);
-				ocg->add_field(ocg, 0, "STDEV_Y", r_t);
-				ocg->add_field(ocg, 0, "STDEV_K", r_t);
-			}
-			nsetel += 2 * depth;
-	
-			if ((setel = (cgats_set_elem *)malloc(sizeof(cgats_set_elem) * nsetel)) == NULL)
-				error("Malloc failed!");
-
-			if ((idhash = (unsigned int *)malloc(sizeof(unsigned int) * npat)) == NULL)
-				error("Malloc failed!");
-
-			/* Setup hash list of reference labels to speed comparisons */
-			for (j = 0; j < npat; j++) {
-				char id[100];		/* Reference patch id */
-
-				/* Normalise reference labels */
-				fix_it8(id, ((char *)icg->t[0].fdata[j][sx]));	/* Copy and fix */
-
-				idhash[j] = shash(id);
-			}
-
-			/* Initialise, ready to read out all the values */
-			for (i = sr->reset(sr); i > 0; i--) {
-				char tod[100];			/* Temp output patch id */
-				char od[100];			/* Output patch id */
-				unsigned int odhash;	/* Chart id hashes */
-				double P[4];			/* Robust/true mean values */
-				double sdP[4];			/* Standard deviation */
-				int pixcnt;				/* Pixel count */
-
-				if (tmean)
-					sr->read(sr, tod, NULL, P, sdP, &pixcnt);
-				else
-					sr->read(sr, tod, P, NULL, sdP, &pixcnt);
-
-				fix_it8(od, tod);
-
-				odhash = shash(od);
-		
-				if (pixcnt == 0)
-					pnotscan++;
-
-				/* Search for matching id in reference */
-				for (j = 0; j < npat; j++) {
-					char id[100];		/* Reference patch id */
-
-					if (odhash != idhash[j]) {	/* Fast reject */
-						continue;
-					}
-
-					/* Normalise reference labels */
-					fix_it8(id, ((char *)icg->t[0].fdata[j][sx]));	/* Copy and fix */
-	
-					if (strcmp(id, od) == 0) {
-						int k = 0, m;
-						double XYZ[3];
-
-						setel[k++].c = id;
-
-				        XYZ[0] = *((double *)icg->t[0].fdata[j][Xx]);
-				        XYZ[1] = *((double *)icg->t[0].fdata[j][Yx]);
-				        XYZ[2] = *((double *)icg->t[0].fdata[j][Zx]);
-						if (isLab) {
-							icmLab2XYZ(&icmD50, XYZ, XYZ);
-							XYZ[0] *= 100.0;
-							XYZ[1] *= 100.0;
-							XYZ[2] *= 100.0;
-						}
-
-						setel[k++].d = XYZ[0];
-						setel[k++].d = XYZ[1];
-						setel[k++].d = XYZ[2];
-
-						if (spec_n > 0) {
-							for (m = 0; m < spec_n; m++) {
-								setel[k++].d = *((double *)icg->t[0].fdata[j][spi[m]]);
-							}
-						}
-
-						for (m = 0; m < depth; m++) 
-							setel[k++].d = P[m] * 100.0/255.0;
-						for (m = 0; m < depth; m++) 
-							setel[k++].d = sdP[m] * 100.0/255.0;
-
-						ocg->add_setarr(ocg, 0, setel);
-
-						break;
-					}
-
-					if (j >= npat && verb >= 1)
-						printf("Warning: Couldn't match field '%s'\n",od);
-				}
-			}
-	
-			if (verb)
-				printf("Writing output values to file '%s'\n",datout_name);
-				
-			if (ocg->write_name(ocg, datout_name))
-				error("Output file '%s' write error : %s",datout_name, ocg->e.m);
-	
-			free(idhash);
-			free(setel);
-
-			ocg->del(ocg);		/* Clean up */
-			icg->del(icg);		/* Clean up */
+			cieref cr;			/* Reference chart values */
 
+			read_cieref(&cr, datin_name);
+			if (write_ti3(&cr, sr, depth, tmean, atm, datout_name, verb, &pnotscan, errmb))
+				error("%s",errmb);
+			free_cieref(&cr);
 		}
 	}
 
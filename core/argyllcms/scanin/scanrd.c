@@ -51,6 +51,7 @@
 /*  #include <fname.h> */
 
 #include "numlib.h"
+#include "conv.h"
 #include "scanrd_.h"
 
 /* ------------------------------------------------- */
@@ -74,7 +75,8 @@ static int calc_perspective(scanrd_ *s);
 static int calc_rotation(scanrd_ *s);
 static int calc_elists(scanrd_ *s, int ref);
 static int write_elists(scanrd_ *s);
-static int read_relists(scanrd_ *s);
+static int read_relists(scanrd_ref_ *r);
+static int copy_relists(scanrd_ *s, scanrd_ref_ *r);
 static int do_match(scanrd_ *s);
 static int compute_ptrans(scanrd_ *s);
 static int compute_man_ptrans(scanrd_ *s, double *sfids);
@@ -107,6 +109,7 @@ int (*read_line)(void *fdata, int y, char *dst),	/* Read RGB line of source file
 void *fdata,		/* Opaque data for read_line */
 
 char *refname,		/* reference file name */
+scanrd_ref *ref,	/* Reference read by new_scanrd_ref(), NULL to read refname */
 
 int (*write_line)(void *ddata, int y, char *src),	/* Write RGB line of diag file */
 void *ddata			/* Opaque data for write_line */
@@ -180,12 +183,28 @@ void *ddata			/* Opaque data for write_line */
 		if (calc_elists(s, 0))		/* match */
 			goto sierr;		/* Error */
 
-		if (s->verb >= 2)
-			DBG((dbgo,"About to read reference feature information\n"));
-		if (read_relists(s))
-			goto sierr;		/* Error */
-		if (s->verb >= 2)
-			DBG((dbgo,"Read of chart reference file succeeded\n"));
+		if (ref == NULL) {
+			scanrd_ref *tref;
+
+			if (s->verb >= 2)
+				DBG((dbgo,"About to read reference feature information\n"));
+			if ((tref = new_scanrd_ref(s->verb, s->refname)) == NULL) {
+				s->errv = SI_MALLOC_REFREAD;
+				sprintf(s->errm,"do_scanrd: new_scanrd_ref failed");
+				goto sierr;		/* Error */
+			}
+			rv = copy_relists(s, (scanrd_ref_ *)tref);
+			tref->free(tref);
+			if (rv)
+				goto sierr;		/* Error */
+			if (s->verb >= 2)
+				DBG((dbgo,"Read of chart reference file succeeded\n"));
+		} else {
+			if (s->verb >= 2)
+				DBG((dbgo,"About to copy reference feature information\n"));
+			if (copy_relists(s, (scanrd_ref_ *)ref))
+				goto sierr;		/* Error */
+		}
 
 		if (sfid != NULL) {		/* Manual matching */
 			if (s->verb >= 2)
@@ -407,6 +426,7 @@ static scanrd_
 	s->noslines = 0;
 	s->novlines = 0;
 	s->gdone = NULL;
+	s->npn = 0;
 	s->irot = 0.0;
 	s->norots = 0;
 	
@@ -467,6 +487,14 @@ static scanrd_
 	s->write_line = write_line;
 	s->ddata = ddata;
 
+	/* Threads to analyse and scan the raster with. */
+	/* (Fall back to doing it all in this thread if this fails) */
+	if ((flags & SI_NOTHREADS) == 0
+	 && (s->pool = new_athreadpool(0)) != NULL && s->pool->nthr <= 1) {
+		s->pool->del(s->pool);
+		s->pool = NULL;
+	}
+
 	return s;
 }
 
@@ -522,6 +550,9 @@ scanrd *ps
 	/* Free up aa line array */
 	if (s->coverage != NULL)
 		free(s->coverage);
+
+	if (s->pool != NULL)
+		s->pool->del(s->pool);
 	free(s);
 }
 
@@ -535,19 +566,58 @@ scanrd_error(scanrd *ps, char **errm) {
 }
 
 /********************************************************************************/
-static int analize(scanrd_ *s, unsigned char *inp[6], int y);
+
+#define ABANDH 16			/* Lines per thread in each pass of the gradient computation */
+
+/* Edge gradients of a pixel, computed ahead of the line by line analysis */
+typedef struct {
+	double tdh,tdv;			/* Horizontal/virtical detect levels */
+	int ss;					/* Number of planes where the cross components have the same sign */
+} gpix;
+
+/* Context for computing the gradients of a pass of lines */
+typedef struct {
+	scanrd_ *s;
+	unsigned char **in;		/* The 5 lines before the pass, then the pass lines */
+	gpix *g;				/* Gradients, width per line of the pass */
+	int y0;					/* y of the first line of the pass */
+} gradcx;
+
+static int init_analize(scanrd_ *s);
+static int analize_grad(void *cntx, int thix, int ix0, int ix1);
+static int analize(scanrd_ *s, gpix *g, int y);
 
 /* Read in and process the input file */
 /* Return non-zero on error */
 static int
 read_input(scanrd_ *s) {
-	unsigned char *in[6];		/* Pointer to six input buffers */
+	unsigned char **in, **tin;	/* Input line buffers, and rotated copy */
+	gpix *g;					/* Gradients for a pass of lines */
+	gradcx cx;					/* Gradient pass context */
 	int w = s->width;			/* Raster width */
 	int h = s->height;			/* Raster height */
+	int stride = s->tdepth * w;	/* In pixels */
+	int pl;						/* Maximum lines in a pass */
+	int nin;					/* Number of input line buffers */
 	int i, y;
 
+	if (init_analize(s))
+		return 1;
+
+	/* Each pass computes the gradients of pl lines, which needs */
+	/* the 5 lines before them as well. */
+	pl = (s->pool != NULL ? s->pool->nthr : 1) * ABANDH;
+	nin = pl + 5;
+
 	/* Allocate input line buffers */
-	for (i = 0; i < 6; i++) {
+	if ((in = (unsigned char **)calloc(2 * nin, sizeof(unsigned char *))) == NULL
+	 || (g = (gpix *)malloc(sizeof(gpix) * pl * w)) == NULL) {
+		s->errv = SI_MALLOC_INPUT_BUF;
+		sprintf(s->errm,"scanrd: Failed to malloc input line buffers");
+		return 1;
+	}
+	tin = in + nin;
+	for (i = 0; i < nin; i++) {
 		if ((in[i] = malloc(s->tdepth * w * s->bypp)) == NULL) {
 			s->errv = SI_MALLOC_INPUT_BUF;
 			sprintf(s->errm,"scanrd: Failed to malloc input line buffers");
@@ -563,27 +633,56 @@ read_input(scanrd_ *s) {
 			return 1;
 		}
 	}
-	/* Process the tiff file line by line (Assume at least 6 lines in total raster) */
-	for (; y < h; ++y) {
-		unsigned char *tt;
-		if (s->read_line(s->fdata, y, (char *)in[5])) {
-			s->errv = SI_RAST_READ_ERR;
-			sprintf(s->errm,"scanrd: read_line() returned error");
-			return 1;
-		}
+	cx.s = s;
+	cx.in = in;
+	cx.g = g;
 
-		if (analize(s, in, y)) {
-			return 1;
+	/* Process the tiff file a pass of lines at a time */
+	/* (Assume at least 6 lines in total raster) */
+	for (; y < h;) {
+		int k, nl;
+
+		if ((nl = h - y) > pl)
+			nl = pl;
+
+		for (k = 0; k < nl; k++) {
+			unsigned char *ip = in[5 + k];
+
+			if (s->read_line(s->fdata, y + k, (char *)ip)) {
+				s->errv = SI_RAST_READ_ERR;
+				sprintf(s->errm,"scanrd: read_line() returned error");
+				return 1;
+			}
+
+			/* Un-gamma correct the latest input line */
+			if (s->bpp == 8) {
+				for (i = 0; i < stride; i++)
+					ip[i] = (unsigned char)s->gamma[ip[i]];
+			} else {
+				unsigned short *ip2 = (unsigned short *)ip;
+				for (i = 0; i < stride; i++)
+					ip2[i] = s->gamma[ip2[i]];
+			}
 		}
 
-		tt = in[0];		/* Shuffle buffers about */
-		in[0] = in[1];
-		in[1] = in[2];
-		in[2] = in[3];
-		in[3] = in[4];
-		in[4] = in[5];
-		in[5] = tt;
+		/* Compute the gradients of the lines, which only depend on the input */
+		cx.y0 = y;
+		if (s->pool != NULL)
+			s->pool->run(s->pool, nl, analize_grad, (void *)&cx);
+		else
+			analize_grad((void *)&cx, 0, 0, nl);
+
+		/* Detect edges using the adaptive threshold, and track regions */
+		for (k = 0; k < nl; k++, y++) {
+			if (analize(s, g + k * w, y))
+				return 1;
+		}
 
+		/* Rotate the last 5 lines of the pass to the start of the buffers */
+		for (i = 0; i < nin; i++)
+			tin[i] = in[(i + nl) % nin];
+		for (i = 0; i < nin; i++)
+			in[i] = tin[i];
 	}
 	s->adivval /= (double)s->divc;	/* Average divider value, 1.0 = 0 degrees, 0.0 = 45 degrees */
 	if (s->adivval < 0.0)
@@ -595,8 +694,10 @@ read_input(scanrd_ *s) {
 		DBG((dbgo,"adivval = %f\n",s->adivval));
 
 	/* Free the input line buffers */
-	for (i = 0; i < 6; i++)
+	for (i = 0; i < nin; i++)
 		free(in[i]);
+	free(in);
+	free(g);
 
 	return 0;
 }
@@ -641,34 +742,15 @@ read_input(scanrd_ *s) {
 
 static int add_region(scanrd_ *s, region *rego, int no_o, region *regn, int no_n, int y);
 
-/* Process a line of the TIFF file */
+/* Init gamma conversion lookup and region tracking */
 /* return non-zero on error */
 static int
-analize(
-scanrd_ *s,
-unsigned char *inp[6],		/* current and previous 5 lines */
-int y						/* Current line y */
+init_analize(
+scanrd_ *s
 ) {
 	int w = s->width;
-	int stride = s->tdepth * s->width;	/* In pixels */
 	unsigned short *gamma = s->gamma;
-	int x,i;
-	unsigned short *inp2[6];	/* current and previous 5 lines (16bpp) equivalent of inp[] */
-	unsigned char  *in[6];		/* six input lines (8bpp) */
-	unsigned short *in2[6];		/* six input lines (16bpp) */
-	region *tr;
-	double tdh,tdv;				/* Horizontal/virtical detect levels */
-	double tdmag;
-	double atdmag = 0.0;		/* Average magnitude over a line */
-	int atdmagc = 0;			/* Average magnitude over a line count */
-	double linedv = 0.0;		/* Lines average divider value */
-	int linedc = 0;				/* Lines average count */
-	int xo3 = s->tdepth * 3;	/* Xoffset by 3 pixels */
-	int xo2 = s->tdepth * 2;	/* Xoffset by 2 pixels */
-	int xo1 = s->tdepth * 1;	/* Xoffset by 1 pixels */
-
-	for (x = 0; x < 6; x++)		/* Create 16 bpp version of line pointers */
-		inp2[x] = (unsigned short *)inp[x];
+	int i;
 
 	if (s->inited == 0) {
 		/* Init gamma conversion lookup and region tracking. */
@@ -720,113 +802,166 @@ int y						/* Current line y */
 		INIT_LIST(s->gdone);
 		s->inited = 1;
 	}
+	return 0;
+}
 
-	/* Un-gamma correct the latest input line */
-	if (s->bpp == 8)
-		for (x = 0; x < stride; x++)
-			inp[5][x] = (unsigned char)gamma[inp[5][x]];
-	else
-		for (x = 0; x < stride; x++)
-			inp2[5][x] = gamma[inp2[5][x]];
+/* Compute the edge gradients of lines ix0..ix1-1 of a pass */
+static int
+analize_grad(
+void *cntx,
+int thix,
+int ix0,
+int ix1
+) {
+	gradcx *cx = (gradcx *)cntx;
+	scanrd_ *s = cx->s;
+	int w = s->width;
+	int x,i,k;
+	unsigned char  *in[6];		/* six input lines (8bpp) */
+	unsigned short *in2[6];		/* six input lines (16bpp) */
+	double tdh,tdv;				/* Horizontal/virtical detect levels */
+	int xo3 = s->tdepth * 3;	/* Xoffset by 3 pixels */
+	int xo2 = s->tdepth * 2;	/* Xoffset by 2 pixels */
+	int xo1 = s->tdepth * 1;	/* Xoffset by 1 pixels */
+
+	for (k = ix0; k < ix1; k++) {
+		unsigned char **inp = cx->in + k;	/* current and previous 5 lines */
+		int y = cx->y0 + k;					/* Current line y */
+		gpix *g = cx->g + k * w;			/* Gradients of the current line */
+
+		/* Compute difference output for line y-3 */
+		for (x = 3; x < (w-2); x++) {		/* Allow for -3 to +2 from x */
+			unsigned char *out = s->out;
+			int e;
+			int ss;
+			int idx = ((y-2) * w + x) * 3;		/* Output raster index in bytes */
+
+			if (s->bpp == 8)
+				for (i = 0; i < 6; i++)
+					in[i] = inp[i] + x * s->tdepth;	/* Strength reduce */
+			else
+				for (i = 0; i < 6; i++) {
+					in2[i] = (unsigned short *)inp[i] + x * s->tdepth;	/* Strength reduce */
+					in[i] = (unsigned char *)in2[i];	/* track 8bpp pointers */
+				}
+
+			if (s->flags & SI_SHOW_IMAGE) {		/* Create B&W image */
+				toRGB(out + idx, in[2], s->depth, s->bpp);		/* Convert to RGB */
+				out[idx] = out[idx+1] = out[idx+2] = (2 * out[idx] + 7 * out[idx+1] + out[idx+2])/10;
+			}
+
+			ss = 0;		/* Sign of cross components the same vote */
+			tdh = tdv = 0.0;
+		
+			if (s->bpp == 8)
+				for (e = 0; e < s->depth; e++) {
+					int d1,d2;
+					/* Compute Gxp */
+					d1 = -in[0][-xo3+e] + -in[0][-xo2+e] + -in[0][-xo1+e]
+					                              + -in[0][ 0+e] + -in[0][ xo1+e] + -in[0][ xo2+e]
+					   + -in[1][-xo3+e] + -in[1][-xo2+e] + -in[1][-xo1+e]
+					                              + -in[1][ 0+e] + -in[1][ xo1+e] + -in[1][ xo2+e] 
+					   + -in[2][-xo3+e] + -in[2][-xo2+e] + -in[2][-xo1+e]
+					                              + -in[2][ 0+e] + -in[2][ xo1+e] + -in[2][ xo2+e]
+					   +  in[3][-xo3+e] +  in[3][-xo2+e] +  in[3][-xo1+e]
+					                              +  in[3][ 0+e] +  in[3][ xo1+e] +  in[3][ xo2+e]
+					   +  in[4][-xo3+e] +  in[4][-xo2+e] +  in[4][-xo1+e]
+					                              +  in[4][ 0+e] +  in[4][ xo1+e] +  in[4][ xo2+e]
+					   +  in[5][-xo3+e] +  in[5][-xo2+e] +  in[5][-xo1+e]
+					                              +  in[5][ 0+e] +  in[5][ xo1+e] +  in[5][ xo2+e];
+					/* Compute Gyp */
+					d2 = -in[0][-xo3+e] + -in[1][-xo3+e] + -in[2][-xo3+e]
+					                              + -in[3][-xo3+e] + -in[4][-xo3+e] + -in[5][-xo3+e]
+					   + -in[0][-xo2+e] + -in[1][-xo2+e] + -in[2][-xo2+e]
+					                              + -in[3][-xo2+e] + -in[4][-xo2+e] + -in[5][-xo2+e]
+					   + -in[0][-xo1+e] + -in[1][-xo1+e] + -in[2][-xo1+e]
+					                              + -in[3][-xo1+e] + -in[4][-xo1+e] + -in[5][-xo1+e]
+					   +  in[0][   0+e] +  in[1][   0+e] +  in[2][   0+e]
+					                              +  in[3][   0+e] +  in[4][   0+e] +  in[5][   0+e]
+					   +  in[0][+xo1+e] +  in[1][+xo1+e] +  in[2][+xo1+e]
+					                              +  in[3][+xo1+e] +  in[4][+xo1+e] +  in[5][+xo1+e]
+					   +  in[0][+xo2+e] +  in[1][+xo2+e] +  in[2][+xo2+e]
+					                              +  in[3][+xo2+e] +  in[4][+xo2+e] +  in[5][+xo2+e];
+
+					if ((d1 >= 0 && d2 >=0)
+					 || (d1 < 0 && d2 < 0))
+						ss++;				/* Sign was the same */
+					tdh += d1/4.5 * d1/4.5;		/* (4.5 = 6x6/4x2, to scale original tuned values) */
+					tdv += d2/4.5 * d2/4.5;
+				}
+			else
+				for (e = 0; e < s->depth; e++) {
+					int d1,d2;
+					/* Compute Gxp */
+					d1 = -in2[0][-xo3+e] + -in2[0][-xo2+e] + -in2[0][-xo1+e]
+					                              + -in2[0][ 0+e] + -in2[0][ xo1+e] + -in2[0][ xo2+e]
+					   + -in2[1][-xo3+e] + -in2[1][-xo2+e] + -in2[1][-xo1+e]
+					                              + -in2[1][ 0+e] + -in2[1][ xo1+e] + -in2[1][ xo2+e] 
+					   + -in2[2][-xo3+e] + -in2[2][-xo2+e] + -in2[2][-xo1+e]
+					                              + -in2[2][ 0+e] + -in2[2][ xo1+e] + -in2[2][ xo2+e]
+					   +  in2[3][-xo3+e] +  in2[3][-xo2+e] +  in2[3][-xo1+e]
+					                              +  in2[3][ 0+e] +  in2[3][ xo1+e] +  in2[3][ xo2+e]
+					   +  in2[4][-xo3+e] +  in2[4][-xo2+e] +  in2[4][-xo1+e]
+					                              +  in2[4][ 0+e] +  in2[4][ xo1+e] +  in2[4][ xo2+e]
+					   +  in2[5][-xo3+e] +  in2[5][-xo2+e] +  in2[5][-xo1+e]
+					                              +  in2[5][ 0+e] +  in2[5][ xo1+e] +  in2[5][ xo2+e];
+					/* Compute Gyp */
+					d2 = -in2[0][-xo3+e] + -in2[1][-xo3+e] + -in2[2][-xo3+e]
+					                              + -in2[3][-xo3+e] + -in2[4][-xo3+e] + -in2[5][-xo3+e]
+					   + -in2[0][-xo2+e] + -in2[1][-xo2+e] + -in2[2][-xo2+e]
+					                              + -in2[3][-xo2+e] + -in2[4][-xo2+e] + -in2[5][-xo2+e]
+					   + -in2[0][-xo1+e] + -in2[1][-xo1+e] + -in2[2][-xo1+e]
+					                              + -in2[3][-xo1+e] + -in2[4][-xo1+e] + -in2[5][-xo1+e]
+					   +  in2[0][   0+e] +  in2[1][   0+e] +  in2[2][   0+e]
+					                              +  in2[3][   0+e] +  in2[4][   0+e] +  in2[5][   0+e]
+					   +  in2[0][+xo1+e] +  in2[1][+xo1+e] +  in2[2][+xo1+e]
+					                              +  in2[3][+xo1+e] +  in2[4][+xo1+e] +  in2[5][+xo1+e]
+					   +  in2[0][+xo2+e] +  in2[1][+xo2+e] +  in2[2][+xo2+e]
+					                              +  in2[3][+xo2+e] +  in2[4][+xo2+e] +  in2[5][+xo2+e];
+
+					if ((d1 >= 0 && d2 >=0)
+					 || (d1 < 0 && d2 < 0))
+						ss++;				/* Sign was the same */
+				
+					tdh += d1/(4.5 * 257) * d1/(4.5 * 257);		/* Scale to 0..255 range */
+					tdv += d2/(4.5 * 257) * d2/(4.5 * 257);
+				}
+
+			g[x].tdh = tdh;
+			g[x].tdv = tdv;
+			g[x].ss = ss;
+		}
+	}
+	return 0;
+}
+
+/* Process a line of the TIFF file, given its gradients */
+/* return non-zero on error */
+static int
+analize(
+scanrd_ *s,
+gpix *g,					/* Gradients of the current line */
+int y						/* Current line y */
+) {
+	int w = s->width;
+	int x;
+	region *tr;
+	double tdh,tdv;				/* Horizontal/virtical detect levels */
+	double tdmag;
+	double atdmag = 0.0;		/* Average magnitude over a line */
+	int atdmagc = 0;			/* Average magnitude over a line count */
+	double linedv = 0.0;		/* Lines average divider value */
+	int linedc = 0;				/* Lines average count */
 
 	/* Compute difference output for line y-3 */
 	atdmagc = w - 5;		/* Magnitude count (to compute average) */
 	for (x = 3; x < (w-2); x++) {		/* Allow for -3 to +2 from x */
 		unsigned char *out = s->out;
-		int e;
-		int ss;
+		int ss = g[x].ss;
 		int idx = ((y-2) * w + x) * 3;		/* Output raster index in bytes */
 
-		if (s->bpp == 8)
-			for (i = 0; i < 6; i++)
-				in[i] = inp[i] + x * s->tdepth;	/* Strength reduce */
-		else
-			for (i = 0; i < 6; i++) {
-				in2[i] = inp2[i] + x * s->tdepth;	/* Strength reduce */
-				in[i] = (unsigned char *)in2[i];	/* track 8bpp pointers */
-			}
-
-		if (s->flags & SI_SHOW_IMAGE) {		/* Create B&W image */
-			toRGB(out + idx, in[2], s->depth, s->bpp);		/* Convert to RGB */
-			out[idx] = out[idx+1] = out[idx+2] = (2 * out[idx] + 7 * out[idx+1] + out[idx+2])/10;
-		}
-
-		ss = 0;		/* Sign of cross components the same vote */
-		tdh = tdv = 0.0;
-		
-		if (s->bpp == 8)
-			for (e = 0; e < s->depth; e++) {
-				int d1,d2;
-				/* Compute Gxp */
-				d1 = -in[0][-xo3+e] + -in[0][-xo2+e] + -in[0][-xo1+e]
-				                              + -in[0][ 0+e] + -in[0][ xo1+e] + -in[0][ xo2+e]
-				   + -in[1][-xo3+e] + -in[1][-xo2+e] + -in[1][-xo1+e]
-				                              + -in[1][ 0+e] + -in[1][ xo1+e] + -in[1][ xo2+e] 
-				   + -in[2][-xo3+e] + -in[2][-xo2+e] + -in[2][-xo1+e]
-				                              + -in[2][ 0+e] + -in[2][ xo1+e] + -in[2][ xo2+e]
-				   +  in[3][-xo3+e] +  in[3][-xo2+e] +  in[3][-xo1+e]
-				                              +  in[3][ 0+e] +  in[3][ xo1+e] +  in[3][ xo2+e]
-				   +  in[4][-xo3+e] +  in[4][-xo2+e] +  in[4][-xo1+e]
-				                              +  in[4][ 0+e] +  in[4][ xo1+e] +  in[4][ xo2+e]
-				   +  in[5][-xo3+e] +  in[5][-xo2+e] +  in[5][-xo1+e]
-				                              +  in[5][ 0+e] +  in[5][ xo1+e] +  in[5][ xo2+e];
-				/* Compute Gyp */
-				d2 = -in[0][-xo3+e] + -in[1][-xo3+e] + -in[2][-xo3+e]
-				                              + -in[3][-xo3+e] + -in[4][-xo3+e] + -in[5][-xo3+e]
-				   + -in[0][-xo2+e] + -in[1][-xo2+e] + -in[2][-xo2+e]
-				                              + -in[3][-xo2+e] + -in[4][-xo2+e] + -in[5][-xo2+e]
-				   + -in[0][-xo1+e] + -in[1][-xo1+e] + -in[2][-xo1+e]
-				                              + -in[3][-xo1+e] + -in[4][-xo1+e] + -in[5][-xo1+e]
-				   +  in[0][   0+e] +  in[1][   0+e] +  in[2][   0+e]
-				                              +  in[3][   0+e] +  in[4][   0+e] +  in[5][   0+e]
-				   +  in[0][+xo1+e] +  in[1][+xo1+e] +  in[2][+xo1+e]
-				                              +  in[3][+xo1+e] +  in[4][+xo1+e] +  in[5][+xo1+e]
-				   +  in[0][+xo2+e] +  in[1][+xo2+e] +  in[2][+xo2+e]
-				                              +  in[3][+xo2+e] +  in[4][+xo2+e] +  in[5][+xo2+e];
-
-				if ((d1 >= 0 && d2 >=0)
-				 || (d1 < 0 && d2 < 0))
-					ss++;				/* Sign was the same */
-				tdh += d1/4.5 * d1/4.5;		/* (4.5 = 6x6/4x2, to scale original tuned values) */
-				tdv += d2/4.5 * d2/4.5;
-			}
-		else
-			for (e = 0; e < s->depth; e++) {
-				int d1,d2;
-				/* Compute Gxp */
-				d1 = -in2[0][-xo3+e] + -in2[0][-xo2+e] + -in2[0][-xo1+e]
-				                              + -in2[0][ 0+e] + -in2[0][ xo1+e] + -in2[0][ xo2+e]
-				   + -in2[1][-xo3+e] + -in2[1][-xo2+e] + -in2[1][-xo1+e]
-				                              + -in2[1][ 0+e] + -in2[1][ xo1+e] + -in2[1][ xo2+e] 
-				   + -in2[2][-xo3+e] + -in2[2][-xo2+e] + -in2[2][-xo1+e]
-				                              + -in2[2][ 0+e] + -in2[2][ xo1+e] + -in2[2][ xo2+e]
-				   +  in2[3][-xo3+e] +  in2[3][-xo2+e] +  in2[3][-xo1+e]
-				                              +  in2[3][ 0+e] +  in2[3][ xo1+e] +  in2[3][ xo2+e]
-				   +  in2[4][-xo3+e] +  in2[4][-xo2+e] +  in2[4][-xo1+e]
-				                              +  in2[4][ 0+e] +  in2[4][ xo1+e] +  in2[4][ xo2+e]
-				   +  in2[5][-xo3+e] +  in2[5][-xo2+e] +  in2[5][-xo1+e]
-				                              +  in2[5][ 0+e] +  in2[5][ xo1+e] +  in2[5][ xo2+e];
-				/* Compute Gyp */
-				d2 = -in2[0][-xo3+e] + -in2[1][-xo3+e] + -in2[2][-xo3+e]
-				                              + -in2[3][-xo3+e] + -in2[4][-xo3+e] + -in2[5][-xo3+e]
-				   + -in2[0][-xo2+e] + -in2[1][-xo2+e] + -in2[2][-xo2+e]
-				                              + -in2[3][-xo2+e] + -in2[4][-xo2+e] + -in2[5][-xo2+e]
-				   + -in2[0][-xo1+e] + -in2[1][-xo1+e] + -in2[2][-xo1+e]
-				                              + -in2[3][-xo1+e] + -in2[4][-xo1+e] + -in2[5][-xo1+e]
-				   +  in2[0][   0+e] +  in2[1][   0+e] +  in2[2][   0+e]
-				                              +  in2[3][   0+e] +  in2[4][   0+e] +  in2[5][   0+e]
-				   +  in2[0][+xo1+e] +  in2[1][+xo1+e] +  in2[2][+xo1+e]
-				                              +  in2[3][+xo1+e] +  in2[4][+xo1+e] +  in2[5][+xo1+e]
-				   +  in2[0][+xo2+e] +  in2[1][+xo2+e] +  in2[2][+xo2+e]
-				                              +  in2[3][+xo2+e] +  in2[4][+xo2+e] +  in2[5][+xo2+e];
-
-				if ((d1 >= 0 && d2 >=0)
-				 || (d1 < 0 && d2 < 0))
-					ss++;				/* Sign was the same */
-				
-				tdh += d1/(4.5 * 257) * d1/(4.5 * 257);		/* Scale to 0..255 range */
-				tdv += d2/(4.5 * 257) * d2/(4.5 * 257);
-			}
+		tdh = g[x].tdh;
+		tdv = g[x].tdv;
 
 		tdmag = tdh + tdv;
 
@@ -947,7 +1082,6 @@ new_points(
 scanrd_ *s
 ) {
 	points *ps;
-	static int pn = 0;
 	if ((ps = (points *) malloc(sizeof(points))) == NULL) {
 		s->errv = SI_MALLOC_POINTS;
 		sprintf(s->errm,"new_points: malloc failed");
@@ -957,8 +1091,7 @@ scanrd_ *s
 	ps->no = 0;
 	ps->nop = 0;
 	ps->r = NULL;
-	ps->pn = pn;
-	pn++;
+	ps->pn = s->npn++;
 	return ps;
 }
 
@@ -2026,28 +2159,28 @@ scanrd_ *s
 /* (~~~ the line counting is rather broken ~~~) */
 static int
 read_relists(
-scanrd_ *s
+scanrd_ref_ *r
 ) {
-	char *fname = s->refname;			/* Path of file to read from */
+	char *fname = r->refname;			/* Path of file to read from */
 	FILE *elf;
 	int i,l = 1;
 	int rv;
 	char *em;	/* Read error message */
 
 	if ((elf=fopen(fname,"r"))==NULL) {
-		s->errv = SI_REF_READ_ERR;
-		sprintf(s->errm,"read_elists: error opening match reference file '%s'",fname);
+		r->errv = SI_REF_READ_ERR;
+		sprintf(r->errm,"read_elists: error opening match reference file '%s'",fname);
 		return 1;
 	}
 
-	s->fid[0] = s->fid[1] = 0.0;
-	s->fid[2] = s->fid[3] = 0.0;
-	s->fid[4] = s->fid[5] = 0.0;
-	s->fid[6] = s->fid[7] = 0.0;
+	r->fid[0] = r->fid[1] = 0.0;
+	r->fid[2] = r->fid[3] = 0.0;
+	r->fid[4] = r->fid[5] = 0.0;
+	r->fid[6] = r->fid[7] = 0.0;
 
 	/* BOXES */
 	for(;;) {
-		if((rv = fscanf(elf,"BOXES %d",&s->nsbox)) == 1) {
+		if((rv = fscanf(elf,"BOXES %d",&r->nsbox)) == 1) {
 			l++;
 			break;
 		}
@@ -2062,12 +2195,12 @@ scanrd_ *s
 	}
 
 	/* Allocate structures for boxes */
-	if ((s->sboxes = (sbox *) calloc(s->nsbox, sizeof(sbox))) == NULL) {
-		s->errv = SI_MALLOC_REFREAD;
-		sprintf(s->errm,"read_elist, malloc failed");
+	if ((r->sboxes = (sbox *) calloc(r->nsbox, sizeof(sbox))) == NULL) {
+		r->errv = SI_MALLOC_REFREAD;
+		sprintf(r->errm,"read_elist, malloc failed");
 		return 1;
 	}
-	for (i = 0; i < s->nsbox;) {
+	for (i = 0; i < r->nsbox;) {
 		char xfix1[20], xfix2[20], yfix1[20],yfix2[20];
 		char xfirst[20];
 		double ox,oy,w,h,xi,yi;
@@ -2082,17 +2215,17 @@ scanrd_ *s
 
 		/* If Fiducial. Typically top left, top right, botton right, bottom left. */
 		if (xfirst[0] == 'F') {
-			s->fid[0] = atof(yfix1);
-			s->fid[1] = atof(yfix2);
-			s->fid[2] = w;
-			s->fid[3] = h;
-			s->fid[4] = ox;
-			s->fid[5] = oy;
-			s->fid[6] = xi;
-			s->fid[7] = yi;
-			s->fidsize = fabs(s->fid[2] - s->fid[0]) + fabs(s->fid[5] - s->fid[3]);
-			s->fidsize /= 80.0;
-			s->havefids = 1;
+			r->fid[0] = atof(yfix1);
+			r->fid[1] = atof(yfix2);
+			r->fid[2] = w;
+			r->fid[3] = h;
+			r->fid[4] = ox;
+			r->fid[5] = oy;
+			r->fid[6] = xi;
+			r->fid[7] = yi;
+			r->fidsize = fabs(r->fid[2] - r->fid[0]) + fabs(r->fid[5] - r->fid[3]);
+			r->fidsize /= 80.0;
+			r->havefids = 1;
 
 //printf("~1 fiducials %f %f, %f %f %f, %f\n",w, h, ox,oy, xi, yi);
 			continue;
@@ -2101,32 +2234,32 @@ scanrd_ *s
 			x = ox;
 			strcpy(xf,xfix1);
 			for(;;) {	/* Do X increment */
-				if (i >= s->nsbox) {
+				if (i >= r->nsbox) {
 					em = "More BOXes than declared";
 					goto read_error;
 				}
 				/* '_' is used as a null string marker for single character single cells */
 				if (xf[0] == '_')
-					sprintf(s->sboxes[i].name,"%s",yfix1);
+					sprintf(r->sboxes[i].name,"%s",yfix1);
 				else if (yfix1[0] == '_')
-					sprintf(s->sboxes[i].name,"%s",xf);
+					sprintf(r->sboxes[i].name,"%s",xf);
 				else {	/* Y indicates Y name comes first */
 					if (xfirst[0] == 'Y')
-						sprintf(s->sboxes[i].name,"%s%s",yfix1,xf);
+						sprintf(r->sboxes[i].name,"%s%s",yfix1,xf);
 					else	/* X or D */
-						sprintf(s->sboxes[i].name,"%s%s",xf,yfix1);
+						sprintf(r->sboxes[i].name,"%s%s",xf,yfix1);
 				}
 				if (xfirst[0] == 'D')
-					s->sboxes[i].diag = 1;	/* Diagnostic box - don't print name or read pixels */
+					r->sboxes[i].diag = 1;	/* Diagnostic box - don't print name or read pixels */
 				else
-					s->sboxes[i].diag = 0;
-				s->sboxes[i].x1 = x;
-				s->sboxes[i].y1 = oy;
-				s->sboxes[i].x2 = x + w;
-				s->sboxes[i].y2 = oy + h;
+					r->sboxes[i].diag = 0;
+				r->sboxes[i].x1 = x;
+				r->sboxes[i].y1 = oy;
+				r->sboxes[i].x2 = x + w;
+				r->sboxes[i].y2 = oy + h;
 
 				/* Misc. init. of new sbox */
-				s->sboxes[i].xpt[0] = -1.0;		/* No default expected value */
+				r->sboxes[i].xpt[0] = -1.0;		/* No default expected value */
 				
 				i++;
 				x += xi;
@@ -2143,7 +2276,7 @@ scanrd_ *s
 
 	/* BOX_SHRINK */
 	for(;;) {
-		if((rv = fscanf(elf,"BOX_SHRINK %lf ",&s->rbox_shrink)) == 1) {
+		if((rv = fscanf(elf,"BOX_SHRINK %lf ",&r->rbox_shrink)) == 1) {
 			l++;
 			break;
 		}
@@ -2159,7 +2292,7 @@ scanrd_ *s
 
 	/* XLIST */
 	for(;;) {
-		if((rv = fscanf(elf,"XLIST %d ",&s->rxelist.c)) == 1) {
+		if((rv = fscanf(elf,"XLIST %d ",&r->rxelist.c)) == 1) {
 			l++;
 			break;
 		}
@@ -2173,14 +2306,14 @@ scanrd_ *s
 		}
 	}
 	/* Allocate structures for ref edge lists */
-	if ((s->rxelist.a = (epoint *) malloc(sizeof(epoint) * s->rxelist.c)) == NULL) {
-		s->errv = SI_MALLOC_REFREAD;
-		sprintf(s->errm,"read_elist, malloc failed");
+	if ((r->rxelist.a = (epoint *) malloc(sizeof(epoint) * r->rxelist.c)) == NULL) {
+		r->errv = SI_MALLOC_REFREAD;
+		sprintf(r->errm,"read_elist, malloc failed");
 		return 1;
 	}
-	for (i = 0; i < s->rxelist.c; i++) {
+	for (i = 0; i < r->rxelist.c; i++) {
 		if (fscanf(elf," %lf %lf %lf ",
-		    &s->rxelist.a[i].pos, &s->rxelist.a[i].len, &s->rxelist.a[i].ccount) != 3) {
+		    &r->rxelist.a[i].pos, &r->rxelist.a[i].len, &r->rxelist.a[i].ccount) != 3) {
 			em = "Failed to read an XLIST line";
 			goto read_error;
 		}
@@ -2189,7 +2322,7 @@ scanrd_ *s
 
 	/* YLIST */
 	for(;;) {
-		if ((rv = fscanf(elf,"YLIST %d ",&s->ryelist.c)) == 1) {
+		if ((rv = fscanf(elf,"YLIST %d ",&r->ryelist.c)) == 1) {
 			l++;
 			break;
 		}
@@ -2202,14 +2335,14 @@ scanrd_ *s
 			l++;
 		}
 	}
-	if ((s->ryelist.a = (epoint *) malloc(sizeof(epoint) * s->ryelist.c)) == NULL) {
-		s->errv = SI_MALLOC_REFREAD;
-		sprintf(s->errm,"read_elist, malloc failed");
+	if ((r->ryelist.a = (epoint *) malloc(sizeof(epoint) * r->ryelist.c)) == NULL) {
+		r->errv = SI_MALLOC_REFREAD;
+		sprintf(r->errm,"read_elist, malloc failed");
 		return 1;
 	}
-	for (i = 0; i < s->ryelist.c; i++) {
+	for (i = 0; i < r->ryelist.c; i++) {
 		if (fscanf(elf," %lf %lf %lf ",
-		    &s->ryelist.a[i].pos, &s->ryelist.a[i].len, &s->ryelist.a[i].ccount) != 3)
+		    &r->ryelist.a[i].pos, &r->ryelist.a[i].len, &r->ryelist.a[i].ccount) != 3)
 			{
 			em = "Failed to read an YLIST line";
 			goto read_error;
@@ -2257,20 +2390,20 @@ scanrd_ *s
 			}
 			l++;
 			/* Now locate the matching box */
-			for (i = 0; i < s->nsbox; i++) {
-				if (strcmp(s->sboxes[i].name, name) == 0) {	/* Found it */
+			for (i = 0; i < r->nsbox; i++) {
+				if (strcmp(r->sboxes[i].name, name) == 0) {	/* Found it */
 					if (isxyz) {
-						XYZ2Lab(s->sboxes[i].xpt, val);
+						XYZ2Lab(r->sboxes[i].xpt, val);
 					} else {
-						s->sboxes[i].xpt[0] = val[0];
-						s->sboxes[i].xpt[1] = val[1];
-						s->sboxes[i].xpt[2] = val[2];
+						r->sboxes[i].xpt[0] = val[0];
+						r->sboxes[i].xpt[1] = val[1];
+						r->sboxes[i].xpt[2] = val[2];
 					}
-					s->xpt = 1;
+					r->xpt = 1;
 					break;
 				}
 			}
-			if (i >= s->nsbox) {
+			if (i >= r->nsbox) {
 				em = "Failed to locate matching sample box in EXPECTED list";
 				goto read_error;
 			}
@@ -2278,7 +2411,7 @@ scanrd_ *s
 	}
 
 	if ((fclose(elf)) == EOF) {
-		s->errv = SI_REF_WRITE_ERR;
+		r->errv = SI_REF_WRITE_ERR;
 		error("read_elists: Unable to close match reference file '%s'\n",fname);
 		return 1;
 	}
@@ -2286,29 +2419,134 @@ scanrd_ *s
 	/* Generate length normalization factor */
 	{
 		double tlen;	/* Total of normalized length */
-		for (tlen = 0.0, i=0; i < s->rxelist.c; i++)
-			tlen += s->rxelist.a[i].len;
-		s->rxelist.lennorm = tlen;
-		for (tlen = 0.0, i=0; i < s->ryelist.c; i++)
-			tlen += s->ryelist.a[i].len;
-		s->ryelist.lennorm = tlen;
+		for (tlen = 0.0, i=0; i < r->rxelist.c; i++)
+			tlen += r->rxelist.a[i].len;
+		r->rxelist.lennorm = tlen;
+		for (tlen = 0.0, i=0; i < r->ryelist.c; i++)
+			tlen += r->ryelist.a[i].len;
+		r->ryelist.lennorm = tlen;
 	}
 
-	if (s->verb >= 3) {
+	if (r->verb >= 3) {
 		DBG((dbgo,"\nrxelist:\n"));
-		debug_elist(s, &s->rxelist);
+		debug_elist(NULL, &r->rxelist);
 		DBG((dbgo,"\nryelist:\n"));
-		debug_elist(s, &s->ryelist);
+		debug_elist(NULL, &r->ryelist);
 	}
 
 	return 0;
 
 read_error:;
-	s->errv = SI_REF_FORMAT_ERR;
-	sprintf(s->errm,"read_relist failed at line %d in file %s: %s\n",l,fname,em);
+	r->errv = SI_REF_FORMAT_ERR;
+	sprintf(r->errm,"read_relist failed at line %d in file %s: %s\n",l,fname,em);
 	return 1;
 }
 
+/* Copy the reference feature information into a scanrd, */
+/* ready to be matched to the raster. */
+/* return non-zero on error */
+static int
+copy_relists(
+scanrd_ *s,
+scanrd_ref_ *r
+) {
+	if (r->errv != 0) {
+		s->errv = r->errv;
+		strcpy(s->errm, r->errm);
+		return 1;
+	}
+
+	/* The sample boxes and edge lists get modified while matching, */
+	/* so each scanrd needs its own copy. */
+	s->nsbox = r->nsbox;
+	if ((s->sboxes = (sbox *) malloc(sizeof(sbox) * r->nsbox)) == NULL) {
+		s->errv = SI_MALLOC_REFREAD;
+		sprintf(s->errm,"copy_relists, malloc failed");
+		return 1;
+	}
+	memcpy(s->sboxes, r->sboxes, sizeof(sbox) * r->nsbox);
+
+	s->rxelist = r->rxelist;
+	if ((s->rxelist.a = (epoint *) malloc(sizeof(epoint) * r->rxelist.c)) == NULL) {
+		s->errv = SI_MALLOC_REFREAD;
+		sprintf(s->errm,"copy_relists, malloc failed");
+		return 1;
+	}
+	memcpy(s->rxelist.a, r->rxelist.a, sizeof(epoint) * r->rxelist.c);
+
+	s->ryelist = r->ryelist;
+	if ((s->ryelist.a = (epoint *) malloc(sizeof(epoint) * r->ryelist.c)) == NULL) {
+		s->errv = SI_MALLOC_REFREAD;
+		sprintf(s->errm,"copy_relists, malloc failed");
+		return 1;
+	}
+	memcpy(s->ryelist.a, r->ryelist.a, sizeof(epoint) * r->ryelist.c);
+
+	s->rbox_shrink = r->rbox_shrink;
+	s->xpt = r->xpt;
+	memcpy(s->fid, r->fid, sizeof(double) * 8);
+	s->fidsize = r->fidsize;
+	s->havefids = r->havefids;
+
+	return 0;
+}
+
+/* Return the error flag, and set the message pointer */
+static unsigned int
+scanrd_ref_error(scanrd_ref *pr, char **errm) {
+	scanrd_ref_ *r = (scanrd_ref_ *)pr;	/* Cast public to private */
+	*errm = r->errm;
+	return r->errv;
+}
+
+/* Free the reference object up */
+static void
+free_scanrd_ref(
+scanrd_ref *pr
+) {
+	scanrd_ref_ *r = (scanrd_ref_ *)pr;	/* Cast public to private */
+
+	free_elist_array(&r->rxelist);
+	free_elist_array(&r->ryelist);
+	if (r->sboxes != NULL)
+		free(r->sboxes);
+	free(r);
+}
+
+/* Read a chart reference file, so that it can be used */
+/* by several do_scanrd() calls. */
+/* Return NULL on failure to allocate */
+/* Need to check error() for other problems */
+scanrd_ref *new_scanrd_ref(
+int verb,			/* verbosity level */
+char *refname		/* reference file name */
+) {
+	scanrd_ref_ *r;
+
+	if ((r = (scanrd_ref_ *)calloc(1, sizeof(scanrd_ref_))) == NULL)
+		return NULL;
+
+	/* Public functions */
+	r->public.error = scanrd_ref_error;
+	r->public.free = free_scanrd_ref;
+
+	r->verb = verb;
+	r->refname = refname;
+	r->errv = 0;
+	r->errm[0] = '\0';
+
+	INIT_ELIST(r->rxelist);
+	INIT_ELIST(r->ryelist);
+	r->rbox_shrink = 0.9;
+	r->xpt = 0;
+	r->nsbox = 0;
+	r->sboxes = NULL;
+
+	read_relists(r);		/* Sets errv on error */
+
+	return (scanrd_ref *)r;
+}
+
 /********************************************************************************/
 /* Create an inverted direction elist */
 /* return non-zero on error */
@@ -3315,6 +3553,7 @@ scanrd_ *s
 		for (e = 0; e < s->depth; e++)
 			sp->P[e] = -2.0;		/* no value result */
 		sp->cnt = 0;
+		sp->rescan = 0;
 		sp->active = 0;		/* Not active */
 	}
 
@@ -3429,17 +3668,240 @@ double svlaf[21] = {
 	7.0898553402722982e+159
 };
 
-/* Scan the input file and accumulate the pixel values */
+#define VBANDH 64			/* Lines in each pass of the value scan */
+#define SUMS_MAXSD 3.0		/* Std. dev. (0.0 - 255.0) above which pixel sum mode patches */
+							/* use a histogram to compute the robust mean */
+#define SUMS_CLIPSD 3.0		/* Std. devs. from the ends of the range within which */
+							/* pixel sum mode patches use a histogram */
+
+/* Value scan pass modes */
+#define VSCAN_HIST  0		/* Histograms of all boxes */
+#define VSCAN_SUMS  1		/* Pixel value sums of all boxes */
+#define VSCAN_FALLB 2		/* Histograms of boxes marked by VSCAN_SUMS */
+
+/* Context for accumulating a pass of lines into the active sample boxes */
+typedef struct {
+	scanrd_ *s;
+	sbox **ab;				/* Boxes active during the pass */
+	sbox **fb;				/* Boxes that finished in the pass */
+	unsigned char **in;		/* Input lines of the pass */
+	int y0, y1;				/* Pass is lines y0 .. y1-1 */
+	int mode;				/* VSCAN_XXX pass mode */
+	int binsize;			/* Number of histogram bins per plane */
+	double vscale;			/* Value scale for 16bpp values to range 0.0 - 255.0 */
+	double svla;			/* Scan value location adhustment */
+} vscancx;
+
+/* Compute the statistics of a sample box from its histogram, */
+/* and free the histogram. */
+static void
+sbox_stats(
+scanrd_ *s,
+sbox *sp,
+int binsize,
+double vscale,
+double svla
+) {
+	int i,j,e;
+	int depth = s->depth;
+	unsigned long **ps = sp->ps;
+	int cnt;
+	double mP[MXDE], sdP[MXDE], P[MXDE];
+
+	/* Compute mean */
+	cnt = 0;
+	for (e = 0; e < depth; e++)
+		mP[e] = 0.0;
+	for (i = 0; i < binsize; i++) {	/* For all bins */
+		cnt += ps[0][i];
+		for (e = 0; e < depth; e++)
+			mP[e] += (double)ps[e][i] * i;
+	}
+	for (e = 0; e < depth; e++)
+		mP[e] /= (double) cnt * svla;
+	sp->cnt = cnt;
+
+	/* Compute standard deviation */
+	for (e = 0; e < depth; e++)
+		sdP[e] =  0.0;
+	for (i = 0; i < binsize; i++) {	/* For all bins */
+		double tt;
+		for (e = 0; e < depth; e++) {
+			tt = mP[e] - (double)i;
+			sdP[e] += tt * tt * (double)ps[e][i];
+		}
+	}
+	for (e = 0; e < depth; e++)
+		sdP[e] = sqrt(sdP[e] / (cnt - 1.0));
+
+	/* Compute "robust" mean */
+	/* (There are a number of ways to do this. we should try others */
+	for (e = 0; e < depth; e++)
+		P[e] = mP[e];
+	for (j = 0; j < 5; j++) { /* Itterate a few times */
+		double Pc[MXDE], Ps[MXDE];
+		for (e = 0; e < depth; e++) {
+			Pc[e] = 0.0;
+			Ps[e] = 0.0;
+		}
+		for (i = 0; i < binsize; i++) {	/* For all bins */
+			double tt, ww;
+
+			/* Unweight values away from current mean */
+			for (e = 0; e < depth; e++) {
+				tt = 1.0 + fabs((double)i - P[e]) * vscale;
+				ww = (double)ps[e][i]/(tt * tt);
+				Pc[e] += ww;
+				Ps[e] += ww * i;
+			}
+		}
+		for (e = 0; e < depth; e++)
+			P[e] = Ps[e] / Pc[e];
+	}
+
+	/* Scale all the values to be equivalent to 8bpp range */
+	for (e = 0; e < depth; e++) {
+		sp->mP[e]  = mP[e] * vscale;
+		sp->sdP[e] = sdP[e] * vscale;
+		sp->P[e]   = P[e] * vscale;
+	}
+
+	free(ps[0]);		/* Free up histogram array */
+	ps[0] = NULL;
+}
+
+/* Compute the mean and standard deviation of a sample box from its */
+/* pixel value sums. Use the mean as the robust mean, unless the standard */
+/* deviation indicates outliers or clipping, in which case mark the box */
+/* for a histogram re-scan. */
+static void
+sbox_sstats(
+scanrd_ *s,
+sbox *sp,
+double vscale,
+double svla
+) {
+	int e;
+
+	sp->rescan = 0;
+	for (e = 0; e < s->depth; e++) {
+		double m, tt;
+
+		m = (double)sp->s1[e] / (double)sp->cnt;
+		sp->mP[e] = (double)sp->s1[e] / ((double) sp->cnt * svla);
+
+		tt = (double)sp->s2[e] - m * (double)sp->s1[e];
+		if (tt < 0.0)
+			tt = 0.0;
+		sp->sdP[e] = sqrt(tt / (sp->cnt - 1.0));
+
+		/* Scale all the values to be equivalent to 8bpp range */
+		sp->mP[e]  *= vscale;
+		sp->sdP[e] *= vscale;
+		sp->P[e] = sp->mP[e];
+
+		/* Values clipped at the ends of the range have a lopsided */
+		/* distribution, so the robust mean won't be the mean either. */
+		if (sp->sdP[e] > SUMS_MAXSD
+		 || (sp->mP[e] - SUMS_CLIPSD * sp->sdP[e]) < 1.0
+		 || (sp->mP[e] + SUMS_CLIPSD * sp->sdP[e]) > 254.0)
+			sp->rescan = 1;
+	}
+}
+
+/* Accumulate the pass lines into active boxes ix0..ix1-1 */
+static int
+vscan_boxes(
+void *cntx,
+int thix,
+int ix0,
+int ix1
+) {
+	vscancx *cx = (vscancx *)cntx;
+	scanrd_ *s = cx->s;
+	int ox = s->width;
+	int i, e;
+
+	for (i = ix0; i < ix1; i++) {
+		sbox *sp = cx->ab[i];
+		int y, ys, ye;
+
+		ys = sp->ymin > cx->y0 ? sp->ymin : cx->y0;
+		ye = sp->ymax < (cx->y1-1) ? sp->ymax : (cx->y1-1);
+
+		for (y = ys; y <= ye; y++) {
+			unsigned char *in = cx->in[y - cx->y0];		/* Input pixel buffer (8bpp) */
+			unsigned short *in2 = (unsigned short *)in;	/* Input pixel buffer (16bpp) */
+			int x,x1,x2,xx;	
+			unsigned char *oo = &s->out[y * ox * 3];		/* Output raster pointer if needed */
+			x1 = nextx(sp,&sp->l);		/* next in left edge */
+			x2 = nextx(sp,&sp->r);		/* next in right edge */
+			if (cx->mode == VSCAN_SUMS) {
+				for (x = s->tdepth*x1, xx = 3*x1; x <= s->tdepth*x2; x += s->tdepth, xx +=3) {
+					for (e = 0; e < s->depth; e++) {
+						ORD64 v = s->bpp == 8 ? in[x+e] : in2[x+e];
+						sp->s1[e] += v;				/* Sum values and squares */
+						sp->s2[e] += v * v;
+					}
+					sp->cnt++;
+					if (s->flags & SI_SHOW_SAMPLED_AREA)
+						toRGB(oo+xx, in+x * s->bypp, s->depth, s->bpp);
+				}
+			} else if (s->bpp == 8)
+				for (x = s->tdepth*x1, xx = 3*x1; x <= s->tdepth*x2; x += s->tdepth, xx +=3) {
+					for (e = 0; e < s->depth; e++)
+						sp->ps[e][in[x+e]]++;		/* Increment histogram bins */
+					if (s->flags & SI_SHOW_SAMPLED_AREA)
+						toRGB(oo+xx, in+x, s->depth, s->bpp);
+				}
+			else
+				for (x = s->tdepth*x1, xx = 3*x1; x <= s->tdepth*x2; x += s->tdepth, xx+=3) {
+					for (e = 0; e < s->depth; e++)
+						sp->ps[e][in2[x+e]]++;		/* Increment histogram bins */
+					if (s->flags & SI_SHOW_SAMPLED_AREA)
+						toRGB(oo+xx, (unsigned char *)(in2+x), s->depth, s->bpp);
+				}
+		}
+	}
+	return 0;
+}
+
+/* Compute the statistics of finished boxes ix0..ix1-1 */
+static int
+vscan_stats(
+void *cntx,
+int thix,
+int ix0,
+int ix1
+) {
+	vscancx *cx = (vscancx *)cntx;
+	int i;
+
+	for (i = ix0; i < ix1; i++) {
+		if (cx->mode == VSCAN_SUMS)
+			sbox_sstats(cx->s, cx->fb[i], cx->vscale, cx->svla);
+		else
+			sbox_stats(cx->s, cx->fb[i], cx->binsize, cx->vscale, cx->svla);
+	}
+	return 0;
+}
+
+/* Do a pass over the input file and accumulate the pixel values */
 /* return non-zero on error */
 static int
-do_value_scan(
-scanrd_ *s
+value_scan(
+scanrd_ *s,
+int mode			/* VSCAN_XXX pass mode */
 ) {
 	int y;			/* current y */
 	int ox,oy;		/* x and y size */
-	int e;
-	unsigned char *in;		/* Input pixel buffer (8bpp) */
-	unsigned short *in2;	/* Input pixel buffer (16bpp) */
+	int e, i;
+	unsigned char *in[VBANDH];	/* Input line buffers */
+	sbox **ab;		/* Active boxes */
+	int nab;		/* Number of active boxes */
+	sbox **fb;		/* Finished boxes */
+	int nfb;		/* Number of finished boxes */
+	vscancx cx;
 	int binsize;
 	double vscale;		/* Value scale for 16bpp values to range 0.0 - 255.0 */
 	double svla;		/* Scan value location adhustment */
@@ -3456,146 +3918,112 @@ scanrd_ *s
 		vscale = 1.0/257.0;
 	}
 
-	/* Allocate one input line buffers */
-	if ((in = malloc(s->tdepth * ox * s->bypp)) == NULL) {
+	/* Allocate a pass of input line buffers */
+	for (i = 0; i < VBANDH; i++) {
+		if ((in[i] = malloc(s->tdepth * ox * s->bypp)) == NULL) {
+			s->errv = SI_MALLOC_VALUE_SCAN;
+			sprintf(s->errm,"do_value_scan: Failed to malloc test output array");
+			return 1;
+		}
+	}
+	if ((ab = (sbox **)malloc(sizeof(sbox *) * 2 * (s->nsbox + 1))) == NULL) {
 		s->errv = SI_MALLOC_VALUE_SCAN;
-		sprintf(s->errm,"do_value_scan: Failed to malloc test output array");
+		sprintf(s->errm,"do_value_scan: Failed to malloc active box array");
 		return 1;
 	}
-	in2 = (unsigned short *)in;
 
 	/* Compute the adjustment factor for these patches */
 	for (svla = 0.0, e = 1; e < (3 * 7); e++)
 		svla += svlaf[e];
 	svla *= svlaf[0];
 
-	/* Process the tiff file line by line */
-	for (y = 0; y < oy; y++) {
-		if (s->read_line(s->fdata, y, (char *)in)) {
-			s->errv = SI_RAST_READ_ERR;
-			sprintf(s->errm,"scanrd: do_value_scan: read_line() returned error");
-			return 1;
+	fb = ab + s->nsbox + 1;
+
+	cx.s = s;
+	cx.ab = ab;
+	cx.fb = fb;
+	cx.in = in;
+	cx.mode = mode;
+	cx.binsize = binsize;
+	cx.vscale = vscale;
+	cx.svla = svla;
+
+	/* Process the tiff file a pass of lines at a time */
+	for (y = 0; y < oy; y = cx.y1) {
+		cx.y0 = y;
+		if ((cx.y1 = y + VBANDH) > oy)
+			cx.y1 = oy;
+
+		for (i = 0; i < (cx.y1 - cx.y0); i++) {
+			if (s->read_line(s->fdata, y + i, (char *)in[i])) {
+				s->errv = SI_RAST_READ_ERR;
+				sprintf(s->errm,"scanrd: do_value_scan: read_line() returned error");
+				return 1;
+			}
 		}
 
-		/* Update the active list with new boxes*/
-		while (s->csi < s->nsbox && s->sbstart[s->csi]->ymin <= y) {
-			/* If goes active on this y */
-			if (s->sbstart[s->csi]->diag == 0 && s->sbstart[s->csi]->ymin == y) {
+		/* Update the active list with boxes starting in this pass */
+		while (s->csi < s->nsbox && s->sbstart[s->csi]->ymin < cx.y1) {
+			/* If goes active on a y in this pass */
+			if (s->sbstart[s->csi]->diag == 0 && s->sbstart[s->csi]->ymin >= cx.y0
+			 && (mode != VSCAN_FALLB || s->sbstart[s->csi]->rescan != 0)) {
 				sp = s->sbstart[s->csi];
 				if (s->verb >= 4)
 					DBG((dbgo,"added box %ld '%s' to the active list\n",(long)(sp - &s->sboxes[0]),sp->name));
 				ADD_ITEM_TO_TOP(s->alist,sp);	/* Add it to the active list */
 				sp->active = 1;
-				sp->ps[0] = calloc(s->tdepth * binsize,sizeof(unsigned long));
-				if (sp->ps[0] == NULL)
-					error("do_value_scan: Failed to malloc sbox histogram array");
-				for (e = 1; e < s->depth; e++)
-					sp->ps[e] = sp->ps[e-1] + binsize;
+				if (mode == VSCAN_SUMS) {
+					for (e = 0; e < s->depth; e++)
+						sp->s1[e] = sp->s2[e] = 0;
+					sp->cnt = 0;
+				} else {
+					sp->ps[0] = calloc(s->tdepth * binsize,sizeof(unsigned long));
+					if (sp->ps[0] == NULL)
+						error("do_value_scan: Failed to malloc sbox histogram array");
+					for (e = 1; e < s->depth; e++)
+						sp->ps[e] = sp->ps[e-1] + binsize;
+				}
 			}
 			s->csi++;
 		}
-		/* Process the line */
+
+		/* Process the lines. Each box has its own histogram */
+		/* and edge scan, so the boxes can be done in parallel. */
+		nab = 0;
 		sp = s->alist;
 		FOR_ALL_ITEMS(sbox, sp) {
-			int x,x1,x2,xx;	
-			unsigned char *oo = &s->out[y * ox * 3];		/* Output raster pointer if needed */
-			x1 = nextx(sp,&sp->l);		/* next in left edge */
-			x2 = nextx(sp,&sp->r);		/* next in right edge */
-			if (s->bpp == 8)
-				for (x = s->tdepth*x1, xx = 3*x1; x <= s->tdepth*x2; x += s->tdepth, xx +=3) {
-					for (e = 0; e < s->depth; e++)
-						sp->ps[e][in[x+e]]++;		/* Increment histogram bins */
-					if (s->flags & SI_SHOW_SAMPLED_AREA)
-						toRGB(oo+xx, in+x, s->depth, s->bpp);
-				}
-			else
-				for (x = s->tdepth*x1, xx = 3*x1; x <= s->tdepth*x2; x += s->tdepth, xx+=3) {
-					for (e = 0; e < s->depth; e++)
-						sp->ps[e][in2[x+e]]++;		/* Increment histogram bins */
-					if (s->flags & SI_SHOW_SAMPLED_AREA)
-						toRGB(oo+xx, (unsigned char *)(in2+x), s->depth, s->bpp);
-				}
+			ab[nab++] = sp;
 		} END_FOR_ALL_ITEMS(sp);
 
+		if (s->pool != NULL)
+			s->pool->run(s->pool, nab, vscan_boxes, (void *)&cx);
+		else
+			vscan_boxes((void *)&cx, 0, 0, nab);
 	 	
-		/* Delete finished boxes from the active list */
-		while (s->cei < s->nsbox && s->sbend[s->cei]->ymax <= y) {	/* All that finished last line */
+		/* Delete boxes that finished in this pass from the active list */
+		nfb = 0;
+		while (s->cei < s->nsbox && s->sbend[s->cei]->ymax < cx.y1) {
 			if (s->verb >= 4)
 				DBG((dbgo,"cei = %d, sbenc[s->cei]->ymax = %d, y = %d, active = %d\n",
-					s->cei,s->sbend[s->cei]->ymax,y,s->sbend[s->cei]->active));
+					s->cei,s->sbend[s->cei]->ymax,cx.y1-1,s->sbend[s->cei]->active));
 
-			/* If goes inactive after this y */
-			if (s->sbend[s->cei]->active != 0 && s->sbend[s->cei]->ymax == y) {
-				int i,j;
-				int cnt;
-				double P[MXDE];
+			/* If went inactive during this pass */
+			if (s->sbend[s->cei]->active != 0) {
 				sp = s->sbend[s->cei];
 				if (s->verb >= 4)
 					DBG((dbgo,"deleted box %ld '%s' from the active list\n",(long)(sp - &s->sboxes[0]),sp->name));
 				DEL_LINK(s->alist,sp);		/* Remove it from active list */
-
-				/* Compute mean */
-				cnt = 0;
-				for (e = 0; e < s->depth; e++)
-				sp->mP[e] = 0.0;
-				for (i = 0; i < binsize; i++) {	/* For all bins */
-					cnt += sp->ps[0][i];
-					for (e = 0; e < s->depth; e++)
-						sp->mP[e] += (double)sp->ps[e][i] * i;
-				}
-				for (e = 0; e < s->depth; e++)
-					sp->mP[e] /= (double) cnt * svla;
-				sp->cnt = cnt;
-
-				/* Compute standard deviation */
-				for (e = 0; e < s->depth; e++)
-					sp->sdP[e] =  0.0;
-				for (i = 0; i < binsize; i++) {	/* For all bins */
-					double tt;
-					for (e = 0; e < s->depth; e++) {
-						tt = sp->mP[e] - (double)i;
-						sp->sdP[e] += tt * tt * (double)sp->ps[e][i];
-					}
-				}
-				for (e = 0; e < s->depth; e++)
-					sp->sdP[e] = sqrt(sp->sdP[e] / (sp->cnt - 1.0));
-
-				/* Compute "robust" mean */
-				/* (There are a number of ways to do this. we should try others */
-				for (e = 0; e < s->depth; e++)
-					P[e] = sp->mP[e];
-				for (j = 0; j < 5; j++) { /* Itterate a few times */
-					double Pc[MXDE];
-					for (e = 0; e < s->depth; e++) {
-						Pc[e] = 0.0;
-						sp->P[e] = 0.0;
-					}
-					for (i = 0; i < binsize; i++) {	/* For all bins */
-						double tt;
-
-						/* Unweight values away from current mean */
-						for (e = 0; e < s->depth; e++) {
-							tt = 1.0 + fabs((double)i - P[e]) * vscale;
-							Pc[e] += (double)sp->ps[e][i]/(tt * tt);
-							sp->P[e] += (double)sp->ps[e][i]/(tt * tt) * i;
-						}
-					}
-					for (e = 0; e < s->depth; e++)
-						P[e] = sp->P[e] /= Pc[e];
-				}
-
-				/* Scale all the values to be equivalent to 8bpp range */
-				for (e = 0; e < s->depth; e++) {
-					sp->mP[e]  *= vscale;
-					sp->sdP[e] *= vscale;
-					sp->P[e]   *= vscale;
-				}
-
-				free(sp->ps[0]);		/* Free up histogram array */
 				sp->active = 0;
+				fb[nfb++] = sp;
 			}
 			s->cei++;
 		}
+
+		/* Compute their statistics */
+		if (s->pool != NULL)
+			s->pool->run(s->pool, nfb, vscan_stats, (void *)&cx);
+		else
+			vscan_stats((void *)&cx, 0, 0, nfb);
 	}
 
 	/* Any boxes remaining on active list must hang */
@@ -3606,13 +4034,52 @@ scanrd_ *s
 			DBG((dbgo,"Cell '%s' was left on the active list\n",sp->name));
 		for (e = 0; e < s->depth; e++)
 			sp->P[e] = -2.0;	/* Signal no value */
-		free(sp->ps[0]);		/* Free up histogram array */
+		if (mode != VSCAN_SUMS)
+			free(sp->ps[0]);		/* Free up histogram array */
+		sp->rescan = 0;
 		sp->active = 0;
 	END_FOR_ALL_ITEMS(sp);
 
+	for (i = 0; i < VBANDH; i++)
+		free(in[i]);
+	free(ab);
+
 	return 0;
 }
 
+/* Scan the input file and accumulate the pixel values */
+/* return non-zero on error */
+static int
+do_value_scan(
+scanrd_ *s
+) {
+	sbox *sp;
+	int nrescan = 0;
+
+	if ((s->flags & SI_SUM_STATS) == 0)
+		return value_scan(s, VSCAN_HIST);
+
+	/* Compute the mean and standard deviation from pixel value sums */
+	if (value_scan(s, VSCAN_SUMS))
+		return 1;
+
+	/* Re-scan any boxes that need a histogram for their robust mean */
+	for (sp = &s->sboxes[0]; sp < &s->sboxes[s->nsbox]; sp++) {
+		if (sp->rescan) {
+			sp->l.i = sp->r.i = -1;		/* Restart edge following */
+			nrescan++;
+		}
+	}
+	if (s->verb >= 3)
+		DBG((dbgo,"%d of %d boxes need a histogram for their robust mean\n",nrescan,s->nsbox));
+	if (nrescan == 0)
+		return 0;
+
+	s->csi = s->cei = 0;
+	INIT_LIST(s->alist);
+	return value_scan(s, VSCAN_FALLB);
+}
+
 /********************************************************************************/
 /* Deal with checking the correlation of the current candidate rotation */
 /* with the expected values. */
@@ -23,6 +23,8 @@
 #define SI_PERSPECTIVE 	      0x20000	/* Allow perspective correction */
 #define SI_GENERAL_ROT 	      0x40000	/* Allow general rotation, else assume zero degrees */
 #define SI_ASISIFFAIL 	      0x80000	/* Read patch values "as is" if everything else failes */
+#define SI_SUM_STATS 	     0x100000	/* Compute patch mean & std. dev. from pixel sums */
+#define SI_NOTHREADS 	     0x200000	/* Do all the work in the calling thread */
 
 /* Scanrd diagnostic flags */
 #define SI_SHOW_FLAGS         0xffff	/* Mask for all SHOW flags */
@@ -99,6 +101,25 @@ struct _scanrd {
 	}; typedef struct _scanrd scanrd;
 
 
+/* A chart recognition reference, read once so that it can be */
+/* used by several do_scanrd() calls, possibly at the same time */
+struct _scanrd_ref {
+	/*** Public methods ***/
+	/* Return the error flag, and set the message pointer */
+	unsigned int (*error)(struct _scanrd_ref *r, char **errm);
+
+	/* Free up the structure */
+	void (*free)(struct _scanrd_ref *r);
+
+	}; typedef struct _scanrd_ref scanrd_ref;
+
+/* Read a chart recognition reference file */
+/* Return NULL on failure to allocate, need to check error() for other problems */
+scanrd_ref *new_scanrd_ref(
+	int verb,			/* verbosity level */
+	char *refname		/* reference file name */
+);
+
 /* Read in a chart */
 /* Then use reset() and read() to get values read */
 scanrd *do_scanrd(
@@ -117,6 +138,7 @@ scanrd *do_scanrd(
 	void *fdata,		/* Opaque data for read_line */
 
 	char *refname,		/* reference file name */
+	scanrd_ref *ref,	/* Reference read by new_scanrd_ref(), NULL to read refname */
 
 	int (*write_line)(void *ddata, int y, char *src),	/* Write 8bpp RGB line of diag file */
 	void *ddata			/* Opaque data for write_line */
@@ -143,6 +143,8 @@ struct _sbox {
 	escan l,r;						/* left and right edge scan structures */
 
 	unsigned long *ps[MXDE];		/* Pixel value histogram arrays (256 or 65536) */
+	ORD64 s1[MXDE], s2[MXDE];		/* Sums of pixel values and their squares */
+	int rescan;						/* NZ if robust mean needs a histogram re-scan */
 	/* Pixel values just scanned, or from best rotation */
 	double mP[MXDE];				/* Mean Pixel values (0.0 - 255.0) */
 	double sdP[MXDE];				/* Standard deviations */
@@ -192,6 +194,7 @@ struct _scanrd_ {
 	int noslines;			/* Number of lines with valid stats */
 	int novlines;			/* Number of valid lines */
 	points *gdone;			/* Head of done point linked list groups */
+	int npn;				/* Serial number of next points structure */
 
 	double ppc[4];			/* Partial perspective correction values. */
 							/* persp() applies perspective distortion, */
@@ -257,6 +260,8 @@ struct _scanrd_ {
 	int diag_pixinc[4];
 	int orth_pixinc[4];
 
+	struct _athreadpool *pool;	/* Threads to analyse and scan the raster with, NULL if none */
+
 	/*** Callbacks ***/
 
 	int (*read_line)(void *fdata, int y, char *dst);
@@ -269,6 +274,28 @@ struct _scanrd_ {
 
 }; typedef struct _scanrd_ scanrd_;
 
+/* The private chart reference object */
+struct _scanrd_ref_ {
+	/* Public part of structure */
+	scanrd_ref public;
+
+	/* Private variables */
+	int verb;				/* verbosity level */
+	unsigned int errv;		/* Error value */
+	char errm[200];			/* Error message */
+	char *refname;			/* Path of reference file */
+
+	elist rxelist, ryelist;	/* X and Y .cht reference edge lists array */
+	double rbox_shrink;		/* Reference box shrink factor */
+	int xpt;				/* NZ if got expected reference values */
+	double fid[8];			/* Four fiducial locations, typicall clockwise from top left */
+	double fidsize;			/* Fiducial diagnostic cross size */
+	double havefids;		/* NZ if there are fiducials */
+	int nsbox;				/* Number of sample boxes */
+	sbox *sboxes;			/* Reference sample box names, outlines and expected values */
+
+}; typedef struct _scanrd_ref_ scanrd_ref_;
+
 /*************************************************************************/
 /* Heapsort macro */
 
@@ -23,6 +23,8 @@
 #include <stdarg.h>
 #include <time.h>
 #include <ctype.h>
+#include <string.h>
+#include <fcntl.h>
 
 #ifdef NT
 /* Set minimum OS target as XP */
@@ -648,7 +650,7 @@ int system_processors() {
 #endif /* NT */
 
 /* Do a string copy while replacing all '\' characters with '/' */
-void copynorm_dirsep(char *d, char *s) { 
+static void copynorm_dirsep(char *d, char *s) { 
 #ifdef NT
 	for (;;) {
 		*d = *s;
@@ -1536,6 +1538,188 @@ int kill_nprocess(char **pname, a1log *log) {
 
 #endif /* UNIX_APPLE || NT */
 
+/* ===================================================================== */
+/* Thread pool */
+
+struct _athreadpool_task {
+	int thix;				/* Thread index */
+	int ix0, ix1;			/* Index range */
+	int (*function)(void *context, int thix, int ix0, int ix1);
+	void *context;
+};
+
+static int athreadpool_task(void *cntx) {
+	struct _athreadpool_task *t = (struct _athreadpool_task *)cntx;
+
+	return t->function(t->context, t->thix, t->ix0, t->ix1);
+}
+
+static int athreadpool_run(
+athreadpool *p,
+int n,
+int (*function)(void *context, int thix, int ix0, int ix1),
+void *context
+) {
+	int i, nc, rv, trv;
+
+	if (n <= 0)
+		return 0;
+
+	nc = p->nthr;
+	if (nc > n)
+		nc = n;
+
+	for (i = 0; i < nc; i++) {
+		p->tasks[i].thix = i;
+		p->tasks[i].ix0 = (int)(((double)n * i)/nc);
+		p->tasks[i].ix1 = (int)(((double)n * (i+1))/nc);
+		p->tasks[i].function = function;
+		p->tasks[i].context = context;
+	}
+
+	for (i = 1; i < nc; i++)
+		p->th[i-1]->start_task(p->th[i-1], athreadpool_task, &p->tasks[i]);
+
+	rv = athreadpool_task(&p->tasks[0]);
+
+	for (i = 1; i < nc; i++) {
+		trv = p->th[i-1]->wait_stop(p->th[i-1]);
+		if (rv == 0)
+			rv = trv;
+	}
+	return rv;
+}
+
+static void athreadpool_del(athreadpool *p) {
+	int i;
+
+	if (p == NULL)
+		return;
+
+	if (p->th != NULL) {
+		for (i = 0; i < (p->nthr-1); i++) {
+			if (p->th[i] != NULL)
+				p->th[i]->del(p->th[i]);
+		}
+		free(p->th);
+	}
+	free(p->tasks);
+	free(p);
+}
+
+/* Create a thread pool with nthr threads. */
+/* nthr <= 0 for one per processor. Return NULL on error. */
+athreadpool *new_athreadpool(int nthr) {
+	athreadpool *p;
+	int i;
+
+	if (nthr <= 0)
+		nthr = system_processors();
+	if (nthr <= 0)
+		nthr = 1;
+
+	if ((p = (athreadpool *)calloc(1, sizeof(athreadpool))) == NULL) {
+		a1loge(g_log, 1, "new_athreadpool: calloc failed\n");
+		return NULL;
+	}
+	p->nthr = nthr;
+	p->run = athreadpool_run;
+	p->del = athreadpool_del;
+
+	if ((p->tasks = (struct _athreadpool_task *)calloc(nthr,
+	                                     sizeof(struct _athreadpool_task))) == NULL
+	 || (p->th = (athread **)calloc(nthr, sizeof(athread *))) == NULL) {
+		a1loge(g_log, 1, "new_athreadpool: calloc failed\n");
+		athreadpool_del(p);
+		return NULL;
+	}
+
+	for (i = 0; i < (nthr-1); i++) {
+		if ((p->th[i] = new_athread_reusable(athreadpool_task, NULL, 1)) == NULL) {
+			a1loge(g_log, 1, "new_athreadpool: creating thread %d failed\n",i);
+			athreadpool_del(p);
+			return NULL;
+		}
+	}
+
+	return p;
+}
+
+/* ===================================================================== */
+/* Cache file support */
+
+/* 64 bit FNV-1a hash of n bytes */
+ORD64 hash64_bytes(ORD64 h, void *b, size_t n) {
+	ORD8 *bp = (ORD8 *)b;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h ^= bp[i];
+		h *= (ORD64)0x100000001b3;
+	}
+	return h;
+}
+
+ORD64 hash64_int(ORD64 h, int v) {
+	ORD8 b[4];
+	write_INR32_le(b, v);
+	return hash64_bytes(h, b, 4);
+}
+
+ORD64 hash64_ord64(ORD64 h, ORD64 v) {
+	ORD8 b[8];
+	write_ORD64_le(b, v);
+	return hash64_bytes(h, b, 8);
+}
+
+ORD64 hash64_dbl(ORD64 h, double v) {
+	ORD8 b[8];
+	write_FLT64_le(b, v);
+	return hash64_bytes(h, b, 8);
+}
+
+ORD64 hash64_str(ORD64 h, char *str) {
+	return hash64_bytes(h, str, strlen(str) + 1);
+}
+
+/* Write the header and body to a file by way of a temporary file */
+/* that is then renamed, so that an interrupted write or a concurrent */
+/* reader never sees a partial file. Return nz on error. */
+int write_file_renamed(char *fname, ORD8 *hdr, size_t hsize, ORD8 *buf, size_t bsize) {
+	FILE *fp;
+	char *tname;
+	int rv = 1;
+
+	if ((tname = malloc(strlen(fname) + 4 + 1)) == NULL)
+		return 1;
+	sprintf(tname, "%s.tmp", fname);
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(tname,"wb")) != NULL)
+#else
+	if ((fp = fopen(tname,"w")) != NULL)
+#endif
+	{
+		if ((hsize > 0 && fwrite(hdr, 1, hsize, fp) != hsize)
+		 || (bsize > 0 && fwrite(buf, 1, bsize, fp) != bsize)) {
+			fclose(fp);
+			remove(tname);
+		} else if (fclose(fp) != 0) {
+			remove(tname);
+		} else {
+#ifdef NT
+			remove(fname);		/* MSWin rename won't replace a file */
+#endif
+			if (rename(tname, fname) == 0)
+				rv = 0;
+			else
+				remove(tname);
+		}
+	}
+	free(tname);
+	return rv;
+}
+
 /* ===================================================================== */
 /* Some web support */
 
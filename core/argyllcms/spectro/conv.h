@@ -225,6 +225,52 @@ athread *new_athread_reusable(int (*function)(void *context), void *context, int
 #define new_athread(func, ctx) new_athread_reusable(func, ctx, 0)
 
 
+/* - - - - - - - - - - - - - - - - - - -- */
+
+/* A pool of reusable threads, for spreading data parallel work */
+/* across processors. */
+struct _athreadpool {
+	int nthr;				/* Number of threads, including the calling thread */
+	athread **th;			/* nthr-1 reusable helper threads */
+	struct _athreadpool_task *tasks;	/* Per thread task details */
+
+	/* Call function(context, thix, ix0, ix1) with the index range 0..n-1 */
+	/* split into up to nthr contiguous chunks, one per thread. thix is the */
+	/* thread index 0..nthr-1, and ix0..ix1-1 its part of the range. */
+	/* The calling thread does chunk 0. The chunk boundaries only depend on */
+	/* n and nthr, so per thread results combined in thix order are repeatable. */
+	/* Not re-entrant - function mustn't call run() on the same pool. */
+	/* Return the first nz function return value, 0 if all OK. */
+	int (*run)(struct _athreadpool *p, int n,
+	           int (*function)(void *context, int thix, int ix0, int ix1), void *context);
+
+	/* Stop the threads and free the pool */
+	void (*del)(struct _athreadpool *p);
+
+}; typedef struct _athreadpool athreadpool;
+
+/* Create a thread pool with nthr threads. */
+/* nthr <= 0 for one per processor. Return NULL on error. */
+athreadpool *new_athreadpool(int nthr);
+
+/* - - - - - - - - - - - - - - - - - - -- */
+/* Cache file support */
+
+/* 64 bit FNV-1a hash, for keying cache files. Start with h = HASH64_INIT. */
+/* Values are hashed in little endian form, so keys are portable. */
+#define HASH64_INIT ((ORD64)0xcbf29ce484222325)
+
+ORD64 hash64_bytes(ORD64 h, void *b, size_t n);
+ORD64 hash64_int(ORD64 h, int v);			/* As an INR32 */
+ORD64 hash64_ord64(ORD64 h, ORD64 v);
+ORD64 hash64_dbl(ORD64 h, double v);		/* As a FLT64 */
+ORD64 hash64_str(ORD64 h, char *str);		/* Including the nul */
+
+/* Write hdr[hsize] followed by buf[bsize] to the file fname, by way of */
+/* a temporary file that is then renamed, so that an interrupted write or */
+/* a concurrent reader never sees a partial file. Return nz on error. */
+int write_file_renamed(char *fname, ORD8 *hdr, size_t hsize, ORD8 *buf, size_t bsize);
+
 /* - - - - - - - - - - - - - - - - - - -- */
 
 /* Return the login $HOME directory. */
@@ -238,9 +284,6 @@ void delete_file(char *fname);
 /* are created. return nz on error */
 int create_parent_directories(char *path);
 
-/* Do a string copy while replacing all '\' characters with '/' */
-static void copynorm_dirsep(char *d, char *s);
-
 /* Allocate and create a path to the given filename that is */
 /* in the same directory as the given file. */
 /* Returns normalized separator '/' path. */
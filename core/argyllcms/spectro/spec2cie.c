@@ -946,6 +946,11 @@ main(int argc, char *argv[])
 			sp2cie->sconvert (sp2cie, &rmwsp, mwXYZ, &mwsp);
 		}
 
+		/* All the patches share the same band layout, */
+		/* so precompute the band to CIE weightings. */
+		if (sp2cie->set_wmat(sp2cie, &sp))
+			error ("Set weighting matrix on sp2cie failed");
+
 		/* If CIE conversion illuminant is non-standard, add it to the output */
 		if (ill_wp != NULL) {
 			char buf[100];
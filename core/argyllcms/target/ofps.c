@@ -31,8 +31,8 @@
 	There is a bug for CMYK when the ink limit == 100%
 	(see "Hack to workaround pathalogical")
 
-	One way of addressing the performance issues would be to use multiple
-	threads to call dnsq. A pool could be setup, one for each CPU.
+	The dnsq vertex positioning in add_to_vsurf() uses a thread pool,
+	but the rest of the topology update is still single threaded.
 
 	Some profiles are too rough, and slow/stall vertex placement.
 	Reducing the cache grid and/or smoothing the rspl values
@@ -124,6 +124,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 #include "aconfig.h"
 #include "numlib.h"
@@ -266,6 +267,7 @@
 #undef FORCE_INCREMENTAL	/* Force incremental update after itteration */
 #define FORCE_RESEED		/* Force reseed after itteration */
 #define MAXTRIES 41		/* Maximum dnsq tries before giving up */
+#define MINPOSTHR 4		/* Minimum number of vertexes to position using threads */
 #define CACHE_PERCEPTUAL		/* Cache the perceptual lookup function */
 #define USE_DISJOINT_SETMASKS		/* Reduce INDEP_SURFACE setmask size */ 
 
@@ -1025,6 +1027,41 @@ static int ofps_cc_percept(ofps *s, double *v, double *p) {
 /* --------------------------------------------------- */
 /* Vertex alloc/free support */
 
+/* Return the vertex cache index bucket for a sort_nix() hash. */
+/* (The hash is mixed so that the low bits are usable as an index) */
+static unsigned int vtx_cache_bkt(ofps *s, unsigned int hash) {
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash & (s->vchsize - 1);
+}
+
+/* Double the size of the vertex cache index, */
+/* and re-distribute the vertexes into it. */
+static void vtx_cache_grow(ofps *s) {
+	vtx **ovch = s->vch;
+	unsigned int i, osize = s->vchsize;
+
+	s->vchsize = osize == 0 ? VTXCHINIT : 2 * osize;
+	if ((s->vch = (vtx **)calloc(sizeof(vtx *), s->vchsize)) == NULL)
+		error("ofps: malloc failed on vertex cache index size %u",s->vchsize);
+
+	for (i = 0; i < osize; i++) {
+		vtx *vx, *nvx;
+		for (vx = ovch[i]; vx != NULL; vx = nvx) {
+			unsigned int hash = vtx_cache_bkt(s, (unsigned int)vx->nix[MXPD+1]);
+			nvx = vx->chn;
+
+			vx->chn = s->vch[hash];
+			if (s->vch[hash] != NULL)
+				s->vch[hash]->pchn = &vx->chn;
+			s->vch[hash] = vx;
+			vx->pchn = &s->vch[hash];
+		}
+	}
+	free(ovch);
+}
+
 /* Check if a vertex is in the cache index, */
 /* and return it if it is. Return NULL otherwise */
 static vtx *vtx_cache_get(ofps *s, int *nix) {
@@ -1032,9 +1069,15 @@ static vtx *vtx_cache_get(ofps *s, int *nix) {
 	unsigned int hash;
 	vtx *vx;
 
-	hash = (unsigned int)nix[MXPD+1];		/* We assume it was put there by sort */
+	if (s->vch == NULL)
+		return NULL;
+
+	/* We assume the hash was put there by sort */
+	hash = vtx_cache_bkt(s, (unsigned int)nix[MXPD+1]);
 
 	for (vx = s->vch[hash]; vx != NULL; vx = vx->chn) {
+		if (nix[MXPD+1] != vx->nix[MXPD+1])
+			continue;
 		for (e = 0; e <= di; e++) { /* See if it is a match */
 			if (nix[e] != vx->nix[e])
 				break;
@@ -1048,10 +1091,13 @@ static vtx *vtx_cache_get(ofps *s, int *nix) {
 
 /* Add a vertex to the cache index */
 static void vtx_cache_add(ofps *s, vtx *vv) {
-	int e, di = s->di;
 	unsigned int hash;
 
-	hash = (unsigned int)vv->nix[MXPD+1];
+	/* Keep the average chain length below 1 */
+	if (s->nvch >= (int)s->vchsize)
+		vtx_cache_grow(s);
+
+	hash = vtx_cache_bkt(s, (unsigned int)vv->nix[MXPD+1]);
 
 	/* Add it to the list */
 	vv->chn = s->vch[hash];
@@ -1059,15 +1105,18 @@ static void vtx_cache_add(ofps *s, vtx *vv) {
 		s->vch[hash]->pchn = &vv->chn;
 	s->vch[hash] = vv;
 	vv->pchn = &s->vch[hash];
+	s->nvch++;
 }
 
 /* Remove a vertex from the cache index */
 static void vtx_cache_rem(ofps *s, vtx *vv) {
-	int e, di = s->di;
 	unsigned int hash;
 	vtx *vx;
 
-	hash = (unsigned int)vv->nix[MXPD+1];
+	if (s->vch == NULL)
+		return;
+
+	hash = vtx_cache_bkt(s, (unsigned int)vv->nix[MXPD+1]);
 
 	for (vx = s->vch[hash]; vx != NULL; vx = vx->chn) {
 		if (vx == vv) {
@@ -1076,6 +1125,7 @@ static void vtx_cache_rem(ofps *s, vtx *vv) {
 				if (vx->chn != NULL)
 					vx->chn->pchn = vx->pchn;
 			}		
+			s->nvch--;
 			return;
 		}
 	}
@@ -1636,8 +1686,6 @@ static void sort_nix(ofps *s, int *nix) {
 		bitp = 31 & (ix + (ix >> 4) + (ix >> 8) + (ix >> 12));
 		nixm |= (1 << bitp);
 	}
-	hash %= VTXCHSIZE;
-
 	nix[MXPD+1] = (int)hash;
 	nix[MXPD+2] = nixm;
 }
@@ -2168,6 +2216,8 @@ struct _vopt_cx {
 	double srad;		/* Search radius used */
 	double stp[MXPD];	/* Starting point used */
 
+	int funccount;		/* Number of times dnsq_solver() has been called */
+
 #ifdef DUMP_FERR
 	/* Debug: */
 	int debug;			/* nz to trace search path */
@@ -2245,7 +2295,7 @@ int dnsq_solver(	/* Return < 0 on abort */
 		fvec[nn_1 + k] = FGPMUL * v;
 	}
 
-	s->funccount++;
+	cx->funccount++;
 
 //for (k = 0; k < nn_1; k++)
 //printf("~1 fvec[%d] = %f\n",k,fvec[k]);
@@ -2258,9 +2308,12 @@ int dnsq_solver(	/* Return < 0 on abort */
 /* Locate a vertex position that has the eperr from all the real nodes */
 /* being equal. Set eperr, eserr and subjective value v[] too. */ 
 /* vv->ceperr contains the current eperr that must be bettered. */
+/* Only vv and the per thread state pt are modified, so different */
+/* combinations can be positioned by different threads at once. */
 /* Return 0 if succeeded, 1 if best result is out of tollerance, 2 if failed. */
-static int position_vtx(
+static int position_vtx_th(
 	ofps *s,
+	vpthr *pt,			/* Per thread state to use */
 	nodecomb *vv,		/* Return the location and its error */
 	int startex,		/* nz if current position is to be used as initial start point */
 	int repos,			/* nz after an itteration and we expect out of gamut */
@@ -2283,8 +2336,8 @@ static int position_vtx(
 	printf("Position_vtx called for comb %s\n",pcomb(di,vv->nix));
 #endif
 
-	s->positions++;
-	s->sob->reset(s->sob);
+	pt->positions++;
+	pt->sob->reset(pt->sob);
 
 #ifdef DUMP_FERR
 	cx.debug = 0;
@@ -2292,6 +2345,7 @@ static int position_vtx(
 
 	/* Setup for dnsq to optimize for equal eperr */
 	cx.s = s;
+	cx.funccount = 0;
 
 	/* Pointers to real nodes. Although we allow for the */
 	/* fake inner/outer nodes, eperr() will fail them later. */
@@ -2477,7 +2531,7 @@ static int position_vtx(
 				double fval[MXPD];
 				int nc;
 
-				s->sob->next(s->sob, cx.stp);
+				pt->sob->next(pt->sob, cx.stp);
 
 				/* Scale random value around original starting point */
 				for (e = 0; e < di; e++) {
@@ -2504,19 +2558,20 @@ static int position_vtx(
 
 //printf("\nStarting location = %s, srad = %f\n",ppos(di,cx.stp),cx.srad);
 		/* Locate vertex */
-		cfunccount = s->funccount;
-		s->dnsqs++;
+		cfunccount = cx.funccount;
+		pt->dnsqs++;
 		if (tcalls == 0)
 			maxfev = 500;
 		else
 			maxfev = 2 * tfev/tcalls; 
 		rv = dnsqe((void *)&cx, dnsq_solver, NULL, di, vv->p, cx.srad, fvec, 0.0, ftol, maxfev, 0);
-		if ((s->funccount - cfunccount) > 20) {
-//printf("More than 20: %d\n",s->funccount - cfunccount);
+		pt->funccount += cx.funccount - cfunccount;
+		if ((cx.funccount - cfunccount) > 20) {
+//printf("More than 20: %d\n",cx.funccount - cfunccount);
 		}
-		if ((s->funccount - cfunccount) > s->maxfunc) {
-			s->maxfunc = (s->funccount - cfunccount);
-//printf("New maximum %d\n",s->maxfunc);
+		if ((cx.funccount - cfunccount) > pt->maxfunc) {
+			pt->maxfunc = (cx.funccount - cfunccount);
+//printf("New maximum %d\n",pt->maxfunc);
 		}
 
 		if (rv != 1 && rv != 3) {
@@ -2533,7 +2588,7 @@ static int position_vtx(
 
 			/* Update average function evaluations */
 			tcalls++;
-			tfev += s->funccount - cfunccount;
+			tfev += cx.funccount - cfunccount;
 			
 #ifdef DEBUG
 			printf("dnsq pos %s\n",ppos(di,vv->p));
@@ -2582,8 +2637,8 @@ static int position_vtx(
 				/* evaluate the location found. */
 				double ss;
 
-				s->sucfunc += (s->funccount - cfunccount);
-				s->sucdnsq++;
+				pt->sucfunc += (cx.funccount - cfunccount);
+				pt->sucdnsq++;
 
 				/* Compute how much the result is out of gamut */
 				vv->oog = ofps_oog(s, vv->p);
@@ -2607,14 +2662,14 @@ static int position_vtx(
 				   || ( fixup && vv->oog < 20.0 && vv->eperr < (vv->ceperr + 0.01))
 				))) {
 
-					if (tries > s->maxretries)
-						s->maxretries = tries;
+					if (tries > pt->maxretries)
+						pt->maxretries = tries;
 #ifdef DEBUG
-					printf(" - comb %s succeeded on retry %d (max %d)\n",pcomb(di,vv->nix),tries,s->maxretries);
+					printf(" - comb %s succeeded on retry %d (max %d)\n",pcomb(di,vv->nix),tries,pt->maxretries);
 					printf("       oog = %f, eperr = %f, ceperr = %f\n",vv->oog,vv->eperr,vv->ceperr);
 #endif
 //if (tries > 10)
-//	printf(" - comb %s succeeded on retry %d (max %d)\n",pcomb(di,vv->nix),tries,s->maxretries);
+//	printf(" - comb %s succeeded on retry %d (max %d)\n",pcomb(di,vv->nix),tries,pt->maxretries);
 // 
 //printf("Solution for comb %s has eperr %f < ceperr %f and not out of gamut by %f, retry %d\n",pcomb(di,vv->nix),vv->eperr,vv->ceperr,vv->oog,tries+1);
 //printf("Solution is at %s (%s)\n",ppos(di,vv->p),ppos(di,vv->v));
@@ -2695,6 +2750,60 @@ static int position_vtx(
 	return 0;
 }
 
+/* Add the per thread positioning stats into the totals, and reset them. */
+static void sum_pthr_stats(ofps *s, vpthr *pt) {
+	s->positions += pt->positions;
+	s->dnsqs += pt->dnsqs;
+	s->funccount += pt->funccount;
+	if (pt->maxfunc > s->maxfunc)
+		s->maxfunc = pt->maxfunc;
+	s->sucfunc += pt->sucfunc;
+	s->sucdnsq += pt->sucdnsq;
+	if (pt->maxretries > s->maxretries)
+		s->maxretries = pt->maxretries;
+
+	pt->positions = pt->dnsqs = pt->funccount = 0;
+	pt->maxfunc = pt->sucfunc = pt->sucdnsq = pt->maxretries = 0;
+}
+
+/* Locate a vertex position in the calling thread. */
+static int position_vtx(
+	ofps *s,
+	nodecomb *vv,		/* Return the location and its error */
+	int startex,		/* nz if current position is to be used as initial start point */
+	int repos,			/* nz after an itteration and we expect out of gamut */
+	int fixup			/* nz if doing fixups after itteration and expect out of gamut ??? */
+) {
+	int rv;
+
+	rv = position_vtx_th(s, &s->pthr[0], vv, startex, repos, fixup);
+	sum_pthr_stats(s, &s->pthr[0]);
+
+	return rv;
+}
+
+/* Context for positioning add_to_vsurf() combinations in parallel */
+typedef struct {
+	ofps *s;
+	int fixup;
+} vpos_cx;
+
+/* Thread pool function to position combs[pcombs[ix0 .. ix1-1]]. */
+/* Sets pvalid on each comb that was positioned sucessfully. */
+static int position_vtx_task(void *cntx, int thix, int ix0, int ix1) {
+	vpos_cx *cx = (vpos_cx *)cntx;
+	ofps *s = cx->s;
+	int j;
+
+	for (j = ix0; j < ix1; j++) {
+		nodecomb *vv = &s->combs[s->pcombs[j]];
+
+		if (position_vtx_th(s, &s->pthr[thix], vv, vv->startex, 0, cx->fixup) == 0)
+			vv->pvalid = 1;
+	}
+	return 0;
+}
+
 /* --------------------------------------------------------- */
 /* Deal with creating a dummy vertex to represent one that */
 /* can't be positioned. We simply locate the best point we can. */
@@ -2910,6 +3019,7 @@ int abortonfail	/* 0 = ignore position failures, 1 = abort add if there are any
 	vtx *ev1, *ev2;	/* Deleted and non-deleted vertexes */
 	int ndelvtx;	/* Number of vertexes to delete */ 
 	int nncombs;	/* Number of node combinations generated, allocated. */
+	int npcombs;	/* Number of node combinations to be positioned */
 
 #ifdef DEBUG
 	printf("\nAdd_to_vsurf node ix %d (p %s), i_sm %s, a_sm %s\n",nn->ix, ppos(di,nn->p),psm(s,&s->sc[nn->pmask].i_sm),psm(s,&s->sc[nn->pmask].a_sm));
@@ -3155,8 +3265,12 @@ int abortonfail	/* 0 = ignore position failures, 1 = abort add if there are any
 	printf("\nThere are %d unique node combinations in list, locating combs. in list:\n",nncombs);
 #endif
 
-	/* Locate the replacement vertex positions */
-	for (i = 0; i < nncombs; i++) { 
+	/* Locate the replacement vertex positions. The dnsq positioning of */
+	/* new vertexes is independent, so we first setup the starting points */
+	/* and position them (using the thread pool if we have one), and then */
+	/* update existing vertexes and account for failures in comb order, */
+	/* so that the result is the same no matter how many threads are used. */
+	for (npcombs = i = 0; i < nncombs; i++) { 
 
 		ev1 = s->combs[i].v1[0];
 		ev2 = s->combs[i].v2[0];
@@ -3171,11 +3285,76 @@ int abortonfail	/* 0 = ignore position failures, 1 = abort add if there are any
 		}
 #endif	/* INDEP_SURFACE */
 
+		/* Try and locate existing vertex that is due to the same nodes */
+		if ((s->combs[i].vv = vtx_cache_get(s, s->combs[i].nix)) != NULL)
+			continue;
+
+		/* We need to create a replacement vertex, locate position for it */
+#ifdef DEBUG
+		printf("About to locate comb ix: %s, ceperr %f\n",pcomb(di,s->combs[i].nix),s->combs[i].ceperr);
+#endif
+//printf("~1 About to locate comb ix: %s, ceperr %f\n",pcomb(di,s->combs[i].nix),s->combs[i].ceperr);
+		/* Compute a starting position between the deleted/not deleted pair */
+		/* This seems very slightly better than the default mct[] + atp[]  scheme. */
+		if (nn->ix >= 0) {	/* If not boundary */
+			double bl;
+			bl = (ev1->nba_eperr - ev2->eperr)/(ev1->eperr - ev2->eperr);
+			if (bl < 0.0)
+				bl = 0.0;
+			else if (bl > 1.0)
+				bl = 1.0;
+			for (e = 0; e < di; e++) { 
+				s->combs[i].p[e] = bl * s->combs[i].v1[0]->p[e] + (1.0 - bl) * s->combs[i].v2[0]->p[e];
+			}
+			ofps_clip_point5(s, s->combs[i].p, s->combs[i].p);
+//printf("Startex is %s\n",ppos(di,s->combs[i].p));
+			s->combs[i].startex = 1;
+		}
+
+		if (npcombs >= s->_npcombs) {
+			s->_npcombs = 2 * s->_npcombs + 5;
+			if ((s->pcombs = (int *)realloc(s->pcombs, sizeof(int) * s->_npcombs)) == NULL)
+				error ("ofps: malloc failed on position combination list %d", s->_npcombs);
+		}
+		s->pcombs[npcombs++] = i;
+	}
+
+	/* find vertex positions of max eperr */
+	if (s->pool != NULL && npcombs >= MINPOSTHR) {
+		vpos_cx cx;
+
+		cx.s = s;
+		cx.fixup = fixup;
+		s->pool->run(s->pool, npcombs, position_vtx_task, (void *)&cx);
+		for (k = 0; k < s->nthr; k++)
+			sum_pthr_stats(s, &s->pthr[k]);
+
+	} else {
+		for (j = 0; j < npcombs; j++) {
+			nodecomb *vv = &s->combs[s->pcombs[j]];
+
+			if (position_vtx(s, vv, vv->startex, 0, fixup) == 0)
+				vv->pvalid = 1;
+			else if (abortonfail)
+				break;			/* Don't waste time on the rest */
+		}
+	}
+
+	/* Update the existing vertexes and note the failures */
+	for (i = 0; i < nncombs; i++) { 
+
+		ev1 = s->combs[i].v1[0];
+		ev2 = s->combs[i].v2[0];
+
+#ifdef INDEP_SURFACE
+	    if (sm_test(s, &s->combs[i].vm) == 0)
+			continue;
+#endif	/* INDEP_SURFACE */
+
 #ifdef DEBUG
 		printf("\nNode combination ix: %s\n",pcomb(di,s->combs[i].nix));
 #endif
-		/* Try and locate existing vertex that is due to the same nodes */
-		if ((s->combs[i].vv = vtx_cache_get(s, s->combs[i].nix)) != NULL) {
+		if (s->combs[i].vv != NULL) {
 #ifdef DEBUG
 			printf("Vertex is same as existing no %d\n",s->combs[i].vv->no);
 #endif
@@ -3191,52 +3370,25 @@ int abortonfail	/* 0 = ignore position failures, 1 = abort add if there are any
 				printf("New existing vertex no %d is deleted vertex - reprieve it\n",s->combs[i].vv->no);
 #endif
 			}
-		}
-
-		/* We need to create a replacement vertex, locate position for it */
-		if (s->combs[i].vv == NULL) {
-#ifdef DEBUG
-			printf("About to locate comb ix: %s, ceperr %f\n",pcomb(di,s->combs[i].nix),s->combs[i].ceperr);
-#endif
-//printf("~1 About to locate comb ix: %s, ceperr %f\n",pcomb(di,s->combs[i].nix),s->combs[i].ceperr);
-			/* Compute a starting position between the deleted/not deleted pair */
-			/* This seems very slightly better than the default mct[] + atp[]  scheme. */
-			if (nn->ix >= 0) {	/* If not boundary */
-				double bl;
-				bl = (ev1->nba_eperr - ev2->eperr)/(ev1->eperr - ev2->eperr);
-				if (bl < 0.0)
-					bl = 0.0;
-				else if (bl > 1.0)
-					bl = 1.0;
-				for (e = 0; e < di; e++) { 
-					s->combs[i].p[e] = bl * s->combs[i].v1[0]->p[e] + (1.0 - bl) * s->combs[i].v2[0]->p[e];
-				}
-				ofps_clip_point5(s, s->combs[i].p, s->combs[i].p);
-//printf("Startex is %s\n",ppos(di,s->combs[i].p));
-				s->combs[i].startex = 1;
-			}
-			/* find vertex position of max eperr */
-			if (position_vtx(s, &s->combs[i], s->combs[i].startex, 0, fixup) != 0) {
-				if (s->verb > 1)
-					warning("Unable to locate vertex at node comb %s\n",pcomb(di,s->combs[i].nix));
-				s->posfails++;
-				s->posfailstp++;
-				if (abortonfail)
-					break;
 
-			} else {
-				s->combs[i].pvalid = 1;
-			}
+		} else if (s->combs[i].pvalid == 0) {
+			if (s->verb > 1)
+				warning("Unable to locate vertex at node comb %s\n",pcomb(di,s->combs[i].nix));
+			s->posfails++;
+			s->posfailstp++;
+			if (abortonfail)
+				break;
 		}
 	}	/* Next replacement vertex */
 
 	/* If we aborted because abortonfail is set and we failed to place a new node, */
 	/* erase our tracks and return failure. */
+	/* (Only the existing vertexes before the failure have been updated) */
 	if (i < nncombs) {
-		for (i = 0; i < nncombs; i++) { 
-			if (s->combs[i].vv != NULL) {
-				s->combs[i].vv->add = 0;
-				s->combs[i].vv->del = 0;
+		for (j = 0; j < i; j++) { 
+			if (s->combs[j].vv != NULL) {
+				s->combs[j].vv->add = 0;
+				s->combs[j].vv->del = 0;
 			}
 		}
 		return 0;
@@ -5023,12 +5175,147 @@ static void ofps_binit(ofps *s) {
 
 /* --------------------------------------------------- */
 /* Setup the perceptual lookup cache */
+
+/* If the ARGYLL_TARGEN_CACHE environment variable names a directory, */
+/* and the caller has supplied a perceptual function hash, the cache */
+/* grid values are saved there in a file named from a hash of the */
+/* perceptual function hash and the grid layout, and are reloaded rather */
+/* than re-computed by the next run using the same perceptual function. */
+/* All values are little endian: */
+/*
+	ORD8   magic[8]		"AOPCACH\0"
+	ORD32  version		OPC_VERSION
+	ORD64  key			Hash of the perceptual function and grid layout
+	ORD32  di, res
+	FLT32  grid[res ^ di][di]
+ */
+
+#define OPC_MAGIC "AOPCACH"		/* + nul */
+#define OPC_VERSION 1			/* Bump if the cache values change */
+
+/* Return the allocated cache file name and key for the given */
+/* grid layout, or NULL if the cache isn't enabled. */
+static char *opc_name(ofps *s, int gr, int filt, ORD64 *pkey) {
+	ORD64 h = HASH64_INIT;
+	char *dir, *fname;
+
+	if (s->pkey == 0
+	 || (dir = getenv("ARGYLL_TARGEN_CACHE")) == NULL || dir[0] == '\000')
+		return NULL;
+
+	h = hash64_int(h, OPC_VERSION);
+	h = hash64_ord64(h, s->pkey);
+	h = hash64_int(h, s->di);
+	h = hash64_int(h, gr);
+	h = hash64_int(h, filt);
+
+	*pkey = h;
+	if ((fname = malloc(strlen(dir) + 1 + 5 + 16 + 4 + 1)) == NULL)
+		return NULL;
+	sprintf(fname, "%s/ofps_%08x%08x.opc", dir,
+	        (unsigned int)(h >> 32), (unsigned int)(h & 0xffffffff));
+
+	return fname;
+}
+
+/* Read the grid values from the cache file into the FLT32 buffer buf. */
+/* Return nz if it can't be read */
+static int opc_read(ofps *s, char *fname, ORD64 key, int gr, ORD8 *buf, size_t gsize) {
+	FILE *fp;
+	ORD8 hdr[8 + 4 + 8 + 4 + 4];
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+	if ((fp = fopen(fname,"rb")) == NULL)
+#else
+	if ((fp = fopen(fname,"r")) == NULL)
+#endif
+		return 1;
+
+	if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)
+	 || memcmp(hdr, OPC_MAGIC, 8) != 0
+	 || read_ORD32_le(hdr + 8) != OPC_VERSION
+	 || read_ORD64_le(hdr + 12) != key
+	 || read_ORD32_le(hdr + 20) != (unsigned int)s->di
+	 || read_ORD32_le(hdr + 24) != (unsigned int)gr
+	 || fread(buf, 1, gsize, fp) != gsize) {
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Write the FLT32 grid values to the cache file. */
+/* (Failure isn't fatal - it just won't be cached.) */
+static void opc_write(ofps *s, char *fname, ORD64 key, int gr, ORD8 *buf, size_t gsize) {
+	ORD8 hdr[8 + 4 + 8 + 4 + 4];
+
+	memcpy(hdr, OPC_MAGIC, 8);
+	write_ORD32_le(hdr + 8, OPC_VERSION);
+	write_ORD64_le(hdr + 12, key);
+	write_ORD32_le(hdr + 20, s->di);
+	write_ORD32_le(hdr + 24, gr);
+
+	write_file_renamed(fname, hdr, sizeof(hdr), buf, gsize);
+}
+
+/* Context for computing or setting the cache grid values */
+typedef struct {
+	ofps *s;
+	int gr;				/* Grid resolution */
+	int filt;			/* nz to use filtered_ofps_to_percept() */
+	ORD8 *buf;			/* FLT32 grid values [gr ^ di][di] */
+} opccx;
+
+/* Compute the no grid values. This calls the callers percept(), */
+/* which needn't be re-entrant, so it isn't done in the thread pool. */
+static void opc_comp(opccx *cx, int no) {
+	ofps *s = cx->s;
+	int i, e, di = s->di;
+	double w = 1.0/(double)(cx->gr-1);		/* As set_rspl() */
+	double iv[MXPD], ov[MXPD];
+
+	for (i = 0; i < no; i++) {
+		int ix = i;
+
+		for (e = 0; e < di; e++) {
+			iv[e] = 0.0 + (ix % cx->gr) * w;
+			ix /= cx->gr;
+		}
+		if (cx->filt)
+			filtered_ofps_to_percept((void *)s, ov, iv);
+		else
+			s->percept(s->od, ov, iv);
+		/* (Round to float first, as set_rspl() does, since write_FLT32_le() truncates) */
+		for (e = 0; e < di; e++)
+			write_FLT32_le(cx->buf + ((size_t)i * di + e) * 4, (double)(float)ov[e]);
+	}
+}
+
+/* set_rspl() function to set the pcache from the grid values */
+static void opc_set_func(void *cntx, double *out, double *in) {
+	opccx *cx = (opccx *)cntx;
+	int e, di = cx->s->di, ix = 0;
+	ORD8 *bp;
+
+	for (e = di-1; e >= 0; e--)
+		ix = ix * cx->gr + *((int *)&in[-e-1]);
+	bp = cx->buf + (size_t)ix * di * 4;
+	for (e = 0; e < di; e++)
+		out[e] = read_FLT32_le(bp + e * 4);
+}
+
 static void
 ofps_init_pcache(ofps *s) {
 	int i, e;
 	int di = s->di;
 	int gr, gres[MXPD];
 	int tinp = s->tinp;
+	opccx cx;
+	int no;
+	size_t gsize;
+	char *pcname;
+	ORD64 pckey = 0;
 
 #ifdef DEBUG
 	printf("Initializing perceptual lookup cache\n");
@@ -5045,41 +5332,67 @@ ofps_init_pcache(ofps *s) {
 	if (gr > TNPAGRIDMAXRES)
 		gr = TNPAGRIDMAXRES;
 
-#ifndef DEBUG
-	if (s->verb)
-#endif
-	{
-		printf("Perceptual cache resolution = %d\n",gr);
-		printf("Seeding cache..."); fflush(stdout);
-	}
-
 	/* Create a rspl to cache the perceptual lookup */
 	if ((s->pcache = new_rspl(RSPL_NOFLAGS, s->di, s->di)) == NULL)
 		error("new_rspl failed");
 
-	for (e = 0; e < di; e++)
+	for (no = 1, e = 0; e < di; e++) {
 		gres[e] = gr;
+		no *= gr;
+	}
 	s->pcache_res = gr;
 
-//	s->pcache->set_rspl(s->pcache, RSPL_SET_APXLS, s->od, s->percept, NULL, NULL, gres, NULL, NULL);
+	cx.s = s;
+	cx.gr = gr;
 
 	/* Filtering seems to make this more robust for some profiles, less for others. */
-	if (s->percept != default_ofps_to_percept)
-		s->pcache->set_rspl(s->pcache, RSPL_NOFLAGS, s, filtered_ofps_to_percept,
-		                                            NULL, NULL, gres, NULL, NULL);
-	else
-		s->pcache->set_rspl(s->pcache, RSPL_NOFLAGS, s->od, s->percept,
-		                                  NULL, NULL, gres, NULL, NULL);
+	cx.filt = s->percept != default_ofps_to_percept;
 
-	/* Hmm. Should we store the underlying ->percept & ->od somewhere before we overwrite it ? */
-	s->percept = ofps_cache_percept;
-	s->od = s->pcache;
+	gsize = (size_t)no * di * 4;
+	if ((cx.buf = (ORD8 *)malloc(gsize)) == NULL)
+		error("ofps: malloc failed on perceptual cache values %d", no);
 
+	pcname = opc_name(s, gr, cx.filt, &pckey);
+
+	if (pcname != NULL && opc_read(s, pcname, pckey, gr, cx.buf, gsize) == 0) {
 #ifndef DEBUG
-	if (s->verb)
+		if (s->verb)
 #endif
-		printf("done\n");
+			printf("Perceptual cache resolution = %d, loaded from '%s'\n",gr,pcname);
+		free(pcname);
+		pcname = NULL;
 
+	} else {
+#ifndef DEBUG
+		if (s->verb)
+#endif
+		{
+			printf("Perceptual cache resolution = %d\n",gr);
+			printf("Seeding cache..."); fflush(stdout);
+		}
+
+		opc_comp(&cx, no);
+
+#ifndef DEBUG
+		if (s->verb)
+#endif
+			printf("done\n");
+	}
+
+//	s->pcache->set_rspl(s->pcache, RSPL_SET_APXLS, s->od, s->percept, NULL, NULL, gres, NULL, NULL);
+
+	s->pcache->set_rspl(s->pcache, RSPL_NOFLAGS, (void *)&cx, opc_set_func,
+	                                  NULL, NULL, gres, NULL, NULL);
+
+	if (pcname != NULL) {
+		opc_write(s, pcname, pckey, gr, cx.buf, gsize);
+		free(pcname);
+	}
+	free(cx.buf);
+
+	/* Hmm. Should we store the underlying ->percept & ->od somewhere before we overwrite it ? */
+	s->percept = ofps_cache_percept;
+	s->od = s->pcache;
 }
 
 /* --------------------------------------------------- */
@@ -8071,7 +8384,14 @@ ofps_del(ofps *s) {
 	}
 
 	/* Any other allocations */
-	s->sob->del(s->sob);
+	if (s->pool != NULL)
+		s->pool->del(s->pool);
+	for (i = 0; i < s->nthr; i++)
+		s->pthr[i].sob->del(s->pthr[i].sob);
+	free(s->pthr);
+	free(s->vch);
+	if (s->pcombs != NULL)
+		free(s->pcombs);
 	if (s->combs != NULL) {
 		for (i = 0; i < s->_ncombs; i++) {
 			if (s->combs[i].v1 != NULL)
@@ -8121,11 +8441,12 @@ double curv_wght,		/* Curvature weighting (if dad < 0) */
 fxpos *fxlist,			/* List of existing fixed points (may be NULL) */
 int fxno,				/* Number of existing fixes points */
 void (*percept)(void *od, double *out, double *in),		/* Perceptual lookup func. */
-void *od				/* context for Perceptual function */
+void *od,				/* context for Perceptual function */
+ORD64 pkey				/* Hash of Perceptual function for caching, 0 if none */
 ) {
 	return new_ofps_ex(verb, di, ilimit, NULL, NULL, tinp, good,
 	                   dadaptation, devd_wght, perc_wght, curv_wght,
-	                   fxlist, fxno, percept, od, 0, -1);
+	                   fxlist, fxno, percept, od, pkey, 0, -1);
 }
 
 /* Extended constructor */
@@ -8145,6 +8466,7 @@ fxpos *fxlist,			/* List of existing fixed points (may be NULL) */
 int fxno,				/* Number of existing fixes points */
 void (*percept)(void *od, double *out, double *in),		/* Perceptual lookup func. */
 void *od,				/* context for Perceptual function */
+ORD64 pkey,				/* Hash of Perceptual function for caching, 0 if none */
 int ntostop,			/* Debug - number of points until diagnostic stop */
 int nopstop				/* Debug - number of optimizations until diagnostic stop, -1 = not */
 ) {
@@ -8164,8 +8486,25 @@ int nopstop				/* Debug - number of optimizations until diagnostic stop, -1 = no
 	s->ntostop = ntostop;
 	s->nopstop = nopstop;
 
-	if ((s->sob = new_sobol(di)) == NULL)
-		error ("ofps: new_sobol %d failed", di);
+#ifdef CACHE_PERCEPTUAL
+	/* Setup threads to position vertexes with. This relies on the */
+	/* perceptual lookup being the (read only) cache, rather than the */
+	/* callers function. (Fall back to doing it in this thread if this fails) */
+	if ((s->pool = new_athreadpool(0)) != NULL && s->pool->nthr <= 1) {
+		s->pool->del(s->pool);
+		s->pool = NULL;
+	}
+#endif
+	s->nthr = s->pool != NULL ? s->pool->nthr : 1;
+
+	if ((s->pthr = (vpthr *)calloc(s->nthr, sizeof(vpthr))) == NULL)
+		error ("ofps: malloc failed on per thread state %d", s->nthr);
+	for (i = 0; i < s->nthr; i++) {
+		if ((s->pthr[i].sob = new_sobol(di)) == NULL)
+			error ("ofps: new_sobol %d failed", di);
+	}
+	if (s->verb && s->pool != NULL)
+		printf("Using %d threads\n",s->nthr);
 	
 	if (s->verb)
 		printf("Degree of adaptation: %.3f\n", dadaptation);
@@ -8260,6 +8599,7 @@ int nopstop				/* Debug - number of optimizations until diagnostic stop, -1 = no
 		s->od = od;
 	}
 #endif
+	s->pkey = pkey;
 
 	s->good = good;		/* Fast/Good flag */
 	s->lperterb = PERTERB_AMOUNT;
@@ -8564,7 +8904,7 @@ char *argv[];
 	s = new_ofps_ex(1, 2, 1.5, NULL, NULL, npoints, 1,
 //	s = new_ofps_ex(1, 2, 2.5, NULL, NULL, npoints, 1,
 	             SA_ADAPT, SA_DEVD_MULT, SA_PERC_MULT, SA_INTERP_MULT,
-	             fx, nfx, sa_percept, (void *)NULL, ntostop, nopstop);
+	             fx, nfx, sa_percept, (void *)NULL, 0, ntostop, nopstop);
 
 #ifdef DUMP_PLOT
 	printf("Device plot (with verts):\n");
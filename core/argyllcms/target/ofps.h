@@ -211,9 +211,22 @@ struct _nodecomb {
 	int startex;		/* nz if existing p[] should be starting dnsqe point */
 }; typedef struct _nodecomb nodecomb;
 
-/* Vertex cache hash index/table size */
-#define VTXCHSIZE 33037
-//#define VTXCHSIZE 67493
+/* Per thread vertex positioning state. */
+/* (Stats are summed into the ofps totals after each use) */
+struct _vpthr {
+	sobol *sob;			/* Random start point generator */
+	int positions;		/* Number of calls to locate vertex */
+	int dnsqs;			/* Number of dnsq is called */
+	int funccount;		/* Number of times dnsq callback function is called */
+	int maxfunc;		/* Maximum function count per dnsq */
+	int sucfunc;		/* Function count per sucessful dnsq */
+	int sucdnsq;		/* Number of sucessful dnsqs */
+	int maxretries;		/* Maximum retries used on sucessful dnsq */
+}; typedef struct _vpthr vpthr;
+
+/* Initial vertex cache hash index/table size. */
+/* (Must be a power of 2. The index doubles as the number of vertexes grows.) */
+#define VTXCHINIT 4096
 
 /* Record of a set of gamut surface plane combination */
 struct _surfcomb {
@@ -283,6 +296,7 @@ struct _ofps {
 
 	int pcache_res;		/* Grid resolution of pcache */ 
 	rspl *pcache;		/* cache of perceptual lookup */
+	ORD64 pkey;			/* Hash identifying the perceptual function, 0 if none */
 	
 	/* Other info */
 	int rix;			/* Next read index */
@@ -327,16 +341,24 @@ struct _ofps {
 	int flag;		/* Access flag associated with node being added */
 	int nvnflag;	/* node_recomp_nvn_dmxs access flag */
 	int fflag;		/* Fixup round flag */
-	vtx *vch[VTXCHSIZE];	/* Vertex cache index */
+	vtx **vch;			/* Vertex cache index */
+	unsigned int vchsize;	/* Number of entries in vch[], power of 2 */
+	int nvch;			/* Number of vertexes in the cache */
 
 	aat_atree_t *vtreep;	/* Binary tree of vertexes sorted by eperr */
 	aat_atree_t *vtrees[MXPD+2];	/* Per nsp, binary tree of vertexes sorted by eserr */
 							/* We get di+2 planes for fake initial nodes */
 
+	/* Vertex positioning threads */
+	struct _athreadpool *pool;	/* Threads to position vertexes with, NULL if none */
+	int nthr;			/* Number of pthr[], pool->nthr or 1 */
+	vpthr *pthr;		/* Per thread positioning state, [0] for the calling thread */
+
 	/* Utility - avoid re-allocation/initialization */
-	sobol *sob;
 	nodecomb *combs;	/* New node combinations being created in add_to_vsurf() */
 	int _ncombs;  /* Number of node combinations allocated. */
+	int *pcombs;		/* Indexes of combs to be positioned in add_to_vsurf() */
+	int _npcombs;		/* Number of pcombs allocated */
 
 	/* Debug/stats */
 	int nopstop;	/* Number of optimization passes before stopping with diagnostics */
@@ -412,7 +434,14 @@ extern ofps *new_ofps(
 	double perc_wght,
 	double curv_wght,
 	fxpos *fxlist, int fxno, 		/* Existing, fixed point list */
-	void (*percept)(void *od, double *out, double *in), void *od);
+	void (*percept)(void *od, double *out, double *in), void *od,
+	ORD64 pkey);
+
+/* percept() is only called from the calling thread. */
+/* If pkey is nz and the ARGYLL_TARGEN_CACHE environment variable */
+/* names a directory, the perceptual lookup cache is saved there, */
+/* and reloaded by later calls with the same pkey. pkey should be */
+/* a hash of everything that affects the percept() values. */
 
 /* Extended constructor */
 ofps *new_ofps_ex(
@@ -432,6 +461,7 @@ fxpos *fxlist,			/* List of existing fixed points (may be NULL) */
 int fxno,				/* Number of existing fixes points */
 void (*percept)(void *od, double *out, double *in),		/* Perceptual lookup func. */
 void *od,				/* context for Perceptual function */
+ORD64 pkey,				/* Hash of Perceptual function for caching, 0 if none */
 int ntostop,			/* Debug - number of points until diagnostic stop */
 int nopstop				/* Debug - number of optimizations until diagnostic stop, -1 = not */
 );
@@ -223,6 +223,8 @@ struct _pcpt {
 	double ilimit;			/* final raw ink limit (scale 1.0) */
 	xcal *cal;				/* if !NULL, linearized to final raw conversion */
 
+	ORD64 pkey;				/* Hash of everything that affects dev_to_perc(), 0 if unknown */
+
 }; typedef struct _pcpt pcpt;
 
 /* Absolute XYZ conversion function */
@@ -715,6 +717,53 @@ static void pcpt_del(pcpt *s) {
 	}
 }
 
+/* Return a hash of the profile contents and the parameters that */
+/* affect dev_to_perc(), so that ofps can save its perceptual cache. */
+/* Return 0 if the profile can't be read. */
+static ORD64 pcpt_key(pcpt *s, char *profName) {
+	ORD64 h = HASH64_INIT;
+	double dv[3];
+	int i, iv[6];
+
+	if (s->luo != NULL || s->mlu != NULL) {
+		FILE *fp;
+		ORD8 *buf;
+		size_t n;
+
+#if defined(O_BINARY) || defined(_O_BINARY)
+		if ((fp = fopen(profName,"rb")) == NULL)
+#else
+		if ((fp = fopen(profName,"r")) == NULL)
+#endif
+			return 0;
+		if ((buf = (ORD8 *)malloc(65536)) == NULL) {
+			fclose(fp);
+			return 0;
+		}
+		while ((n = fread(buf, 1, 65536, fp)) > 0)
+			h = hash64_bytes(h, buf, n);
+		free(buf);
+		fclose(fp);
+	}
+
+	iv[0] = s->di;
+	iv[1] = (int)s->xmask;
+	iv[2] = (int)s->nmask;
+	iv[3] = s->luo != NULL;
+	iv[4] = s->mlu != NULL;
+	iv[5] = s->clu != NULL;
+	for (i = 0; i < 6; i++)
+		h = hash64_int(h, iv[i]);
+	dv[0] = s->nemph;
+	dv[1] = s->idemph;
+	dv[2] = s->ixpow;
+	for (i = 0; i < 3; i++)
+		h = hash64_dbl(h, dv[i]);
+	if (h == 0)
+		h = 1;
+	return h;
+}
+
 /* Create a pcpt conversion class */
 pcpt *new_pcpt(
 char *profName,			/* ICC or MPP profile path, NULL for default, "none" for linear */
@@ -949,6 +998,8 @@ double xpow				/* Extra device power, default = none */
 		                     &inmin, &inmax, &gres, &inmax, &outmax);
 	}
 
+	s->pkey = pcpt_key(s, profName);
+
 	return s;
 }
 
@@ -2699,7 +2750,8 @@ int main(int argc, char *argv[]) {
 				/* Optimised Farthest Point Sampling */
 				s = new_ofps(verb, di, uilimit, fsteps, good,
 				            dadapt, 1.0 - perc_wght, perc_wght, curv_wght, fxlist, fxno,
-			                (void(*)(void *, double *, double *))pdata->dev_to_perc, (void *)pdata);
+			                (void(*)(void *, double *, double *))pdata->dev_to_perc, (void *)pdata,
+			                pdata->pkey);
 				sprintf(buf,"%d",fsteps - fxno);
 				pp->add_kword(pp, 0, "OFPS_PATCHES", buf, NULL);
 			}
@@ -3053,7 +3105,8 @@ int main(int argc, char *argv[]) {
 		ofps *s;
 		printf("Computing device space point stats:\n");
 		if ((s = new_ofps(verb, di, uilimit, fxno, 0, 0.0, 0.0, 0.0, 0.0, fxlist, fxno,
-	           (void(*)(void *, double *, double *))pdata->dev_to_perc, (void *)pdata)) == NULL) {
+	           (void(*)(void *, double *, double *))pdata->dev_to_perc, (void *)pdata,
+	           pdata->pkey)) == NULL) {
 			printf("Failed to compute stats\n");
 		} else {
 			s->stats(s);
@@ -56,6 +56,7 @@ void usage(char *diag) {
 	fprintf(stderr," -v            Verbose\n");
 	fprintf(stderr," -d sres       Surface resolution details 1.0 - 50.0\n");
 	fprintf(stderr," -w            emit %s %s file as well as CGATS .gam file\n",vrml_format(),vrml_ext());
+	fprintf(stderr," -b            write a binary .gamb gamut file rather than CGATS .gam file\n");
 	fprintf(stderr," -n            Don't add %s axes or white/black point\n",vrml_format());
 	fprintf(stderr," -k            Add %s markers for prim. & sec. \"cusp\" points\n",vrml_format());
 	fprintf(stderr,"               (Set env. ARGYLL_3D_DISP_FORMAT to VRML, X3D or X3DOM to change format)\n");
@@ -104,7 +105,7 @@ int
 main(int argc, char *argv[]) {
 	int fa,nfa;				/* argument we're looking at */
 	char prof_name[MAXNAMEL+1];
-	char *xl, out_name[MAXNAMEL+4+1];
+	char *xl, out_name[MAXNAMEL+5+1];
 	icmFile *fp;
 	icc *icco;
 	icmErr err = { 0, { '\000'} };
@@ -113,6 +114,7 @@ main(int argc, char *argv[]) {
 	int verb = 0;
 	int rv = 0;
 	int dovrml = 0;
+	int dobin = 0;				/* Write binary gamut file */
 	int doaxes = 1;
 	int docusps = 0;
 	double gamres = 0;			/* Surface resolution */
@@ -267,6 +269,10 @@ main(int argc, char *argv[]) {
 			else if (argv[fa][1] == 'w') {
 				dovrml = 1;
 			}
+			/* Binary gamut output */
+			else if (argv[fa][1] == 'b') {
+				dobin = 1;
+			}
 			/* No axis output in vrml */
 			else if (argv[fa][1] == 'n') {
 				doaxes = 0;
@@ -544,7 +550,10 @@ main(int argc, char *argv[]) {
 	if ((xl = strrchr(out_name, '.')) == NULL)	/* Figure where extention is */
 		xl = out_name + strlen(out_name);
 
-	strcpy(xl,".gam");
+	if (dobin)
+		strcpy(xl,".gamb");
+	else
+		strcpy(xl,".gam");
 
 	/* Get a expanded color conversion object */
 	if ((luo = xicco->get_luobj(xicco, fl, func, intent, pcsor, order, &vc, &ink)) == NULL)
@@ -589,8 +598,13 @@ main(int argc, char *argv[]) {
 			gam = xgam;
 		}
 
-		if (gam->write_gam(gam, out_name))
-			error ("write gamut failed on '%s'",out_name);
+		if (dobin) {
+			if (gam->write_bgam(gam, out_name))
+				error ("write binary gamut failed on '%s'",out_name);
+		} else {
+			if (gam->write_gam(gam, out_name))
+				error ("write gamut failed on '%s'",out_name);
+		}
 
 		if (dovrml) {
 			xl[0] = '\000';			/* remove extension */
@@ -736,6 +736,19 @@ int           use_fwa			/* NZ to involke FWA. */
 			error ("mpp->set_ilob, set_fwa failed");
 	}
 
+	/* All our spectra have the model layout, so precompute the weightings */
+	{
+		xspect layout;
+
+		layout.norm = p->norm; 
+		layout.spec_n = p->spec_n; 
+		layout.spec_wl_short = p->spec_wl_short; 
+		layout.spec_wl_long = p->spec_wl_long; 
+
+		if (p->spc->set_wmat(p->spc, &layout))
+			error ("mpp->set_ilob, set_wmat failed");
+	}
+
 	return 0;
 }
 
@@ -922,6 +935,52 @@ double *in					/* Input device values */
 		out->spec[j] *= out->norm;
 }
 
+/* Lookup a batch of spectral values. */
+/* (Note that this is never FWA compensated) */
+static void lookup_spec_n(
+mpp *p,						/* This */
+xspect *out,				/* Returned n spectral values */
+double *in,					/* n * p->n Input device values */
+int n						/* Number of values */
+) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		lookup_spec(p, &out[i], in + i * p->n);
+}
+
+#define LOOKUP_NBLK 32		/* Spectra converted at a time by lookup_n() */
+
+/* Lookup a batch of XYZ or Lab colors */
+static void lookup_n(
+mpp *p,						/* This */
+double (*out)[3],			/* Returned n XYZ or Lab values */
+double *in,					/* n * p->n Input device values */
+int n						/* Number of values */
+) {
+	int i, nb;
+	xspect *tspec;
+
+	if (p->spc == NULL) {
+		for (i = 0; i < n; i++)
+			lookup(p, out[i], in + i * p->n);
+		return;
+	}
+
+	if ((nb = n) > LOOKUP_NBLK)
+		nb = LOOKUP_NBLK;
+	if ((tspec = (xspect *)malloc(nb * sizeof(xspect))) == NULL)
+		error("mpp->lookup_n, malloc failed");
+
+	for (i = 0; i < n; i += nb) {
+		if (nb > (n - i))
+			nb = n - i;
+		lookup_spec_n(p, tspec, in + i * p->n, nb);
+		p->spc->convert_n(p->spc, out + i, tspec, nb);
+	}
+	free(tspec);
+}
+
 /* Macros for an arbitrary dimensional counter */
 /* Declare the counter name nn, dimensions di, & count */
 
@@ -1133,6 +1192,10 @@ static void del_mpp(mpp *p) {
 		del_mppcols(p->cols, p->nodp, p->n, p->spec_n);	/* Delete array of target points */
 		if (p->spc != NULL)
 			p->spc->del(p->spc);
+		if (p->pool != NULL)
+			p->pool->del(p->pool);
+		free(p->ptrv);
+		free(p->ptdv);
 
 		/* Delete shape parameters */
 		if (p->shape != NULL) {
@@ -1177,6 +1240,8 @@ mpp *new_mpp(void) {
 	p->dlookup     = dlookup;
 	p->lookup_xyz  = lookup_xyz;
 	p->lookup_spec = lookup_spec;
+	p->lookup_n    = lookup_n;
+	p->lookup_spec_n = lookup_spec_n;
 
 	return p;
 }
@@ -1754,6 +1819,68 @@ static void mppprog(void *pdata, int perc) {
 	}
 }
 
+/* Test point summing function. Return the error sum over */
+/* test points i0..i1-1, and add the gradient sum to dv[] if not NULL. */
+typedef double (*mpp_ptsfunc)(mpp *p, double *dv, double pv[], int i0, int i1);
+
+/* Context for summing the test points in parallel */
+typedef struct {
+	mpp *p;
+	mpp_ptsfunc func;
+	int ndv;			/* Number of gradient values, 0 if none */
+	double *pv;			/* Parameters */
+} mpp_ptsctx;
+
+static int mpp_ptstask(void *cntx, int thix, int i0, int i1) {
+	mpp_ptsctx *cx = (mpp_ptsctx *)cntx;
+	mpp *p = cx->p;
+	double *dv = NULL;
+
+	if (cx->ndv > 0)
+		dv = p->ptdv + thix * MPP_MXPARMS;
+	p->ptrv[thix] = cx->func(p, dv, cx->pv, i0, i1);
+	return 0;
+}
+
+/* Sum func() over all the test points, using the thread pool if there is one. */
+/* dv[ndv] is zero'd and returns the gradient sum if not NULL. The per thread */
+/* sums are combined in thread order, so the result is repeatable. */
+static double mpp_ptsum(mpp *p, mpp_ptsfunc func, double *dv, int ndv, double pv[]) {
+	double rv = 0.0;
+	int i, k;
+
+	for (k = 0; k < ndv; k++)
+		dv[k] = 0.0;
+
+	if (p->pool == NULL) {
+		return func(p, dv, pv, 0, p->nodp);
+	} else {
+		mpp_ptsctx cx;
+
+		cx.p = p;
+		cx.func = func;
+		cx.ndv = dv != NULL ? ndv : 0;
+		cx.pv = pv;
+
+		for (i = 0; i < p->pool->nthr; i++) {
+			double *tdv = p->ptdv + i * MPP_MXPARMS;
+			p->ptrv[i] = 0.0;
+			for (k = 0; k < cx.ndv; k++)
+				tdv[k] = 0.0;
+		}
+
+		p->pool->run(p->pool, p->nodp, mpp_ptstask, (void *)&cx);
+
+		for (i = 0; i < p->pool->nthr; i++) {
+			double *tdv = p->ptdv + i * MPP_MXPARMS;
+			rv += p->ptrv[i];
+			for (k = 0; k < cx.ndv; k++)
+				dv[k] += tdv[k];
+		}
+	}
+	return rv;
+}
+
 #ifdef NEVER		// Skip efunc1 passes for now.
 
 /* Setup test point data ready for efunc1 on the given och and oba */
@@ -1846,9 +1973,9 @@ static double efunc1(void *adata, double pv[]) {
 #endif /* NEVER */
 
 /* Optimise all transfer curves simultaniously to minimise a particular bands error */
-static double efunc2(void *adata, double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv, rv = 0.0;
+/* Return the efunc2() error sum over test points i0..i1-1 */
+static double efunc2_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double rv = 0.0;
 	double tcnv[MPP_MXINKS];	/* Transfer curve corrected device values */
 	double tcnv1[MPP_MXINKS];	/* 1.0 - Transfer curve corrected device values */
 	double ww[MPP_MXINKS];		/* Interpolated tweak params for each channel */
@@ -1856,7 +1983,7 @@ static double efunc2(void *adata, double pv[]) {
 	int i, m, k;
 
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		mppcol *c = &p->cols[i];
 		double ov;
 
@@ -1917,6 +2044,16 @@ static double efunc2(void *adata, double pv[]) {
 		rv += ov * ov;
 	}
 
+	return rv;
+}
+
+static double efunc2(void *adata, double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv, rv;
+	int i, m, k;
+
+	rv = mpp_ptsum(p, efunc2_pts, NULL, 0, pv);
+
 	rv /= (double)p->nodp;
 
 	/* Compute weighted magnitude of shaper parameters squared */
@@ -1946,16 +2083,16 @@ static double efunc2(void *adata, double pv[]) {
 	rv += smv;
 
 #ifdef DEBUG
-	printf("efunc2 itt %d/%d band %d returning %f\n",p->oit,p->ott,j,rv);
+	printf("efunc2 itt %d/%d band %d returning %f\n",p->oit,p->ott,p->oba,rv);
 #endif
 	return rv;
 }
 
 /* Return the gradient of the minimisation function at the given location, */
 /* as well as the function value at this location. */
-static double dfunc2(void *adata, double dv[], double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv, tt, rv = 0.0;
+/* Return the dfunc2() error sum and gradient sum over test points i0..i1-1 */
+static double dfunc2_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double tt, rv = 0.0;
 	double dtcnv_dpv[MPP_MXINKS][MPP_MXTCORD];	/* Del in tcnv[m] due to del in parameter */
 	double dww_dtcnv[MPP_MXINKS][MPP_MXINKS];	/* Del in ww[m] due to del in tcnv[m] */
 	double dtcnv_tc[MPP_MXINKS];				/* Del in tcnv'[m] due to del in tcnv[m] */
@@ -1968,11 +2105,8 @@ static double dfunc2(void *adata, double dv[], double pv[]) {
 	int j = p->oba;			/* Band being optimised */
 	int i, m, k;
 
-	for (k = 0; k < (p->n * p->cord); k++)
-		dv[k] = 0.0;
-
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		int mo;
 		mppcol *c = &p->cols[i];
 		double ov;
@@ -2235,6 +2369,16 @@ for (m = 0; m < p->n; m++) {
 		}
 	}
 
+	return rv;
+}
+
+static double dfunc2(void *adata, double dv[], double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv, tt, rv;
+	int i, m, k;
+
+	rv = mpp_ptsum(p, dfunc2_pts, dv, p->n * p->cord, pv);
+
 	rv /= (double)p->nodp;
 	for (k = 0; k < (p->n * p->cord); k++)
 		dv[k] /= (double)p->nodp;
@@ -2267,7 +2411,7 @@ for (m = 0; m < p->n; m++) {
 	rv += smv;
 
 #ifdef DEBUG
-	printf("dfunc2 itt %d/%d band %d returning %f\n",p->oit,p->ott,j,rv);
+	printf("dfunc2 itt %d/%d band %d returning %f\n",p->oit,p->ott,p->oba,rv);
 #endif
 	return rv;
 }
@@ -2345,9 +2489,9 @@ static void sfunc3(mpp *p) {
 
 /* Optimise all shape parameters simultaniously to minimise a particular bands error */
 /* Assume test point tcnv and pcnv are setup for pre-shape values */
-static double efunc3(void *adata, double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv, rv = 0.0;
+/* Return the efunc3() error sum over test points i0..i1-1 */
+static double efunc3_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double rv = 0.0;
 	double tcnv[MPP_MXINKS];	/* Transfer curve corrected device values */
 	double tcnv1[MPP_MXINKS];	/* 1.0 - Transfer curve corrected device values */
 	double ww[MPP_MXINKS];		/* Interpolated tweak params for each channel */
@@ -2356,7 +2500,7 @@ static double efunc3(void *adata, double pv[]) {
 	int i, m, k;
 
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		mppcol *c = &p->cols[i];
 		double ov;
 
@@ -2399,6 +2543,16 @@ static double efunc3(void *adata, double pv[]) {
 		rv += ov * ov;
 	}
 
+	return rv;
+}
+
+static double efunc3(void *adata, double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv, rv;
+	int m;
+
+	rv = mpp_ptsum(p, efunc3_pts, NULL, 0, pv);
+
 	rv /= (double)p->nodp;
 
 	/* Compute average magnitude of shaper parameters squared */
@@ -2410,16 +2564,16 @@ static double efunc3(void *adata, double pv[]) {
 	rv += SHAPE_PMW * smv;		
 
 #ifdef DEBUG
-	printf("efunc3 itt %d/%d band %d (smv %f) returning %f\n",p->oit,p->ott,j,smv,rv);
+	printf("efunc3 itt %d/%d band %d (smv %f) returning %f\n",p->oit,p->ott,p->oba,smv,rv);
 #endif
 	return rv;
 }
 
 /* Return the gradient of the minimisation function at the given location, */
 /* as well as the function value at this location. */
-static double dfunc3(void *adata, double dv[], double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv, tt, rv = 0.0;
+/* Return the dfunc3() error sum and gradient sum over test points i0..i1-1 */
+static double dfunc3_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double tt, rv = 0.0;
 	double dtcnv[MPP_MXINKS];	/* Derivative of transfer curve corrected device values */
 	double dov[MPP_MXINKS];		/* Derivative of output interpolation device values */
 	double tcnv[MPP_MXINKS];	/* Transfer curve corrected device values */
@@ -2429,11 +2583,8 @@ static double dfunc3(void *adata, double dv[], double pv[]) {
 	int n1 = p->n - 1;
 	int i, m, k;
 
-	for (k = 0; k < p->nnn2; k++)
-		dv[k] = 0.0;					/* Start with 0 delta */
-
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		mppcol *c = &p->cols[i];
 		double ov, ddov;
 
@@ -2508,6 +2659,16 @@ static double dfunc3(void *adata, double dv[], double pv[]) {
 		}
 	}
 
+	return rv;
+}
+
+static double dfunc3(void *adata, double dv[], double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv, tt, rv;
+	int k;
+
+	rv = mpp_ptsum(p, dfunc3_pts, dv, p->nnn2, pv);
+
 	rv /= ((double)p->nodp);
 
 	for (k = 0; k < p->nnn2; k++)
@@ -2524,7 +2685,7 @@ static double dfunc3(void *adata, double dv[], double pv[]) {
 	rv += SHAPE_PMW * smv;		
 
 #ifdef DEBUG
-	printf("dfunc3 itt %d/%d band %d (smv %f) returning %f\n",p->oit,p->ott,j,smv,rv);
+	printf("dfunc3 itt %d/%d band %d (smv %f) returning %f\n",p->oit,p->ott,p->oba,smv,rv);
 #endif
 	return rv;
 }
@@ -2627,14 +2788,14 @@ static void sfunc4(mpp *p) {
 
 /* Optimise all vertex values simultaniously to minimise a particular bands error */
 /* Assume test point tcnv and pcnv are setup for post-shape values */
-static double efunc4(void *adata, double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv = 0.0, rv = 0.0;
+/* Return the efunc4() error sum over test points i0..i1-1 */
+static double efunc4_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double rv = 0.0;
 	int j = p->oba;				/* Band being optimised */
 	int i, k;
 
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		mppcol *c = &p->cols[i];
 		double ov = 0.0;
 
@@ -2651,6 +2812,17 @@ static double efunc4(void *adata, double pv[]) {
 		rv += ov * ov;
 	}
 
+	return rv;
+}
+
+static double efunc4(void *adata, double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv = 0.0, rv;
+	int j = p->oba;				/* Band being optimised */
+	int i;
+
+	rv = mpp_ptsum(p, efunc4_pts, NULL, 0, pv);
+
 	rv /= p->nodp;
 
 	/* Compute anchor point error */
@@ -2671,20 +2843,15 @@ static double efunc4(void *adata, double pv[]) {
 
 /* Return the gradient of the minimisation function at the given location, */
 /* as well as the function value at this location. */
-static double dfunc4(void *adata, double dv[], double pv[]) {
-	mpp *p = (mpp *)adata;
-	double smv = 0.0, rv = 0.0;
-	double drv[MPP_MXCCOMB];	/* Delta in rv */
+/* Return the dfunc4() error sum and gradient sum over test points i0..i1-1 */
+static double dfunc4_pts(mpp *p, double *dv, double pv[], int i0, int i1) {
+	double rv = 0.0;
+	double *drv = dv + p->nn;	/* Delta in rv */
 	int j = p->oba;				/* Band being optimised */
 	int i, k;
 
-	for (k = 0; k < p->nn; k++) {
-		dv[k] = 0.0;
-		drv[k] = 0.0;
-	}
-
 	/* For each test point */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		mppcol *c = &p->cols[i];
 		double ov = 0.0, ddov;
 
@@ -2710,9 +2877,22 @@ static double dfunc4(void *adata, double dv[], double pv[]) {
 		}
 	}
 
+	return rv;
+}
+
+static double dfunc4(void *adata, double dv[], double pv[]) {
+	mpp *p = (mpp *)adata;
+	double smv = 0.0, rv;
+	double tdv[2 * MPP_MXCCOMB];	/* Point sum of dv[], followed by delta in rv */
+	double *drv = tdv + p->nn;		/* Delta in rv */
+	int j = p->oba;				/* Band being optimised */
+	int k;
+
+	rv = mpp_ptsum(p, dfunc4_pts, tdv, 2 * p->nn, pv);
+
 	rv /= p->nodp;
 	for (k = 0; k < p->nn; k++)
-		dv[k] /= ((double)p->nodp);
+		dv[k] = tdv[k]/((double)p->nodp);
 
 	/* Compute anchor point error */
 	for (smv = 0.0, k = 0; k < p->nn; k++) {
@@ -3901,6 +4081,21 @@ static int create(
 	/* Allocate and init shape related parameter space */
 	init_shape(p);
 
+	/* Setup threads to sum the test points with. */
+	/* (Fall back to doing it in this thread if this fails) */
+	if ((p->pool = new_athreadpool(0)) != NULL) {
+		if (p->pool->nthr <= 1
+		 || (p->ptrv = (double *)calloc(p->pool->nthr, sizeof(double))) == NULL
+		 || (p->ptdv = (double *)calloc(p->pool->nthr * MPP_MXPARMS, sizeof(double))) == NULL) {
+			free(p->ptrv);
+			p->ptrv = NULL;
+			p->pool->del(p->pool);
+			p->pool = NULL;
+		}
+	}
+	if (p->verb && p->pool != NULL)
+		printf("Using %d threads\n",p->pool->nthr);
+
 	p->cord = 1;		/* Start with only 1 order */
 
 #ifndef DEBUG
@@ -4388,6 +4583,15 @@ static int create(
 	p->nodp = 0;
 	p->cols = NULL;
 
+	/* Done with the threads */
+	if (p->pool != NULL) {
+		p->pool->del(p->pool);
+		p->pool = NULL;
+	}
+	free(p->ptrv);
+	free(p->ptdv);
+	p->ptrv = p->ptdv = NULL;
+
 	return 0;
 }
 
@@ -133,6 +133,19 @@ struct _mpp {
 	               xspect *out,					/* Returned spectral value */
 	               double *in);					/* Input device values */
 
+	/* Lookup a batch of n XYZ or Lab colors (default XYZ) */
+	/* [will use spectral and FWA if configured, like lookup()] */
+	void (*lookup_n) (struct _mpp *p,
+	               double (*out)[3],			/* Returned n XYZ or Lab values */
+	               double *in,					/* n * nodchan Input device values */
+	               int n);						/* Number of values */
+
+	/* Lookup a batch of n spectral values. (never FWA corrected) */
+	void (*lookup_spec_n) (struct _mpp *p,
+	               xspect *out,					/* Returned n spectral values */
+	               double *in,					/* n * nodchan Input device values */
+	               int n);						/* Number of values */
+
 	/* Return a gamut object, return NULL on error */
 	gamut *(*get_gamut)(struct _mpp *p, double detail);	/* detail level 0.0 = default */
 
@@ -176,6 +189,9 @@ struct _mpp {
 	int nodp;				/* Number of device data points */
 	mppcol *cols;			/* List of test points */
 	double spmax;			/* Maximum spectral value of any sample and band */
+	struct _athreadpool *pool;	/* Threads used to sum the test points, NULL if none */
+	double *ptrv;			/* [pool->nthr] Per thread partial error sums */
+	double *ptdv;			/* [pool->nthr * MPP_MXPARMS] Per thread partial gradients */
 
 	/* Lookup */
 	icColorSpaceSignature pcs;	/* PCS to return, XYZ, Lab */
@@ -387,6 +387,8 @@ main(int argc, char *argv[]) {
 	uint16 pconfig, photometric, pmtc;
 	tdata_t *inbuf;
 	int inbpix = 0;               					/* Number of pixels in jpeg in buf */
+	double (*lout)[3] = NULL;					/* Line of points to add to gamut */
+	int nlout;									/* Number of points in lout */
 	void (*cvt)(double *out, double *in) = NULL;	/* TIFF conversion function, NULL if none */
 	icColorSpaceSignature tcs = 0;				/* TIFF colorspace */
 	uint16 extrasamples = 0;					/* Extra "alpha" samples */
@@ -1072,6 +1074,11 @@ main(int argc, char *argv[]) {
 			}
 		}
 
+		if (!filter) {
+			if ((lout = (double (*)[3])malloc(width * sizeof(double [3]))) == NULL)
+				error("Malloc failed on gamut line buffer");
+		}
+
 		for (y = 0; y < height; y++) {
 
 			/* Read in the next line */
@@ -1088,7 +1095,7 @@ main(int argc, char *argv[]) {
 			}
 
 			/* Do floating point conversion */
-			for (x = 0; x < width; x++) {
+			for (nlout = x = 0; x < width; x++) {
 				int i;
 				double in[MAX_CHAN], out[MAX_CHAN];
 				
@@ -1154,9 +1161,19 @@ main(int argc, char *argv[]) {
 				}
 				if (filter)
 					add_fpixel(out);
-				else
-					gam->expand(gam, out);
+				else {
+					lout[nlout][0] = out[0];
+					lout[nlout][1] = out[1];
+					lout[nlout][2] = out[2];
+					nlout++;
+				}
 			}
+			if (!filter)
+				gam->expand_n(gam, lout, nlout);	/* Add the line to the gamut */
+		}
+		if (lout != NULL) {
+			free(lout);
+			lout = NULL;
 		}
 
 		/* Release buffers and close files */
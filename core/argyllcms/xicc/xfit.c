@@ -898,40 +898,82 @@ static void xfitprog(void *pdata, int perc) {
 
 int xfitfunc_trace = 1;
 
-/* Shaper+Matrix optimisation function handed to powell() */
-/* We simply minimize the total delta E squared, consistent with smoothness */
-static double xfitfunc(void *edata, double *v) {
-	xfit *p = (xfit *)edata;
-	double tw = 0.0;				/* Total weight */
-	double ev = 0.0, rv, smv;
-	double tin[MXDI], out[MXDO];
-	int di = p->di;
-	int fdi = p->fdi;
-	int i, e, f;
+/* Data point summing function. Return the weighted error sum over data */
+/* points i0..i1-1 and the weight sum in *ptw, and add the partial */
+/* derivatives to dav[] if it is not NULL. */
+typedef double (*xfit_ptsfunc)(xfit *p, double *ptw, double *dav, int i0, int i1);
 
-	/* Copy the parameters being optimised into xfit structure */
+/* Context for summing the data points in parallel */
+typedef struct {
+	xfit *p;
+	xfit_ptsfunc func;
+	int ndv;			/* Number of partial derivatives, 0 if none */
+} xfit_ptsctx;
+
+static int xfit_ptstask(void *cntx, int thix, int i0, int i1) {
+	xfit_ptsctx *cx = (xfit_ptsctx *)cntx;
+	xfit *p = cx->p;
+	double *dav = NULL;
+
+	if (cx->ndv > 0)
+		dav = p->ptdav + thix * MXPARMS;
+	p->ptev[thix] = cx->func(p, &p->pttw[thix], dav, i0, i1);
+	return 0;
+}
 
-	/* Special case - a single shaper curve. The first sm_iluord params */
-	/* are the common curve parameters, and the remainder are the matrix onwards */
-	if (p->opt_ssch) {
+/* Sum func() over all the data points, using the thread pool if there is one. */
+/* Return the weighted error sum, and the weight sum in *ptw. dav[ndv] is */
+/* zero'd and returns the partial derivative sum if not NULL. The per thread */
+/* sums are combined in thread order, so the result is repeatable. */
+static double xfit_ptsum(xfit *p, xfit_ptsfunc func, double *ptw, double *dav, int ndv) {
+	double ev = 0.0;
+	int i, k;
 
-		for (e = 0; e < di; e++) {	/* Duplicate and extend to per channel curve params */
-			for (i = 0; i < p->sm_iluord; i++)
-				p->v[p->shp_offs[e] + i] = v[i];
-			for (; i < p->iluord[e]; i++)
-				p->v[p->shp_offs[e] + i] = 0.0;
-		}
-		for (i = p->sm_iluord; i < p->opt_cnt; i++)
-			p->v[p->mat_off + i - p->sm_iluord] = v[i];
+	for (k = 0; k < ndv; k++)
+		dav[k] = 0.0;
+
+	if (p->pool == NULL) {
+		return func(p, ptw, dav, 0, p->nodp);
 	} else {
-		for (i = 0; i < p->opt_cnt; i++) { 
-//printf("~1 param %d = %f\n",i,v[i]);
-			p->v[p->opt_off + i] = v[i];
+		xfit_ptsctx cx;
+
+		cx.p = p;
+		cx.func = func;
+		cx.ndv = dav != NULL ? ndv : 0;
+
+		for (i = 0; i < p->pool->nthr; i++) {
+			double *tdav = p->ptdav + i * MXPARMS;
+			p->ptev[i] = p->pttw[i] = 0.0;
+			for (k = 0; k < cx.ndv; k++)
+				tdav[k] = 0.0;
+		}
+
+		p->pool->run(p->pool, p->nodp, xfit_ptstask, (void *)&cx);
+
+		*ptw = 0.0;
+		for (i = 0; i < p->pool->nthr; i++) {
+			double *tdav = p->ptdav + i * MXPARMS;
+			ev += p->ptev[i];
+			*ptw += p->pttw[i];
+			for (k = 0; k < cx.ndv; k++)
+				dav[k] += tdav[k];
 		}
 	}
+	return ev;
+}
+
+/* Return the xfitfunc() weighted error sum over data points i0..i1-1, */
+/* and the weight sum in *ptw. (dav is not used) */
+static double xfitfunc_pts(xfit *p, double *ptw, double *dav, int i0, int i1) {
+	double tw = 0.0;				/* Total weight */
+	double ev = 0.0;
+	double tin[MXDI], out[MXDO];
+	int di = p->di;
+	int fdi = p->fdi;
+	int i, e, f;
 
 	/* For all our data points */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		double del;
 
 		/* Apply input shaper channel curves */
@@ -976,6 +1018,43 @@ static double xfitfunc(void *edata, double *v) {
 		ev += p->rpoints[i].w * del;
 	}
 
+	*ptw = tw;
+	return ev;
+}
+
+/* Shaper+Matrix optimisation function handed to powell() */
+/* We simply minimize the total delta E squared, consistent with smoothness */
+static double xfitfunc(void *edata, double *v) {
+	xfit *p = (xfit *)edata;
+	double tw;						/* Total weight */
+	double ev, rv, smv;
+	int di = p->di;
+	int i, e;
+
+	/* Copy the parameters being optimised into xfit structure */
+
+	/* Special case - a single shaper curve. The first sm_iluord params */
+	/* are the common curve parameters, and the remainder are the matrix onwards */
+	if (p->opt_ssch) {
+
+		for (e = 0; e < di; e++) {	/* Duplicate and extend to per channel curve params */
+			for (i = 0; i < p->sm_iluord; i++)
+				p->v[p->shp_offs[e] + i] = v[i];
+			for (; i < p->iluord[e]; i++)
+				p->v[p->shp_offs[e] + i] = 0.0;
+		}
+		for (i = p->sm_iluord; i < p->opt_cnt; i++)
+			p->v[p->mat_off + i - p->sm_iluord] = v[i];
+	} else {
+		for (i = 0; i < p->opt_cnt; i++) { 
+//printf("~1 param %d = %f\n",i,v[i]);
+			p->v[p->opt_off + i] = v[i];
+		}
+	}
+
+	/* For all our data points */
+	ev = xfit_ptsum(p, xfitfunc_pts, &tw, NULL, 0);
+
 	/* Normalise error to be an average delta E squared */
 	ev /= tw;
 
@@ -994,17 +1073,14 @@ fprintf(stdout,"~1(sm %f, ev %f)xfitfunc returning %f\n",smv,ev,rv);
 	return rv;
 }
 
-/* Shaper+Matrix optimisation function with partial derivatives, */
-/* handed to conjgrad() */
-static double dxfitfunc(void *edata, double *dv, double *v) {
-	xfit *p = (xfit *)edata;
+/* Return the dxfitfunc() weighted error sum over data points i0..i1-1, */
+/* the weight sum in *ptw, and add the partial derivatives for all */
+/* parameters to dav[] */
+static double dxfitfunc_pts(xfit *p, double *ptw, double *dav, int i0, int i1) {
 	double tw = 0.0;				/* Total weight */
-	double ev = 0.0, rv, smv;
+	double ev = 0.0;
 	double tin[MXDI], out[MXDO];
 
-	double dav[MXPARMS];				/* Overall del due to del param vals */
-	double sdav[MXPARMS];				/* Overall del due to del smooth param vals */
-
 	double dtin_iv[MXDI * MXLUORD];		/* Del in itrans out due to del itrans param vals */
 	double dmato_mv[1 << MXDI];			/* Del in mat out due to del in matrix param vals */
 	double dmato_tin[MXDO * MXDI];		/* Del in mat out due to del in matrix input values */
@@ -1017,33 +1093,8 @@ static double dxfitfunc(void *edata, double *dv, double *v) {
 	int fdi = p->fdi;
 	int i, jj, k, e, ee, f, ff;
 
-	/* Copy the parameters being optimised into xfit structure */
-
-	/* Special case - a single shaper curve. The first sm_iluord params */
-	/* are the common curve parameters, and the remainder are the matrix onwards */
-	if (p->opt_ssch) {
-		for (e = 0; e < di; e++) {	/* Duplicate and extend to per channel curve params */
-			for (i = 0; i < p->sm_iluord; i++)
-				p->v[p->shp_offs[e] + i] = v[i];
-			for (; i < p->iluord[e]; i++)
-				p->v[p->shp_offs[e] + i] = 0.0;
-		}
-		for (i = p->sm_iluord; i < p->opt_cnt; i++) 
-			p->v[p->mat_off + i - p->sm_iluord] = v[i];
-
-	} else {
-		for (i = 0; i < p->opt_cnt; i++) { 
-			p->v[p->opt_off + i] = v[i];
-		}
-	}
-
-	/* Zero the accumulated partial derivatives */
-	/* We compute deriv for all parameters (not just current optimised) */
-	for (i = 0; i < p->tot_cnt; i++)
-		dav[i] = 0.0;
-
 	/* For all our data points */
-	for (i = 0; i < p->nodp; i++) {
+	for (i = i0; i < i1; i++) {
 		double del;
 
 		/* Apply input channel curves */
@@ -1156,6 +1207,47 @@ static double dxfitfunc(void *edata, double *dv, double *v) {
 		}
 	}
 
+	*ptw = tw;
+	return ev;
+}
+
+/* Shaper+Matrix optimisation function with partial derivatives, */
+/* handed to conjgrad() */
+static double dxfitfunc(void *edata, double *dv, double *v) {
+	xfit *p = (xfit *)edata;
+	double tw;						/* Total weight */
+	double ev, rv, smv;
+
+	double dav[MXPARMS];				/* Overall del due to del param vals */
+	double sdav[MXPARMS];				/* Overall del due to del smooth param vals */
+
+	int di = p->di;
+	int i, e;
+
+	/* Copy the parameters being optimised into xfit structure */
+
+	/* Special case - a single shaper curve. The first sm_iluord params */
+	/* are the common curve parameters, and the remainder are the matrix onwards */
+	if (p->opt_ssch) {
+		for (e = 0; e < di; e++) {	/* Duplicate and extend to per channel curve params */
+			for (i = 0; i < p->sm_iluord; i++)
+				p->v[p->shp_offs[e] + i] = v[i];
+			for (; i < p->iluord[e]; i++)
+				p->v[p->shp_offs[e] + i] = 0.0;
+		}
+		for (i = p->sm_iluord; i < p->opt_cnt; i++) 
+			p->v[p->mat_off + i - p->sm_iluord] = v[i];
+
+	} else {
+		for (i = 0; i < p->opt_cnt; i++) { 
+			p->v[p->opt_off + i] = v[i];
+		}
+	}
+
+	/* For all our data points, accumulate the partial derivatives */
+	/* We compute deriv for all parameters (not just current optimised) */
+	ev = xfit_ptsum(p, dxfitfunc_pts, &tw, dav, p->tot_cnt);
+
 	/* Normalise error to be an average delta E squared */
 	ev /= tw;
 	for (i = 0; i < p->tot_cnt; i++) {
@@ -1698,6 +1790,156 @@ printf("~1 changing %f %f %f -> %f %f %f\n", out[0], out[1], out[2], tout[0], to
 
 #endif /* SPECIAL_FORCE */
 
+/* Context for creating the grid position curves */
+typedef struct {
+	xfit *p;
+	double demph;		/* dark emphasis factor for cLUT grid res. */
+} xfit_posctx;
+
+/* Create the grid position curves for input channels e0..e1-1 from the */
+/* residual error in p->rpoints[].v[0]. Each channel is independent, */
+/* so this can be run for several channels at once. Return nz on error. */
+static int xfit_postask(void *cntx, int thix, int e0, int e1) {
+	xfit_posctx *cx = (xfit_posctx *)cntx;
+	xfit *p = cx->p;
+	cow *tpoints;		/* Residual error vs. channel value */
+	int i, ee;
+
+	if ((tpoints = (cow *)malloc(p->nodp * sizeof(cow))) == NULL)
+		return 1;
+	for (i = 0; i < p->nodp; i++) {
+		tpoints[i].v[0] = p->rpoints[i].v[0];
+		tpoints[i].w    = p->rpoints[i].w;
+	}
+
+	for (ee = e0; ee < e1; ee++) {
+		rspl *resid;
+		double imin[1],imax[1],omin[1],omax[1]; 
+		int resres[1] = { 1024 };
+#define NPGP 100
+		mcv *posc;
+		mcvco pgp[NPGP];
+		double vo, vs;
+		double *pms;
+		
+		/* Create a rspl that plots the residual error */
+		/* vs the axis value */
+		for (i = 0; i < p->nodp; i++)
+			tpoints[i].p[0] = p->ipoints[i].p[ee];
+
+		imin[0] = p->in_min[ee];
+		imax[0] = p->in_max[ee];
+		omin[0] = 0.0;
+		omax[0] = 0.0;
+		
+		if ((resid = new_rspl(RSPL_NOFLAGS, 1, 1)) == NULL) {
+			free(tpoints);
+			return 1;
+		}
+
+		resid->fit_rspl_w(resid, RSPLFLAGS, tpoints, p->nodp, imin, imax, resres,
+			omin, omax, 2.0, NULL, NULL);
+
+#ifdef DEBUG_PLOT
+		{
+#define	XRES 100
+			double xx[XRES];
+			double y1[XRES];
+
+			printf("Input residual error channel %d\n",ee);
+			for (i = 0; i < XRES; i++) {
+				co pp;
+				double x;
+				x = i/(double)(XRES-1);
+				xx[i] = x = x * (imax[0] - imin[0]) + imin[0];
+				pp.p[0] = xx[i];
+				resid->interp(resid, &pp);
+				y1[i] = pp.v[0];
+				if (y1[i] < 0.0)
+					y1[i] = 0.0;
+				y1[i] = pow(y1[i], 0.5);	/* Convert from error^2 to error */
+			}
+			do_plot(xx,y1,NULL,NULL,XRES);
+		}
+#endif /* DEBUG_PLOT */
+
+		/* Create a set of guide points that contain */
+		/* the accumulated residual error vs. the axis value */
+		for (i = 0; i < NPGP; i++) {
+			co pp;
+			double vv;
+
+			pp.p[0] = i/(NPGP-1.0);
+			resid->interp(resid, &pp);
+
+			pgp[i].p = (pp.p[0] - p->in_min[ee])/(p->in_max[ee] - p->in_min[ee]);
+			pgp[i].w = 1.0; 
+
+			vv = pp.v[0];
+			if (vv < 0.0)
+				vv = 0.0;
+			vv = pow(vv, 0.5);		/* Convert from error^2 to error */
+			vv += PSHAPE_MINE;		/* In case error is near zero */
+			vv = pow(vv, PSHAPE_DIST);		/* Agressivness of grid distribution */
+
+			if (i == 0)
+				pgp[i].v = vv;
+			else
+				pgp[i].v = pgp[i-1].v + vv;
+
+		}
+		resid->del(resid);
+
+		/* Normalize the output range */
+		vo = pgp[0].v;
+		vs = pgp[NPGP-1].v - vo;
+		
+		for (i = 0; i < NPGP; i++) {
+			pgp[i].v = (pgp[i].v - vo)/vs;
+			
+			/* Apply any dark emphasis */
+			if (cx->demph > 1.0) {
+				pgp[i].v = icx_powlike(pgp[i].v, 1.0/cx->demph);
+			}
+		}
+		/* Fit the non-monotonic parameters to the guide points */
+		if ((posc = new_mcv_noos()) == NULL) {
+			free(tpoints);
+			return 1;
+		}
+
+		posc->fit(posc, 0, p->iluord[ee], pgp, NPGP, 0.1);	// ~~99
+
+#ifdef DEBUG_PLOT
+		{
+#define	XRES 100
+			double xx[XRES];
+			double y1[XRES];
+
+			printf("Position curve %d\n",ee);
+			for (i = 0; i < XRES; i++) {
+				xx[i] = i/(double)(XRES-1);
+				y1[i] = posc->interp(posc, xx[i]);
+			}
+			do_plot(xx,y1,NULL,NULL,XRES);
+		}
+#endif /* DEBUG_PLOT */
+
+		/* Transfer parameters to xfit pos (skip offset and scale) */
+		posc->get_params(posc, &pms);
+
+		for (i = 0; i < p->iluord[ee]; i++) {
+			p->v[p->pos_offs[ee] + i] = pms[i+2];
+		}
+//p->v[p->in_offs[ee]] = -1.5;
+
+		free(pms);
+		posc->del(posc);
+	}
+	free(tpoints);
+	return 0;
+}
+
 /* - - - - - - - - - */
 /* Do the fitting. */
 /* return nz on error */
@@ -1955,6 +2197,21 @@ static int xfit_fit(
 			return 1;
 	}
 
+	/* Setup threads to spread the data point sums and per channel fits over. */
+	/* (Fall back to doing it all in this thread if this fails) */
+	if (p->pool == NULL && (p->pool = new_athreadpool(0)) != NULL) {
+		if (p->pool->nthr <= 1
+		 || (p->ptev = (double *)calloc(p->pool->nthr, sizeof(double))) == NULL
+		 || (p->pttw = (double *)calloc(p->pool->nthr, sizeof(double))) == NULL
+		 || (p->ptdav = (double *)calloc(p->pool->nthr * MXPARMS, sizeof(double))) == NULL) {
+			free(p->ptev);
+			free(p->pttw);
+			p->ptev = p->pttw = NULL;
+			p->pool->del(p->pool);
+			p->pool = NULL;
+		}
+	}
+
 	/* Allocate array of span DE's for current opt channel */
 	{
 		int lres = 0;
@@ -2291,7 +2548,6 @@ dump_xfit(p);
 	/* of optimization drivel approach rather than the predictive */
 	/* method used here.) */
 	if (p->tcomb & oc_p) {
-		int ee;
 
 		if (p->verb)
 			printf("About to create grid position input curves\n");
@@ -2333,126 +2589,20 @@ dump_xfit(p);
 			p->rpoints[i].w    = p->ipoints[i].w;
 		}
 
-		/* Do each input axis in turn */
-		for (ee = 0; ee < p->di; ee++) {
-			rspl *resid;
-			double imin[1],imax[1],omin[1],omax[1]; 
-			int resres[1] = { 1024 };
-#define NPGP 100
-			mcv *posc;
-			mcvco pgp[NPGP];
-			double vo, vs;
-			double *pms;
-			
-			/* Create a rspl that plots the residual error */
-			/* vs the axis value */
-			for (i = 0; i < p->nodp; i++)
-				p->rpoints[i].p[0] = p->ipoints[i].p[ee];
-
-			imin[0] = in_min[ee];
-			imax[0] = in_max[ee];
-			omin[0] = 0.0;
-			omax[0] = 0.0;
-			
-			if ((resid = new_rspl(RSPL_NOFLAGS, 1, 1)) == NULL)
-				return 1;
-
-			resid->fit_rspl_w(resid, RSPLFLAGS, p->rpoints, p->nodp, imin, imax, resres,
-				omin, omax, 2.0, NULL, NULL);
-
-#ifdef DEBUG_PLOT
-			{
-#define	XRES 100
-				double xx[XRES];
-				double y1[XRES];
-
-				printf("Input residual error channel %d\n",ee);
-				for (i = 0; i < XRES; i++) {
-					co pp;
-					double x;
-					x = i/(double)(XRES-1);
-					xx[i] = x = x * (imax[0] - imin[0]) + imin[0];
-					pp.p[0] = xx[i];
-					resid->interp(resid, &pp);
-					y1[i] = pp.v[0];
-					if (y1[i] < 0.0)
-						y1[i] = 0.0;
-					y1[i] = pow(y1[i], 0.5);	/* Convert from error^2 to error */
-				}
-				do_plot(xx,y1,NULL,NULL,XRES);
-			}
-#endif /* DEBUG_PLOT */
-
-			/* Create a set of guide points that contain */
-			/* the accumulated residual error vs. the axis value */
-			for (i = 0; i < NPGP; i++) {
-				co pp;
-				double vv;
-
-				pp.p[0] = i/(NPGP-1.0);
-				resid->interp(resid, &pp);
-
-				pgp[i].p = (pp.p[0] - in_min[ee])/(in_max[ee] - in_min[ee]);
-				pgp[i].w = 1.0; 
-
-				vv = pp.v[0];
-				if (vv < 0.0)
-					vv = 0.0;
-				vv = pow(vv, 0.5);		/* Convert from error^2 to error */
-				vv += PSHAPE_MINE;		/* In case error is near zero */
-				vv = pow(vv, PSHAPE_DIST);		/* Agressivness of grid distribution */
-
-				if (i == 0)
-					pgp[i].v = vv;
-				else
-					pgp[i].v = pgp[i-1].v + vv;
-
-			}
-			resid->del(resid);
+		/* Do each input axis (in parallel if we can) */
+		{
+			xfit_posctx cx;
 
-			/* Normalize the output range */
-			vo = pgp[0].v;
-			vs = pgp[NPGP-1].v - vo;
-			
-			for (i = 0; i < NPGP; i++) {
-				pgp[i].v = (pgp[i].v - vo)/vs;
-				
-				/* Apply any dark emphasis */
-				if (demph > 1.0) {
-					pgp[i].v = icx_powlike(pgp[i].v, 1.0/demph);
-				}
-			}
-			/* Fit the non-monotonic parameters to the guide points */
-			if ((posc = new_mcv_noos()) == NULL)
+			cx.p = p;
+			cx.demph = demph;
+#ifndef DEBUG_PLOT
+			if (p->pool != NULL) {
+				if (p->pool->run(p->pool, p->di, xfit_postask, (void *)&cx) != 0)
+					return 1;
+			} else
+#endif
+			if (xfit_postask((void *)&cx, 0, 0, p->di) != 0)
 				return 1;
-
-			posc->fit(posc, 0, p->iluord[ee], pgp, NPGP, 0.1);	// ~~99
-
-#ifdef DEBUG_PLOT
-			{
-#define	XRES 100
-				double xx[XRES];
-				double y1[XRES];
-
-				printf("Position curve %d\n",ee);
-				for (i = 0; i < XRES; i++) {
-					xx[i] = i/(double)(XRES-1);
-					y1[i] = posc->interp(posc, xx[i]);
-				}
-				do_plot(xx,y1,NULL,NULL,XRES);
-			}
-#endif /* DEBUG_PLOT */
-
-			/* Transfer parameters to xfit pos (skip offset and scale) */
-			posc->get_params(posc, &pms);
-
-			for (i = 0; i < p->iluord[ee]; i++) {
-				p->v[p->pos_offs[ee] + i] = pms[i+2];
-			}
-//p->v[p->in_offs[ee]] = -1.5;
-
-			free(pms);
-			posc->del(posc);
 		}
 	}
 
@@ -3119,6 +3269,11 @@ static void xfit_del(xfit *p) {
 		free(p->piv);
 	if (p->uerrv != NULL)
 		free(p->uerrv);
+	if (p->pool != NULL)
+		p->pool->del(p->pool);
+	free(p->ptev);
+	free(p->pttw);
+	free(p->ptdav);
 	free(p);
 }
 
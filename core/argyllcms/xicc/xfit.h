@@ -148,6 +148,12 @@ struct _xfit {
 	double *sa;				/* Search area */
 	int opt_ch;				/* Channel being optimized */
 
+	/* Threads used to sum the data points, NULL if none */
+	struct _athreadpool *pool;
+	double *ptev;			/* [pool->nthr] Per thread partial error sums */
+	double *pttw;			/* [pool->nthr] Per thread partial weight sums */
+	double *ptdav;			/* [pool->nthr * MXPARMS] Per thread partial derivatives */
+
 	/* Methods */
 	void (*del)(struct _xfit *p);
 
@@ -4433,6 +4433,10 @@ void xspect_scale(xspect *sp, double scale) {
 	}
 }
 
+/* xsp2cie precomputed weighting support */
+static int xsp2cie_comp_wmat(struct _xsp2cie *p);
+static int xsp2cie_wm_match(struct _xsp2cie *p, xspect *in);
+
 #ifndef SALONEINSTLIB
 
 /* Convert from one xspect type to another (targ type) */
@@ -5240,6 +5244,10 @@ static int xsp2cie_set_fwa_imp(xsp2cie *p) {
 	p->extract  = xsp2cie_fwa_extract;
 	p->apply    = xsp2cie_fwa_apply;
 
+	/* Update any precomputed weightings to match */
+	if (p->wm_n != 0 && xsp2cie_comp_wmat(p))
+		return 1;
+
 #if defined(DOPLOT) || defined(DEBUG)
 	/* Print the estimated vs. real media spectrum */
 	for (i = 0, ww = p->media.spec_wl_short; ww <= p->media.spec_wl_long; ww += 1.0, i++) {
@@ -5632,9 +5640,218 @@ xspect *in			/* Spectrum to be converted */
 
 }
 
+/* Per integration step values used by the FWA weighting fast path. */
+/* These are the values xsp2cie_fwa_sconvert() looks up at each wavelength */
+/* that don't depend on the sample. */
+struct _xsp2cie_fwastep {
+	int ix;				/* Input band base index for linear interpolation */
+	double w;			/* Input band interpolation weight */
+	double Eu;			/* FWA emmission profile */
+	double Ii;			/* Instrument illuminant level */
+	double It;			/* Target illuminant level */
+	double Rmb;			/* Base media reflectance estimate */
+	double Su;			/* FWA sensitivity (stimulation steps only) */
+	double IoO[3];		/* Observer illuminant * observer (CIE steps only) */
+}; typedef struct _xsp2cie_fwastep xsp2cie_fwastep;
+
+/* Set the base index and weight for linear interpolation of */
+/* a spectrum with the weighting layout at wavelength wl. */
+/* (Same as getval_raw_xspec_lin_ex()) */
+static void xsp2cie_wm_linwt(xsp2cie *p, int *pix, double *pw, double wl) {
+	int i;
+	double f;
+
+	if (wl < p->wm_wl_short)
+		wl = p->wm_wl_short;
+	if (wl > p->wm_wl_long)
+		wl = p->wm_wl_long;
+
+	f = (wl - p->wm_wl_short) / (p->wm_wl_long - p->wm_wl_short);
+	f *= (p->wm_n - 1.0);
+	i = (int)floor(f);
+
+	if (i < 0)
+		i = 0;
+	else if (i > (p->wm_n - 2))
+		i = (p->wm_n - 2);
+
+	*pix = i;
+	*pw = f - (double)i;
+}
+
+/* Compute the FWA per integration step tables. */
+/* Return NZ on malloc error */
+static int xsp2cie_comp_fwas(xsp2cie *p) {
+	xsp2cie_fwastep *sp;
+	double ww;
+	int i, j, ns, no;
+
+#define MIN_ILLUM 1e-7		/* Same as xsp2cie_fwa_sconvert() */
+#define MIN_REFL  1e-6
+
+	for (ns = 0, ww = FWA1_stim.spec_wl_short; ww <= FWA1_stim.spec_wl_long; ww += p->fwa_bw)
+		ns++;
+	for (no = 0, ww = p->spec_wl_short; ww <= p->spec_wl_long; ww += p->spec_bw)
+		no++;
+
+	free(p->fwas);
+	if ((p->fwas = (xsp2cie_fwastep *)calloc(ns + no, sizeof(xsp2cie_fwastep))) == NULL) {
+		DBGF((DBGA,"xsp2cie_comp_fwas malloc of %d steps failed\n",ns + no));
+		return 1;
+	}
+	p->fwa_ns = ns;
+	p->fwa_no = no;
+
+	/* FWA stimulation steps */
+	for (i = 0, ww = FWA1_stim.spec_wl_short; i < ns; ww += p->fwa_bw, i++) {
+		sp = &p->fwas[i];
+		xsp2cie_wm_linwt(p, &sp->ix, &sp->w, ww);
+		getval_lxspec(&p->emits, &sp->Eu, ww);
+		getval_lxspec(&p->iillum, &sp->Ii, ww);
+		if (sp->Ii < MIN_ILLUM)
+			sp->Ii = MIN_ILLUM;
+		getval_lxspec(&p->tillum, &sp->It, ww);
+		if (sp->It < MIN_ILLUM)
+			sp->It = MIN_ILLUM;
+		getval_lxspec(&p->media, &sp->Rmb, ww);
+		if (sp->Rmb < MIN_REFL)
+			sp->Rmb = MIN_REFL;
+		getval_lxspec(&FWA1_stim, &sp->Su, ww);
+	}
+
+	/* CIE integration steps */
+	p->fwa_scale = 0.0;
+	for (i = 0, ww = p->spec_wl_short; i < no; ww += p->spec_bw, i++) {
+		double Io;
+
+		sp = &p->fwas[ns + i];
+		xsp2cie_wm_linwt(p, &sp->ix, &sp->w, ww);
+		getval_lxspec(&p->emits, &sp->Eu, ww);
+		getval_lxspec(&p->iillum, &sp->Ii, ww);
+		if (sp->Ii < MIN_ILLUM)
+			sp->Ii = MIN_ILLUM;
+		getval_lxspec(&p->tillum, &sp->It, ww);
+		if (sp->It < MIN_ILLUM)
+			sp->It = MIN_ILLUM;
+		getval_lxspec(&p->media, &sp->Rmb, ww);
+		if (sp->Rmb < MIN_REFL)
+			sp->Rmb = MIN_REFL;
+		getval_lxspec(&p->oillum, &Io, ww);
+		for (j = 0; j < 3; j++) {
+			double O;
+			getval_lxspec(&p->observer[j], &O, ww);
+			sp->IoO[j] = Io * O;
+		}
+		p->fwa_scale += sp->IoO[1];
+	}
+	if (p->isemis) {
+		p->fwa_scale = 0.683002;
+		p->fwa_scale *= p->spec_bw;
+	} else {
+		p->fwa_scale = 1.0/p->fwa_scale;
+	}
+
+#undef MIN_ILLUM 
+#undef MIN_REFL
+	return 0;
+}
+
+/* FWA corrected conversion using the per integration step tables. */
+/* This is xsp2cie_fwa_sconvert() without the lookups of the fixed spectra. */
+static void xsp2cie_fwa_wmat_convert(xsp2cie *p, double *out, xspect *in) {
+	xsp2cie_fwastep *sp;
+	double Rc[2 * XSPECT_MAX_BANDS];	/* Sample reflectance at each step */
+	double Emc, Smc;	/* Emission and Stimulation multipiers for instrument meas. */
+	double Emct, Smct;	/* Emission and Stimulation multipiers for target illum. */
+	double *rcp;
+	int i, j, k, ns = p->fwa_ns, no = p->fwa_no;
+
+#define MIN_ILLUM 1e-7
+#define MIN_REFL  1e-6
+
+	/* Interpolate the sample at every step */
+	for (i = 0; i < (ns + no) && i < (2 * XSPECT_MAX_BANDS); i++) {
+		sp = &p->fwas[i];
+		Rc[i] = ((1.0 - sp->w) * in->spec[sp->ix] + sp->w * in->spec[sp->ix+1]) / in->norm;
+		if (Rc[i] < 0.0)
+			Rc[i] = 0.0;
+	}
+	if (i < (ns + no)) {		/* Too many steps to hold - fall back */
+		xsp2cie_fwa_sconvert(p, NULL, out, in);
+		return;
+	}
+
+	/* Estimate FWA stimulation level, as per xsp2cie_fwa_sconvert() */
+	Emc = Emct = 0.0;
+	for (k = 0; k < 4; k++) {
+		Smct = Smc = 0.0;
+		for (i = 0; i < ns; i++) {
+			double Kc, Kct, Rcch;
+
+			sp = &p->fwas[i];
+			Kc  = Emc * sp->Eu;
+			Kct = Emct * sp->Eu;
+			if (sp->Rmb <= MIN_REFL)
+				Rcch = sqrt(fabs(sp->Rmb));
+			else
+				Rcch = (-Kc + sqrt(Kc * Kc + 4.0 * sp->Ii * sp->Ii * sp->Rmb * Rc[i]))
+				     / (2.0 * sp->Ii * sp->Rmb);
+			Smc  += sp->Su * (sp->Ii * Rcch + Kc);
+			Smct += sp->Su * (sp->It * Rcch + Kct);
+		}
+		Emc  = Smc/p->Sm;
+		Emct = Smct/p->Sm;
+	}
+
+	/* Integrate the corrected reflectance */
+	out[0] = out[1] = out[2] = 0.0;
+	rcp = Rc + ns;
+	for (i = 0; i < no; i++) {
+		double Kc, Kct, Rcch, Rct;
+
+		sp = &p->fwas[ns + i];
+		if (p->insteqtarget) {
+			Rct = rcp[i];
+		} else {
+			Kc  = Emc * sp->Eu;
+			Kct = Emct * sp->Eu;
+			if (sp->Rmb <= MIN_REFL)
+				Rcch = sqrt(fabs(sp->Rmb));
+			else
+				Rcch = (-Kc + sqrt(Kc * Kc + 4.0 * sp->Ii * sp->Ii * sp->Rmb * rcp[i]))
+				     / (2.0 * sp->Ii * sp->Rmb);
+			if (sp->It <= MIN_ILLUM)
+				Rct = sp->Rmb;
+			else
+				Rct = ((sp->It * Rcch * sp->Rmb + Kct) * Rcch)/sp->It;
+		}
+		for (j = 0; j < 3; j++)
+			out[j] += Rct * sp->IoO[j];
+	}
+	for (j = 0; j < 3; j++) {
+		out[j] *= p->fwa_scale;
+#ifdef CLAMP_XYZ
+		if (p->clamp && out[j] < 0.0)
+			out[j] = 0.0;
+#endif /* CLAMP_XYZ */
+	}
+
+	if (p->doLab == 1) {
+		icmXYZ2Lab(&icmD50, out, out);
+	} else if (p->doLab == 2) {
+		icmXYZ2Lpt(&icmD50, out, out);
+	}
+
+#undef MIN_ILLUM 
+#undef MIN_REFL
+}
+
 /* Normal conversion without returning spectrum */
 static void xsp2cie_fwa_convert(xsp2cie *p, double *out, xspect *in) {
-	xsp2cie_fwa_sconvert(p, NULL, out, in);
+	if (p->fwas != NULL && xsp2cie_wm_match(p, in))
+		xsp2cie_fwa_wmat_convert(p, out, in);
+	else
+		xsp2cie_fwa_sconvert(p, NULL, out, in);
 }
 
 /* Extract the colorant reflectance value from the media. Takes FWA */
@@ -5952,6 +6169,152 @@ double wl_long		/* Ending nm */
 	p->spec_bw		 = bw;
 	p->spec_wl_short = wl_short;
 	p->spec_wl_long  = wl_long;
+
+	/* Update any precomputed weightings to match */
+	if (p->wm_n != 0 && xsp2cie_comp_wmat(p))
+		p->wm_n = 0;		/* Fall back to integration */
+}
+
+/* Return nz if the spectrum has the precomputed weighting layout */
+static int xsp2cie_wm_match(xsp2cie *p, xspect *in) {
+	return p->wm_n != 0
+	    && in->spec_n == p->wm_n
+	    && in->spec_wl_short == p->wm_wl_short
+	    && in->spec_wl_long == p->wm_wl_long;
+}
+
+/* Compute the band to CIE weighting matrix for the current layout. */
+/* Because the integration is linear in the sample values, each column */
+/* is the (un-normalised) integration of a unit impulse at that band. */
+/* Return NZ on error */
+static int xsp2cie_comp_wmat(xsp2cie *p) {
+	xspect imp;			/* Unit impulse spectrum */
+	double *IO;			/* Illuminant * observer at each step */
+	double ww, scale = 0.0;
+	int i, j, k, nsteps;
+
+	for (nsteps = 0, ww = p->spec_wl_short; ww <= p->spec_wl_long; ww += p->spec_bw)
+		nsteps++;
+
+	if ((IO = (double *)malloc(sizeof(double) * 3 * nsteps)) == NULL) {
+		DBGF((DBGA,"xsp2cie_comp_wmat malloc of %d steps failed\n",nsteps));
+		return 1;
+	}
+
+	for (i = 0, ww = p->spec_wl_short; i < nsteps; ww += p->spec_bw, i++) {
+		double I = 1.0;
+		if (!p->isemis)
+			getval_xspec(&p->illuminant, &I, ww);
+		for (j = 0; j < 3; j++) {
+			double O;
+			getval_xspec(&p->observer[j], &O, ww);
+			IO[i * 3 + j] = I * O;
+		}
+		scale += IO[i * 3 + 1];
+	}
+	if (p->isemis) {
+		scale = 0.683002;
+		scale *= p->spec_bw;
+	} else {
+		scale = 1.0/scale;
+	}
+
+	imp.spec_n = p->wm_n;
+	imp.spec_wl_short = p->wm_wl_short;
+	imp.spec_wl_long = p->wm_wl_long;
+	imp.norm = 1.0;
+	for (k = 0; k < imp.spec_n; k++)
+		imp.spec[k] = 0.0;
+
+	for (k = 0; k < imp.spec_n; k++) {
+		double acc[3] = { 0.0, 0.0, 0.0 };
+
+		imp.spec[k] = 1.0;
+		for (i = 0, ww = p->spec_wl_short; i < nsteps; ww += p->spec_bw, i++) {
+			double S;
+			getval_xspec(&imp, &S, ww);
+			if (S == 0.0)
+				continue;
+			for (j = 0; j < 3; j++)
+				acc[j] += IO[i * 3 + j] * S;
+		}
+		imp.spec[k] = 0.0;
+		for (j = 0; j < 3; j++)
+			p->wmat[j][k] = scale * acc[j];
+	}
+	free(IO);
+
+#ifndef SALONEINSTLIB
+	/* FWA conversion isn't linear, so precompute the per step values instead */
+	if (p->sconvert == xsp2cie_fwa_sconvert) {
+		if (xsp2cie_comp_fwas(p))
+			return 1;
+	}
+#endif /* !SALONEINSTLIB */
+
+	return 0;
+}
+
+/* Set the band layout to precompute weightings for. */
+/* Return NZ if error */
+static int xsp2cie_set_wmat(
+xsp2cie *p,			/* this */
+xspect *layout		/* Band layout to use, NULL to turn off */
+) {
+#ifndef SALONEINSTLIB
+	free(p->fwas);
+	p->fwas = NULL;
+#endif /* !SALONEINSTLIB */
+
+	if (layout == NULL) {
+		p->wm_n = 0;
+		return 0;
+	}
+
+	if (layout->spec_n < 2 || layout->spec_n > XSPECT_MAX_BANDS
+	 || layout->spec_wl_long <= layout->spec_wl_short) {
+		DBGF((DBGA,"xsp2cie_set_wmat() bad layout %d bands %f - %f\n",
+		        layout->spec_n, layout->spec_wl_short, layout->spec_wl_long));
+		p->wm_n = 0;
+		return 1;
+	}
+
+	p->wm_n        = layout->spec_n;
+	p->wm_wl_short = layout->spec_wl_short;
+	p->wm_wl_long  = layout->spec_wl_long;
+
+	if (xsp2cie_comp_wmat(p)) {
+		p->wm_n = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Do the normal spectral to CIE conversion using the weighting matrix */
+static void xsp2cie_wmat_convert(
+xsp2cie *p,			/* this */
+double *out,		/* Return XYZ or D50 Lab value */
+xspect *in			/* Spectrum to be converted */
+) {
+	int j, k;
+
+	for (j = 0; j < 3; j++) {
+		double acc = 0.0;
+		for (k = 0; k < p->wm_n; k++)
+			acc += p->wmat[j][k] * in->spec[k];
+		out[j] = acc / in->norm;
+#ifdef CLAMP_XYZ
+		if (p->clamp && out[j] < 0.0)
+			out[j] = 0.0;		/* Just to be sure we don't get silly values */
+#endif /* CLAMP_XYZ */
+	}
+
+	/* If Lab is target, convert to D50 Lab */
+	if (p->doLab == 1) {
+		icmXYZ2Lab(&icmD50, out, out);
+	} else if (p->doLab == 2) {
+		icmXYZ2Lpt(&icmD50, out, out);
+	}
 }
 
 /* Do the normal spectral to CIE conversion. */
@@ -6022,7 +6385,29 @@ xspect *in			/* Spectrum to be converted */
 
 /* Normal Tristumulus conversion */
 void xsp2cie_convert(xsp2cie *p, double *out, xspect *in) {
-	xsp2cie_sconvert(p, NULL, out, in);
+	if (xsp2cie_wm_match(p, in))
+		xsp2cie_wmat_convert(p, out, in);
+	else
+		xsp2cie_sconvert(p, NULL, out, in);
+}
+
+/* Batch conversion */
+static void xsp2cie_convert_n(xsp2cie *p, double (*out)[3], xspect *in, int n) {
+	int i;
+
+	/* Matrix multiply directly if we can */
+	if (p->convert == xsp2cie_convert) {
+		for (i = 0; i < n; i++) {
+			if (xsp2cie_wm_match(p, &in[i]))
+				xsp2cie_wmat_convert(p, out[i], &in[i]);
+			else
+				xsp2cie_sconvert(p, NULL, out[i], &in[i]);
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		p->convert(p, out[i], &in[i]);
 }
 
 /* Return the illuminant XYZ being used in the CIE XYZ/Lab conversion. */ 
@@ -6041,6 +6426,9 @@ void xsp2cie_get_cie_il(xsp2cie *p, double *xyz) {
 void xsp2cie_del(
 xsp2cie *p
 ) {
+#ifndef SALONEINSTLIB
+	free(p->fwas);
+#endif /* !SALONEINSTLIB */
 	free(p);
 	return;
 }
@@ -6121,6 +6509,8 @@ icxClamping clamp				/* NZ to clamp XYZ/Lab to be +ve */
 	p->photo2rad     = xsp2cie_photo2rad;
 	p->convert       = xsp2cie_convert;
 	p->sconvert      = xsp2cie_sconvert;
+	p->set_wmat      = xsp2cie_set_wmat;
+	p->convert_n     = xsp2cie_convert_n;
 	p->get_cie_il    = xsp2cie_get_cie_il;
 #ifndef SALONEINSTLIB
 	p->set_mw        = xsp2cie_set_mw;		/* Default no media white */
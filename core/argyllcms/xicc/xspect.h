@@ -408,6 +408,18 @@ struct _xsp2cie {
 	int    insteqtarget;	/* iillum == tillum, bypass FWA */
 #endif /* !SALONEINSTLIB*/
 
+	/* Precomputed weightings for a fixed input band layout (see set_wmat()) */
+	int    wm_n;			/* Number of input bands, 0 if not in use */
+	double wm_wl_short;		/* Input band layout start wavelength */
+	double wm_wl_long;		/* Input band layout end wavelength */
+	double wmat[3][XSPECT_MAX_BANDS];	/* Band to XYZ weightings, Y normalisation included */
+#ifndef SALONEINSTLIB
+	struct _xsp2cie_fwastep *fwas;	/* FWA per integration step tables, NULL if not FWA */
+	int    fwa_ns;			/* Number of FWA stimulation steps at start of fwas[] */
+	int    fwa_no;			/* Number of CIE integration steps following them */
+	double fwa_scale;		/* CIE integration normalisation */
+#endif /* !SALONEINSTLIB*/
+
 	/* Public: */
 	void (*del)(struct _xsp2cie *p);
 
@@ -454,6 +466,26 @@ struct _xsp2cie {
 	                 xspect *in				/* Spectrum to be converted, normalised by norm */
 	                );
 
+	/* Precompute the band to CIE weightings for spectra with the same */
+	/* number of bands and wavelength range as layout, for the current */
+	/* illuminant, observer, integration steps and FWA setting. */
+	/* convert() and convert_n() then use a matrix multiply for spectra */
+	/* with that layout, and fall back to the integration otherwise. */
+	/* The weightings are recomputed if the FWA or integration steps change. */
+	/* Pass NULL to turn this off. Return NZ if error */
+	int (*set_wmat) (struct _xsp2cie *p,	/* this */
+	                 xspect *layout			/* Band layout to use, NULL to turn off */
+	                );
+
+	/* Convert a batch of spectra. If the weighting matrix has been set */
+	/* with set_wmat() and a spectrum has a matching layout, */
+	/* it is used, else convert() is used for that spectrum. */
+	void (*convert_n) (struct _xsp2cie *p,	/* this */
+	                 double (*out)[3],		/* Return n XYZ or D50 Lab values */
+	                 xspect *in,			/* n spectra to be converted */
+	                 int n					/* Number of spectra */
+	                );
+
 	/* Get the XYZ of the illuminant being used to compute the CIE XYZ */
 	/* value. */
 	void (*get_cie_il)(struct _xsp2cie *p,	/* this */